@@ -47,6 +47,8 @@
 #include <linux/moduleparam.h>
 #include <linux/sched.h>
 #include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
 
 #include <linux/ppp_defs.h>
 
@@ -142,8 +144,13 @@ EXPORT_SYMBOL(dahdi_unregister_chardev);
 
 EXPORT_SYMBOL(dahdi_register_echocan_factory);
 EXPORT_SYMBOL(dahdi_unregister_echocan_factory);
+EXPORT_SYMBOL(dahdi_echocan_state_alloc);
+EXPORT_SYMBOL(dahdi_echocan_state_free);
 
 EXPORT_SYMBOL(dahdi_set_hpec_ioctl);
+EXPORT_SYMBOL(dahdi_set_clockref_hook);
+EXPORT_SYMBOL(dahdi_span_clockref);
+EXPORT_SYMBOL(dahdi_timing_idle);
 
 #ifdef CONFIG_PROC_FS
 static struct proc_dir_entry *proc_entries[DAHDI_MAX_SPANS];
@@ -190,6 +197,14 @@ static struct class_simple *dahdi_class = NULL;
 
 static int deftaps = 64;
 
+/*! Whether to skip echo cancellation while the transmit direction is idle,
+ * for echocans which allow it */
+static int ec_idle_bypass = 1;
+
+/*! Limit on the total tap length of all software echo canceler instances,
+ * or zero for no limit */
+static int ec_max_cost;
+
 static int debug;
 
 /*!
@@ -321,6 +336,9 @@ struct dahdi_timer {
 
 static LIST_HEAD(zaptimers);
 
+/* Open channels (pseudo ones included) and timers */
+static atomic_t dahdi_users = ATOMIC_INIT(0);
+
 #ifdef DEFINE_SPINLOCK
 static DEFINE_SPINLOCK(zaptimerlock);
 static DEFINE_SPINLOCK(bigzaplock);
@@ -392,56 +410,412 @@ static rwlock_t ecfactory_list_lock = __RW_LOCK_UNLOCKED();
 
 static LIST_HEAD(ecfactory_list);
 
+/* Factories that provide echocan_state_size get a pool of pre-sized state
+ * blocks for each tail length DAHDI_ECHOCANCEL accepts, so that creating an
+ * echo canceler during call setup does not have to go to the allocator.  The
+ * blocks come from a cacheline-aligned slab cache, so the coefficient arrays
+ * of neighbouring channels never share a cacheline.  Each pool keeps one block
+ * per channel on a registered span, and is filled to that level as spans are
+ * registered, so a call asking for a tail length other than deftaps does not
+ * go to the allocator either.
+ *
+ * The factory list is taken for reading with channel locks held and
+ * interrupts off, so it is only taken for writing with interrupts off. */
+#define ECPOOL_MIN_TAPS_SHIFT	5	/* 32 taps */
+#define ECPOOL_SIZES		6	/* 32, 64, 128, 256, 512 and 1024 taps */
+
+struct ecpool {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+	kmem_cache_t *cache;
+#else
+	struct kmem_cache *cache;
+#endif
+	spinlock_t lock;
+	/*! Free blocks, linked through their first word */
+	void *free;
+	/*! Number of blocks on the free list */
+	unsigned int avail;
+	/*! Number of blocks handed out to echo canceler instances */
+	unsigned int inuse;
+	/*! Number of allocations the free list could not satisfy */
+	unsigned int misses;
+	size_t size;
+	char name[32];
+};
+
 struct ecfactory {
 	const struct dahdi_echocan_factory *ec;
 	struct list_head list;
+	struct ecpool pools[ECPOOL_SIZES];
+	/*! Number of instances in use */
+	unsigned int instances;
+	/*! Total tap length of the instances in use; the CPU cost of a
+	 * software echo canceler is roughly proportional to it */
+	unsigned long cost;
+	/*! Number of instances refused because of max_instances or ec_max_cost */
+	unsigned int refused;
 };
 
-int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec)
+/* Echo canceler capacity accounting; nests inside ecfactory_list_lock */
+#ifdef DEFINE_SPINLOCK
+static DEFINE_SPINLOCK(ecacct_lock);
+#else
+static spinlock_t ecacct_lock = SPIN_LOCK_UNLOCKED;
+#endif
+
+/*! Total tap length of all software echo canceler instances */
+static unsigned long ec_cost;
+/*! Number of times a span could not provide an echo canceler and a software one was tried */
+static atomic_t ec_hw_unavailable = ATOMIC_INIT(0);
+/*! Number of times no echo canceler at all could be provided */
+static atomic_t ec_unavailable = ATOMIC_INIT(0);
+
+/*! Number of channels on registered spans */
+static atomic_t ecpool_channels = ATOMIC_INIT(0);
+
+static int ecpool_index(u32 tap_length)
+{
+	int x;
+
+	for (x = 0; x < ECPOOL_SIZES; x++) {
+		if (tap_length == (1 << (x + ECPOOL_MIN_TAPS_SHIFT)))
+			return x;
+	}
+
+	return -1;
+}
+
+static void ecpool_destroy(struct ecfactory *cur)
+{
+	struct ecpool *pool;
+	void *block;
+	int x;
+
+	for (x = 0; x < ECPOOL_SIZES; x++) {
+		pool = &cur->pools[x];
+		if (!pool->cache)
+			continue;
+		WARN_ON(pool->inuse);
+		while ((block = pool->free)) {
+			pool->free = *(void **) block;
+			kmem_cache_free(pool->cache, block);
+		}
+		pool->avail = 0;
+		kmem_cache_destroy(pool->cache);
+		pool->cache = NULL;
+	}
+}
+
+static int ecpool_init(struct ecfactory *cur)
+{
+	struct ecpool *pool;
+	u32 taps;
+	int x;
+
+	for (x = 0; x < ECPOOL_SIZES; x++) {
+		pool = &cur->pools[x];
+		taps = 1 << (x + ECPOOL_MIN_TAPS_SHIFT);
+		spin_lock_init(&pool->lock);
+		pool->size = max(cur->ec->echocan_state_size(taps), sizeof(void *));
+		snprintf(pool->name, sizeof(pool->name), "dahdi_ec_%s_%u",
+			 cur->ec->name, taps);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23)
+		pool->cache = kmem_cache_create(pool->name, pool->size, 0,
+						SLAB_HWCACHE_ALIGN, NULL, NULL);
+#else
+		pool->cache = kmem_cache_create(pool->name, pool->size, 0,
+						SLAB_HWCACHE_ALIGN, NULL);
+#endif
+		if (!pool->cache) {
+			ecpool_destroy(cur);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* Bring the free list of a pool up to the number of registered channels, less
+ * the blocks already handed out.  Called from process context only. */
+static void ecpool_fill(struct ecpool *pool)
+{
+	unsigned long flags;
+	void *block;
+
+	for (;;) {
+		spin_lock_irqsave(&pool->lock, flags);
+		if (pool->avail + pool->inuse >= atomic_read(&ecpool_channels)) {
+			spin_unlock_irqrestore(&pool->lock, flags);
+			break;
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+
+		if (!(block = kmem_cache_alloc(pool->cache, GFP_KERNEL)))
+			break;
+
+		spin_lock_irqsave(&pool->lock, flags);
+		*(void **) block = pool->free;
+		pool->free = block;
+		pool->avail++;
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+}
+
+/* Release free blocks a pool holds beyond the number of registered channels */
+static void ecpool_trim(struct ecpool *pool)
+{
+	unsigned long flags;
+	void *block;
+
+	for (;;) {
+		spin_lock_irqsave(&pool->lock, flags);
+		if (!pool->free || pool->avail <= atomic_read(&ecpool_channels)) {
+			spin_unlock_irqrestore(&pool->lock, flags);
+			break;
+		}
+		block = pool->free;
+		pool->free = *(void **) block;
+		pool->avail--;
+		spin_unlock_irqrestore(&pool->lock, flags);
+
+		kmem_cache_free(pool->cache, block);
+	}
+}
+
+/* Adjust every factory's pools after the number of registered channels changed */
+static void ecpool_resize_all(void)
 {
 	struct ecfactory *cur;
+	int x;
 
-	WARN_ON(!ec->owner);
+	read_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		if (!cur->ec->echocan_state_size)
+			continue;
+		/* Filling sleeps, so pin the factory and let go of the list
+		 * while doing it; the entry cannot be removed while its module
+		 * is referenced. */
+		if (!try_module_get(cur->ec->owner))
+			continue;
+		read_unlock(&ecfactory_list_lock);
 
-	write_lock(&ecfactory_list_lock);
+		for (x = 0; x < ECPOOL_SIZES; x++) {
+			ecpool_trim(&cur->pools[x]);
+			ecpool_fill(&cur->pools[x]);
+		}
 
-	/* make sure it isn't already registered */
+		read_lock(&ecfactory_list_lock);
+		module_put(cur->ec->owner);
+	}
+	read_unlock(&ecfactory_list_lock);
+}
+
+static struct ecpool *ecpool_find(const struct dahdi_echocan_factory *ec, u32 tap_length)
+{
+	struct ecfactory *cur;
+	struct ecpool *pool = NULL;
+	int x = ecpool_index(tap_length);
+
+	if (x < 0)
+		return NULL;
+
+	read_lock(&ecfactory_list_lock);
 	list_for_each_entry(cur, &ecfactory_list, list) {
 		if (cur->ec == ec) {
-			write_unlock(&ecfactory_list_lock);
-			return -EPERM;
+			if (cur->pools[x].cache)
+				pool = &cur->pools[x];
+			break;
 		}
 	}
+	read_unlock(&ecfactory_list_lock);
+
+	return pool;
+}
 
-	if (!(cur = kzalloc(sizeof(*cur), GFP_KERNEL))) {
-		write_unlock(&ecfactory_list_lock);
+void *dahdi_echocan_state_alloc(const struct dahdi_echocan_factory *ec, u32 tap_length)
+{
+	struct ecpool *pool;
+	unsigned long flags;
+	void *block;
+
+	might_sleep();
+
+	/* only the tail lengths DAHDI_ECHOCANCEL accepts are pooled; any other
+	 * (such as a deftaps that is not a power of two) comes from kmalloc */
+	if (!(pool = ecpool_find(ec, tap_length))) {
+		if (!ec->echocan_state_size)
+			return NULL;
+		return kzalloc(ec->echocan_state_size(tap_length), GFP_KERNEL);
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if ((block = pool->free)) {
+		pool->free = *(void **) block;
+		pool->avail--;
+	} else {
+		pool->misses++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (!block && !(block = kmem_cache_alloc(pool->cache, GFP_KERNEL)))
+		return NULL;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	pool->inuse++;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	memset(block, 0, pool->size);
+
+	return block;
+}
+
+void dahdi_echocan_state_free(const struct dahdi_echocan_factory *ec, u32 tap_length, void *state)
+{
+	struct ecpool *pool;
+	unsigned long flags;
+
+	if (!state)
+		return;
+
+	if (!(pool = ecpool_find(ec, tap_length))) {
+		kfree(state);
+		return;
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	pool->inuse--;
+	if (pool->avail < atomic_read(&ecpool_channels)) {
+		*(void **) state = pool->free;
+		pool->free = state;
+		pool->avail++;
+		state = NULL;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (state)
+		kmem_cache_free(pool->cache, state);
+}
+
+/*! \brief Account for a new instance of a software echo canceler
+ *
+ * \retval Zero if the instance may be created.
+ * \retval -ENODEV if the echo canceler is at its capacity, or the
+ * ec_max_cost limit would be exceeded.
+ */
+static int ecfactory_reserve(const struct dahdi_echocan_factory *ec, u32 cost)
+{
+	struct ecfactory *cur;
+	unsigned long flags;
+	int res = -ENODEV;
+
+	read_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		if (cur->ec != ec)
+			continue;
+		spin_lock_irqsave(&ecacct_lock, flags);
+		if ((ec->max_instances && (cur->instances >= ec->max_instances)) ||
+		    (ec_max_cost && (ec_cost + cost > ec_max_cost))) {
+			cur->refused++;
+		} else {
+			cur->instances++;
+			cur->cost += cost;
+			ec_cost += cost;
+			res = 0;
+		}
+		spin_unlock_irqrestore(&ecacct_lock, flags);
+		break;
+	}
+	read_unlock(&ecfactory_list_lock);
+
+	return res;
+}
+
+static void ecfactory_unreserve(const struct dahdi_echocan_factory *ec, u32 cost)
+{
+	struct ecfactory *cur;
+	unsigned long flags;
+
+	read_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		if (cur->ec != ec)
+			continue;
+		spin_lock_irqsave(&ecacct_lock, flags);
+		cur->instances--;
+		cur->cost -= cost;
+		ec_cost -= cost;
+		spin_unlock_irqrestore(&ecacct_lock, flags);
+		break;
+	}
+	read_unlock(&ecfactory_list_lock);
+}
+
+int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+	struct ecfactory *cur, *new;
+	unsigned long flags;
+	int x;
+
+	WARN_ON(!ec->owner);
+
+	if (!(new = kzalloc(sizeof(*new), GFP_KERNEL)))
 		return -ENOMEM;
+
+	new->ec = ec;
+	INIT_LIST_HEAD(&new->list);
+
+	if (ec->echocan_state_size && ecpool_init(new)) {
+		kfree(new);
+		return -ENOMEM;
+	}
+
+	write_lock_irqsave(&ecfactory_list_lock, flags);
+
+	/* make sure it isn't already registered */
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		if (cur->ec == ec) {
+			write_unlock_irqrestore(&ecfactory_list_lock, flags);
+			if (ec->echocan_state_size)
+				ecpool_destroy(new);
+			kfree(new);
+			return -EPERM;
+		}
 	}
 
-	cur->ec = ec;
-	INIT_LIST_HEAD(&cur->list);
+	list_add_tail(&new->list, &ecfactory_list);
 
-	list_add_tail(&cur->list, &ecfactory_list);
+	write_unlock_irqrestore(&ecfactory_list_lock, flags);
 
-	write_unlock(&ecfactory_list_lock);
+	/* reserve state blocks for the spans that are already registered */
+	if (ec->echocan_state_size) {
+		for (x = 0; x < ECPOOL_SIZES; x++)
+			ecpool_fill(&new->pools[x]);
+	}
 
 	return 0;
 }
 
 void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec)
 {
-	struct ecfactory *cur, *next;
+	struct ecfactory *cur, *next, *found = NULL;
+	unsigned long flags;
 
-	write_lock(&ecfactory_list_lock);
+	write_lock_irqsave(&ecfactory_list_lock, flags);
 
 	list_for_each_entry_safe(cur, next, &ecfactory_list, list) {
 		if (cur->ec == ec) {
 			list_del(&cur->list);
+			found = cur;
 			break;
 		}
 	}
 
-	write_unlock(&ecfactory_list_lock);
+	write_unlock_irqrestore(&ecfactory_list_lock, flags);
+
+	if (found) {
+		if (ec->echocan_state_size)
+			ecpool_destroy(found);
+		kfree(found);
+	}
 }
 
 static inline void rotate_sums(void)
@@ -493,6 +867,52 @@ static int dahdi_q_sig(struct dahdi_chan *chan)
 	return -1; /* not found -- error */
 }
 
+/* ERLE (in 0.1 dB) at or above which an echo canceller is reported as converged */
+#define ECSTATS_CONVERGED_ERLE 100
+
+/* 20 * log10(1 + n / 8) in tenths of a dB */
+static const u8 ecstats_db_frac[8] = { 0, 10, 19, 28, 35, 42, 49, 55 };
+
+/*! \brief Approximate 20 * log10(level) in tenths of a dB, to within 1 dB */
+static int ecstats_db(u32 level)
+{
+	int n;
+	u32 frac;
+
+	if (!level)
+		return 0;
+
+	n = fls(level) - 1;
+	if (n >= 3)
+		frac = (level >> (n - 3)) & 7;
+	else
+		frac = (level << (3 - n)) & 7;
+
+	return (n * 602) / 10 + ecstats_db_frac[frac];
+}
+
+/* must be called with chan->lock held, and chan->ec_state having the stats feature */
+static void fill_ecstats(struct dahdi_echocan_state *ec, struct dahdi_ecstats *st)
+{
+	const struct dahdi_echocan_stats *s = &ec->stats;
+
+	memset(st, 0, sizeof(*st));
+	dahdi_copy_string(st->echocan, ec->ops->name, sizeof(st->echocan));
+	if (s->tx_level && s->rx_level)
+		st->erl = ecstats_db(s->tx_level) - ecstats_db(s->rx_level);
+	if (s->rx_level)
+		st->erle = ecstats_db(s->rx_level) - ecstats_db(s->clean_level);
+	st->converged = (st->erle >= ECSTATS_CONVERGED_ERLE);
+	st->samples = s->samples;
+	st->nlp_samples = s->nlp_samples;
+	st->doubletalk = s->doubletalk;
+	st->resets = s->resets;
+	st->bypassed = ec->status.bypassed;
+	st->tx_level = s->tx_level;
+	st->rx_level = s->rx_level;
+	st->clean_level = s->clean_level;
+}
+
 #ifdef CONFIG_PROC_FS
 static const char *sigstr(int sig)
 {
@@ -564,8 +984,9 @@ static int fill_alarm_string(char *buf, int count, int alarms)
 
 static int dahdi_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
 {
-	int x, len = 0, real_count;
+	int x, i, len = 0, real_count;
 	long span;
+	unsigned long flags;
 
 	/* In Linux 2.6, page is always PROC_BLOCK_SIZE=(PAGE_SIZE-1024) bytes.
 	 * 0<count<=PROC_BLOCK_SIZE . count=1 will produce an error in
@@ -674,14 +1095,37 @@ static int dahdi_proc_read(char *page, char **start, off_t off, int count, int *
 		len += fill_alarm_string(page+len, count-len,
 				chan->chan_alarms);
 
-		if (chan->ec_factory)
-			len += snprintf(page+len, count-len, "(SWEC: %s) ",
+		if (chan->ec_factory) {
+			len += snprintf(page+len, count-len, "(SWEC: %s",
 					chan->ec_factory->name);
+			for (i = 0; i < DAHDI_MAX_ECHOCAN_PREFS - 1; i++) {
+				if (!chan->ec_fallback[i])
+					break;
+				len += snprintf(page+len, count-len, "/%s",
+						chan->ec_fallback[i]->name);
+			}
+			len += snprintf(page+len, count-len, ") ");
+		}
 
 		if (chan->ec_state)
 			len += snprintf(page+len, count-len, "(EC: %s) ",
 					chan->ec_state->ops->name);
 
+		spin_lock_irqsave(&chan->lock, flags);
+		if (chan->ec_state && chan->ec_state->features.stats) {
+			struct dahdi_ecstats st;
+
+			fill_ecstats(chan->ec_state, &st);
+			spin_unlock_irqrestore(&chan->lock, flags);
+			len += snprintf(page+len, count-len,
+					"(ERL: %ddB ERLE: %ddB%s NLP: %u%% DT: %u Resets: %u) ",
+					st.erl / 10, st.erle / 10,
+					st.converged ? " converged" : "",
+					(st.samples >= 100) ? st.nlp_samples / (st.samples / 100) : 0,
+					st.doubletalk, st.resets);
+		} else
+			spin_unlock_irqrestore(&chan->lock, flags);
+
 		len += snprintf(page+len, count-len, "\n");
 
 		/* If everything printed so far is before beginning 
@@ -711,6 +1155,85 @@ static int dahdi_proc_read(char *page, char **start, off_t off, int count, int *
 		len = count;	/* don't return bytes not asked for */
 	return len;
 }
+
+/* Number of distinct span (hardware) echo cancelers listed in /proc/dahdi/echocans */
+#define EC_PROC_MAX_HW 8
+
+/*! \brief /proc/dahdi/echocans: echo canceler usage and capacity */
+static int dahdi_proc_echocans_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct ecfactory *cur;
+	struct {
+		const char *name;
+		unsigned int instances;
+	} hw[EC_PROC_MAX_HW];
+	unsigned int hw_count = 0;
+	unsigned long flags;
+	int x, i, len = 0;
+
+	if (off > 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	len += snprintf(page + len, count - len,
+			"%-16s %10s %10s %10s %10s\n",
+			"Software", "Instances", "Limit", "Taps", "Refused");
+
+	read_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		spin_lock_irqsave(&ecacct_lock, flags);
+		len += snprintf(page + len, count - len,
+				"%-16s %10u %10u %10lu %10u\n",
+				cur->ec->name, cur->instances,
+				cur->ec->max_instances, cur->cost,
+				cur->refused);
+		spin_unlock_irqrestore(&ecacct_lock, flags);
+	}
+	read_unlock(&ecfactory_list_lock);
+
+	/* instances created by spans have no factory; count them by name */
+	read_lock(&chan_lock);
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		struct dahdi_chan *chan = chans[x];
+
+		if (!chan)
+			continue;
+		spin_lock_irqsave(&chan->lock, flags);
+		if (chan->ec_state && !chan->ec_current) {
+			for (i = 0; i < hw_count; i++) {
+				if (!strcmp(hw[i].name, chan->ec_state->ops->name))
+					break;
+			}
+			if (i == hw_count && hw_count < EC_PROC_MAX_HW) {
+				hw[i].name = chan->ec_state->ops->name;
+				hw[i].instances = 0;
+				hw_count++;
+			}
+			if (i < hw_count)
+				hw[i].instances++;
+		}
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+	read_unlock(&chan_lock);
+
+	len += snprintf(page + len, count - len, "\n%-16s %10s\n",
+			"Hardware", "Instances");
+	for (i = 0; i < hw_count; i++)
+		len += snprintf(page + len, count - len, "%-16s %10u\n",
+				hw[i].name, hw[i].instances);
+
+	len += snprintf(page + len, count - len,
+			"\nSoftware taps in use: %lu (limit %d)\n"
+			"Hardware unavailable, software tried: %d\n"
+			"No echo canceler available: %d\n",
+			ec_cost, ec_max_cost,
+			atomic_read(&ec_hw_unavailable),
+			atomic_read(&ec_unavailable));
+
+	*eof = 1;
+	return len;
+}
 #endif
 
 static int dahdi_first_empty_alias(void)
@@ -1166,6 +1689,98 @@ static void release_echocan(const struct dahdi_echocan_factory *ec)
 		module_put(ec->owner);
 }
 
+/*! \brief Free an echo canceler instance removed from a channel
+ * \param ec_current The factory which created it, or NULL if the span did.
+ */
+static void free_echocan(struct dahdi_chan *chan, const struct dahdi_echocan_factory *ec_current,
+			 struct dahdi_echocan_state *ec_state)
+{
+	u32 cost = ec_state->status.tail;
+
+	ec_state->ops->echocan_free(chan, ec_state);
+	if (ec_current) {
+		ecfactory_unreserve(ec_current, cost);
+		release_echocan(ec_current);
+	}
+}
+
+/*! \brief Try to create an echo canceler instance from one software factory
+ *
+ * \retval -ENODEV if this factory cannot provide one right now, and the
+ * next one should be tried.
+ */
+static int create_echocan(struct dahdi_chan *chan, const struct dahdi_echocan_factory *factory,
+			  struct dahdi_echocanparams *ecp, struct dahdi_echocanparam *p,
+			  struct dahdi_echocan_state **ec)
+{
+	int ret;
+
+	if (ecfactory_reserve(factory, ecp->tap_length))
+		return -ENODEV;
+
+	/* try to get another reference to the module providing
+	   this echo canceler */
+	if (!try_module_get(factory->owner)) {
+		module_printk(KERN_ERR, "Cannot get a reference to the '%s' echo canceler\n", factory->name);
+		ecfactory_unreserve(factory, ecp->tap_length);
+		return -ENODEV;
+	}
+
+	ret = factory->echocan_create(chan, ecp, p, ec);
+	if (!ret && !*ec) {
+		module_printk(KERN_ERR, "%s failed to allocate an " \
+			      "dahdi_echocan_state instance.\n",
+			      factory->name);
+		ret = -EFAULT;
+	}
+	if (ret) {
+		release_echocan(factory);
+		ecfactory_unreserve(factory, ecp->tap_length);
+		/* out of memory for this one; another may still fit */
+		if (ret == -ENOMEM)
+			ret = -ENODEV;
+	}
+
+	return ret;
+}
+
+/*! \brief Set the echo canceler preferences of a channel
+ * \param names Echo canceler names, in order of preference; the list ends
+ * at the first empty name.
+ */
+static int attach_echocans(struct dahdi_chan *chan, char names[DAHDI_MAX_ECHOCAN_PREFS][16])
+{
+	const struct dahdi_echocan_factory *new[DAHDI_MAX_ECHOCAN_PREFS] = { NULL, };
+	const struct dahdi_echocan_factory *old[DAHDI_MAX_ECHOCAN_PREFS];
+	unsigned long flags;
+	int x;
+
+	for (x = 0; x < DAHDI_MAX_ECHOCAN_PREFS; x++) {
+		names[x][15] = '\0';
+		if (!names[x][0])
+			break;
+		if (!(new[x] = find_echocan(names[x]))) {
+			while (x--)
+				release_echocan(new[x]);
+			return -EINVAL;
+		}
+	}
+
+	spin_lock_irqsave(&chan->lock, flags);
+	old[0] = chan->ec_factory;
+	chan->ec_factory = new[0];
+	for (x = 1; x < DAHDI_MAX_ECHOCAN_PREFS; x++) {
+		old[x] = chan->ec_fallback[x - 1];
+		chan->ec_fallback[x - 1] = new[x];
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	for (x = 0; x < DAHDI_MAX_ECHOCAN_PREFS; x++)
+		release_echocan(old[x]);
+
+	return 0;
+}
+
 /** 
  * close_channel - close the channel, resetting any channel variables
  * @chan: the dahdi_chan to close
@@ -1256,10 +1871,8 @@ static void close_channel(struct dahdi_chan *chan)
 	if (chan->span && chan->span->dacs && oldconf)
 		chan->span->dacs(chan, NULL);
 
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
+	if (ec_state)
+		free_echocan(chan, ec_current, ec_state);
 
 	spin_unlock_irqrestore(&chan->lock, flags);
 
@@ -1880,6 +2493,8 @@ static void dahdi_chan_unreg(struct dahdi_chan *chan)
 	might_sleep();
 
 	release_echocan(chan->ec_factory);
+	for (x = 0; x < DAHDI_MAX_ECHOCAN_PREFS - 1; x++)
+		release_echocan(chan->ec_fallback[x]);
 
 #ifdef CONFIG_DAHDI_NET
 	if (chan->flags & DAHDI_FLAG_NETDEV) {
@@ -2562,10 +3177,8 @@ static int initialize_channel(struct dahdi_chan *chan)
 		chan->ringcadence[1] = DAHDI_RINGOFFTIME;
 	}
 
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
+	if (ec_state)
+		free_echocan(chan, ec_current, ec_state);
 
 	spin_unlock_irqrestore(&chan->lock, flags);
 
@@ -2592,6 +3205,7 @@ static int dahdi_timing_open(struct inode *inode, struct file *file)
 	spin_lock_irqsave(&zaptimerlock, flags);
 	list_add(&t->list, &zaptimers);
 	spin_unlock_irqrestore(&zaptimerlock, flags);
+	atomic_inc(&dahdi_users);
 
 	return 0;
 }
@@ -2621,6 +3235,7 @@ static int dahdi_timer_release(struct inode *inode, struct file *file)
 	}
 
 	kfree(cur);
+	atomic_dec(&dahdi_users);
 
 	return 0;
 }
@@ -2654,6 +3269,7 @@ static int dahdi_specchan_open(struct inode *inode, struct file *file, int unit)
 			if (!res) {
 				chans[unit]->file = file;
 				spin_unlock_irqrestore(&chans[unit]->lock, flags);
+				atomic_inc(&dahdi_users);
 			} else {
 				spin_unlock_irqrestore(&chans[unit]->lock, flags);
 				close_channel(chans[unit]);
@@ -2678,6 +3294,7 @@ static int dahdi_specchan_release(struct inode *node, struct file *file, int uni
 		chans[unit]->file = NULL;
 		spin_unlock_irqrestore(&chans[unit]->lock, flags);
 		close_channel(chans[unit]);
+		atomic_dec(&dahdi_users);
 		if (chans[unit]->span && chans[unit]->span->close)
 			res = chans[unit]->span->close(chans[unit]);
 		/* The channel might be destroyed by low-level driver span->close() */
@@ -3857,6 +4474,27 @@ void dahdi_set_hpec_ioctl(int (*func)(unsigned int cmd, unsigned long data))
 	dahdi_hpec_ioctl = func;
 }
 
+static void (*dahdi_clockref_hook)(struct dahdi_span *span, int chunks);
+
+void dahdi_set_clockref_hook(void (*func)(struct dahdi_span *span, int chunks))
+{
+	rcu_assign_pointer(dahdi_clockref_hook, func);
+	/* Make sure nobody is still calling the old one */
+	if (!func)
+		synchronize_rcu();
+}
+
+void dahdi_span_clockref(struct dahdi_span *span, int chunks)
+{
+	void (*func)(struct dahdi_span *span, int chunks);
+
+	rcu_read_lock();
+	func = rcu_dereference(dahdi_clockref_hook);
+	if (func)
+		func(span, chunks);
+	rcu_read_unlock();
+}
+
 static void recalc_slaves(struct dahdi_chan *chan)
 {
 	int x;
@@ -3961,7 +4599,7 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 	case DAHDI_ATTACH_ECHOCAN:
 	{
 		struct dahdi_attach_echocan ae;
-		const struct dahdi_echocan_factory *new = NULL, *old;
+		char names[DAHDI_MAX_ECHOCAN_PREFS][16];
 
 		if (copy_from_user(&ae, (struct dahdi_attach_echocan *) data, sizeof(ae))) {
 			return -EFAULT;
@@ -3969,23 +4607,21 @@ static int dahdi_ctl_ioctl(struct inode *inode, struct file *file, unsigned int
 
 		VALID_CHANNEL(ae.chan);
 
-		ae.echocan[sizeof(ae.echocan) - 1] = 0;
-		if (ae.echocan[0]) {
-			if (!(new = find_echocan(ae.echocan))) {
-				return -EINVAL;
-			}
-		}
+		memset(names, 0, sizeof(names));
+		memcpy(names[0], ae.echocan, sizeof(names[0]));
 
-		spin_lock_irqsave(&chans[ae.chan]->lock, flags);
-		old = chans[ae.chan]->ec_factory;
-		chans[ae.chan]->ec_factory = new;
-		spin_unlock_irqrestore(&chans[ae.chan]->lock, flags);
+		return attach_echocans(chans[ae.chan], names);
+	}
+	case DAHDI_ATTACH_ECHOCANS:
+	{
+		struct dahdi_attach_echocans ae;
 
-		if (old) {
-			release_echocan(old);
-		}
+		if (copy_from_user(&ae, (struct dahdi_attach_echocans *) data, sizeof(ae)))
+			return -EFAULT;
 
-		break;
+		VALID_CHANNEL(ae.chan);
+
+		return attach_echocans(chans[ae.chan], ae.echocan);
 	}
 	case DAHDI_CHANCONFIG:
 	{
@@ -4970,7 +5606,7 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 	struct dahdi_echocan_state *ec = NULL, *ec_state;
 	const struct dahdi_echocan_factory *ec_current;
 	struct dahdi_echocanparam *params;
-	int ret;
+	int ret, x;
 	unsigned long flags;
 
 	if (ecp->param_count > DAHDI_MAX_ECHOCANPARAMS)
@@ -4984,10 +5620,8 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 		ec_current = chan->ec_current;
 		chan->ec_current = NULL;
 		spin_unlock_irqrestore(&chan->lock, flags);
-		if (ec_state) {
-			ec_state->ops->echocan_free(chan, ec_state);
-			release_echocan(ec_current);
-		}
+		if (ec_state)
+			free_echocan(chan, ec_current, ec_state);
 
 		return 0;
 	}
@@ -5011,10 +5645,8 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 	ec_current = chan->ec_current;
 	chan->ec_current = NULL;
 	spin_unlock_irqrestore(&chan->lock, flags);
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
+	if (ec_state)
+		free_echocan(chan, ec_current, ec_state);
 
 	switch (ecp->tap_length) {
 	case 32:
@@ -5031,36 +5663,32 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 	ret = -ENODEV;
 	ec_current = NULL;
 
-	/* attempt to use the span's echo canceler; fall back to built-in
-	   if it fails (but not if an error occurs) */
-	if (chan->span && chan->span->echocan_create)
+	/* attempt to use the span's echo canceler; fall back to the
+	   channel's software ones, in order of preference, if it is not
+	   available or they are at capacity (but not if an error occurs) */
+	if (chan->span && chan->span->echocan_create) {
 		ret = chan->span->echocan_create(chan, ecp, params, &ec);
+		if ((ret == -ENODEV) && chan->ec_factory)
+			atomic_inc(&ec_hw_unavailable);
+	}
 
-	if ((ret == -ENODEV) && chan->ec_factory) {
-		/* try to get another reference to the module providing
-		   this channel's echo canceler */
-		if (!try_module_get(chan->ec_factory->owner)) {
-			module_printk(KERN_ERR, "Cannot get a reference to the '%s' echo canceler\n", chan->ec_factory->name);
-			goto exit_with_free;
-		}
+	for (x = 0; (ret == -ENODEV) && (x < DAHDI_MAX_ECHOCAN_PREFS); x++) {
+		const struct dahdi_echocan_factory *factory;
 
-		/* got the reference, copy the pointer and use it for making
-		   an echo canceler instance if possible */
-		ec_current = chan->ec_factory;
+		factory = x ? chan->ec_fallback[x - 1] : chan->ec_factory;
+		if (!factory)
+			continue;
 
-		ret = ec_current->echocan_create(chan, ecp, params, &ec);
-		if (ret) {
-			release_echocan(ec_current);
+		ec = NULL;
+		ret = create_echocan(chan, factory, ecp, params, &ec);
+		if (!ret)
+			ec_current = factory;
+	}
 
-			goto exit_with_free;
-		}
-		if (!ec) {
-			module_printk(KERN_ERR, "%s failed to allocate an " \
-				      "dahdi_echocan_state instance.\n",
-				      ec_current->name);
-			ret = -EFAULT;
-			goto exit_with_free;
-		}
+	if (ret) {
+		if ((ret == -ENODEV) && chan->ec_factory)
+			atomic_inc(&ec_unavailable);
+		goto exit_with_free;
 	}
 
 	if (ec) {
@@ -5068,6 +5696,9 @@ static int ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams
 		chan->ec_current = ec_current;
 		chan->ec_state = ec;
 		ec->status.mode = ECHO_MODE_ACTIVE;
+		ec->status.tail = ecp->tap_length;
+		ec->status.tx_idle = 0;
+		ec->status.bypassed = 0;
 		if (!ec->features.CED_tx_detect) {
 			echo_can_disable_detector_init(&chan->ec_state->txecdis);
 		}
@@ -5133,6 +5764,45 @@ static void set_echocan_fax_mode(struct dahdi_chan *chan, unsigned int channo, c
 	}
 }
 
+static const struct {
+	int tone;
+	/* whether the echo canceler should be put into FAX mode */
+	int fax;
+	int tx_event;
+	int rx_event;
+	const char *tx_reason;
+	const char *rx_reason;
+} ecdis_tones[] = {
+	{ ECDIS_CED, 1, DAHDI_EVENT_TX_CED_DETECTED, DAHDI_EVENT_RX_CED_DETECTED,
+	  "CED tx detected", "CED rx detected" },
+	{ ECDIS_ANSAM, 1, DAHDI_EVENT_TX_ANSAM_DETECTED, DAHDI_EVENT_RX_ANSAM_DETECTED,
+	  "ANSam tx detected", "ANSam rx detected" },
+	{ ECDIS_V21, 1, DAHDI_EVENT_TX_V21_DETECTED, DAHDI_EVENT_RX_V21_DETECTED,
+	  "V.21 preamble tx detected", "V.21 preamble rx detected" },
+	{ ECDIS_BELL, 1, DAHDI_EVENT_TX_BELL_ANS_DETECTED, DAHDI_EVENT_RX_BELL_ANS_DETECTED,
+	  "Bell answer tone tx detected", "Bell answer tone rx detected" },
+	{ ECDIS_CNG, 0, DAHDI_EVENT_TX_CNG_DETECTED, DAHDI_EVENT_RX_CNG_DETECTED,
+	  "CNG tx detected", "CNG rx detected" },
+};
+
+/* Act on the tones found by the core's fax/modem tone detector. Called with chan->lock held. */
+static void ecdis_detected(struct dahdi_chan *chan, unsigned int channo, int tones, int rx)
+{
+	int x;
+
+	for (x = 0; x < ARRAY_SIZE(ecdis_tones); x++) {
+		if (!(tones & ecdis_tones[x].tone))
+			continue;
+		/* leave CNG to echocans which detect it themselves */
+		if ((ecdis_tones[x].tone == ECDIS_CNG) &&
+		    (rx ? chan->ec_state->features.CNG_rx_detect : chan->ec_state->features.CNG_tx_detect))
+			continue;
+		if (ecdis_tones[x].fax && (chan->ec_state->status.mode == ECHO_MODE_ACTIVE))
+			set_echocan_fax_mode(chan, channo, rx ? ecdis_tones[x].rx_reason : ecdis_tones[x].tx_reason, 1);
+		dahdi_qevent_nolock(chan, rx ? ecdis_tones[x].rx_event : ecdis_tones[x].tx_event);
+	}
+}
+
 static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long data, int unit)
 {
 	struct dahdi_chan *chan = chans[unit];
@@ -5212,10 +5882,8 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 			chan->gainalloc = 0;
 			spin_unlock_irqrestore(&chan->lock, flags);
 
-			if (ec_state) {
-				ec_state->ops->echocan_free(chan, ec_state);
-				release_echocan(ec_current);
-			}
+			if (ec_state)
+				free_echocan(chan, ec_current, ec_state);
 
 			if (rxgain)
 				kfree(rxgain);
@@ -5265,10 +5933,8 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 					chan->flags &= ~DAHDI_FLAG_AUDIO;
 					chan->flags |= (DAHDI_FLAG_PPP | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 
-					if (tec) {
-						tec->ops->echocan_free(chan, tec);
-						release_echocan(ec_current);
-					}
+					if (tec)
+						free_echocan(chan, ec_current, tec);
 				} else
 					return -ENOMEM;
 			}
@@ -5373,6 +6039,21 @@ static int dahdi_chan_ioctl(struct inode *inode, struct file *file, unsigned int
 			spin_unlock_irqrestore(&chan->lock, flags);
 		}
 		break;
+	case DAHDI_GET_ECSTATS:
+	{
+		struct dahdi_ecstats st;
+
+		spin_lock_irqsave(&chan->lock, flags);
+		if (!chan->ec_state || !chan->ec_state->features.stats) {
+			spin_unlock_irqrestore(&chan->lock, flags);
+			return -EINVAL;
+		}
+		fill_ecstats(chan->ec_state, &st);
+		spin_unlock_irqrestore(&chan->lock, flags);
+		if (copy_to_user((struct dahdi_ecstats *) data, &st, sizeof(st)))
+			return -EFAULT;
+		break;
+	}
 	case DAHDI_SETTXBITS:
 		if (chan->sig != DAHDI_SIG_CAS)
 			return -EINVAL;
@@ -5634,6 +6315,10 @@ int dahdi_register(struct dahdi_span *span, int prefmaster)
 		dahdi_chan_reg(span->chans[x]);
 	}
 
+	/* Reserve echo canceler state for the new channels */
+	atomic_add(span->channels, &ecpool_channels);
+	ecpool_resize_all();
+
 #ifdef CONFIG_PROC_FS
 	{
 		char tempfile[17];
@@ -5709,6 +6394,8 @@ int dahdi_unregister(struct dahdi_span *span)
 	clear_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags);
 	for (x=0;x<span->channels;x++)
 		dahdi_chan_unreg(span->chans[x]);
+	atomic_sub(span->channels, &ecpool_channels);
+	ecpool_resize_all();
 	new_maxspans = 0;
 	new_master = master; /* FIXME: locking */
 	if (master == span)
@@ -5899,13 +6586,9 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 		getlin[x] = DAHDI_XLAW(txb[x], ms);
 
 	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_tx_detect) {
-		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-			if (echo_can_disable_detector_update(&ms->ec_state->txecdis, getlin[x])) {
-				set_echocan_fax_mode(ms, ss->channo, "CED tx detected", 1);
-				dahdi_qevent_nolock(ms, DAHDI_EVENT_TX_CED_DETECTED);
-				break;
-			}
-		}
+		x = echo_can_disable_detector_update(&ms->ec_state->txecdis, getlin, DAHDI_CHUNKSIZE);
+		if (x)
+			ecdis_detected(ms, ss->channo, x, 0);
 	}
 
 	if ((!ms->confmute && !ms->dialing) || (ms->flags & DAHDI_FLAG_PSEUDO)) {
@@ -6733,6 +7416,33 @@ static void process_echocan_events(struct dahdi_chan *chan)
 	}
 }
 
+/* Transmitted samples no louder than this are considered silence (about -54dBm0) */
+#define EC_TX_IDLE_LEVEL 64
+
+/*! \brief Whether the echocan can be bypassed for this chunk
+ *
+ * True once nothing but silence has been transmitted for longer than the
+ * echo tail, so that there can be no echo left to cancel.
+ */
+static inline int ec_tx_idle(struct dahdi_echocan_state *ec, const short *txlins)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		if (abs(txlins[x]) > EC_TX_IDLE_LEVEL) {
+			ec->status.tx_idle = 0;
+			return 0;
+		}
+	}
+
+	if (ec->status.tx_idle < ec->status.tail) {
+		ec->status.tx_idle += DAHDI_CHUNKSIZE;
+		return 0;
+	}
+
+	return 1;
+}
+
 static inline void __dahdi_ec_chunk(struct dahdi_chan *ss, unsigned char *rxchunk, const unsigned char *txchunk)
 {
 	short rxlin, txlin;
@@ -6786,14 +7496,23 @@ static inline void __dahdi_ec_chunk(struct dahdi_chan *ss, unsigned char *rxchun
 			if (ss->ec_state->ops->echocan_process) {
 				short rxlins[DAHDI_CHUNKSIZE], txlins[DAHDI_CHUNKSIZE];
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-					rxlins[x] = DAHDI_XLAW(rxchunk[x], ss);
+				for (x = 0; x < DAHDI_CHUNKSIZE; x++)
 					txlins[x] = DAHDI_XLAW(txchunk[x], ss);
-				}
-				ss->ec_state->ops->echocan_process(ss->ec_state, rxlins, txlins, DAHDI_CHUNKSIZE);
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-					rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
+				if (ss->ec_state->features.idle_bypass && ec_idle_bypass &&
+				    ec_tx_idle(ss->ec_state, txlins)) {
+					/* nothing to cancel; leave the echocan's state and the
+					   received audio alone */
+					ss->ec_state->status.bypassed += DAHDI_CHUNKSIZE;
+				} else {
+					for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+						rxlins[x] = DAHDI_XLAW(rxchunk[x], ss);
+
+					ss->ec_state->ops->echocan_process(ss->ec_state, rxlins, txlins, DAHDI_CHUNKSIZE);
+
+					for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+						rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
+				}
 			} else if (ss->ec_state->ops->echocan_events)
 				ss->ec_state->ops->echocan_events(ss->ec_state);
 
@@ -6893,13 +7612,9 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 	}
 
 	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_rx_detect) {
-		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-			if (echo_can_disable_detector_update(&ms->ec_state->rxecdis, putlin[x])) {
-				set_echocan_fax_mode(ms, ss->channo, "CED rx detected", 1);
-				dahdi_qevent_nolock(ms, DAHDI_EVENT_RX_CED_DETECTED);
-				break;
-			}
-		}
+		x = echo_can_disable_detector_update(&ms->ec_state->rxecdis, putlin, DAHDI_CHUNKSIZE);
+		if (x)
+			ecdis_detected(ms, ss->channo, x, 1);
 	}
 
 	/* if doing rx tone decoding */
@@ -7873,6 +8588,23 @@ int dahdi_transmit(struct dahdi_span *span)
 	return 0;
 }
 
+int dahdi_timing_idle(void)
+{
+#ifdef	DAHDI_SYNC_TICK
+	int x;
+#endif
+
+	if (atomic_read(&dahdi_users) || dahdi_dynamic_ioctl || maxlinks)
+		return 0;
+#ifdef	DAHDI_SYNC_TICK
+	for (x = 0; x < maxspans; x++) {
+		if (spans[x] && spans[x]->sync_tick)
+			return 0;
+	}
+#endif
+	return 1;
+}
+
 static void process_masterspan(void)
 {
 	unsigned long flags;
@@ -7885,6 +8617,10 @@ static void process_masterspan(void)
 	 * to be called 1000 times per second. */
 	atomic_inc(&core_timer.count);
 #endif
+	/* With nothing open there are no sums to rotate nor timers to run */
+	if (dahdi_timing_idle())
+		return;
+
 	/* Hold the big zap lock for the duration of major
 	   activities which touch all sorts of channels */
 	spin_lock_irqsave(&bigzaplock, flags);
@@ -8184,6 +8920,8 @@ MODULE_VERSION(DAHDI_VERSION);
 
 module_param(debug, int, 0644);
 module_param(deftaps, int, 0644);
+module_param(ec_idle_bypass, int, 0644);
+module_param(ec_max_cost, int, 0644);
 
 static struct file_operations dahdi_fops = {
 	.owner   = THIS_MODULE,
@@ -8284,6 +9022,8 @@ static int __init dahdi_init(void)
 
 #ifdef CONFIG_PROC_FS
 	proc_entries[0] = proc_mkdir("dahdi", NULL);
+	create_proc_read_entry("dahdi/echocans", 0444, NULL,
+			dahdi_proc_echocans_read, NULL);
 #endif
 
 	if ((res = register_chrdev(DAHDI_MAJOR, "dahdi", &dahdi_fops))) {
@@ -8324,6 +9064,7 @@ static void __exit dahdi_cleanup(void)
 	unregister_chrdev(DAHDI_MAJOR, "dahdi");
 
 #ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/echocans", NULL);
 	remove_proc_entry("dahdi", NULL);
 #endif
 
@@ -49,9 +49,12 @@
 #include <linux/init.h>
 #include <linux/errno.h>
 #include <linux/moduleparam.h>
+#include <linux/proc_fs.h>
 
 #if defined(USE_HIGHRESTIMER)
 #include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <asm/div64.h>
 #else
 #include <linux/time.h>
 #endif
@@ -81,6 +84,31 @@ struct dahdi_dummy {
 #if !defined(USE_HIGHRESTIMER)
 	unsigned long calls_since_start;
 	struct timespec start_interval;
+#else
+	unsigned long ticks;		/* Timeline, including missed ticks */
+	unsigned long wakeups;
+	unsigned long idle_wakeups;
+	unsigned long missed;
+	unsigned long dropped;		/* Missed and too late to catch up */
+	/* Reference clock, fed from dahdi_span_clockref() */
+	spinlock_t reflock;
+	unsigned long ref_chunks;
+	ktime_t ref_time;		/* When the last chunks arrived */
+	int ref_seen;
+	/* Software PLL disciplining the tick to the reference */
+	int pll_span;			/* Reference span being followed */
+	int locked;
+	unsigned long local_base;	/* ticks and ref_chunks when locked */
+	unsigned long ref_base;
+	s64 ref_offset;			/* ns since the reference's last chunks, when locked */
+	s64 phase_sum;
+	int phase_n;
+	s64 phase_ns;			/* Averaged phase error, positive if ahead */
+	s64 integ_ps;			/* Integral term, ps per tick */
+	s32 adj_ps;			/* Tick period adjustment, ps per tick */
+	s32 frac_ps;			/* Adjustment not yet applied */
+	unsigned int relocks;
+	unsigned int holdovers;
 #endif
 };
 
@@ -88,17 +116,45 @@ static struct dahdi_dummy *ztd;
 
 static int debug = 0;
 
+/* Span whose far end clock the tick follows, 0 to free run */
+static int ref_span = 0;
+
+/* Furthest the tick may be pulled from nominal, in parts per million */
+static int pll_max_ppm = 200;
+
+/* Ticks run back to back on each timer expiry */
+static int batch = 1;
+
 #ifdef USE_HIGHRESTIMER
 #define CLOCK_SRC "HRtimer"
 static struct hrtimer zaptimer;
 #define DAHDI_RATE 1000                     /* DAHDI ticks per second */
 #define DAHDI_TIME (1000000 / DAHDI_RATE)  /* DAHDI tick time in us */
 #define DAHDI_TIME_NS (DAHDI_TIME * 1000)  /* DAHDI tick time in ns */
+
+/* Most missed ticks processed when the timer catches up */
+#define DAHDI_DUMMY_MAX_CATCHUP	100
+
+/* Largest batch, in ticks, and how often to look for work when idle */
+#define DAHDI_DUMMY_MAX_BATCH	20
+#define DAHDI_DUMMY_IDLE_TICKS	10
+
+/* Ticks the phase error is averaged over between PLL updates */
+#define PLL_INTERVAL	100
+/* Proportional and integral divisors; 1 ns of phase error moves the
+   period by 1000/PLL_KP ps, settling over roughly 10 seconds */
+#define PLL_KP		10000
+#define PLL_KI		4000000
+/* Phase error, in ns, beyond which the PLL starts over rather than slews */
+#define PLL_MAX_PHASE	(50 * DAHDI_TIME_NS)
+/* Reference silent for this long, in ns, puts the PLL in holdover */
+#define PLL_HOLDOVER	NSEC_PER_SEC
 #else
 #define CLOCK_SRC "Linux26"
 static struct timer_list timer;
 static atomic_t shutdown;
 #define JIFFIES_INTERVAL (HZ/250) 	/* 4ms is fine for dahdi_dummy */
+#define JIFFIES_IDLE_INTERVAL (HZ/100)	/* Only looking for work */
 #endif
 
 /* Different bits of the debug variable: */
@@ -106,26 +162,169 @@ static atomic_t shutdown;
 #define DEBUG_TICKS   (1 << 1)
 
 #if defined(USE_HIGHRESTIMER)
+static inline s64 pll_div(s64 n, u32 d)
+{
+	u64 a = (n < 0) ? -n : n;
+
+	do_div(a, d);
+	return (n < 0) ? -(s64)a : (s64)a;
+}
+
+static void dahdi_dummy_clockref(struct dahdi_span *span, int chunks)
+{
+	unsigned long flags;
+
+	if (span->spanno != ref_span)
+		return;
+	spin_lock_irqsave(&ztd->reflock, flags);
+	ztd->ref_chunks += chunks;
+	ztd->ref_time = ktime_get();
+	ztd->ref_seen = 1;
+	spin_unlock_irqrestore(&ztd->reflock, flags);
+}
+
+/* Compare our timeline with the reference's and steer the tick period
+   toward it.  Called from the timer, once per expiry of n ticks. */
+static void dahdi_dummy_pll(struct dahdi_dummy *ztd, ktime_t now, int n)
+{
+	unsigned long ref_chunks;
+	ktime_t ref_time;
+	int ref_seen;
+	s64 since, e, max_ps;
+
+	spin_lock(&ztd->reflock);
+	if (ztd->pll_span != ref_span) {
+		/* A new reference, or none; start over */
+		ztd->pll_span = ref_span;
+		ztd->ref_seen = 0;
+		ztd->locked = 0;
+		ztd->integ_ps = 0;
+		ztd->adj_ps = 0;
+		ztd->phase_ns = 0;
+	}
+	ref_chunks = ztd->ref_chunks;
+	ref_time = ztd->ref_time;
+	ref_seen = ztd->ref_seen;
+	spin_unlock(&ztd->reflock);
+
+	if (!ref_seen)
+		return;
+
+	since = ktime_to_ns(ktime_sub(now, ref_time));
+	if (since > PLL_HOLDOVER) {
+		/* Reference gone; keep the frequency we had */
+		if (ztd->locked) {
+			ztd->locked = 0;
+			ztd->holdovers++;
+			if (printk_ratelimit())
+				printk(KERN_NOTICE "dahdi_dummy: Lost reference span %d, holding over\n", ztd->pll_span);
+		}
+		return;
+	}
+
+	if (!ztd->locked) {
+		/* Measure from here on */
+		ztd->locked = 1;
+		ztd->local_base = ztd->ticks;
+		ztd->ref_base = ref_chunks;
+		ztd->ref_offset = since;
+		ztd->phase_sum = 0;
+		ztd->phase_n = 0;
+		return;
+	}
+
+	/* The reference is taken to be (since) further on than its last
+	   chunks, as its next ones are on the way */
+	e = (s64)(long)((ztd->ticks - ztd->local_base) - (ref_chunks - ztd->ref_base)) * DAHDI_TIME_NS -
+		(since - ztd->ref_offset);
+	ztd->phase_sum += e * n;
+	ztd->phase_n += n;
+	if (ztd->phase_n < PLL_INTERVAL)
+		return;
+	e = pll_div(ztd->phase_sum, ztd->phase_n);
+	ztd->phase_sum = 0;
+	ztd->phase_n = 0;
+	ztd->phase_ns = e;
+
+	if ((e > PLL_MAX_PHASE) || (e < -PLL_MAX_PHASE)) {
+		/* Too far off to slew, e.g. the far end restarted */
+		ztd->locked = 0;
+		ztd->relocks++;
+		return;
+	}
+
+	/* Being ahead lengthens the period */
+	max_ps = (s64)min(max(pll_max_ppm, 0), 1000) * (DAHDI_TIME_NS / 1000);
+	ztd->integ_ps += pll_div(e * 1000, PLL_KI);
+	if (ztd->integ_ps > max_ps)
+		ztd->integ_ps = max_ps;
+	else if (ztd->integ_ps < -max_ps)
+		ztd->integ_ps = -max_ps;
+	e = pll_div(e * 1000, PLL_KP) + ztd->integ_ps;
+	if (e > max_ps)
+		e = max_ps;
+	else if (e < -max_ps)
+		e = -max_ps;
+	ztd->adj_ps = e;
+}
+
+/* Period in ns of the next n ticks, carrying what doesn't make a
+   whole ns over */
+static inline s64 dahdi_dummy_period(struct dahdi_dummy *ztd, int n)
+{
+	s32 ps = ztd->adj_ps * n + ztd->frac_ps;
+	s32 ns = ps / 1000;
+
+	ztd->frac_ps = ps - ns * 1000;
+	return (s64)DAHDI_TIME_NS * n + ns;
+}
+
 static enum hrtimer_restart dahdi_dummy_hr_int(struct hrtimer *htmr)
 {
-	unsigned long overrun;
-	
-	/* Trigger DAHDI */
-	dahdi_receive(&ztd->span);
-	dahdi_transmit(&ztd->span);
-
-	/* Overrun should always return 1, since we are in the timer that 
-	 * expired.
-	 * We should worry if overrun is 2 or more; then we really missed 
-	 * a tick */
-	overrun = hrtimer_forward(&zaptimer, hrtimer_get_expires(htmr), 
-			ktime_set(0, DAHDI_TIME_NS));
-	if(overrun > 1) {
+	unsigned long overrun, runs;
+	ktime_t now = ktime_get();
+	int idle = dahdi_timing_idle();
+	int n = max(min(batch, DAHDI_DUMMY_MAX_BATCH), 1);
+
+	/* With nothing open, only wake up now and then to see if that's
+	 * changed; the core skips the ticks anyway */
+	if (idle) {
+		n = max(n, DAHDI_DUMMY_IDLE_TICKS);
+		ztd->idle_wakeups++;
+	}
+	ztd->wakeups++;
+
+	/* Count whole periods since the last expiry, so that if we were
+	 * held off we catch up on the ticks we missed rather than let
+	 * them slip */
+	overrun = hrtimer_forward(&zaptimer, now,
+			ktime_set(0, dahdi_dummy_period(ztd, n)));
+	if (!overrun)
+		overrun = 1;
+	runs = overrun * n;
+	if (overrun > 1) {
+		ztd->missed += (overrun - 1) * n;
 		if(printk_ratelimit())
 			printk(KERN_NOTICE "dahdi_dummy: HRTimer missed %lu ticks\n", 
-					overrun - 1);
+					(overrun - 1) * n);
+	}
+	if (idle) {
+		/* One is enough to show the core we're still here */
+		runs = 1;
+	} else if (runs > DAHDI_DUMMY_MAX_CATCHUP) {
+		ztd->dropped += runs - DAHDI_DUMMY_MAX_CATCHUP;
+		runs = DAHDI_DUMMY_MAX_CATCHUP;
 	}
 
+	/* Trigger DAHDI, a batch of ticks back to back */
+	while (runs--) {
+		dahdi_receive(&ztd->span);
+		dahdi_transmit(&ztd->span);
+	}
+	ztd->ticks += overrun * n;
+
+	dahdi_dummy_pll(ztd, now, overrun * n);
+
 	if(debug && DEBUG_TICKS) {
 		static int count = 0;
 		/* Printk every 5 seconds, good test to see if timer is 
@@ -137,6 +336,44 @@ static enum hrtimer_restart dahdi_dummy_hr_int(struct hrtimer *htmr)
 	/* Always restart the timer */
 	return HRTIMER_RESTART;
 }
+
+#ifdef CONFIG_PROC_FS
+static int dahdi_dummy_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	int len;
+	s32 adj = ztd->adj_ps;
+
+	if (off > 0) {
+		*eof = 1;
+		return 0;
+	}
+	len = snprintf(page, count,
+		       "reference: %d%s\n"
+		       "phase error: %lld ns\n"
+		       "frequency adjustment: %s%d.%03d ppm\n"
+		       "relocks: %u\n"
+		       "holdovers: %u\n"
+		       "batch: %d\n"
+		       "ticks: %lu\n"
+		       "wakeups: %lu\n"
+		       "idle wakeups: %lu\n"
+		       "missed: %lu\n"
+		       "dropped: %lu\n",
+		       ztd->pll_span,
+		       !ztd->pll_span ? " (free running)" :
+		       ztd->locked ? " (locked)" :
+		       ztd->holdovers ? " (holdover)" : " (acquiring)",
+		       (long long)ztd->phase_ns,
+		       (adj < 0) ? "-" : "", abs(adj) / 1000, abs(adj) % 1000,
+		       ztd->relocks, ztd->holdovers, max(min(batch, DAHDI_DUMMY_MAX_BATCH), 1),
+		       ztd->ticks, ztd->wakeups, ztd->idle_wakeups,
+		       ztd->missed, ztd->dropped);
+	if (len > count)
+		len = count;
+	*eof = 1;
+	return len;
+}
+#endif
 #else
 static unsigned long timespec_diff_ms(struct timespec *t0, struct timespec *t1)
 {
@@ -164,7 +401,8 @@ static void dahdi_dummy_timer(unsigned long param)
 	const unsigned long MS_LIMIT = 3000;
 
 	if (!atomic_read(&shutdown))
-		mod_timer(&timer, jiffies + JIFFIES_INTERVAL);
+		mod_timer(&timer, jiffies + (dahdi_timing_idle() ?
+				JIFFIES_IDLE_INTERVAL : JIFFIES_INTERVAL));
 
 	now = current_kernel_time();
 	ms_since_start = timespec_diff_ms(&ztd->start_interval, &now);
@@ -214,6 +452,9 @@ static int dahdi_dummy_initialize(struct dahdi_dummy *ztd)
 	init_waitqueue_head(&ztd->span.maintq);
 	ztd->span.pvt = ztd;
 	ztd->chan->pvt = ztd;
+#if defined(USE_HIGHRESTIMER)
+	spin_lock_init(&ztd->reflock);
+#endif
 	if (dahdi_register(&ztd->span, 0)) {
 		return -1;
 	}
@@ -245,6 +486,11 @@ int init_module(void)
 	printk(KERN_DEBUG "dahdi_dummy: Starting High Resolution Timer\n");
 	hrtimer_start(&zaptimer, ktime_set(0, DAHDI_TIME_NS), HRTIMER_MODE_REL);
 	printk(KERN_INFO "dahdi_dummy: High Resolution Timer started, good to go\n");
+
+	dahdi_set_clockref_hook(dahdi_dummy_clockref);
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("dahdi/dummy", 0444, NULL, dahdi_dummy_proc_read, NULL);
+#endif
 #else
 	init_timer(&timer);
 	timer.function = dahdi_dummy_timer;
@@ -263,6 +509,10 @@ int init_module(void)
 void cleanup_module(void)
 {
 #if defined(USE_HIGHRESTIMER)
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/dummy", NULL);
+#endif
+	dahdi_set_clockref_hook(NULL);
 	/* Stop high resolution timer */
 	hrtimer_cancel(&zaptimer);
 #else
@@ -276,6 +526,12 @@ void cleanup_module(void)
 }
 
 module_param(debug, int, 0600);
+module_param(ref_span, int, 0644);
+MODULE_PARM_DESC(ref_span, "Follow the far end clock of this span, e.g. a dynamic span, instead of free running (needs high resolution timers)");
+module_param(pll_max_ppm, int, 0644);
+MODULE_PARM_DESC(pll_max_ppm, "Furthest the tick may be pulled from 1 kHz to follow ref_span, in parts per million");
+module_param(batch, int, 0644);
+MODULE_PARM_DESC(batch, "Wake up every this many ms and run that many ticks back to back (1-20, needs high resolution timers)");
 
 MODULE_DESCRIPTION("Timing-Only Driver");
 MODULE_AUTHOR("Robert Pleh <robert.pleh@hermes.si>");
@@ -33,6 +33,12 @@
 #include <linux/interrupt.h>
 #include <linux/vmalloc.h>
 #include <linux/moduleparam.h>
+#include <linux/proc_fs.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+#include <linux/hrtimer.h>
+#endif
 
 #include <dahdi/kernel.h>
 
@@ -46,16 +52,37 @@
 
 #define ENABLE_TASKLETS
 
+/*
+ * With several CPUs, each span can instead be run by a worker on the CPU it
+ * was given when created, so spans are processed in parallel rather than
+ * one after another.  This needs queue_work_on() and cpumask_next().
+ */
+#if defined(CONFIG_SMP) && (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28))
+#define ENABLE_PARALLEL
+#endif
+
+/* Time how long each span takes to run */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+#define ENABLE_RUN_STATS
+#endif
+
 /*
  *  Dynamic spans implemented using TDM over X with standard message
  *  types.  Message format is as follows:
  *
  *         Byte #:          Meaning
- *         0                Number of samples per channel
+ *         0                Number of samples per channel, DAHDI_CHUNKSIZE
+ *                          unless the peer has advertised aggregation, then
+ *                          up to that many chunks' worth
  *         1                Current flags on span
  *				Bit    0: Yellow Alarm
  *	                        Bit    1: Sig bits present
- *				Bits 2-7: reserved for future use
+ *				Bit    2: Loopback
+ *				Bits 3-4: log2 of the chunks per message the
+ *				          sender accepts (0 = one chunk only)
+ *				Bit    5: Sender accepts compact messages
+ *				Bit    6: This is a compact message
+ *				Bit    7: reserved for future use
  *         2-3		    16-bit counter value for detecting drops, network byte order.
  *         4-5		    Number of channels in the message, network byte order
  *         6...		    16-bit words, containing sig bits for each
@@ -63,6 +90,18 @@
  *                          the least significant channel, network byte order.
  *         the rest	    data for each channel, all samples per channel
                             before moving to the next.
+ *
+ *  A compact message only carries the sig bits when they have changed, or
+ *  periodically as a refresh, and replaces the data with:
+ *
+ *         bitmap           one bit per channel, least significant bit of
+ *                          the first byte for the first channel, set if
+ *                          the channel's samples follow
+ *         the rest	    for each channel, all its samples if its bit is
+ *                          set, else the one byte value all its samples
+ *                          had (the idle pattern)
+ *
+ *  Compact messages may be followed by padding.
  */
 
 /* Arbitrary limit to the max # of channels in a span */
@@ -71,6 +110,32 @@
 #define ZTD_FLAG_YELLOW_ALARM		(1 << 0)
 #define ZTD_FLAG_SIGBITS_PRESENT	(1 << 1)
 #define ZTD_FLAG_LOOPBACK			(1 << 2)
+#define ZTD_FLAG_AGG_SHIFT			3
+#define ZTD_FLAG_AGG_MASK			(3 << ZTD_FLAG_AGG_SHIFT)
+#define ZTD_FLAG_COMPACT_OK			(1 << 5)
+#define ZTD_FLAG_COMPACT			(1 << 6)
+
+/* Compact messages resend unchanged sig bits after this many messages */
+#define DAHDI_DYNAMIC_SIG_REFRESH	100
+
+/* Most chunks we send or accept in one message, and its log2 */
+#define DAHDI_DYNAMIC_MAX_AGG		8
+#define DAHDI_DYNAMIC_MAX_AGG_LOG2	3
+
+/* Largest aggregated message we'll build */
+#define DAHDI_DYNAMIC_AGG_MAXLEN	1400
+
+/* Chunks of received audio a span's jitter buffer can hold */
+#define DAHDI_DYNAMIC_JB_MAX		64
+
+/* Deepest jitter buffer that can be asked for, in chunks */
+#define DAHDI_DYNAMIC_JB_MAX_DEPTH	(DAHDI_DYNAMIC_JB_MAX / 2)
+
+/* Lost chunks concealed by fading the last one before going silent */
+#define DAHDI_DYNAMIC_FADE			8
+
+/* Chunks a span's worker may fall behind by before ticks are dropped */
+#define DAHDI_DYNAMIC_MAX_BACKLOG	8
 
 #define ERR_NSAMP					(1 << 16)
 #define ERR_NCHAN					(1 << 17)
@@ -84,6 +149,7 @@ EXPORT_SYMBOL(dahdi_dynamic_receive);
 static int taskletrun;
 static int taskletsched;
 static int taskletpending;
+static int taskletchunks;
 static int taskletexec;
 static int txerrors;
 static struct tasklet_struct ztd_tlet;
@@ -91,6 +157,9 @@ static struct tasklet_struct ztd_tlet;
 static void ztd_tasklet(unsigned long data);
 #endif
 
+#ifdef ENABLE_PARALLEL
+static struct workqueue_struct *ztd_wq;
+#endif
 
 static struct dahdi_dynamic {
 	char addr[40];
@@ -109,12 +178,73 @@ static struct dahdi_dynamic {
 	int timing;
 	int master;
 	unsigned char *msgbuf;
+	int agg;		/* Chunks per message we'd like to send */
+	int peer_agg;		/* Chunks per message the peer accepts */
+	int txagg;		/* Chunks in the message being staged */
+	int txpos;		/* Chunks staged so far */
+	unsigned char *txbuf;	/* Staged audio, txagg chunks per channel */
+	int peer_compact;	/* Peer accepts compact messages */
+	int txcompact;		/* Message being staged is compact */
+	int sigage;		/* Compact messages since sig bits were sent */
+	unsigned char txsig[DAHDI_DYNAMIC_MAX_CHANS];	/* As last sent */
+	/* Where the received message has each channel's samples, or if
+	   NULL, the value they all had */
+	unsigned char *rxsrc[DAHDI_DYNAMIC_MAX_CHANS];
+	unsigned char rxfill[DAHDI_DYNAMIC_MAX_CHANS];
+	unsigned long txmsgs;
+	unsigned long txbytes;
+	unsigned long rxmsgs;
+	unsigned long rxbytes;
+	/* Jitter buffer, DAHDI_DYNAMIC_JB_MAX chunks per channel, indexed
+	   by chunk position modulo its size */
+	unsigned char *jb;
+	unsigned int jb_tag[DAHDI_DYNAMIC_JB_MAX];	/* Position held by each slot */
+	unsigned char jb_valid[DAHDI_DYNAMIC_JB_MAX];
+	int jb_active;
+	int jb_depth;		/* Chunks held back before playout starts */
+	int jb_priming;		/* Of those, still to go */
+	int jb_nchunks;		/* Chunks per message in this stream */
+	unsigned int jb_play;	/* Position of the next chunk to play */
+	unsigned int jb_high;	/* One past the newest position received */
+	unsigned short jb_anchor_seq;	/* Newest message counter seen... */
+	unsigned int jb_anchor_pos;	/* ...and where its first chunk went */
+	int jb_conceal;		/* Consecutive chunks concealed */
+	unsigned int rx_late;
+	unsigned int rx_lost;
+	unsigned int rx_reordered;
+	unsigned int rx_dup;
+	unsigned int rx_resync;
+	/* Protects the receive side and the channels' chunks against the
+	   span being run at the same time */
+	spinlock_t lock;
+#ifdef ENABLE_PARALLEL
+	struct work_struct work;
+	int cpu;		/* Where the span is run */
+	int backlog;		/* Ticks the worker has yet to run */
+#endif
+	unsigned int missed;	/* Ticks that came before the last was run */
+	unsigned int dropped;	/* Ticks never run */
+	unsigned long runs;
+	u64 run_ns;		/* Total time spent running the span */
+	unsigned int run_max_ns;
 } *dspans;
 
 static struct dahdi_dynamic_driver *drivers =  NULL;
 
 static int debug = 0;
 
+/* Chunks per message to send to peers that accept aggregation */
+static int aggregate = 1;
+
+/* Chunks of received audio to hold back against network jitter */
+static int jb_depth = 0;
+
+/* Send compact messages to peers that accept them */
+static int compact = 0;
+
+/* Run each span on its own CPU rather than all of them in one tasklet */
+static int parallel = 0;
+
 static int hasmaster = 0;
 #ifdef DEFINE_SPINLOCK
 static DEFINE_SPINLOCK(dlock); 
@@ -161,23 +291,69 @@ static void checkmaster(void)
 		printk(KERN_INFO "TDMoX: No master.\n");
 }
 
-static void ztd_sendmessage(struct dahdi_dynamic *z)
+/* Longest message we might build; compact ones can be shorter */
+static int ztd_msglen(struct dahdi_dynamic *z, int nchunks)
+{
+	/* Header, one short of sig bits per four channels, then the audio */
+	return 6 + ((z->span.channels + 3) / 4) * 2 +
+		z->span.channels * DAHDI_CHUNKSIZE * nchunks +
+		(z->txcompact ? (z->span.channels + 7) / 8 : 0);
+}
+
+/* Decide whether a compact message needs the sig bits */
+static int ztd_sigchanged(struct dahdi_dynamic *z)
+{
+	int x;
+
+	if (++z->sigage < DAHDI_DYNAMIC_SIG_REFRESH) {
+		for (x = 0; x < z->span.channels; x++) {
+			if ((z->chans[x]->txsig & 0xf) != z->txsig[x])
+				break;
+		}
+		if (x == z->span.channels)
+			return 0;
+	}
+	z->sigage = 0;
+	for (x = 0; x < z->span.channels; x++)
+		z->txsig[x] = z->chans[x]->txsig & 0xf;
+	return 1;
+}
+
+static inline int ztd_uniform(const unsigned char *buf, int len)
+{
+	int x;
+
+	for (x = 1; x < len; x++) {
+		if (buf[x] != buf[0])
+			return 0;
+	}
+	return 1;
+}
+
+static int ztd_buildmessage(struct dahdi_dynamic *z, unsigned char *buf, int nchunks)
 {
-	unsigned char *buf = z->msgbuf;
 	unsigned short bits;
 	int msglen = 0;
 	int x;
 	int offset;
+	int nsamp = DAHDI_CHUNKSIZE * nchunks;
+	int sendsig = z->txcompact ? ztd_sigchanged(z) : 1;
+	unsigned char *bitmap, *src;
 
 	/* Byte 0: Number of samples per channel */
-	*buf = DAHDI_CHUNKSIZE;
+	*buf = nsamp;
 	buf++; msglen++;
 
 	/* Byte 1: Flags */
 	*buf = 0;
 	if (z->span.alarms & DAHDI_ALARM_RED)
 		*buf |= ZTD_FLAG_YELLOW_ALARM;
-	*buf |= ZTD_FLAG_SIGBITS_PRESENT;
+	if (sendsig)
+		*buf |= ZTD_FLAG_SIGBITS_PRESENT;
+	*buf |= DAHDI_DYNAMIC_MAX_AGG_LOG2 << ZTD_FLAG_AGG_SHIFT;
+	*buf |= ZTD_FLAG_COMPACT_OK;
+	if (z->txcompact)
+		*buf |= ZTD_FLAG_COMPACT;
 	buf++; msglen++;
 
 	/* Bytes 2-3: Transmit counter */
@@ -192,7 +368,7 @@ static void ztd_sendmessage(struct dahdi_dynamic *z)
 	buf++; msglen++;
 	bits = 0;
 	offset = 0;
-	for (x=0;x<z->span.channels;x++) {
+	for (x=0;sendsig && x<z->span.channels;x++) {
 		offset = x % 4;
 		bits |= (z->chans[x]->txsig & 0xf) << (offset << 2);
 		if (offset == 3) {
@@ -204,48 +380,253 @@ static void ztd_sendmessage(struct dahdi_dynamic *z)
 		}
 	}
 
-	if (offset != 3) {
+	if (sendsig && offset != 3) {
 		/* Finish it off if it's not done already */
 		*((unsigned short *)buf) = htons(bits);
 		buf++; msglen++;
 		buf++; msglen++;
 	}
 	
-	for (x=0;x<z->span.channels;x++) {
-		memcpy(buf, z->chans[x]->writechunk, DAHDI_CHUNKSIZE);
-		buf += DAHDI_CHUNKSIZE;
-		msglen += DAHDI_CHUNKSIZE;
+	if (z->txcompact) {
+		/* Idle channels go as a single byte */
+		bitmap = buf;
+		memset(bitmap, 0, (z->span.channels + 7) / 8);
+		buf += (z->span.channels + 7) / 8;
+		msglen += (z->span.channels + 7) / 8;
+		for (x = 0; x < z->span.channels; x++) {
+			src = (nchunks > 1) ? z->txbuf + x * nsamp : z->chans[x]->writechunk;
+			if (ztd_uniform(src, nsamp)) {
+				*buf = src[0];
+				buf++; msglen++;
+			} else {
+				bitmap[x >> 3] |= 1 << (x & 7);
+				memcpy(buf, src, nsamp);
+				buf += nsamp;
+				msglen += nsamp;
+			}
+		}
+	} else if (nchunks > 1) {
+		/* Already laid out channel by channel in txbuf */
+		memcpy(buf, z->txbuf, z->span.channels * nsamp);
+		msglen += z->span.channels * nsamp;
+	} else {
+		for (x=0;x<z->span.channels;x++) {
+			memcpy(buf, z->chans[x]->writechunk, DAHDI_CHUNKSIZE);
+			buf += DAHDI_CHUNKSIZE;
+			msglen += DAHDI_CHUNKSIZE;
+		}
 	}
-	
+
+	return msglen;
+}
+
+static void ztd_sendmessage(struct dahdi_dynamic *z)
+{
+	unsigned char *buf;
+	int msglen;
+	int nchunks;
+	int x;
+
+	/* The aggregate size and format only change on a message boundary */
+	if (!z->txpos) {
+		z->txagg = min(z->agg, z->peer_agg);
+		z->txcompact = compact && z->peer_compact;
+	}
+	nchunks = z->txagg;
+	if (nchunks > 1) {
+		for (x = 0; x < z->span.channels; x++) {
+			memcpy(z->txbuf + (x * nchunks + z->txpos) * DAHDI_CHUNKSIZE,
+				z->chans[x]->writechunk, DAHDI_CHUNKSIZE);
+		}
+		if (++z->txpos < nchunks)
+			return;
+		z->txpos = 0;
+	}
+
+	/* Build straight into the driver's transmit buffer when it has one */
+	if (z->driver->getbuf) {
+		msglen = ztd_msglen(z, nchunks);
+		buf = z->driver->getbuf(z->pvt, msglen);
+		if (buf) {
+			msglen = ztd_buildmessage(z, buf, nchunks);
+			z->driver->sendbuf(z->pvt, msglen);
+			z->txmsgs++;
+			z->txbytes += msglen;
+			return;
+		}
+	}
+
+	msglen = ztd_buildmessage(z, z->msgbuf, nchunks);
 	z->driver->transmit(z->pvt, z->msgbuf, msglen);
-	
+	z->txmsgs++;
+	z->txbytes += msglen;
 }
 
-static void __ztdynamic_run(void)
+/* Copy chunk y of channel x out of the message being received */
+static inline void ztd_rxchunk(struct dahdi_dynamic *z, int x, int y, unsigned char *dst)
+{
+	if (z->rxsrc[x])
+		memcpy(dst, z->rxsrc[x] + y * DAHDI_CHUNKSIZE, DAHDI_CHUNKSIZE);
+	else
+		memset(dst, z->rxfill[x], DAHDI_CHUNKSIZE);
+}
+
+static inline unsigned char *ztd_jb_chunk(struct dahdi_dynamic *z, int chan, unsigned int pos)
+{
+	return z->jb + (chan * DAHDI_DYNAMIC_JB_MAX + (pos % DAHDI_DYNAMIC_JB_MAX)) * DAHDI_CHUNKSIZE;
+}
+
+/* Start a new stream with the message seq, held back jb_depth chunks */
+static void ztd_jb_resync(struct dahdi_dynamic *z, unsigned short seq, int nchunks)
+{
+	if (z->jb_active)
+		z->rx_resync++;
+	memset(z->jb_valid, 0, sizeof(z->jb_valid));
+	z->jb_active = 1;
+	z->jb_nchunks = nchunks;
+	z->jb_priming = z->jb_depth;
+	z->jb_anchor_seq = seq;
+	z->jb_anchor_pos = z->jb_play + z->jb_depth;
+	z->jb_high = z->jb_anchor_pos;
+}
+
+/* Place a message's chunks by its counter.  Called with the span's lock held. */
+static void ztd_jb_put(struct dahdi_dynamic *z, unsigned short seq, int nchunks)
+{
+	unsigned int pos;
+	int x, y, d;
+
+	if (!z->jb_active || (nchunks != z->jb_nchunks))
+		ztd_jb_resync(z, seq, nchunks);
+
+	pos = z->jb_anchor_pos + (short)(seq - z->jb_anchor_seq) * nchunks;
+	d = pos - z->jb_play;
+	if (d < 0) {
+		if ((int)(z->jb_high - z->jb_play) > 0) {
+			/* Too late, and we've newer audio to play anyway */
+			z->rx_late++;
+			return;
+		}
+		/* Ran dry, so the peer has fallen behind us */
+		ztd_jb_resync(z, seq, nchunks);
+		pos = z->jb_anchor_pos;
+	} else if (d + nchunks > DAHDI_DYNAMIC_JB_MAX) {
+		/* Too far ahead to hold; the peer has run ahead of us */
+		ztd_jb_resync(z, seq, nchunks);
+		pos = z->jb_anchor_pos;
+	}
+
+	if (z->jb_valid[pos % DAHDI_DYNAMIC_JB_MAX] &&
+	    (z->jb_tag[pos % DAHDI_DYNAMIC_JB_MAX] == pos)) {
+		z->rx_dup++;
+		return;
+	}
+
+	if ((short)(seq - z->jb_anchor_seq) < 0) {
+		z->rx_reordered++;
+	} else {
+		z->jb_anchor_seq = seq;
+		z->jb_anchor_pos = pos;
+	}
+
+	for (x = 0; x < z->span.channels; x++) {
+		for (y = 0; y < nchunks; y++)
+			ztd_rxchunk(z, x, y, ztd_jb_chunk(z, x, pos + y));
+	}
+	for (y = 0; y < nchunks; y++) {
+		z->jb_valid[(pos + y) % DAHDI_DYNAMIC_JB_MAX] = 1;
+		z->jb_tag[(pos + y) % DAHDI_DYNAMIC_JB_MAX] = pos + y;
+	}
+	if ((int)(pos + nchunks - z->jb_high) > 0)
+		z->jb_high = pos + nchunks;
+}
+
+/* Stand in for a lost chunk: repeat the last one, fading it out 6dB a
+   chunk until it goes silent.  Clear channels are left alone. */
+static void ztd_conceal(struct dahdi_dynamic *z)
+{
+	struct dahdi_chan *chan;
+	int x, y;
+
+	z->jb_conceal++;
+	if (z->jb_conceal == 1)
+		return;
+	for (x = 0; x < z->span.channels; x++) {
+		chan = z->chans[x];
+		if ((chan->flags & DAHDI_FLAG_CLEAR) || !chan->xlaw)
+			continue;
+		for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+			if (z->jb_conceal > DAHDI_DYNAMIC_FADE)
+				chan->readchunk[y] = DAHDI_LIN2X(0, chan);
+			else
+				chan->readchunk[y] = DAHDI_LIN2X(DAHDI_XLAW(chan->readchunk[y], chan) / 2, chan);
+		}
+	}
+}
+
+/* Move the next chunk out of the jitter buffer into the channels'
+   readchunks, concealing it if it never arrived */
+static void ztd_playout(struct dahdi_dynamic *z)
+{
+	unsigned int slot;
+	int x;
+
+	if (!z->jb_active)
+		return;
+	slot = z->jb_play % DAHDI_DYNAMIC_JB_MAX;
+	if (z->jb_priming) {
+		z->jb_priming--;
+	} else if (z->jb_valid[slot] && (z->jb_tag[slot] == z->jb_play)) {
+		for (x = 0; x < z->span.channels; x++)
+			memcpy(z->chans[x]->readchunk, ztd_jb_chunk(z, x, z->jb_play), DAHDI_CHUNKSIZE);
+		z->jb_valid[slot] = 0;
+		z->jb_conceal = 0;
+	} else {
+		z->rx_lost++;
+		ztd_conceal(z);
+		/* Give up on the stream once it has gone quiet for good */
+		if ((z->jb_conceal > DAHDI_DYNAMIC_JB_MAX) && ((int)(z->jb_high - z->jb_play) <= 0))
+			z->jb_active = 0;
+	}
+	z->jb_play++;
+}
+
+/* Run one span for one chunk: play out what was received, hand it to
+   DAHDI and send what DAHDI gives back */
+static void ztd_runspan(struct dahdi_dynamic *z)
 {
 	unsigned long flags;
-	struct dahdi_dynamic *z;
-	struct dahdi_dynamic_driver *drv;
 	int y;
-	spin_lock_irqsave(&dlock, flags);
-	z = dspans;
-	while(z) {
-		if (!z->dead) {
-			/* Ignore dead spans */
-			for (y=0;y<z->span.channels;y++) {
-				/* Echo cancel double buffered data */
-				dahdi_ec_chunk(z->span.chans[y], z->span.chans[y]->readchunk, z->span.chans[y]->writechunk);
-			}
-			dahdi_receive(&z->span);
-			dahdi_transmit(&z->span);
-			/* Handle all transmissions now */
-			spin_unlock_irqrestore(&dlock, flags);
-			ztd_sendmessage(z);
-			spin_lock_irqsave(&dlock, flags);
-		}
-		z = z->next;
+#ifdef ENABLE_RUN_STATS
+	ktime_t start = ktime_get();
+	s64 ns;
+#endif
+
+	spin_lock_irqsave(&z->lock, flags);
+	ztd_playout(z);
+	for (y=0;y<z->span.channels;y++) {
+		/* Echo cancel double buffered data */
+		dahdi_ec_chunk(z->span.chans[y], z->span.chans[y]->readchunk, z->span.chans[y]->writechunk);
 	}
-	spin_unlock_irqrestore(&dlock, flags);
+	dahdi_receive(&z->span);
+	dahdi_transmit(&z->span);
+	spin_unlock_irqrestore(&z->lock, flags);
+
+	/* Not under the lock, since a local peer receives it right away */
+	ztd_sendmessage(z);
+
+	z->runs++;
+#ifdef ENABLE_RUN_STATS
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	z->run_ns += ns;
+	if (ns > z->run_max_ns)
+		z->run_max_ns = ns;
+#endif
+}
+
+static void ztd_flush(void)
+{
+	struct dahdi_dynamic_driver *drv;
 
 	read_lock(&drvlock);
 	drv = drivers;
@@ -259,20 +640,129 @@ static void __ztdynamic_run(void)
 	read_unlock(&drvlock);
 }
 
+/* The list is walked under RCU rather than dlock, since a span run can
+   end up back here or in the dispatch through a local peer.  Spans are
+   only freed once a grace period has passed after they were unlinked. */
+static void __ztdynamic_run(void)
+{
+	struct dahdi_dynamic *z;
+
+	rcu_read_lock();
+	for (z = rcu_dereference(dspans); z; z = rcu_dereference(z->next)) {
+		/* Ignore dead spans */
+		if (!z->dead)
+			ztd_runspan(z);
+	}
+	rcu_read_unlock();
+
+	ztd_flush();
+}
+
+#ifdef ENABLE_PARALLEL
+
+static void ztd_work(struct work_struct *work)
+{
+	struct dahdi_dynamic *z = container_of(work, struct dahdi_dynamic, work);
+	unsigned long flags;
+	int chunks;
+
+	/* Span processing expects softirq context, as in the tasklet */
+	local_bh_disable();
+	spin_lock_irqsave(&z->lock, flags);
+	chunks = z->backlog;
+	z->backlog = 0;
+	spin_unlock_irqrestore(&z->lock, flags);
+	while (chunks-- > 0)
+		ztd_runspan(z);
+	/* Each worker sends what it has queued itself, so that no span waits
+	   on another that is running late */
+	if (z->driver->flush)
+		z->driver->flush();
+	local_bh_enable();
+}
+
+/* Queue each span on its own CPU; dlock is only held to walk the list */
+static void ztd_dispatch(int chunks)
+{
+	unsigned long flags;
+	struct dahdi_dynamic *z;
+
+	spin_lock_irqsave(&dlock, flags);
+	for (z = dspans; z; z = z->next) {
+		if (z->dead)
+			continue;
+		spin_lock(&z->lock);
+		if (z->backlog)
+			z->missed++;
+		z->backlog += chunks;
+		if (z->backlog > DAHDI_DYNAMIC_MAX_BACKLOG) {
+			z->dropped += z->backlog - DAHDI_DYNAMIC_MAX_BACKLOG;
+			z->backlog = DAHDI_DYNAMIC_MAX_BACKLOG;
+		}
+		spin_unlock(&z->lock);
+
+		/* If it is already queued, it will pick up the backlog */
+		if (cpu_online(z->cpu))
+			queue_work_on(z->cpu, ztd_wq, &z->work);
+		else
+			queue_work(ztd_wq, &z->work);
+	}
+	spin_unlock_irqrestore(&dlock, flags);
+}
+
+static int ztd_pick_cpu(void)
+{
+	static int last = -1;
+	int cpu;
+
+	cpu = cpumask_next(last, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+	last = cpu;
+	return cpu;
+}
+#endif
+
 #ifdef ENABLE_TASKLETS
-static void ztdynamic_run(void)
+static void ztd_run_serial(int chunks)
 {
+	unsigned long flags;
+	struct dahdi_dynamic *z;
+
 	if (!taskletpending) {
 		taskletpending = 1;
+		taskletchunks = chunks;
 		taskletsched++;
 		tasklet_hi_schedule(&ztd_tlet);
 	} else {
 		txerrors++;
+		/* Every span misses this one */
+		spin_lock_irqsave(&dlock, flags);
+		for (z = dspans; z; z = z->next) {
+			z->missed++;
+			z->dropped += chunks;
+		}
+		spin_unlock_irqrestore(&dlock, flags);
 	}
 }
 #else
-#define ztdynamic_run __ztdynamic_run
+static void ztd_run_serial(int chunks)
+{
+	while (chunks--)
+		__ztdynamic_run();
+}
+#endif
+
+static void ztdynamic_run(int chunks)
+{
+#ifdef ENABLE_PARALLEL
+	if (ztd_wq) {
+		ztd_dispatch(chunks);
+		return;
+	}
 #endif
+	ztd_run_serial(chunks);
+}
 
 void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msglen)
 {
@@ -284,12 +774,15 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	int x, bits, sig;
 	int nchans, master;
 	int newalarm;
-	unsigned short rxpos, rxcnt;
+	int nsamp, nchunks;
+	int bmlen = 0;
+	unsigned char *data;
+	unsigned short rxpos, rxcnt, gap;
 	
 	
-	spin_lock_irqsave(&dlock, flags);
+	spin_lock_irqsave(&ztd->lock, flags);
 	if (msglen < 6) {
-		spin_unlock_irqrestore(&dlock, flags);
+		spin_unlock_irqrestore(&ztd->lock, flags);
 		newerr = ERR_LEN;
 		if (newerr != ztd->err) {
 			printk(KERN_NOTICE "Span %s: Insufficient samples for header (only %d)\n", span->name, msglen);
@@ -298,9 +791,11 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		return;
 	}
 	
-	/* First, check the chunksize */
-	if (*msg != DAHDI_CHUNKSIZE) {
-		spin_unlock_irqrestore(&dlock, flags);
+	/* First, check the chunksize: one or more whole chunks */
+	nsamp = *msg;
+	if (!nsamp || (nsamp % DAHDI_CHUNKSIZE) ||
+	    (nsamp > DAHDI_CHUNKSIZE * DAHDI_DYNAMIC_MAX_AGG)) {
+		spin_unlock_irqrestore(&ztd->lock, flags);
 		newerr = ERR_NSAMP | msg[0];
 		if (newerr != 	ztd->err) {
 			printk(KERN_NOTICE "Span %s: Expected %d samples, but receiving %d\n", span->name, DAHDI_CHUNKSIZE, msg[0]);
@@ -318,7 +813,7 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	
 	nchans = ntohs(*((unsigned short *)msg));
 	if (nchans != span->channels) {
-		spin_unlock_irqrestore(&dlock, flags);
+		spin_unlock_irqrestore(&ztd->lock, flags);
 		newerr = ERR_NCHAN | nchans;
 		if (newerr != ztd->err) {
 			printk(KERN_NOTICE "Span %s: Expected %d channels, but receiving %d\n", span->name, span->channels, nchans);
@@ -334,16 +829,27 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 
 	/* Start with header */
 	xlen = 6;
-	/* Add samples of audio */
-	xlen += nchans * DAHDI_CHUNKSIZE;
 	/* If RBS info is there, add that */
 	if (sflags & ZTD_FLAG_SIGBITS_PRESENT) {
 		/* Account for sigbits -- one short per 4 channels*/
 		xlen += ((nchans + 3) / 4) * 2;
 	}
+	if (sflags & ZTD_FLAG_COMPACT) {
+		/* Add the bitmap, then a byte or the samples for each channel */
+		bmlen = (nchans + 7) / 8;
+		if (xlen + bmlen <= msglen) {
+			data = msg + (xlen - 6);
+			for (x = 0; x < nchans; x++)
+				xlen += (data[x >> 3] & (1 << (x & 7))) ? nsamp : 1;
+		}
+		xlen += bmlen;
+	} else {
+		/* Add samples of audio */
+		xlen += nchans * nsamp;
+	}
 	
-	if (xlen != msglen) {
-		spin_unlock_irqrestore(&dlock, flags);
+	if ((xlen != msglen) && !((sflags & ZTD_FLAG_COMPACT) && (xlen < msglen))) {
+		spin_unlock_irqrestore(&ztd->lock, flags);
 		newerr = ERR_LEN | xlen;
 		if (newerr != ztd->err) {
 			printk(KERN_NOTICE "Span %s: Expected message size %d, but was %d instead\n", span->name, xlen, msglen);
@@ -374,10 +880,38 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		}
 	}
 	
+	/* Note how much the peer is willing to take from us */
+	ztd->peer_agg = 1 << ((sflags & ZTD_FLAG_AGG_MASK) >> ZTD_FLAG_AGG_SHIFT);
+	ztd->peer_compact = (sflags & ZTD_FLAG_COMPACT_OK) ? 1 : 0;
+
+	/* Find each channel's samples */
+	if (sflags & ZTD_FLAG_COMPACT) {
+		data = msg + bmlen;
+		for (x = 0; x < nchans; x++) {
+			if (msg[x >> 3] & (1 << (x & 7))) {
+				ztd->rxsrc[x] = data;
+				data += nsamp;
+			} else {
+				ztd->rxsrc[x] = NULL;
+				ztd->rxfill[x] = *data;
+				data++;
+			}
+		}
+	} else {
+		for (x = 0; x < nchans; x++)
+			ztd->rxsrc[x] = msg + x * nsamp;
+	}
+	ztd->rxmsgs++;
+	ztd->rxbytes += msglen;
+
 	/* Record data for channels */
-	for (x=0;x<nchans;x++) {
-		memcpy(span->chans[x]->readchunk, msg, DAHDI_CHUNKSIZE);
-		msg += DAHDI_CHUNKSIZE;
+	nchunks = nsamp / DAHDI_CHUNKSIZE;
+	if (nchunks == 1 && !ztd->jb_depth && !ztd->jb_active) {
+		for (x=0;x<nchans;x++)
+			ztd_rxchunk(ztd, x, 0, span->chans[x]->readchunk);
+	} else {
+		/* Played out one chunk per run, in counter order */
+		ztd_jb_put(ztd, rxpos, nchunks);
 	}
 
 	master = ztd->master;
@@ -385,7 +919,7 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	rxcnt = ztd->rxcnt;
 	ztd->rxcnt = rxpos+1;
 
-	spin_unlock_irqrestore(&dlock, flags);
+	spin_unlock_irqrestore(&ztd->lock, flags);
 	
 	/* Check for Yellow alarm */
 	newalarm = span->alarms & ~(DAHDI_ALARM_YELLOW | DAHDI_ALARM_RED);
@@ -401,13 +935,22 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	/* Keep track of last received packet */
 	ztd->rxjif = jiffies;
 
-	/* note if we had a missing packet */
-	if (rxpos != rxcnt)
+	/* Let a timing driver follow the far end's clock, counting the
+	   chunks of any messages lost on the way */
+	gap = (unsigned short)(rxpos - rxcnt);
+	if (gap < DAHDI_DYNAMIC_JB_MAX)
+		dahdi_span_clockref(span, nchunks * (gap + 1));
+	else if (gap < 0x8000)
+		dahdi_span_clockref(span, nchunks);
+
+	/* note if we had a missing packet; the jitter buffer counts them */
+	if ((rxpos != rxcnt) && !ztd->jb_depth)
 		printk(KERN_NOTICE "Span %s: Expected seq no %d, but received %d instead\n", span->name, rxcnt, rxpos);
 
-	/* If this is our master span, then run everything */
+	/* If this is our master span, then run everything, once for
+	   each chunk the message carried */
 	if (master)
-		ztdynamic_run();
+		ztdynamic_run(nchunks);
 	
 }
 
@@ -419,6 +962,11 @@ static void dynamic_destroy(struct dahdi_dynamic *z)
 	if (test_bit(DAHDI_FLAGBIT_REGISTERED, &z->span.flags))
 		dahdi_unregister(&z->span);
 
+#ifdef ENABLE_PARALLEL
+	/* It's off the list, so this is the last time it could be queued */
+	cancel_work_sync(&z->work);
+#endif
+
 	/* Destroy the pvt stuff if there */
 	if (z->pvt)
 		z->driver->destroy(z->pvt);
@@ -427,6 +975,12 @@ static void dynamic_destroy(struct dahdi_dynamic *z)
 	if (z->msgbuf)
 		kfree(z->msgbuf);
 
+	if (z->txbuf)
+		kfree(z->txbuf);
+
+	if (z->jb)
+		vfree(z->jb);
+
 	/* Free channels */
 	for (x = 0; x < z->span.channels; x++) {
 		kfree(z->chans[x]);
@@ -454,12 +1008,12 @@ static struct dahdi_dynamic *find_dynamic(struct dahdi_dynamic_span *zds)
 static struct dahdi_dynamic_driver *find_driver(char *name)
 {
 	struct dahdi_dynamic_driver *ztd;
-	ztd = drivers;
+	ztd = rcu_dereference(drivers);
 	while(ztd) {
 		/* here's our driver */
 		if (!strcmp(name, ztd->name))
 			break;
-		ztd = ztd->next;
+		ztd = rcu_dereference(ztd->next);
 	}
 	return ztd;
 }
@@ -485,9 +1039,9 @@ static int destroy_dynamic(struct dahdi_dynamic_span *zds)
 	while(cur) {
 		if (cur == z) {
 			if (prev)
-				prev->next = z->next;
+				rcu_assign_pointer(prev->next, z->next);
 			else
-				dspans = z->next;
+				rcu_assign_pointer(dspans, z->next);
 			break;
 		}
 		prev = cur;
@@ -495,7 +1049,8 @@ static int destroy_dynamic(struct dahdi_dynamic_span *zds)
 	}
 	spin_unlock_irqrestore(&dlock, flags);
 
-	/* Destroy it */
+	/* Let any run still walking the list get past it, then destroy it */
+	synchronize_rcu();
 	dynamic_destroy(z);
 	
 	return 0;
@@ -575,6 +1130,11 @@ static int create_dynamic(struct dahdi_dynamic_span *zds)
 
 	/* Zero it out */
 	memset(z, 0, sizeof(*z));
+	spin_lock_init(&z->lock);
+#ifdef ENABLE_PARALLEL
+	INIT_WORK(&z->work, ztd_work);
+	z->cpu = ztd_pick_cpu();
+#endif
 
 	for (x = 0; x < zds->numchans; x++) {
 		if (!(z->chans[x] = kmalloc(sizeof(*z->chans[x]), GFP_KERNEL))) {
@@ -585,8 +1145,10 @@ static int create_dynamic(struct dahdi_dynamic_span *zds)
 		memset(z->chans[x], 0, sizeof(*z->chans[x]));
 	}
 
-	/* Allocate message buffer with sample space and header space */
-	bufsize = zds->numchans * DAHDI_CHUNKSIZE + zds->numchans / 4 + 48;
+	/* Allocate message buffer with sample space, sig bits, the compact
+	   bitmap and header space */
+	bufsize = zds->numchans * DAHDI_CHUNKSIZE * DAHDI_DYNAMIC_MAX_AGG +
+		((zds->numchans + 3) / 4) * 2 + (zds->numchans + 7) / 8 + 48;
 
 	z->msgbuf = kmalloc(bufsize, GFP_KERNEL);
 
@@ -598,6 +1160,14 @@ static int create_dynamic(struct dahdi_dynamic_span *zds)
 	/* Zero out -- probably not needed but why not */
 	memset(z->msgbuf, 0, bufsize);
 
+	/* Staging for aggregated transmit, and the receive playout queue */
+	z->txbuf = kmalloc(zds->numchans * DAHDI_CHUNKSIZE * DAHDI_DYNAMIC_MAX_AGG, GFP_KERNEL);
+	z->jb = vmalloc(zds->numchans * DAHDI_CHUNKSIZE * DAHDI_DYNAMIC_JB_MAX);
+	if (!z->txbuf || !z->jb) {
+		dynamic_destroy(z);
+		return -ENOMEM;
+	}
+
 	/* Setup parameters properly assuming we're going to be okay. */
 	dahdi_copy_string(z->dname, zds->driver, sizeof(z->dname));
 	dahdi_copy_string(z->addr, zds->addr, sizeof(z->addr));
@@ -605,6 +1175,22 @@ static int create_dynamic(struct dahdi_dynamic_span *zds)
 	sprintf(z->span.name, "DYN/%s/%s", zds->driver, zds->addr);
 	sprintf(z->span.desc, "Dynamic '%s' span at '%s'", zds->driver, zds->addr);
 	z->span.channels = zds->numchans;
+
+	/* Only aggregate once the peer says it can take it, and never
+	   beyond what fits in one Ethernet frame */
+	z->agg = aggregate;
+	if (z->agg > DAHDI_DYNAMIC_MAX_AGG)
+		z->agg = DAHDI_DYNAMIC_MAX_AGG;
+	while ((z->agg > 1) && (ztd_msglen(z, z->agg) > DAHDI_DYNAMIC_AGG_MAXLEN))
+		z->agg--;
+	if (z->agg < 1)
+		z->agg = 1;
+	z->peer_agg = 1;
+	z->jb_depth = jb_depth;
+	if (z->jb_depth < 0)
+		z->jb_depth = 0;
+	if (z->jb_depth > DAHDI_DYNAMIC_JB_MAX_DEPTH)
+		z->jb_depth = DAHDI_DYNAMIC_JB_MAX_DEPTH;
 	z->span.pvt = z;
 	z->span.deflaw = DAHDI_LAW_MULAW;
 	z->span.flags |= DAHDI_FLAG_RBS;
@@ -623,24 +1209,25 @@ static int create_dynamic(struct dahdi_dynamic_span *zds)
 		z->chans[x]->pvt = z;
 	}
 	
-	spin_lock_irqsave(&dlock, flags);
+	/* Drivers are unlinked under RCU, so they're looked up under it */
+	rcu_read_lock();
 	ztd = find_driver(zds->driver);
 	if (!ztd) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,5,70)
 		char fn[80];
 #endif
 
-		spin_unlock_irqrestore(&dlock, flags);
+		rcu_read_unlock();
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,5,70)
 		request_module("dahdi_dynamic_%s", zds->driver);
 #else
 		sprintf(fn, "dahdi_dynamic_%s", zds->driver);
 		request_module(fn);
 #endif
-		spin_lock_irqsave(&dlock, flags);
+		rcu_read_lock();
 		ztd = find_driver(zds->driver);
 	}
-	spin_unlock_irqrestore(&dlock, flags);
+	rcu_read_unlock();
 
 
 	/* Another race -- should let the module get unloaded while we
@@ -672,7 +1259,7 @@ static int create_dynamic(struct dahdi_dynamic_span *zds)
 	/* Okay, created and registered. add it to the list */
 	spin_lock_irqsave(&dlock, flags);
 	z->next = dspans;
-	dspans = z;
+	rcu_assign_pointer(dspans, z);
 	spin_unlock_irqrestore(&dlock, flags);
 
 	checkmaster();
@@ -688,7 +1275,8 @@ static void ztd_tasklet(unsigned long data)
 	taskletrun++;
 	if (taskletpending) {
 		taskletexec++;
-		__ztdynamic_run();
+		while (taskletchunks--)
+			__ztdynamic_run();
 	}
 	taskletpending = 0;
 }
@@ -704,7 +1292,7 @@ static int ztdynamic_ioctl(unsigned int cmd, unsigned long data)
 		   spans are pulling timing, then now is the time to process
 		   them */
 		if (!hasmaster)
-			ztdynamic_run();
+			ztdynamic_run(1);
 		return 0;
 	case DAHDI_DYNAMIC_CREATE:
 		if (copy_from_user(&zds, (__user const void *) data, sizeof(zds)))
@@ -739,7 +1327,7 @@ int dahdi_dynamic_register(struct dahdi_dynamic_driver *dri)
 		res = -1;
 	else {
 		dri->next = drivers;
-		drivers = dri;
+		rcu_assign_pointer(drivers, dri);
 	}
 	write_unlock_irqrestore(&drvlock, flags);
 	return res;
@@ -748,16 +1336,18 @@ int dahdi_dynamic_register(struct dahdi_dynamic_driver *dri)
 void dahdi_dynamic_unregister(struct dahdi_dynamic_driver *dri)
 {
 	struct dahdi_dynamic_driver *cur, *prev=NULL;
-	struct dahdi_dynamic *z, *zp, *zn;
+	struct dahdi_dynamic *z, *zp, *zn, *gone = NULL;
 	unsigned long flags;
 	write_lock_irqsave(&drvlock, flags);
 	cur = drivers;
 	while(cur) {
 		if (cur == dri) {
+			/* Anyone looking it up under RCU is done with it by
+			   the time the grace period below is over */
 			if (prev)
-				prev->next = cur->next;
+				rcu_assign_pointer(prev->next, cur->next);
 			else
-				drivers = cur->next;
+				rcu_assign_pointer(drivers, cur->next);
 			break;
 		}
 		prev = cur;
@@ -772,19 +1362,33 @@ void dahdi_dynamic_unregister(struct dahdi_dynamic_driver *dri)
 		if (z->driver == dri) {
 			/* Unlink */
 			if (zp)
-				zp->next = z->next;
-			else
-				dspans = z->next;
-			if (!z->usecount)
-				dynamic_destroy(z);
+				rcu_assign_pointer(zp->next, z->next);
 			else
-				z->dead = 1;
+				rcu_assign_pointer(dspans, z->next);
+			/* A run still on z carries on down the gone list,
+			   which is not freed until the grace period is over */
+			z->next = gone;
+			gone = z;
 		} else {
 			zp = z;
 		}
 		z = zn;
 	}
 	spin_unlock_irqrestore(&dlock, flags);
+	synchronize_rcu();
+
+	/* Destroying may sleep, so it's done once they're off the list */
+	for (z = gone; z; z = zn) {
+		zn = z->next;
+		if (!z->usecount) {
+			dynamic_destroy(z);
+		} else {
+			z->dead = 1;
+#ifdef ENABLE_PARALLEL
+			cancel_work_sync(&z->work);
+#endif
+		}
+	}
 }
 
 static struct timer_list alarmcheck;
@@ -802,6 +1406,12 @@ static void check_for_red_alarm(unsigned long ignored)
 		/* If nothing received for a second, consider that RED ALARM */
 		if ((jiffies - z->rxjif) > 1 * HZ) {
 			newalarm |= DAHDI_ALARM_RED;
+			/* Whoever comes back may not aggregate; the receive
+			   path sets these under the span lock */
+			spin_lock(&z->lock);
+			z->peer_agg = 1;
+			z->peer_compact = 0;
+			spin_unlock(&z->lock);
 			if (z->span.alarms != newalarm) {
 				z->span.alarms = newalarm;
 				dahdi_alarm_notify(&z->span);
@@ -819,6 +1429,53 @@ static void check_for_red_alarm(unsigned long ignored)
 	
 }
 
+#ifdef CONFIG_PROC_FS
+static int ztdynamic_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct dahdi_dynamic *z;
+	unsigned long flags;
+	int depth, len = 0;
+	u64 avg;
+
+	if (off > 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	spin_lock_irqsave(&dlock, flags);
+	for (z = dspans; z && (len < count); z = z->next) {
+		depth = z->jb_active ? (int)(z->jb_high - z->jb_play) : 0;
+		if (depth < 0)
+			depth = 0;
+		avg = z->run_ns;
+		if (z->runs)
+			do_div(avg, z->runs);
+		len += snprintf(page + len, count - len,
+				"%s: depth %d/%d late %u lost %u reordered %u dup %u resync %u agg %d/%d "
+				"compact %d/%d tx %lu/%lu rx %lu/%lu cpu %d run %lu avg %uns max %uns "
+				"missed %u dropped %u\n",
+				z->span.name, depth, z->jb_depth, z->rx_late,
+				z->rx_lost, z->rx_reordered, z->rx_dup,
+				z->rx_resync, z->txagg ? z->txagg : 1, z->peer_agg,
+				z->txcompact, z->peer_compact, z->txmsgs, z->txbytes,
+				z->rxmsgs, z->rxbytes,
+#ifdef ENABLE_PARALLEL
+				ztd_wq ? z->cpu : -1,
+#else
+				-1,
+#endif
+				z->runs, (unsigned int)avg, z->run_max_ns,
+				z->missed, z->dropped);
+	}
+	spin_unlock_irqrestore(&dlock, flags);
+
+	if (len > count)
+		len = count;
+	*eof = 1;
+	return len;
+}
+#endif
+
 static int ztdynamic_init(void)
 {
 	dahdi_set_dynamic_ioctl(ztdynamic_ioctl);
@@ -831,6 +1488,16 @@ static int ztdynamic_init(void)
 	mod_timer(&alarmcheck, jiffies + 1 * HZ);
 #ifdef ENABLE_TASKLETS
 	tasklet_init(&ztd_tlet, ztd_tasklet, 0);
+#endif
+#ifdef ENABLE_PARALLEL
+	if (parallel) {
+		ztd_wq = create_workqueue("dahdi_dynamic");
+		if (!ztd_wq)
+			printk(KERN_NOTICE "TDMoX: Unable to create workqueue, running spans serially\n");
+	}
+#endif
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("dahdi/dynamic", 0444, NULL, ztdynamic_proc_read, NULL);
 #endif
 	printk(KERN_INFO "DAHDI Dynamic Span support LOADED\n");
 	return 0;
@@ -846,10 +1513,27 @@ static void ztdynamic_cleanup(void)
 #endif
 	dahdi_set_dynamic_ioctl(NULL);
 	del_timer(&alarmcheck);
+#ifdef ENABLE_PARALLEL
+	if (ztd_wq) {
+		flush_workqueue(ztd_wq);
+		destroy_workqueue(ztd_wq);
+	}
+#endif
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/dynamic", NULL);
+#endif
 	printk(KERN_INFO "DAHDI Dynamic Span support unloaded\n");
 }
 
 module_param(debug, int, 0600);
+module_param(aggregate, int, 0600);
+MODULE_PARM_DESC(aggregate, "Chunks per message to send to peers that accept aggregation (1-8)");
+module_param(jb_depth, int, 0600);
+MODULE_PARM_DESC(jb_depth, "Chunks of received audio to buffer against network jitter (0-32)");
+module_param(compact, int, 0600);
+MODULE_PARM_DESC(compact, "Send compact messages, without unchanged sig bits or idle channels, to peers that accept them");
+module_param(parallel, int, 0444);
+MODULE_PARM_DESC(parallel, "Run each span on a fixed CPU, in parallel with the others, rather than all in one tasklet (default 0)");
 
 MODULE_DESCRIPTION("DAHDI Dynamic Span Support");
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
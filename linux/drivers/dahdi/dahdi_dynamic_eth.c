@@ -31,11 +31,43 @@
 #include <linux/kmod.h>
 #include <linux/netdevice.h>
 #include <linux/notifier.h>
+#include <linux/moduleparam.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/proc_fs.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/rculist.h>
+#else
+#include <linux/list.h>
+#endif
 
 #include <dahdi/kernel.h>
 
 #define ETH_P_DAHDI_DETH	0xd00d
 
+/* Spans are found by (source MAC, subaddr) for every received frame, so
+   they are kept in a small hash table which the receive path walks under
+   RCU only.  zlock serializes the writers. */
+#define ZTDETH_HASH_BITS	6
+#define ZTDETH_HASH_SIZE	(1 << ZTDETH_HASH_BITS)
+
+/* Receive steering needs queue_work_on() and cpumask_next() */
+#if defined(CONFIG_SMP) && (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28))
+#define ZTDETH_STEERING
+#endif
+
+/* Frames waiting for a span's CPU beyond this are dropped */
+#define ZTDETH_STEER_BACKLOG	64
+
+/* Transmit frames are recycled from a small per-span ring with the
+   Ethernet and TDMoE headers already in place */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+#define ZTDETH_SKB_POOL
+#define ZTDETH_POOL_SIZE	8
+#endif
+
 struct ztdeth_header {
 	unsigned short subaddr;
 };
@@ -50,62 +82,203 @@ static spinlock_t zlock = SPIN_LOCK_UNLOCKED;
 
 static struct sk_buff_head skbs;
 
-static struct ztdeth {
+/* Steer each span's received frames to the CPU it was assigned at creation */
+static int steer = 0;
+
+struct ztdeth {
 	unsigned char addr[ETH_ALEN];
 	unsigned short subaddr; /* Network byte order */
 	struct dahdi_span *span;
 	char ethdev[IFNAMSIZ];
 	struct net_device *dev;
-	struct ztdeth *next;
-} *zdevs = NULL;
+	struct hlist_node node;
+	int cpu;
+	struct rcu_head rcu;
+#ifdef ZTDETH_SKB_POOL
+	struct sk_buff *pool[ZTDETH_POOL_SIZE];
+	unsigned int pool_next;
+	unsigned int pool_reserve;	/* Headroom of a pool frame as allocated */
+	struct sk_buff *txskb;		/* Handed out by getbuf, awaiting sendbuf */
+	int txhdrlen;
+#endif
+};
+
+static struct hlist_head ztdeth_hash[ZTDETH_HASH_SIZE];
+
+/* Receive counters, bumped from softirq on the local CPU only */
+struct ztdeth_stats {
+	unsigned long frames;
+	unsigned long unknown;
+	unsigned long lookups;
+	unsigned long probes;
+	unsigned long steered;
+	unsigned long steer_drops;
+	unsigned long tx_frames;
+	unsigned long tx_runs;
+	unsigned long tx_drops;
+	unsigned long pool_misses;
+};
+
+static DEFINE_PER_CPU(struct ztdeth_stats, ztdeth_stats);
+
+#ifdef ZTDETH_STEERING
+struct ztdeth_steer {
+	struct sk_buff_head queue;
+	struct work_struct work;
+};
+
+static DEFINE_PER_CPU(struct ztdeth_steer, ztdeth_steer);
+static struct workqueue_struct *ztdeth_wq;
+#endif
 
-static struct dahdi_span *ztdeth_getspan(unsigned char *addr, unsigned short subaddr)
+static inline unsigned int ztdeth_hashfn(const unsigned char *addr, unsigned short subaddr)
 {
-	unsigned long flags;
+	u32 a = (addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+	u32 b = (addr[4] << 24) | (addr[5] << 16) | subaddr;
+
+	return jhash_2words(a, b, 0) & (ZTDETH_HASH_SIZE - 1);
+}
+
+/* Must be called under rcu_read_lock() (or with zlock held) */
+static struct ztdeth *ztdeth_lookup(const unsigned char *addr, unsigned short subaddr)
+{
+	struct ztdeth_stats *stats = &get_cpu_var(ztdeth_stats);
 	struct ztdeth *z;
-	struct dahdi_span *span = NULL;
-	spin_lock_irqsave(&zlock, flags);
-	z = zdevs;
-	while(z) {
-		if (!memcmp(addr, z->addr, ETH_ALEN) &&
-			z->subaddr == subaddr)
-			break;
-		z = z->next;
+	struct hlist_node *n;
+
+	stats->lookups++;
+	hlist_for_each_entry_rcu(z, n, &ztdeth_hash[ztdeth_hashfn(addr, subaddr)], node) {
+		stats->probes++;
+		if (!memcmp(addr, z->addr, ETH_ALEN) && z->subaddr == subaddr)
+			goto done;
 	}
-	if (z)
-		span = z->span;
-	spin_unlock_irqrestore(&zlock, flags);
-	return span;
+	z = NULL;
+done:
+	put_cpu_var(ztdeth_stats);
+	return z;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,14)
-static int ztdeth_rcv(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt, struct net_device *orig_dev)
+static const unsigned char *ztdeth_source(struct sk_buff *skb)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,9)
+	return eth_hdr(skb)->h_source;
 #else
-static int ztdeth_rcv(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt)
+	return skb->mac.ethernet->h_source;
 #endif
+}
+
+static inline struct ztdeth_header *ztdeth_hdr(struct sk_buff *skb)
 {
-	struct dahdi_span *span;
-	struct ztdeth_header *zh;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
-	zh = (struct ztdeth_header *)skb_network_header(skb);
+	return (struct ztdeth_header *)skb_network_header(skb);
 #else
-	zh = (struct ztdeth_header *)skb->nh.raw;
+	return (struct ztdeth_header *)skb->nh.raw;
 #endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,9)
-	span = ztdeth_getspan(eth_hdr(skb)->h_source, zh->subaddr);
-#else
-	span = ztdeth_getspan(skb->mac.ethernet->h_source, zh->subaddr);
-#endif	
-	if (span) {
-		skb_pull(skb, sizeof(struct ztdeth_header));
+}
+
+/* Hand a frame to its span.  Called under rcu_read_lock(); consumes skb. */
+static void ztdeth_deliver(struct ztdeth *z, struct sk_buff *skb)
+{
+	skb_pull(skb, sizeof(struct ztdeth_header));
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
-		skb_linearize(skb);
+	skb_linearize(skb);
 #else
-		skb_linearize(skb, GFP_KERNEL);
+	skb_linearize(skb, GFP_KERNEL);
 #endif
-		dahdi_dynamic_receive(span, (unsigned char *)skb->data, skb->len);
-	}
+	dahdi_dynamic_receive(z->span, (unsigned char *)skb->data, skb->len);
 	kfree_skb(skb);
+}
+
+#ifdef ZTDETH_STEERING
+static void ztdeth_steer_work(struct work_struct *work)
+{
+	struct ztdeth_steer *st = container_of(work, struct ztdeth_steer, work);
+	struct sk_buff *skb;
+	struct ztdeth *z;
+
+	/* Span processing expects softirq context, as in ztdeth_rcv() */
+	local_bh_disable();
+	while ((skb = skb_dequeue(&st->queue))) {
+		rcu_read_lock();
+		/* The span may have gone away while the frame was queued */
+		z = ztdeth_lookup(ztdeth_source(skb), ztdeth_hdr(skb)->subaddr);
+		if (z)
+			ztdeth_deliver(z, skb);
+		else
+			kfree_skb(skb);
+		rcu_read_unlock();
+	}
+	local_bh_enable();
+}
+
+/* Returns nonzero if the frame was queued for another CPU */
+static int ztdeth_steer_skb(struct ztdeth *z, struct sk_buff *skb)
+{
+	struct ztdeth_steer *st;
+	int cpu = z->cpu;
+
+	if (!steer || !ztdeth_wq || !cpu_online(cpu))
+		return 0;
+	st = &per_cpu(ztdeth_steer, cpu);
+	/* Keep the span's frames in order behind any already queued */
+	if (cpu == smp_processor_id() && skb_queue_empty(&st->queue))
+		return 0;
+	if (skb_queue_len(&st->queue) >= ZTDETH_STEER_BACKLOG) {
+		get_cpu_var(ztdeth_stats).steer_drops++;
+		put_cpu_var(ztdeth_stats);
+		kfree_skb(skb);
+		return 1;
+	}
+	skb_queue_tail(&st->queue, skb);
+	queue_work_on(cpu, ztdeth_wq, &st->work);
+	get_cpu_var(ztdeth_stats).steered++;
+	put_cpu_var(ztdeth_stats);
+	return 1;
+}
+
+static int ztdeth_pick_cpu(void)
+{
+	static int last = -1;
+	int cpu;
+
+	cpu = cpumask_next(last, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+	last = cpu;
+	return cpu;
+}
+#else
+static inline int ztdeth_steer_skb(struct ztdeth *z, struct sk_buff *skb)
+{
+	return 0;
+}
+
+static inline int ztdeth_pick_cpu(void)
+{
+	return 0;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,14)
+static int ztdeth_rcv(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt, struct net_device *orig_dev)
+#else
+static int ztdeth_rcv(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt)
+#endif
+{
+	struct ztdeth *z;
+
+	get_cpu_var(ztdeth_stats).frames++;
+	put_cpu_var(ztdeth_stats);
+	rcu_read_lock();
+	z = ztdeth_lookup(ztdeth_source(skb), ztdeth_hdr(skb)->subaddr);
+	if (!z) {
+		get_cpu_var(ztdeth_stats).unknown++;
+		put_cpu_var(ztdeth_stats);
+		kfree_skb(skb);
+	} else if (!ztdeth_steer_skb(z, skb)) {
+		ztdeth_deliver(z, skb);
+	}
+	rcu_read_unlock();
 	return 0;
 }
 
@@ -113,28 +286,30 @@ static int ztdeth_notifier(struct notifier_block *block, unsigned long event, vo
 {
 	struct net_device *dev = ptr;
 	struct ztdeth *z;
+	struct hlist_node *n;
 	unsigned long flags;
+	int x;
 	switch(event) {
 	case NETDEV_GOING_DOWN:
 	case NETDEV_DOWN:
 		spin_lock_irqsave(&zlock, flags);
-		z = zdevs;
-		while(z) {
-			/* Note that the device no longer exists */
-			if (z->dev == dev)
-				z->dev = NULL;
-			z = z->next;
+		for (x = 0; x < ZTDETH_HASH_SIZE; x++) {
+			hlist_for_each_entry(z, n, &ztdeth_hash[x], node) {
+				/* Note that the device no longer exists */
+				if (z->dev == dev)
+					z->dev = NULL;
+			}
 		}
 		spin_unlock_irqrestore(&zlock, flags);
 		break;
 	case NETDEV_UP:
 		spin_lock_irqsave(&zlock, flags);
-		z = zdevs;
-		while(z) {
-			/* Now that the device exists again, use it */
-			if (!strcmp(z->ethdev, dev->name))
-				z->dev = dev;
-			z = z->next;
+		for (x = 0; x < ZTDETH_HASH_SIZE; x++) {
+			hlist_for_each_entry(z, n, &ztdeth_hash[x], node) {
+				/* Now that the device exists again, use it */
+				if (!strcmp(z->ethdev, dev->name))
+					z->dev = dev;
+			}
 		}
 		spin_unlock_irqrestore(&zlock, flags);
 		break;
@@ -187,21 +362,189 @@ static int ztdeth_transmit(void *pvt, unsigned char *msg, int msglen)
 				dev->hard_header(skb, dev, ETH_P_DAHDI_DETH, addr, dev->dev_addr, skb->len);
 #endif
 			skb_queue_tail(&skbs, skb);
+		} else {
+			get_cpu_var(ztdeth_stats).tx_drops++;
+			put_cpu_var(ztdeth_stats);
 		}
 	}
-	else
+	else {
 		spin_unlock_irqrestore(&zlock, flags);
+		get_cpu_var(ztdeth_stats).tx_drops++;
+		put_cpu_var(ztdeth_stats);
+	}
 	return 0;
 }
 
+#ifdef ZTDETH_SKB_POOL
+/* Write the headers of a pool frame for dev with room for msglen bytes of
+   payload, into a frame that is new or back from the device */
+static void ztdeth_pool_build(struct sk_buff *skb, struct net_device *dev,
+	unsigned char *addr, unsigned short subaddr, int msglen)
+{
+	struct ztdeth_header *zh;
+
+	skb_reserve(skb, dev->hard_header_len + sizeof(struct ztdeth_header));
+	skb_put(skb, msglen);
+	zh = (struct ztdeth_header *)skb_push(skb, sizeof(struct ztdeth_header));
+	zh->subaddr = subaddr;
+	skb->protocol = __constant_htons(ETH_P_DAHDI_DETH);
+	skb_set_network_header(skb, 0);
+	skb->dev = dev;
+#if  LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	dev_hard_header(skb, dev, ETH_P_DAHDI_DETH, addr, dev->dev_addr, skb->len);
+#else
+	if (dev->hard_header)
+		dev->hard_header(skb, dev, ETH_P_DAHDI_DETH, addr, dev->dev_addr, skb->len);
+#endif
+}
+
+static struct sk_buff *ztdeth_pool_alloc(struct ztdeth *z, struct net_device *dev,
+	unsigned char *addr, unsigned short subaddr, int msglen)
+{
+	struct sk_buff *skb;
+
+	skb = dev_alloc_skb(msglen + dev->hard_header_len + sizeof(struct ztdeth_header) + 32);
+	if (!skb)
+		return NULL;
+	z->pool_reserve = skb_headroom(skb);
+	ztdeth_pool_build(skb, dev, addr, subaddr, msglen);
+	return skb;
+}
+
+static unsigned char *ztdeth_getbuf(void *pvt, int msglen)
+{
+	struct ztdeth *z = pvt;
+	struct sk_buff *skb;
+	struct net_device *dev;
+	unsigned char addr[ETH_ALEN];
+	unsigned short subaddr;
+	unsigned long flags;
+	int hdrlen;
+
+	spin_lock_irqsave(&zlock, flags);
+	dev = z->dev;
+	memcpy(addr, z->addr, sizeof(z->addr));
+	subaddr = z->subaddr;
+	spin_unlock_irqrestore(&zlock, flags);
+	if (!dev)
+		return NULL;
+
+	hdrlen = dev->hard_header_len + sizeof(struct ztdeth_header);
+	/* Runt frames get padded by the driver, which can't be done to a
+	   frame we still hold a reference to */
+	if (hdrlen + msglen < ETH_ZLEN)
+		return NULL;
+
+	skb = z->pool[z->pool_next];
+	if (skb && (skb_shared(skb) || skb_cloned(skb))) {
+		/* The device, or a packet tap, still has the last frame sent
+		   from this slot; leave it be and send a new one */
+		get_cpu_var(ztdeth_stats).pool_misses++;
+		put_cpu_var(ztdeth_stats);
+		kfree_skb(skb);
+		skb = NULL;
+	} else if (skb && (skb->dev != dev || skb_is_nonlinear(skb) ||
+		   z->pool_reserve + hdrlen + msglen >
+		   skb_end_pointer(skb) - skb->head)) {
+		kfree_skb(skb);
+		skb = NULL;
+	}
+	if (!skb) {
+		skb = ztdeth_pool_alloc(z, dev, addr, subaddr, msglen);
+		z->pool[z->pool_next] = skb;
+		if (!skb)
+			return NULL;
+	} else {
+		/* Only we hold it now, and the device is done with it.  It
+		   may have changed the frame while sending it, so the headers
+		   are written again. */
+		skb->data = skb->head + z->pool_reserve;
+		skb->len = 0;
+		skb_reset_tail_pointer(skb);
+		ztdeth_pool_build(skb, dev, addr, subaddr, msglen);
+	}
+	skb_reset_mac_header(skb);
+	z->txskb = skb;
+	z->txhdrlen = hdrlen;
+	return skb->data + hdrlen;
+}
+
+static int ztdeth_sendbuf(void *pvt, int msglen)
+{
+	struct ztdeth *z = pvt;
+	int len = z->txhdrlen + msglen;
+
+	/* Compact messages can come out shorter than getbuf was asked for,
+	   but the frame must not become a runt the driver would pad */
+	if (len < ETH_ZLEN) {
+		memset(z->txskb->data + len, 0, ETH_ZLEN - len);
+		len = ETH_ZLEN;
+	}
+	skb_trim(z->txskb, len);
+
+	/* Keep our reference so the frame comes back to the pool */
+	skb_queue_tail(&skbs, skb_get(z->txskb));
+	z->txskb = NULL;
+	z->pool_next = (z->pool_next + 1) % ZTDETH_POOL_SIZE;
+	return 0;
+}
+
+static void ztdeth_pool_free(struct ztdeth *z)
+{
+	int x;
+
+	for (x = 0; x < ZTDETH_POOL_SIZE; x++) {
+		if (z->pool[x])
+			kfree_skb(z->pool[x]);
+	}
+}
+#else
+static inline void ztdeth_pool_free(struct ztdeth *z)
+{
+}
+#endif
+
+/* Send a run of frames, all for the same device, one at a time.  They go
+   through dev_queue_xmit() like any other frame, so the qdisc, packet taps
+   and queue selection all see them. */
+static void ztdeth_xmit_run(struct net_device *dev, struct sk_buff_head *run)
+{
+	struct ztdeth_stats *stats;
+	struct sk_buff *skb;
+	int drops = 0, frames = 0;
+
+	while ((skb = __skb_dequeue(run))) {
+		if (dev_queue_xmit(skb))
+			drops++;
+		else
+			frames++;
+	}
+	/* The flush may run from a workqueue, so stay on one CPU's counters */
+	stats = &get_cpu_var(ztdeth_stats);
+	stats->tx_drops += drops;
+	stats->tx_frames += frames;
+	stats->tx_runs++;
+	put_cpu_var(ztdeth_stats);
+}
 
 static int ztdeth_flush(void)
 {
+	struct sk_buff_head list, run;
 	struct sk_buff *skb;
+	unsigned long flags;
 
-	/* Handle all transmissions now */
-	while ((skb = skb_dequeue(&skbs))) {
-		dev_queue_xmit(skb);
+	/* Take everything queued by this run in one go */
+	__skb_queue_head_init(&list);
+	spin_lock_irqsave(&skbs.lock, flags);
+	skb_queue_splice_init(&skbs, &list);
+	spin_unlock_irqrestore(&skbs.lock, flags);
+
+	/* Handle all transmissions now, a device's worth at a time */
+	__skb_queue_head_init(&run);
+	while ((skb = __skb_dequeue(&list))) {
+		__skb_queue_tail(&run, skb);
+		if (skb_queue_empty(&list) || skb_peek(&list)->dev != skb->dev)
+			ztdeth_xmit_run(skb->dev, &run);
 	}
 	return 0;
 }
@@ -269,30 +612,28 @@ static int hex2int(char *s)
 	return tmp;
 }
 
+static void ztdeth_free_rcu(struct rcu_head *head)
+{
+	struct ztdeth *z = container_of(head, struct ztdeth, rcu);
+
+	ztdeth_pool_free(z);
+	kfree(z);
+}
+
 static void ztdeth_destroy(void *pvt)
 {
 	struct ztdeth *z = pvt;
 	unsigned long flags;
-	struct ztdeth *prev=NULL, *cur;
 	spin_lock_irqsave(&zlock, flags);
-	cur = zdevs;
-	while(cur) {
-		if (cur == z) {
-			if (prev)
-				prev->next = cur->next;
-			else
-				zdevs = cur->next;
-			break;
-		}
-		prev = cur;
-		cur = cur->next;
-	}
+	hlist_del_rcu(&z->node);
 	spin_unlock_irqrestore(&zlock, flags);
-	if (cur == z) {	/* Successfully removed */
-		printk(KERN_INFO "TDMoE: Removed interface for %s\n", z->span->name);
-		kfree(z);
-		module_put(THIS_MODULE);
-	}
+	printk(KERN_INFO "TDMoE: Removed interface for %s\n", z->span->name);
+	/* We may be called with the dynamic span lock held, so the receive
+	   path is waited out asynchronously rather than with synchronize_rcu() */
+	call_rcu(&z->rcu, ztdeth_free_rcu);
+	/* The callback may still be pending when the module goes, so the
+	   unload path waits for it rather than it holding a reference */
+	module_put(THIS_MODULE);
 }
 
 static void *ztdeth_create(struct dahdi_span *span, char *addr)
@@ -389,9 +730,10 @@ static void *ztdeth_create(struct dahdi_span *span, char *addr)
 		sprintf(src + strlen(src), "%02x", z->dev->dev_addr[5]);
 		printk(KERN_INFO "TDMoE: Added new interface for %s at %s (addr=%s, src=%s, subaddr=%d)\n", span->name, z->dev->name, addr, src, ntohs(z->subaddr));
 
+		z->cpu = ztdeth_pick_cpu();
+
 		spin_lock_irqsave(&zlock, flags);
-		z->next = zdevs;
-		zdevs = z;
+		hlist_add_head_rcu(&z->node, &ztdeth_hash[ztdeth_hashfn(z->addr, z->subaddr)]);
 		spin_unlock_irqrestore(&zlock, flags);
 		if(!try_module_get(THIS_MODULE))
 			printk(KERN_DEBUG "TDMoE: Unable to increment module use count\n");
@@ -400,36 +742,144 @@ static void *ztdeth_create(struct dahdi_span *span, char *addr)
 }
 
 static struct dahdi_dynamic_driver ztd_eth = {
-	"eth",
-	"Ethernet",
-	ztdeth_create,
-	ztdeth_destroy,
-	ztdeth_transmit,
-	ztdeth_flush
+	.name = "eth",
+	.desc = "Ethernet",
+	.create = ztdeth_create,
+	.destroy = ztdeth_destroy,
+	.transmit = ztdeth_transmit,
+	.flush = ztdeth_flush,
+#ifdef ZTDETH_SKB_POOL
+	.getbuf = ztdeth_getbuf,
+	.sendbuf = ztdeth_sendbuf,
+#endif
 };
 
 static struct notifier_block ztdeth_nblock = {
 	.notifier_call = ztdeth_notifier,
 };
 
+#ifdef CONFIG_PROC_FS
+static int ztdeth_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct ztdeth_stats *stats, total;
+	struct ztdeth *z;
+	struct hlist_node *n;
+	int cpu, x, len = 0;
+
+	if (off > 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	memset(&total, 0, sizeof(total));
+	len += snprintf(page + len, count - len,
+			"%-4s %10s %10s %10s %10s %10s\n",
+			"CPU", "Frames", "Unknown", "Probes", "Steered", "Dropped");
+	for_each_online_cpu(cpu) {
+		stats = &per_cpu(ztdeth_stats, cpu);
+		len += snprintf(page + len, count - len,
+				"%-4d %10lu %10lu %10lu %10lu %10lu\n",
+				cpu, stats->frames, stats->unknown, stats->probes,
+				stats->steered, stats->steer_drops);
+		total.lookups += stats->lookups;
+		total.probes += stats->probes;
+	}
+	/* Average lookup cost, in hash entries compared per frame */
+	len += snprintf(page + len, count - len, "Lookup cost: %lu.%02lu\n",
+			total.lookups ? total.probes / total.lookups : 0,
+			total.lookups ? (total.probes * 100 / total.lookups) % 100 : 0);
+	len += snprintf(page + len, count - len, "%-4s %10s %10s %10s %10s\n",
+			"CPU", "TxFrames", "TxRuns", "TxDrops", "PoolMiss");
+	for_each_online_cpu(cpu) {
+		stats = &per_cpu(ztdeth_stats, cpu);
+		len += snprintf(page + len, count - len,
+				"%-4d %10lu %10lu %10lu %10lu\n",
+				cpu, stats->tx_frames, stats->tx_runs,
+				stats->tx_drops, stats->pool_misses);
+	}
+	len += snprintf(page + len, count - len, "Steering: %s\n",
+#ifdef ZTDETH_STEERING
+			steer ? "on" : "off");
+#else
+			"unavailable");
+#endif
+
+	rcu_read_lock();
+	for (x = 0; x < ZTDETH_HASH_SIZE; x++) {
+		hlist_for_each_entry_rcu(z, n, &ztdeth_hash[x], node) {
+			if (len >= count)
+				break;
+			len += snprintf(page + len, count - len,
+					"%s: %s/%02x:%02x:%02x:%02x:%02x:%02x/%d bucket %d cpu %d\n",
+					z->span->name, z->ethdev,
+					z->addr[0], z->addr[1], z->addr[2],
+					z->addr[3], z->addr[4], z->addr[5],
+					ntohs(z->subaddr), x, z->cpu);
+		}
+	}
+	rcu_read_unlock();
+
+	if (len > count)
+		len = count;
+	*eof = 1;
+	return len;
+}
+#endif
+
 static int __init ztdeth_init(void)
 {
+	int x;
+#ifdef ZTDETH_STEERING
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ztdeth_steer *st = &per_cpu(ztdeth_steer, cpu);
+		skb_queue_head_init(&st->queue);
+		INIT_WORK(&st->work, ztdeth_steer_work);
+	}
+	ztdeth_wq = create_workqueue("ztdeth");
+	if (!ztdeth_wq)
+		printk(KERN_NOTICE "TDMoE: Unable to create workqueue, receive steering disabled\n");
+#endif
+
+	for (x = 0; x < ZTDETH_HASH_SIZE; x++)
+		INIT_HLIST_HEAD(&ztdeth_hash[x]);
+
 	dev_add_pack(&ztdeth_ptype);
 	register_netdevice_notifier(&ztdeth_nblock);
 	dahdi_dynamic_register(&ztd_eth);
 
 	skb_queue_head_init(&skbs);
 
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("dahdi/dynamic_eth", 0444, NULL, ztdeth_proc_read, NULL);
+#endif
+
 	return 0;
 }
 
 static void __exit ztdeth_exit(void)
 {
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/dynamic_eth", NULL);
+#endif
 	dev_remove_pack(&ztdeth_ptype);
 	unregister_netdevice_notifier(&ztdeth_nblock);
 	dahdi_dynamic_unregister(&ztd_eth);
+#ifdef ZTDETH_STEERING
+	if (ztdeth_wq) {
+		/* Runs the queued frames against an empty table, freeing them */
+		flush_workqueue(ztdeth_wq);
+		destroy_workqueue(ztdeth_wq);
+	}
+#endif
+	/* Wait for any outstanding ztdeth_free_rcu() */
+	rcu_barrier();
 }
 
+module_param(steer, int, 0644);
+MODULE_PARM_DESC(steer, "Process each span's received frames on a fixed CPU");
+
 MODULE_DESCRIPTION("DAHDI Dynamic TDMoE Support");
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
 MODULE_LICENSE("GPL v2");
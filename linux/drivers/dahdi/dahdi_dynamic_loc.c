@@ -10,9 +10,9 @@
  * Note : a DAHDI timing source must exist prior to loading this driver
  *
  * Address syntax : 
- * <key>:<id>[:<monitor id>]
+ * <key>:<id>[:<monitor id>][/<impairments>]
  *
- * As of now, keys and ids are single digit only
+ * Keys and ids are hexadecimal, up to ffff
  *
  * One span may have up to one "normal" peer, and one "monitor" peer
  * 
@@ -26,7 +26,25 @@
  *   1:2:0
  *   1:3:1
  * 
- * Contrary to TDMoE, no frame loss can occur.
+ * Contrary to TDMoE, no frame loss can occur, unless asked for: what a
+ * span sends can be impaired by a list of letters each followed by a
+ * number, with no separators:
+ *
+ *   d<chunks>   fixed delay
+ *   j<chunks>   random extra delay, from none to this much
+ *   l<percent>  messages lost
+ *   r<percent>  messages held back behind the next one
+ *   e<percent>  messages with a bit flipped in their sig words
+ *   s<seed>     seed for the above, so that runs can be repeated
+ *
+ * Percentages may have two decimals.  For instance, a pair linked by a
+ * 20ms path with up to 5ms of jitter losing one message in a hundred:
+ *
+ *   2:0/d20j5l1
+ *   2:1/d20j5l1
+ *
+ * Impaired messages go through a queue which moves on as the span sends,
+ * so results only depend on the seed, not on the machine.
  *
  * See bug #2021 for more details
  * 
@@ -54,6 +72,8 @@
 #include <linux/kmod.h>
 #include <linux/netdevice.h>
 #include <linux/notifier.h>
+#include <linux/ctype.h>
+#include <linux/proc_fs.h>
 
 #include <dahdi/kernel.h>
 
@@ -63,6 +83,33 @@ static DEFINE_SPINLOCK(zlock);
 static spinlock_t zlock = SPIN_LOCK_UNLOCKED;
 #endif
 
+/* Messages an impaired span can have on the way */
+#define ZTDLOCAL_QUEUE_LEN	64
+
+/* Longest delay plus jitter, in chunks, that is sure to fit the queue */
+#define ZTDLOCAL_MAX_DELAY	48
+
+/* Sig bits present flag, as in dahdi_dynamic.c */
+#define ZTDLOCAL_SIGBITS_PRESENT	(1 << 1)
+
+struct ztdlocal_impair {
+	unsigned int delay;	/* Chunks */
+	unsigned int jitter;	/* Chunks */
+	unsigned int loss;	/* Hundredths of a percent */
+	unsigned int reorder;
+	unsigned int sigerr;
+	u32 seed;
+};
+
+struct ztdlocal_msg {
+	unsigned char *buf;
+	int size;
+	int len;
+	int used;
+	unsigned int due;	/* Clock at which it arrives */
+	unsigned int seq;	/* Order sent, to break ties */
+};
+
 static struct ztdlocal {
 	unsigned short key;
 	unsigned short id;
@@ -70,55 +117,196 @@ static struct ztdlocal {
 	struct ztdlocal *peer; /* Indicates the rw peer for this span */
 	struct dahdi_span *span;
 	struct ztdlocal *next;
+	struct ztdlocal_impair imp;
+	int impaired;
+	u32 rand;
+	unsigned int clock;	/* Chunks sent so far */
+	unsigned int seq;
+	struct ztdlocal_msg queue[ZTDLOCAL_QUEUE_LEN];
+	unsigned long sent;
+	unsigned long lost;
+	unsigned long reordered;
+	unsigned long corrupted;
+	unsigned long overflows;
 } *zdevs = NULL;
 
-static int ztdlocal_transmit(void *pvt, unsigned char *msg, int msglen)
+/* Small and repeatable from the seed (xorshift) */
+static inline u32 ztdlocal_rand(struct ztdlocal *z)
 {
-	struct ztdlocal *z;
-	unsigned long flags;
+	u32 x = z->rand;
 
-	spin_lock_irqsave(&zlock, flags);
-	z = pvt;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	z->rand = x;
+	return x;
+}
+
+static inline int ztdlocal_chance(struct ztdlocal *z, unsigned int rate)
+{
+	return rate && ((ztdlocal_rand(z) % 10000) < rate);
+}
+
+static void ztdlocal_deliver(struct ztdlocal *z, unsigned char *msg, int msglen)
+{
 	if (z->peer && z->peer->span) {
 		dahdi_dynamic_receive(z->peer->span, msg, msglen);
 	}
 	if (z->monitor_rx_peer && z->monitor_rx_peer->span) {
 		dahdi_dynamic_receive(z->monitor_rx_peer->span, msg, msglen);
 	}
+}
+
+/* Put a message on the way, impaired as asked.  Called with zlock held. */
+static void ztdlocal_queue(struct ztdlocal *z, unsigned char *msg, int msglen)
+{
+	struct ztdlocal_msg *m = NULL;
+	int nchunks = msg[0] / DAHDI_CHUNKSIZE;
+	int x, siglen;
+
+	if (nchunks < 1)
+		nchunks = 1;
+	z->clock += nchunks;
+	z->sent++;
+
+	if (ztdlocal_chance(z, z->imp.loss)) {
+		z->lost++;
+		return;
+	}
+	for (x = 0; x < ZTDLOCAL_QUEUE_LEN; x++) {
+		if (!z->queue[x].used) {
+			m = &z->queue[x];
+			break;
+		}
+	}
+	if (m && (m->size < msglen)) {
+		kfree(m->buf);
+		m->buf = kmalloc(msglen, GFP_ATOMIC);
+		m->size = m->buf ? msglen : 0;
+		if (!m->buf)
+			m = NULL;
+	}
+	if (!m) {
+		z->overflows++;
+		return;
+	}
+
+	memcpy(m->buf, msg, msglen);
+	m->len = msglen;
+	m->used = 1;
+	m->seq = z->seq++;
+	m->due = z->clock + z->imp.delay;
+	if (z->imp.jitter)
+		m->due += ztdlocal_rand(z) % (z->imp.jitter + 1);
+	if (ztdlocal_chance(z, z->imp.reorder)) {
+		/* Due just after the next one */
+		m->due += nchunks + 1;
+		z->reordered++;
+	}
+	if (ztdlocal_chance(z, z->imp.sigerr) && (msglen >= 6) &&
+	    (msg[1] & ZTDLOCAL_SIGBITS_PRESENT)) {
+		siglen = ((ntohs(*((unsigned short *)(msg + 4))) + 3) / 4) * 2;
+		if (siglen && (6 + siglen <= msglen)) {
+			x = ztdlocal_rand(z) % (siglen * 8);
+			m->buf[6 + x / 8] ^= 1 << (x % 8);
+			z->corrupted++;
+		}
+	}
+}
+
+/* Hand over whatever has arrived by now, earliest first */
+static void ztdlocal_run_queue(struct ztdlocal *z)
+{
+	struct ztdlocal_msg *m, *next;
+	int x;
+
+	for (;;) {
+		next = NULL;
+		for (x = 0; x < ZTDLOCAL_QUEUE_LEN; x++) {
+			m = &z->queue[x];
+			if (!m->used || ((int)(m->due - z->clock) > 0))
+				continue;
+			if (!next || ((int)(m->due - next->due) < 0) ||
+			    ((m->due == next->due) && ((int)(m->seq - next->seq) < 0)))
+				next = m;
+		}
+		if (!next)
+			break;
+		next->used = 0;
+		ztdlocal_deliver(z, next->buf, next->len);
+	}
+}
+
+static int ztdlocal_transmit(void *pvt, unsigned char *msg, int msglen)
+{
+	struct ztdlocal *z;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zlock, flags);
+	z = pvt;
+	if (z->impaired) {
+		ztdlocal_queue(z, msg, msglen);
+		ztdlocal_run_queue(z);
+	} else {
+		ztdlocal_deliver(z, msg, msglen);
+	}
 	spin_unlock_irqrestore(&zlock, flags);
 	return 0;
 }
 
-static int digit2int(char d)
+/* A percentage with up to two decimals, in hundredths of a percent */
+static unsigned int ztdlocal_rate(const char *c, char **end)
+{
+	unsigned int rate;
+	int x;
+
+	rate = simple_strtoul(c, end, 10) * 100;
+	if (**end == '.') {
+		c = *end + 1;
+		for (x = 10; isdigit(*c); c++, x /= 10)
+			rate += (*c - '0') * x;
+		*end = (char *)c;
+	}
+	return rate;
+}
+
+static int ztdlocal_parse_impair(const char *c, struct ztdlocal_impair *imp)
 {
-	switch(d) {
-	case 'F':
-	case 'E':
-	case 'D':
-	case 'C':
-	case 'B':
-	case 'A':
-		return d - 'A' + 10;
-	case 'f':
-	case 'e':
-	case 'd':
-	case 'c':
-	case 'b':
-	case 'a':
-		return d - 'a' + 10;
-	case '9':
-	case '8':
-	case '7':
-	case '6':
-	case '5':
-	case '4':
-	case '3':
-	case '2':
-	case '1':
-	case '0':
-		return d - '0';
+	char *end;
+	char opt;
+
+	while (*c) {
+		opt = *c++;
+		switch (opt) {
+		case 'd':
+			imp->delay = simple_strtoul(c, &end, 10);
+			break;
+		case 'j':
+			imp->jitter = simple_strtoul(c, &end, 10);
+			break;
+		case 'l':
+			imp->loss = ztdlocal_rate(c, &end);
+			break;
+		case 'r':
+			imp->reorder = ztdlocal_rate(c, &end);
+			break;
+		case 'e':
+			imp->sigerr = ztdlocal_rate(c, &end);
+			break;
+		case 's':
+			imp->seed = simple_strtoul(c, &end, 10);
+			break;
+		default:
+			return -1;
+		}
+		if (end == c)
+			return -1;
+		c = end;
 	}
-	return -1;
+	if ((imp->delay + imp->jitter > ZTDLOCAL_MAX_DELAY) ||
+	    (imp->loss > 10000) || (imp->reorder > 10000) || (imp->sigerr > 10000))
+		return -1;
+	return 0;
 }
 
 static void ztdlocal_destroy(void *pvt)
@@ -150,7 +338,11 @@ static void ztdlocal_destroy(void *pvt)
 	}
 	spin_unlock_irqrestore(&zlock, flags);
 	if (cur == z) {
+		int x;
+
 		printk(KERN_INFO "TDMoL: Removed interface for %s, key %d id %d\n", z->span->name, z->key, z->id);
+		for (x = 0; x < ZTDLOCAL_QUEUE_LEN; x++)
+			kfree(z->queue[x].buf);
 		module_put(THIS_MODULE);
 		kfree(z);
 	}
@@ -159,22 +351,34 @@ static void ztdlocal_destroy(void *pvt)
 static void *ztdlocal_create(struct dahdi_span *span, char *address)
 {
 	struct ztdlocal *z, *l;
+	struct ztdlocal_impair imp;
 	unsigned long flags;
 	int key = -1, id = -1, monitor = -1;
+	char *c, *end;
 
-	if (strlen(address) >= 3) {
-		if (address[1] != ':')
+	memset(&imp, 0, sizeof(imp));
+	c = address;
+	key = simple_strtoul(c, &end, 16);
+	if ((end == c) || (*end != ':'))
+		goto INVALID_ADDRESS;
+	c = end + 1;
+	id = simple_strtoul(c, &end, 16);
+	if (end == c)
+		goto INVALID_ADDRESS;
+	if (*end == ':') {
+		c = end + 1;
+		monitor = simple_strtoul(c, &end, 16);
+		if (end == c)
 			goto INVALID_ADDRESS;
-		key = digit2int(address[0]);
-		id = digit2int(address[2]);
-	} 
-	if (strlen (address) == 5) {
-		if (address[3] != ':')
+	}
+	if (*end == '/') {
+		if (ztdlocal_parse_impair(end + 1, &imp))
 			goto INVALID_ADDRESS;
-		monitor = digit2int(address[4]);
+	} else if (*end) {
+		goto INVALID_ADDRESS;
 	}
 
-	if (key == -1 || id == -1)
+	if ((key > 0xffff) || (id > 0xffff) || (monitor > 0xffff))
 		goto INVALID_ADDRESS;
 
 	z = kmalloc(sizeof(struct ztdlocal), GFP_KERNEL);
@@ -185,6 +389,10 @@ static void *ztdlocal_create(struct dahdi_span *span, char *address)
 		z->key = key;
 		z->id = id;
 		z->span = span;
+		z->imp = imp;
+		z->impaired = imp.delay || imp.jitter || imp.loss || imp.reorder || imp.sigerr;
+		/* The same seed gives the same run; xorshift needs nonzero */
+		z->rand = imp.seed ? imp.seed : ((key << 16) | id) + 1;
 			
 		spin_lock_irqsave(&zlock, flags);
 		/* Add this peer to any existing spans with same key
@@ -248,14 +456,57 @@ static struct dahdi_dynamic_driver ztd_local = {
 	NULL	/* flush */
 };
 
+#ifdef CONFIG_PROC_FS
+static int ztdlocal_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct ztdlocal *z;
+	unsigned long flags;
+	int x, queued, len = 0;
+
+	if (off > 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	spin_lock_irqsave(&zlock, flags);
+	for (z = zdevs; z && (len < count); z = z->next) {
+		queued = 0;
+		for (x = 0; x < ZTDLOCAL_QUEUE_LEN; x++)
+			queued += z->queue[x].used;
+		len += snprintf(page + len, count - len,
+				"%s: %x:%x delay %u jitter %u loss %u.%02u%% reorder %u.%02u%% "
+				"sigerr %u.%02u%% sent %lu lost %lu reordered %lu corrupted %lu "
+				"overflows %lu queued %d\n",
+				z->span->name, z->key, z->id, z->imp.delay, z->imp.jitter,
+				z->imp.loss / 100, z->imp.loss % 100,
+				z->imp.reorder / 100, z->imp.reorder % 100,
+				z->imp.sigerr / 100, z->imp.sigerr % 100,
+				z->sent, z->lost, z->reordered, z->corrupted,
+				z->overflows, queued);
+	}
+	spin_unlock_irqrestore(&zlock, flags);
+
+	if (len > count)
+		len = count;
+	*eof = 1;
+	return len;
+}
+#endif
+
 static int __init ztdlocal_init(void)
 {
 	dahdi_dynamic_register(&ztd_local);
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("dahdi/dynamic_loc", 0444, NULL, ztdlocal_proc_read, NULL);
+#endif
 	return 0;
 }
 
 static void __exit ztdlocal_exit(void)
 {
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/dynamic_loc", NULL);
+#endif
 	dahdi_dynamic_unregister(&ztd_local);
 }
 
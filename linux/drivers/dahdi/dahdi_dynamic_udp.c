@@ -0,0 +1,530 @@
+/*
+ * Dynamic Span Interface for DAHDI (UDP/IP Interface)
+ *
+ * Based on dahdi_dynamic_eth.c, Copyright (C) 2001-2008 Digium, Inc.
+ *
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+/*
+ * Carries the standard dynamic span messages, one per UDP datagram, so
+ * that spans can cross routers.  The address is
+ *
+ *	<remote ip>:<remote port>[/<local port>]
+ *
+ * and the local port defaults to the remote one.  Spans sharing a local
+ * port share one kernel socket, and received datagrams are matched to a
+ * span by their source address and port.
+ *
+ * Datagrams are taken straight off the socket's encapsulation hook in
+ * softirq, so they are never queued to the socket.  Sending may sleep,
+ * so messages are built in place in a small per-span ring and flushed
+ * from a workqueue, every span's in one pass, once per DAHDI run.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/proc_fs.h>
+#include <linux/in.h>
+#include <linux/inet.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/net.h>
+#include <net/sock.h>
+#include <net/udp.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/rculist.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+#include <linux/nsproxy.h>
+#include <net/net_namespace.h>
+#endif
+
+#include <dahdi/kernel.h>
+
+#define ZTDUDP_HASH_BITS	6
+#define ZTDUDP_HASH_SIZE	(1 << ZTDUDP_HASH_BITS)
+
+/* Messages a span can have waiting for the transmit work */
+#define ZTDUDP_TXRING		4
+
+/* Any nonzero encapsulation type sends datagrams to encap_rcv */
+#define ZTDUDP_ENCAP_TYPE	1
+
+struct ztdudp_sock {
+	struct list_head list;
+	struct socket *sock;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	struct net *net;
+#endif
+	unsigned short port;		/* Host byte order */
+	int refs;
+};
+
+struct ztdudp_slot {
+	unsigned char *buf;
+	int size;
+	int len;
+};
+
+struct ztdudp {
+	struct sockaddr_in remote;
+	struct ztdudp_sock *usock;
+	struct dahdi_span *span;
+	struct hlist_node node;		/* In ztdudp_hash, for receive */
+	struct list_head list;		/* In ztdudp_spans, for transmit */
+	int dead;
+	struct ztdudp_slot tx[ZTDUDP_TXRING];
+	unsigned int tx_head;		/* Next slot getbuf hands out */
+	unsigned int tx_tail;		/* Next slot the work sends */
+	unsigned long rx_frames;
+	unsigned long tx_frames;
+	unsigned long tx_errors;
+	unsigned long tx_drops;
+};
+
+/* zlock guards the receive hash and the dead flags; ztdudp_mutex the span
+   and socket lists */
+#ifdef DEFINE_SPINLOCK
+static DEFINE_SPINLOCK(zlock);
+#else
+static spinlock_t zlock = SPIN_LOCK_UNLOCKED;
+#endif
+
+static DEFINE_MUTEX(ztdudp_mutex);
+static LIST_HEAD(ztdudp_socks);
+static LIST_HEAD(ztdudp_spans);
+static struct hlist_head ztdudp_hash[ZTDUDP_HASH_SIZE];
+
+static struct workqueue_struct *ztdudp_wq;
+static void ztdudp_tx_work(struct work_struct *work);
+static DECLARE_WORK(ztdudp_work, ztdudp_tx_work);
+static atomic_t ztdudp_pending = ATOMIC_INIT(0);
+
+static unsigned long ztdudp_unknown;
+static unsigned long ztdudp_badsum;
+
+static inline unsigned int ztdudp_hashfn(struct ztdudp_sock *us, __be32 addr, __be16 port)
+{
+	return jhash_3words((u32)addr, (u32)port, (u32)(unsigned long)us, 0) & (ZTDUDP_HASH_SIZE - 1);
+}
+
+/* Must be called under rcu_read_lock() */
+static struct ztdudp *ztdudp_lookup(struct ztdudp_sock *us, __be32 addr, __be16 port)
+{
+	struct ztdudp *z;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(z, n, &ztdudp_hash[ztdudp_hashfn(us, addr, port)], node) {
+		if ((z->usock == us) && (z->remote.sin_addr.s_addr == addr) &&
+		    (z->remote.sin_port == port))
+			return z;
+	}
+	return NULL;
+}
+
+/* Socket encapsulation hook: skb->data is at the UDP header */
+static int ztdudp_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	struct ztdudp_sock *us = sk->sk_user_data;
+	struct ztdudp *z;
+	struct udphdr *uh;
+
+	/* Nothing has checked the sum for us on this path */
+	if (udp_lib_checksum_complete(skb)) {
+		ztdudp_badsum++;
+		goto out;
+	}
+	uh = udp_hdr(skb);
+
+	rcu_read_lock();
+	z = ztdudp_lookup(us, ip_hdr(skb)->saddr, uh->source);
+	if (z) {
+		__skb_pull(skb, sizeof(struct udphdr));
+		if (!skb_linearize(skb)) {
+			z->rx_frames++;
+			dahdi_dynamic_receive(z->span, (unsigned char *)skb->data, skb->len);
+		}
+	} else
+		ztdudp_unknown++;
+	rcu_read_unlock();
+out:
+	kfree_skb(skb);
+	return 0;
+}
+
+/* Find or open the socket for a local port.  Called with ztdudp_mutex. */
+static struct ztdudp_sock *ztdudp_sock_get(unsigned short port)
+{
+	struct ztdudp_sock *us;
+	struct sockaddr_in sin;
+	struct sock *sk;
+	int res;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	/* Bind in the namespace of whoever is configuring the span */
+	struct net *net = current->nsproxy->net_ns;
+#endif
+
+	list_for_each_entry(us, &ztdudp_socks, list) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+		if (us->net != net)
+			continue;
+#endif
+		if (us->port == port) {
+			us->refs++;
+			return us;
+		}
+	}
+
+	us = kmalloc(sizeof(*us), GFP_KERNEL);
+	if (!us)
+		return NULL;
+	memset(us, 0, sizeof(*us));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	us->net = net;
+	res = __sock_create(net, PF_INET, SOCK_DGRAM, IPPROTO_UDP, &us->sock, 1);
+#else
+	res = sock_create_kern(PF_INET, SOCK_DGRAM, IPPROTO_UDP, &us->sock);
+#endif
+	if (res < 0) {
+		printk(KERN_NOTICE "TDMoIP: Unable to create socket (%d)\n", res);
+		kfree(us);
+		return NULL;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(port);
+	res = kernel_bind(us->sock, (struct sockaddr *)&sin, sizeof(sin));
+	if (res < 0) {
+		printk(KERN_NOTICE "TDMoIP: Unable to bind to port %d (%d)\n", port, res);
+		sock_release(us->sock);
+		kfree(us);
+		return NULL;
+	}
+
+	sk = us->sock->sk;
+	sk->sk_allocation = GFP_ATOMIC;
+	sk->sk_user_data = us;
+	udp_sk(sk)->encap_rcv = ztdudp_rcv;
+	udp_sk(sk)->encap_type = ZTDUDP_ENCAP_TYPE;
+
+	us->port = port;
+	us->refs = 1;
+	list_add(&us->list, &ztdudp_socks);
+	return us;
+}
+
+/* Called with ztdudp_mutex, from process context */
+static void ztdudp_sock_put(struct ztdudp_sock *us)
+{
+	if (--us->refs)
+		return;
+	list_del(&us->list);
+	/* Datagrams already in ztdudp_rcv() only compare the pointer */
+	sock_release(us->sock);
+	kfree(us);
+}
+
+static void ztdudp_free(struct ztdudp *z)
+{
+	int x;
+
+	for (x = 0; x < ZTDUDP_TXRING; x++)
+		kfree(z->tx[x].buf);
+	mutex_lock(&ztdudp_mutex);
+	ztdudp_sock_put(z->usock);
+	mutex_unlock(&ztdudp_mutex);
+	kfree(z);
+	module_put(THIS_MODULE);
+}
+
+static void ztdudp_tx_work(struct work_struct *work)
+{
+	struct ztdudp *z, *n;
+	struct ztdudp_slot *slot;
+	struct msghdr msg;
+	struct kvec iov;
+	LIST_HEAD(reap);
+	int res;
+
+	atomic_set(&ztdudp_pending, 0);
+
+	mutex_lock(&ztdudp_mutex);
+	list_for_each_entry_safe(z, n, &ztdudp_spans, list) {
+		if (z->dead) {
+			list_move(&z->list, &reap);
+			continue;
+		}
+		while (z->tx_tail != z->tx_head) {
+			/* Read the slot only after seeing it published */
+			smp_rmb();
+			slot = &z->tx[z->tx_tail];
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name = &z->remote;
+			msg.msg_namelen = sizeof(z->remote);
+			msg.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			iov.iov_base = slot->buf;
+			iov.iov_len = slot->len;
+			res = kernel_sendmsg(z->usock->sock, &msg, &iov, 1, slot->len);
+			if (res < 0)
+				z->tx_errors++;
+			else
+				z->tx_frames++;
+			smp_mb();
+			z->tx_tail = (z->tx_tail + 1) % ZTDUDP_TXRING;
+		}
+	}
+	mutex_unlock(&ztdudp_mutex);
+
+	if (!list_empty(&reap)) {
+		/* Let the receive path finish with them */
+		synchronize_rcu();
+		list_for_each_entry_safe(z, n, &reap, list)
+			ztdudp_free(z);
+	}
+}
+
+static unsigned char *ztdudp_getbuf(void *pvt, int msglen)
+{
+	struct ztdudp *z = pvt;
+	struct ztdudp_slot *slot;
+	unsigned int head = z->tx_head;
+
+	/* Work hasn't caught up; drop rather than wait */
+	if (((head + 1) % ZTDUDP_TXRING) == z->tx_tail)
+		return NULL;
+
+	slot = &z->tx[head];
+	if (slot->size < msglen) {
+		/* Only on the first message, or when aggregation grows it */
+		kfree(slot->buf);
+		slot->buf = kmalloc(msglen, GFP_ATOMIC);
+		slot->size = slot->buf ? msglen : 0;
+	}
+	return slot->buf;
+}
+
+static int ztdudp_sendbuf(void *pvt, int msglen)
+{
+	struct ztdudp *z = pvt;
+
+	z->tx[z->tx_head].len = msglen;
+	/* Publish the message before moving the head past it */
+	smp_wmb();
+	z->tx_head = (z->tx_head + 1) % ZTDUDP_TXRING;
+	atomic_set(&ztdudp_pending, 1);
+	return 0;
+}
+
+static int ztdudp_transmit(void *pvt, unsigned char *msg, int msglen)
+{
+	struct ztdudp *z = pvt;
+	unsigned char *buf;
+
+	/* Only reached when getbuf() already came up empty */
+	buf = ztdudp_getbuf(pvt, msglen);
+	if (!buf) {
+		z->tx_drops++;
+		return 0;
+	}
+	memcpy(buf, msg, msglen);
+	return ztdudp_sendbuf(pvt, msglen);
+}
+
+static int ztdudp_flush(void)
+{
+	/* One pass of the work sends every span's messages */
+	if (atomic_read(&ztdudp_pending))
+		queue_work(ztdudp_wq, &ztdudp_work);
+	return 0;
+}
+
+static void ztdudp_destroy(void *pvt)
+{
+	struct ztdudp *z = pvt;
+	unsigned long flags;
+
+	/* The socket and memory are let go of from the transmit work, which
+	   may be sending from this interface right now */
+	printk(KERN_INFO "TDMoIP: Removed interface for %s\n", z->span->name);
+	/* The span goes away once we return, so the proc file checks dead
+	   under zlock before it looks at the span */
+	spin_lock_irqsave(&zlock, flags);
+	hlist_del_rcu(&z->node);
+	z->dead = 1;
+	spin_unlock_irqrestore(&zlock, flags);
+	/* And a datagram already in ztdudp_rcv() may still hand it one */
+	synchronize_rcu();
+	queue_work(ztdudp_wq, &ztdudp_work);
+}
+
+static void *ztdudp_create(struct dahdi_span *span, char *addr)
+{
+	struct ztdudp *z;
+	char tmp[64], *port, *lport;
+	unsigned long rport, local;
+	unsigned long flags;
+
+	/* Address should be <ip>:<port>[/<local port>] */
+	dahdi_copy_string(tmp, addr, sizeof(tmp));
+	lport = strchr(tmp, '/');
+	if (lport)
+		*lport++ = '\0';
+	port = strchr(tmp, ':');
+	if (!port) {
+		printk(KERN_NOTICE "TDMoIP: Missing port in '%s'\n", addr);
+		return NULL;
+	}
+	*port++ = '\0';
+	rport = simple_strtoul(port, NULL, 10);
+	local = lport ? simple_strtoul(lport, NULL, 10) : rport;
+	if (!rport || (rport > 65535) || !local || (local > 65535)) {
+		printk(KERN_NOTICE "TDMoIP: Invalid port in '%s'\n", addr);
+		return NULL;
+	}
+
+	z = kmalloc(sizeof(*z), GFP_KERNEL);
+	if (!z)
+		return NULL;
+	memset(z, 0, sizeof(*z));
+
+	z->remote.sin_family = AF_INET;
+	z->remote.sin_port = htons(rport);
+	if (!in4_pton(tmp, -1, (u8 *)&z->remote.sin_addr.s_addr, -1, NULL)) {
+		printk(KERN_NOTICE "TDMoIP: Invalid IP address in '%s'\n", addr);
+		kfree(z);
+		return NULL;
+	}
+	z->span = span;
+
+	mutex_lock(&ztdudp_mutex);
+	z->usock = ztdudp_sock_get(local);
+	if (!z->usock) {
+		mutex_unlock(&ztdudp_mutex);
+		kfree(z);
+		return NULL;
+	}
+	list_add_tail(&z->list, &ztdudp_spans);
+	spin_lock_irqsave(&zlock, flags);
+	hlist_add_head_rcu(&z->node, &ztdudp_hash[ztdudp_hashfn(z->usock,
+		z->remote.sin_addr.s_addr, z->remote.sin_port)]);
+	spin_unlock_irqrestore(&zlock, flags);
+	mutex_unlock(&ztdudp_mutex);
+
+	printk(KERN_INFO "TDMoIP: Added new interface for %s (addr=%s, local port=%lu)\n", span->name, addr, local);
+
+	if(!try_module_get(THIS_MODULE))
+		printk(KERN_DEBUG "TDMoIP: Unable to increment module use count\n");
+	return z;
+}
+
+static struct dahdi_dynamic_driver ztd_udp = {
+	.name = "udp",
+	.desc = "UDP/IP",
+	.create = ztdudp_create,
+	.destroy = ztdudp_destroy,
+	.transmit = ztdudp_transmit,
+	.flush = ztdudp_flush,
+	.getbuf = ztdudp_getbuf,
+	.sendbuf = ztdudp_sendbuf,
+};
+
+#ifdef CONFIG_PROC_FS
+static int ztdudp_proc_read(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct ztdudp *z;
+	unsigned long flags;
+	int len = 0;
+
+	if (off > 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	len += snprintf(page + len, count - len, "Unknown source: %lu  Bad checksum: %lu\n",
+			ztdudp_unknown, ztdudp_badsum);
+	mutex_lock(&ztdudp_mutex);
+	list_for_each_entry(z, &ztdudp_spans, list) {
+		if (len >= count)
+			break;
+		spin_lock_irqsave(&zlock, flags);
+		/* Its span is already gone */
+		if (!z->dead) {
+			len += snprintf(page + len, count - len,
+					"%s: %u.%u.%u.%u:%d/%d rx %lu tx %lu errors %lu drops %lu\n",
+					z->span->name, NIPQUAD(z->remote.sin_addr.s_addr),
+					ntohs(z->remote.sin_port), z->usock->port,
+					z->rx_frames, z->tx_frames, z->tx_errors, z->tx_drops);
+		}
+		spin_unlock_irqrestore(&zlock, flags);
+	}
+	mutex_unlock(&ztdudp_mutex);
+
+	if (len > count)
+		len = count;
+	*eof = 1;
+	return len;
+}
+#endif
+
+static int __init ztdudp_init(void)
+{
+	int x;
+
+	/* Single threaded, so messages leave in the order they were made */
+	ztdudp_wq = create_singlethread_workqueue("ztdudp");
+	if (!ztdudp_wq)
+		return -ENOMEM;
+
+	for (x = 0; x < ZTDUDP_HASH_SIZE; x++)
+		INIT_HLIST_HEAD(&ztdudp_hash[x]);
+
+	dahdi_dynamic_register(&ztd_udp);
+
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("dahdi/dynamic_udp", 0444, NULL, ztdudp_proc_read, NULL);
+#endif
+
+	return 0;
+}
+
+static void __exit ztdudp_exit(void)
+{
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/dynamic_udp", NULL);
+#endif
+	dahdi_dynamic_unregister(&ztd_udp);
+	/* Reap whatever was destroyed on the way out */
+	flush_workqueue(ztdudp_wq);
+	destroy_workqueue(ztdudp_wq);
+}
+
+MODULE_DESCRIPTION("DAHDI Dynamic UDP/IP Support");
+MODULE_LICENSE("GPL v2");
+
+module_init(ztdudp_init);
+module_exit(ztdudp_exit);
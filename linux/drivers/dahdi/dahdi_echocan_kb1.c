@@ -33,6 +33,7 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
 #include <linux/errno.h>
 #include <linux/module.h>
 #include <linux/init.h>
@@ -148,15 +149,19 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
+static size_t echo_can_state_size(u32 tap_length);
 
 static const struct dahdi_echocan_factory my_factory = {
 	.name = "KB1",
 	.owner = THIS_MODULE,
 	.echocan_create = echo_can_create,
+	.echocan_state_size = echo_can_state_size,
 };
 
 static const struct dahdi_echocan_features my_features = {
 	.NLP_toggle = 1,
+	.stats = 1,
+	.idle_bypass = 1,
 };
 
 static const struct dahdi_echocan_ops my_ops = {
@@ -267,14 +272,9 @@ static inline short get_cc_s(echo_can_cb_s *cb, int pos)
 static inline void init_cc(struct ec_pvt *pvt, int N, int maxy, int maxu)
 {
 	void *ptr = pvt;
-	unsigned long tmp;
 
-	/* Double-word align past end of state */
-	ptr += sizeof(*pvt);
-	tmp = (unsigned long)ptr;
-	tmp += 3;
-	tmp &= ~3L;
-	ptr = (void *)tmp;
+	/* Coefficients start on the first cacheline past the end of state */
+	ptr += L1_CACHE_ALIGN(sizeof(*pvt));
 
 	/* Reset parameters */
 	pvt->N_d = N;
@@ -333,7 +333,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 {
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
 
-	kfree(pvt);
+	dahdi_echocan_state_free(&my_factory, pvt->N_d, pvt);
 }
 
 static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
@@ -471,6 +471,8 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	if (((pvt->s_tilde_i >> (DEFAULT_ALPHA_ST_I - 1)) > pvt->max_y_tilde)
 	    && (pvt->max_y_tilde > 0))  {
 		/* Then start the Hangover counter */
+		if (!pvt->HCNTR_d)
+			pvt->dahdi.stats.doubletalk++;
 		pvt->HCNTR_d = DEFAULT_HANGT;
 #ifdef MEC2_STATS_DETAILED
 		printk(KERN_INFO "Reset near end speech timer with: s_tilde_i %d, stmnt %d, max_y_tilde %d\n", pvt->s_tilde_i, (pvt->s_tilde_i >> (DEFAULT_ALPHA_ST_I - 1)), pvt->max_y_tilde);
@@ -541,6 +543,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 #ifdef MEC2_STATS_DETAILED
 				printk(KERN_INFO "aggresively correcting frame with pvt->Ly_i %9d pvt->Lu_i %9d expression %d\n", pvt->Ly_i, pvt->Lu_i, (pvt->Ly_i/(pvt->Lu_i + 1)));
 #endif
+				pvt->dahdi.stats.nlp_samples++;
 #ifdef MEC2_STATS
 				++pvt->cntr_residualcorrected_frames;
 #endif
@@ -554,6 +557,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 #ifdef MEC2_STATS_DETAILED
 					printk(KERN_INFO "correcting frame with pvt->Ly_i %9d pvt->Lu_i %9d expression %d\n", pvt->Ly_i, pvt->Lu_i, (pvt->Ly_i/(pvt->Lu_i + 1)));
 #endif
+					pvt->dahdi.stats.nlp_samples++;
 #ifdef MEC2_STATS
 					++pvt->cntr_residualcorrected_frames;
 #endif
@@ -626,6 +630,39 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 		*isig++ = result;
 		++iref;
 	}
+
+	ec->stats.tx_level = pvt->Ly_i >> DEFAULT_SIGMA_LY_I;
+	ec->stats.rx_level = pvt->s_tilde_i >> DEFAULT_ALPHA_ST_I;
+	ec->stats.clean_level = pvt->Lu_i >> DEFAULT_SIGMA_LU_I;
+	ec->stats.samples += size;
+}
+
+static void calc_cb_sizes(u32 tap_length, int *maxy, int *maxu)
+{
+	*maxy = tap_length + DEFAULT_M;
+	*maxu = DEFAULT_M;
+	if (*maxy < (1 << DEFAULT_ALPHA_YT_I))
+		*maxy = (1 << DEFAULT_ALPHA_YT_I);
+	if (*maxy < (1 << DEFAULT_SIGMA_LY_I))
+		*maxy = (1 << DEFAULT_SIGMA_LY_I);
+	if (*maxu < (1 << DEFAULT_SIGMA_LU_I))
+		*maxu = (1 << DEFAULT_SIGMA_LU_I);
+}
+
+static size_t echo_can_state_size(u32 tap_length)
+{
+	int maxy;
+	int maxu;
+
+	calc_cb_sizes(tap_length, &maxy, &maxu);
+
+	return L1_CACHE_ALIGN(sizeof(struct ec_pvt)) +	/* state */
+		sizeof(int) * tap_length +			/* a_i */
+		sizeof(short) * tap_length + 			/* a_s */
+		2 * sizeof(short) * (maxy) +			/* y_s */
+		2 * sizeof(short) * (1 << DEFAULT_ALPHA_ST_I) + /* s_s */
+		2 * sizeof(short) * (maxu) +			/* u_s */
+		2 * sizeof(short) * tap_length;			/* y_tilde_s */
 }
 
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
@@ -633,30 +670,13 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 {
 	int maxy;
 	int maxu;
-	size_t size;
 	unsigned int x;
 	char *c;
 	struct ec_pvt *pvt;
 
-	maxy = ecp->tap_length + DEFAULT_M;
-	maxu = DEFAULT_M;
-	if (maxy < (1 << DEFAULT_ALPHA_YT_I))
-		maxy = (1 << DEFAULT_ALPHA_YT_I);
-	if (maxy < (1 << DEFAULT_SIGMA_LY_I))
-		maxy = (1 << DEFAULT_SIGMA_LY_I);
-	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
-		maxu = (1 << DEFAULT_SIGMA_LU_I);
-
-	size = sizeof(*ec) +
-		4 + 						/* align */
-		sizeof(int) * ecp->tap_length +			/* a_i */
-		sizeof(short) * ecp->tap_length + 		/* a_s */
-		2 * sizeof(short) * (maxy) +			/* y_s */
-		2 * sizeof(short) * (1 << DEFAULT_ALPHA_ST_I) + /* s_s */
-		2 * sizeof(short) * (maxu) +			/* u_s */
-		2 * sizeof(short) * ecp->tap_length;		/* y_tilde_s */
+	calc_cb_sizes(ecp->tap_length, &maxy, &maxu);
 
-	pvt = kzalloc(size, GFP_KERNEL);
+	pvt = dahdi_echocan_state_alloc(&my_factory, ecp->tap_length);
 	if (!pvt)
 		return -ENOMEM;
 
@@ -672,7 +692,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			pvt->aggressive = p[x].value ? 1 : 0;
 		} else {
 			printk(KERN_WARNING "Unknown parameter supplied to KB1 echo canceler: '%s'\n", p[x].name);
-			kfree(pvt);
+			dahdi_echocan_state_free(&my_factory, ecp->tap_length, pvt);
 
 			return -EINVAL;
 		}
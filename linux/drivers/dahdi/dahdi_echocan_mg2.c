@@ -33,6 +33,7 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
 #include <linux/errno.h>
 #include <linux/module.h>
 #include <linux/init.h>
@@ -180,15 +181,19 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
+static size_t echo_can_state_size(u32 tap_length);
 
 static const struct dahdi_echocan_factory my_factory = {
 	.name = "MG2",
 	.owner = THIS_MODULE,
 	.echocan_create = echo_can_create,
+	.echocan_state_size = echo_can_state_size,
 };
 
 static const struct dahdi_echocan_features my_features = {
 	.NLP_toggle = 1,
+	.stats = 1,
+	.idle_bypass = 1,
 };
 
 static const struct dahdi_echocan_ops my_ops = {
@@ -308,14 +313,9 @@ static inline short get_cc_s(echo_can_cb_s *cb, int pos)
 static inline void init_cc(struct ec_pvt *pvt, int N, int maxy, int maxu)
 {
 	void *ptr = pvt;
-	unsigned long tmp;
 
-	/* Double-word align past end of state */
-	ptr += sizeof(*pvt);
-	tmp = (unsigned long)ptr;
-	tmp += 3;
-	tmp &= ~3L;
-	ptr = (void *)tmp;
+	/* Coefficients start on the first cacheline past the end of state */
+	ptr += L1_CACHE_ALIGN(sizeof(*pvt));
 
 	/* Reset parameters */
 	pvt->N_d = N;
@@ -383,7 +383,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 #if defined(DC_NORMALIZE) && defined(MEC2_DCBIAS_MESSAGE)
 	printk(KERN_INFO "EC: DC bias calculated: %d V\n", pvt->dc_estimate >> 15);
 #endif
-	kfree(pvt);
+	dahdi_echocan_state_free(&my_factory, pvt->N_d, pvt);
 }
 
 #ifdef DC_NORMALIZE
@@ -460,10 +460,12 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			rs = -32768;
 			pvt->HCNTR_d = DEFAULT_HANGT;
 			RESTORE_COEFFS;
+			pvt->dahdi.stats.resets++;
 		} else if (rs > 32767) {
 			rs = 32767;
 			pvt->HCNTR_d = DEFAULT_HANGT;
 			RESTORE_COEFFS;
+			pvt->dahdi.stats.resets++;
 		}
 
 		sign_error = ABS(rs) - ABS(isig);
@@ -472,6 +474,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 		{
 			rs = 0;
 			RESTORE_COEFFS;
+			pvt->dahdi.stats.resets++;
 		}
 
 		/* eq. (3): compute the output value (see figure 3) and the error
@@ -579,6 +582,8 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	if (((pvt->s_tilde_i >> (DEFAULT_ALPHA_ST_I - 1)) > pvt->max_y_tilde)
 	    && (pvt->max_y_tilde > 0))  {
 		/* Then start the Hangover counter */
+		if (!pvt->HCNTR_d)
+			pvt->dahdi.stats.doubletalk++;
 		pvt->HCNTR_d = DEFAULT_HANGT;
 		RESTORE_COEFFS;
 #ifdef MEC2_STATS_DETAILED
@@ -681,6 +686,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 #ifdef MEC2_STATS_DETAILED
 				printk(KERN_INFO "aggresively correcting frame with pvt->Ly_i %9d pvt->Lu_i %9d expression %d\n", pvt->Ly_i, pvt->Lu_i, (pvt->Ly_i/(pvt->Lu_i + 1)));
 #endif
+				pvt->dahdi.stats.nlp_samples++;
 #ifdef MEC2_STATS
 				++pvt->cntr_residualcorrected_frames;
 #endif
@@ -694,6 +700,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 #ifdef MEC2_STATS_DETAILED
 					printk(KERN_INFO "correcting frame with pvt->Ly_i %9d pvt->Lu_i %9d expression %d\n", pvt->Ly_i, pvt->Lu_i, (pvt->Ly_i/(pvt->Lu_i + 1)));
 #endif
+					pvt->dahdi.stats.nlp_samples++;
 #ifdef MEC2_STATS
 					++pvt->cntr_residualcorrected_frames;
 #endif
@@ -766,6 +773,41 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 		*isig++ = result;
 		++iref;
 	}
+
+	ec->stats.tx_level = pvt->Ly_i >> DEFAULT_SIGMA_LY_I;
+	ec->stats.rx_level = pvt->s_tilde_i >> DEFAULT_ALPHA_ST_I;
+	ec->stats.clean_level = pvt->Lu_i >> DEFAULT_SIGMA_LU_I;
+	ec->stats.samples += size;
+}
+
+static void calc_cb_sizes(u32 tap_length, int *maxy, int *maxu)
+{
+	*maxy = tap_length + DEFAULT_M;
+	*maxu = DEFAULT_M;
+	if (*maxy < (1 << DEFAULT_ALPHA_YT_I))
+		*maxy = (1 << DEFAULT_ALPHA_YT_I);
+	if (*maxy < (1 << DEFAULT_SIGMA_LY_I))
+		*maxy = (1 << DEFAULT_SIGMA_LY_I);
+	if (*maxu < (1 << DEFAULT_SIGMA_LU_I))
+		*maxu = (1 << DEFAULT_SIGMA_LU_I);
+}
+
+static size_t echo_can_state_size(u32 tap_length)
+{
+	int maxy;
+	int maxu;
+
+	calc_cb_sizes(tap_length, &maxy, &maxu);
+
+	return L1_CACHE_ALIGN(sizeof(struct ec_pvt)) +	/* state */
+		sizeof(int) * tap_length +			/* a_i */
+		sizeof(short) * tap_length + 			/* a_s */
+		sizeof(int) * tap_length +			/* b_i */
+		sizeof(int) * tap_length +			/* c_i */
+		2 * sizeof(short) * (maxy) +			/* y_s */
+		2 * sizeof(short) * (1 << DEFAULT_ALPHA_ST_I) + /* s_s */
+		2 * sizeof(short) * (maxu) +			/* u_s */
+		2 * sizeof(short) * tap_length;			/* y_tilde_s */
 }
 
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
@@ -773,31 +815,13 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 {
 	int maxy;
 	int maxu;
-	size_t size;
 	unsigned int x;
 	char *c;
 	struct ec_pvt *pvt;
 
-	maxy = ecp->tap_length + DEFAULT_M;
-	maxu = DEFAULT_M;
-	if (maxy < (1 << DEFAULT_ALPHA_YT_I))
-		maxy = (1 << DEFAULT_ALPHA_YT_I);
-	if (maxy < (1 << DEFAULT_SIGMA_LY_I))
-		maxy = (1 << DEFAULT_SIGMA_LY_I);
-	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
-		maxu = (1 << DEFAULT_SIGMA_LU_I);
-	size = sizeof(**ec) +
-		4 + 						/* align */
-		sizeof(int) * ecp->tap_length +			/* a_i */
-		sizeof(short) * ecp->tap_length + 		/* a_s */
-		sizeof(int) * ecp->tap_length +			/* b_i */
-		sizeof(int) * ecp->tap_length +			/* c_i */
-		2 * sizeof(short) * (maxy) +			/* y_s */
-		2 * sizeof(short) * (1 << DEFAULT_ALPHA_ST_I) + /* s_s */
-		2 * sizeof(short) * (maxu) +			/* u_s */
-		2 * sizeof(short) * ecp->tap_length;		/* y_tilde_s */
+	calc_cb_sizes(ecp->tap_length, &maxy, &maxu);
 
-	pvt = kzalloc(size, GFP_KERNEL);
+	pvt = dahdi_echocan_state_alloc(&my_factory, ecp->tap_length);
 	if (!pvt)
 		return -ENOMEM;
 
@@ -813,7 +837,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			pvt->aggressive = p[x].value ? 1 : 0;
 		} else {
 			printk(KERN_WARNING "Unknown parameter supplied to MG2 echo canceler: '%s'\n", p[x].name);
-			kfree(pvt);
+			dahdi_echocan_state_free(&my_factory, ecp->tap_length, pvt);
 
 			return -EINVAL;
 		}
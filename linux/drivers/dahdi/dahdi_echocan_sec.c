@@ -38,6 +38,7 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
 #include <linux/errno.h>
 #include <linux/module.h>
 #include <linux/init.h>
@@ -86,15 +87,19 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
+static size_t echo_can_state_size(u32 tap_length);
 
 static const struct dahdi_echocan_factory my_factory = {
 	.name = "SEC",
 	.owner = THIS_MODULE,
 	.echocan_create = echo_can_create,
+	.echocan_state_size = echo_can_state_size,
 };
 
 static const struct dahdi_echocan_features my_features = {
 	.NLP_toggle = 1,
+	.stats = 1,
+	.idle_bypass = 1,
 };
 
 static const struct dahdi_echocan_ops my_ops = {
@@ -137,20 +142,28 @@ struct ec_pvt {
 
 #define dahdi_to_pvt(a) container_of(a, struct ec_pvt, dahdi)
 
+static size_t echo_can_state_size(u32 tap_length)
+{
+	/* The state, followed by the FIR taps and the (doubled) tx history,
+	   each starting on a cacheline */
+	return L1_CACHE_ALIGN(sizeof(struct ec_pvt)) +
+		L1_CACHE_ALIGN(tap_length * sizeof(int32_t)) +
+		L1_CACHE_ALIGN(tap_length * sizeof(int16_t)) +
+		tap_length * 2 * sizeof(int16_t);
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
 	struct ec_pvt *pvt;
-	size_t size;
+	char *ptr;
 
 	if (ecp->param_count > 0) {
 		printk(KERN_WARNING "SEC does not support parameters; failing request\n");
 		return -EINVAL;
 	}
 
-	size = sizeof(*pvt) + ecp->tap_length * sizeof(int32_t) + ecp->tap_length * 3 * sizeof(int16_t);
-	
-	pvt = kzalloc(size, GFP_KERNEL);
+	pvt = dahdi_echocan_state_alloc(&my_factory, ecp->tap_length);
 	if (!pvt)
 		return -ENOMEM;
 
@@ -159,12 +172,12 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 
 	pvt->taps = ecp->tap_length;
 	pvt->tap_mask = ecp->tap_length - 1;
-	pvt->tx_history = (int16_t *) (pvt + sizeof(*pvt));
-	pvt->fir_taps = (int32_t *) (pvt + sizeof(*pvt) +
-				     ecp->tap_length * 2 * sizeof(int16_t));
-	pvt->fir_taps_short = (int16_t *) (pvt + sizeof(*pvt) +
-					   ecp->tap_length * sizeof(int32_t) +
-					   ecp->tap_length * 2 * sizeof(int16_t));
+	ptr = (char *) pvt + L1_CACHE_ALIGN(sizeof(*pvt));
+	pvt->fir_taps = (int32_t *) ptr;
+	ptr += L1_CACHE_ALIGN(ecp->tap_length * sizeof(int32_t));
+	pvt->fir_taps_short = (int16_t *) ptr;
+	ptr += L1_CACHE_ALIGN(ecp->tap_length * sizeof(int16_t));
+	pvt->tx_history = (int16_t *) ptr;
 	pvt->rx_power_threshold = 10000000;
 	pvt->use_suppressor = FALSE;
 	/* Non-linear processor - a fancy way to say "zap small signals, to avoid
@@ -179,7 +192,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 {
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
 
-	kfree(pvt);
+	dahdi_echocan_state_free(&my_factory, pvt->taps, pvt);
 }
 
 static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
@@ -253,6 +266,8 @@ static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
 				pvt->latest_correction = -3;
 			}
 		} else {
+			if (pvt->latest_correction != -2)
+				pvt->dahdi.stats.doubletalk++;
 			pvt->nonupdate_dwell = NONUPDATE_DWELL_TIME;
 			pvt->latest_correction = -2;
 		}
@@ -282,8 +297,10 @@ static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
 	}
 #endif
 
-	if (pvt->use_nlp && pvt->rx_power < 32)
+	if (pvt->use_nlp && pvt->rx_power < 32) {
 		clean_rx = 0;
+		pvt->dahdi.stats.nlp_samples++;
+	}
 
 	/* Roll around the rolling buffer */
 	pvt->curr_pos = (pvt->curr_pos - 1) & pvt->tap_mask;
@@ -302,6 +319,11 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 		*isig++ = result;
 		++iref;
 	}
+
+	ec->stats.tx_level = pvt->tx_power;
+	ec->stats.rx_level = pvt->rx_power;
+	ec->stats.clean_level = pvt->clean_rx_power;
+	ec->stats.samples += size;
 }
 
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val)
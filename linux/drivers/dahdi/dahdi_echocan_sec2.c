@@ -37,6 +37,7 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
 #include <linux/errno.h>
 #include <linux/module.h>
 #include <linux/init.h>
@@ -81,11 +82,18 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
+static size_t echo_can_state_size(u32 tap_length);
 
 static const struct dahdi_echocan_factory my_factory = {
 	.name = "SEC2",
 	.owner = THIS_MODULE,
 	.echocan_create = echo_can_create,
+	.echocan_state_size = echo_can_state_size,
+};
+
+static const struct dahdi_echocan_features my_features = {
+	.stats = 1,
+	.idle_bypass = 1,
 };
 
 static const struct dahdi_echocan_ops my_ops = {
@@ -127,37 +135,44 @@ struct ec_pvt {
 
 #define dahdi_to_pvt(a) container_of(a, struct ec_pvt, dahdi)
 
+static size_t echo_can_state_size(u32 tap_length)
+{
+	/* The state, followed by the 32-bit and 16-bit FIR taps and the FIR
+	   history, each starting on a cacheline */
+	return L1_CACHE_ALIGN(sizeof(struct ec_pvt)) +
+		L1_CACHE_ALIGN(tap_length * sizeof(int32_t)) +
+		L1_CACHE_ALIGN(tap_length * sizeof(int16_t)) +
+		tap_length * sizeof(int16_t);
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
 	struct ec_pvt *pvt;
-	size_t size;
+	char *ptr;
 
 	if (ecp->param_count > 0) {
 		printk(KERN_WARNING "SEC2 does not support parameters; failing request\n");
 		return -EINVAL;
 	}
 
-	size = sizeof(*pvt) + ecp->tap_length * sizeof(int32_t) + ecp->tap_length * 3 * sizeof(int16_t);
-	
-	pvt = kzalloc(size, GFP_KERNEL);
+	pvt = dahdi_echocan_state_alloc(&my_factory, ecp->tap_length);
 	if (!pvt)
 		return -ENOMEM;
 
 	pvt->dahdi.ops = &my_ops;
-
-	if (ecp->param_count > 0) {
-		printk(KERN_WARNING "SEC-2 echo canceler does not support parameters; failing request\n");
-		return -EINVAL;
-	}
+	pvt->dahdi.features = my_features;
 
 	pvt->taps = ecp->tap_length;
 	pvt->curr_pos = ecp->tap_length - 1;
 	pvt->tap_mask = ecp->tap_length - 1;
-	pvt->fir_taps32 = (int32_t *) (pvt + sizeof(*pvt));
-	pvt->fir_taps16 = (int16_t *) (pvt + sizeof(*pvt) + ecp->tap_length * sizeof(int32_t));
+	ptr = (char *) pvt + L1_CACHE_ALIGN(sizeof(*pvt));
+	pvt->fir_taps32 = (int32_t *) ptr;
+	ptr += L1_CACHE_ALIGN(ecp->tap_length * sizeof(int32_t));
+	pvt->fir_taps16 = (int16_t *) ptr;
+	ptr += L1_CACHE_ALIGN(ecp->tap_length * sizeof(int16_t));
 	/* Create FIR filter */
-	fir16_create(&pvt->fir_state, pvt->fir_taps16, pvt->taps);
+	fir16_init(&pvt->fir_state, pvt->fir_taps16, (int16_t *) ptr, pvt->taps);
 	pvt->rx_power_threshold = 10000000;
 	pvt->use_suppressor = FALSE;
 	/* Non-linear processor - a fancy way to say "zap small signals, to avoid
@@ -172,8 +187,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 {
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
 
-	fir16_free(&pvt->fir_state);
-	kfree(pvt);
+	dahdi_echocan_state_free(&my_factory, pvt->taps, pvt);
 }
 
 static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
@@ -253,6 +267,8 @@ static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
 				pvt->latest_correction = -1;
 			}
 		} else {
+			if (pvt->latest_correction != -2)
+				pvt->dahdi.stats.doubletalk++;
 			pvt->nonupdate_dwell = NONUPDATE_DWELL_TIME;
 			pvt->latest_correction = -2;
 		}
@@ -282,8 +298,10 @@ static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
 	}
 #endif
 
-	if (pvt->use_nlp  &&  pvt->rx_power < 32)
+	if (pvt->use_nlp  &&  pvt->rx_power < 32) {
 		clean_rx = 0;
+		pvt->dahdi.stats.nlp_samples++;
+	}
 
 	/* Roll around the rolling buffer */
 	if (pvt->curr_pos <= 0)
@@ -304,6 +322,11 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 		*isig++ = result;
 		++iref;
 	}
+
+	ec->stats.tx_level = pvt->tx_power;
+	ec->stats.rx_level = pvt->rx_power;
+	ec->stats.clean_level = pvt->clean_rx_power;
+	ec->stats.samples += size;
 }
 
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val)
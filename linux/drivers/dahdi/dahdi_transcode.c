@@ -34,32 +34,444 @@
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/page-flags.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/file.h>
 #include <asm/io.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+#include <linux/ktime.h>
+#endif
 
 #include <dahdi/kernel.h>
 
+/* Time how long it takes to allocate channels */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+#define ENABLE_ALLOC_STATS
+#endif
+
+/* Index of a channel in a free list head, and the end of the list */
+#define TC_FREE_NONE	0xffff
+
+/* The frames of a DAHDI_TC_SUBMIT or DAHDI_TC_COLLECT are copied in and
+ * handled this many at a time */
+#define TC_BATCH_CHUNK	64
+
 static int debug;
 /* The registration list contains transcoders in the order in which they were
  * registered. */
 static LIST_HEAD(registration_list);
-/* The active list is sorted by the most recently used transcoder is last. This
- * is used as a simplistic way to spread the load amongst the different hardware
- * transcoders in the system. */
+/* The active list holds the same transcoders, and is walked under RCU when
+ * allocating channels so that call setup does not need the translock. */
 static LIST_HEAD(active_list);
 static spinlock_t translock = SPIN_LOCK_UNLOCKED;
+/* Allocations which failed because every channel was busy */
+static atomic_t busy_count = ATOMIC_INIT(0);
+
+/* Counters for each pair of formats channels were asked for, in the order
+ * they were first asked for.  A channel keeps the index of its pair, or
+ * TC_NO_PAIR once the table is full.  The frame counters of the pairs are
+ * kept for each CPU, as they are for each transcoder. */
+#define TC_MAX_PAIRS	32
+#define TC_NO_PAIR	0xff
+struct tc_pair {
+	u32 srcfmt;
+	u32 dstfmt;
+	struct dahdi_tc_counters counters;
+};
+static struct tc_pair tc_pairs[TC_MAX_PAIRS];
+static int tc_npairs;
+static spinlock_t pairs_lock = SPIN_LOCK_UNLOCKED;
+struct tc_pair_frames {
+	struct dahdi_tc_counters pair[TC_MAX_PAIRS];
+};
+static DEFINE_PER_CPU(struct tc_pair_frames, tc_pair_frames);
 
 EXPORT_SYMBOL(dahdi_transcoder_register);
 EXPORT_SYMBOL(dahdi_transcoder_unregister);
 EXPORT_SYMBOL(dahdi_transcoder_alert);
 EXPORT_SYMBOL(dahdi_transcoder_alloc);
 EXPORT_SYMBOL(dahdi_transcoder_free);
+EXPORT_SYMBOL(dahdi_transcoder_dropped);
+
+/*
+ * Free channel lists.  These are stacks of channel indexes which are pushed
+ * and popped with atomic_cmpxchg(), so that allocating and releasing
+ * channels takes no locks.  Every update of a head also bumps the count
+ * in its upper bits, so a pop which read the next index of a channel that
+ * was taken and put back meanwhile fails its cmpxchg and tries again.
+ */
+static inline int tc_free_head(int old, int index)
+{
+	return (int)(((unsigned int)old + 0x10000) & ~0xffffU) | index;
+}
+
+static struct dahdi_transcoder_channel *
+tc_pop(struct dahdi_transcoder *tc, atomic_t *head)
+{
+	int old, index;
+
+	do {
+		old = atomic_read(head);
+		index = old & TC_FREE_NONE;
+		if (TC_FREE_NONE == index)
+			return NULL;
+	} while (atomic_cmpxchg(head, old,
+		 tc_free_head(old, tc->channels[index].next_free)) != old);
+
+	return &tc->channels[index];
+}
+
+static void tc_push(struct dahdi_transcoder *tc, atomic_t *head,
+		    struct dahdi_transcoder_channel *chan)
+{
+	int index = chan - tc->channels;
+	int old;
+
+	do {
+		old = atomic_read(head);
+		chan->next_free = old & TC_FREE_NONE;
+	} while (atomic_cmpxchg(head, old, tc_free_head(old, index)) != old);
+}
+
+/* Returns the free list for channels built for fmts, claiming an unused one
+ * if create is set, or NULL if there is none. */
+static struct dahdi_tc_freelist *
+tc_built_list(struct dahdi_transcoder *tc, u32 fmts, int create)
+{
+	struct dahdi_tc_freelist *fl;
+	int x;
+
+	for (x = 0; x < DAHDI_TC_FREELISTS; x++) {
+		fl = &tc->built[x];
+		if ((u32)atomic_read(&fl->fmts) == fmts)
+			return fl;
+		if (atomic_read(&fl->fmts))
+			continue;
+		/* Lists are claimed in order, so fmts has none. */
+		if (!create)
+			return NULL;
+		if (!atomic_cmpxchg(&fl->fmts, 0, (int)fmts) ||
+		    ((u32)atomic_read(&fl->fmts) == fmts))
+			return fl;
+	}
+	return NULL;
+}
+
+/* Put a channel which is not busy on the free list for its current state. */
+static void tc_put_free(struct dahdi_transcoder *tc,
+			struct dahdi_transcoder_channel *chan)
+{
+	struct dahdi_tc_freelist *fl = NULL;
+
+	if (dahdi_tc_is_built(chan))
+		fl = tc_built_list(tc, chan->built_fmts, 1);
+	/* When all the lists are taken it goes with the unbuilt channels,
+	 * which are checked when they are popped anyway. */
+	tc_push(tc, fl ? &fl->head : &tc->unbuilt, chan);
+}
+
+/*
+ * Frame counters.  A frame is counted in when it is written and out when a
+ * transcoded frame is read, whichever way the channel is driven, and the
+ * time between them goes into the turnaround histogram.  Channels do not
+ * reorder frames, so the write times are kept in a small ring on each
+ * channel.  That only holds while each frame written gives one frame to
+ * read, so the ring is emptied when that is seen not to hold: when it
+ * overflows, when a frame is read with no time left in it, and when the
+ * driver drops a frame.  The frames still in flight then are read without
+ * a time.
+ */
+static inline u32 tc_now_us(void)
+{
+#ifdef ENABLE_ALLOC_STATS
+	u64 ns = ktime_to_ns(ktime_get());
+	do_div(ns, 1000);
+	return (u32)ns;
+#else
+	return jiffies_to_usecs(jiffies);
+#endif
+}
+
+/* Four buckets for each power of two, with the times below four
+ * microseconds getting a bucket each. */
+static int tc_bucket(u32 us)
+{
+	int msb;
+	int bucket;
+
+	if (us < 4)
+		return us;
+	msb = fls(us) - 1;
+	bucket = 4 + ((msb - 2) << 2) + ((us >> (msb - 2)) & 3);
+	return min(bucket, DAHDI_TC_TURNAROUND_BUCKETS - 1);
+}
+
+/* The largest time which falls in the bucket */
+static u32 tc_bucket_top(int bucket)
+{
+	int msb;
+
+	if (bucket < 3)
+		return bucket;
+	++bucket;
+	msb = ((bucket - 4) >> 2) + 2;
+	return ((u32)(4 + ((bucket - 4) & 3)) << (msb - 2)) - 1;
+}
+
+/* Counts on the counters of this CPU.  The frames of a channel are counted
+ * with its stamp_lock held and interrupts off, since drivers may drop them
+ * from their interrupt handlers. */
+static void tc_count_in(struct dahdi_tc_counters *c, u16 inflight)
+{
+	c->frames_in++;
+	c->inflight++;
+	if (inflight > c->inflight_max)
+		c->inflight_max = inflight;
+}
+
+static void tc_count_out(struct dahdi_tc_counters *c, u16 inflight,
+			 int stamped, u32 us)
+{
+	c->frames_out++;
+	if (inflight)
+		c->inflight--;
+	if (!stamped)
+		return;
+	c->turnaround[tc_bucket(us)]++;
+	if (us > c->turnaround_max)
+		c->turnaround_max = us;
+}
+
+static inline struct dahdi_tc_counters *
+tc_pair_frames_here(const struct dahdi_transcoder_channel *chan)
+{
+	return &per_cpu(tc_pair_frames, smp_processor_id()).pair[chan->pair];
+}
+
+/* Empties the ring of write times.  Called with the stamp_lock held. */
+static void tc_flush_stamps(struct dahdi_transcoder_channel *chan)
+{
+	chan->stamp_tail = chan->stamp_head;
+	chan->unstamped = chan->inflight;
+}
+
+static void tc_frame_in(struct dahdi_transcoder_channel *chan)
+{
+	struct dahdi_transcoder *tc = chan->parent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->stamp_lock, flags);
+	if ((u8)(chan->stamp_head - chan->stamp_tail) >= DAHDI_TC_STAMPS)
+		tc_flush_stamps(chan);
+	chan->stamps[chan->stamp_head++ % DAHDI_TC_STAMPS] = tc_now_us();
+	chan->inflight++;
+	tc_count_in(per_cpu_ptr(tc->frames, smp_processor_id()),
+		    chan->inflight);
+	if (TC_NO_PAIR != chan->pair)
+		tc_count_in(tc_pair_frames_here(chan), chan->inflight);
+	spin_unlock_irqrestore(&chan->stamp_lock, flags);
+}
+
+static void tc_frame_out(struct dahdi_transcoder_channel *chan)
+{
+	struct dahdi_transcoder *tc = chan->parent;
+	unsigned long flags;
+	int stamped = 0;
+	u32 us = 0;
+
+	spin_lock_irqsave(&chan->stamp_lock, flags);
+	if (chan->unstamped) {
+		/* Written before the ring was last emptied */
+		chan->unstamped--;
+	} else if (chan->stamp_head != chan->stamp_tail) {
+		us = tc_now_us() -
+			chan->stamps[chan->stamp_tail++ % DAHDI_TC_STAMPS];
+		stamped = 1;
+	} else {
+		/* More frames read than written; start over. */
+		tc_flush_stamps(chan);
+	}
+	tc_count_out(per_cpu_ptr(tc->frames, smp_processor_id()),
+		     chan->inflight, stamped, us);
+	if (TC_NO_PAIR != chan->pair)
+		tc_count_out(tc_pair_frames_here(chan), chan->inflight,
+			     stamped, us);
+	if (chan->inflight)
+		chan->inflight--;
+	spin_unlock_irqrestore(&chan->stamp_lock, flags);
+}
+
+void dahdi_transcoder_dropped(struct dahdi_transcoder_channel *chan)
+{
+	struct dahdi_transcoder *tc = chan->parent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->stamp_lock, flags);
+	if (chan->inflight) {
+		chan->inflight--;
+		per_cpu_ptr(tc->frames, smp_processor_id())->inflight--;
+		if (TC_NO_PAIR != chan->pair)
+			tc_pair_frames_here(chan)->inflight--;
+	}
+	tc_flush_stamps(chan);
+	spin_unlock_irqrestore(&chan->stamp_lock, flags);
+}
+
+/* Returns the index of the counters for the pair of formats, adding them if
+ * there is room. */
+static u8 tc_pair_index(u32 srcfmt, u32 dstfmt)
+{
+	int x;
+
+	spin_lock(&pairs_lock);
+	for (x = 0; x < tc_npairs; x++) {
+		if ((tc_pairs[x].srcfmt == srcfmt) &&
+		    (tc_pairs[x].dstfmt == dstfmt))
+			break;
+	}
+	if ((x == tc_npairs) && (tc_npairs < TC_MAX_PAIRS)) {
+		tc_pairs[x].srcfmt = srcfmt;
+		tc_pairs[x].dstfmt = dstfmt;
+		tc_npairs++;
+	}
+	spin_unlock(&pairs_lock);
+	return (x < TC_MAX_PAIRS) ? x : TC_NO_PAIR;
+}
+
+static void tc_count_alloc(struct dahdi_transcoder_channel *chan)
+{
+	struct dahdi_transcoder *tc = chan->parent;
+	u8 pair = tc_pair_index(chan->srcfmt, chan->dstfmt);
+
+	unsigned long flags;
+
+	spin_lock(&tc->stats_lock);
+	tc->counters.allocs++;
+	spin_unlock(&tc->stats_lock);
+
+	spin_lock_irqsave(&chan->stamp_lock, flags);
+	chan->pair = pair;
+	chan->stamp_head = chan->stamp_tail = 0;
+	chan->inflight = 0;
+	chan->unstamped = 0;
+	spin_unlock_irqrestore(&chan->stamp_lock, flags);
+
+	if (TC_NO_PAIR != pair) {
+		spin_lock(&pairs_lock);
+		tc_pairs[pair].counters.allocs++;
+		spin_unlock(&pairs_lock);
+	}
+}
+
+static void tc_count_busy(struct dahdi_transcoder *tc)
+{
+	spin_lock(&tc->stats_lock);
+	tc->counters.busy++;
+	spin_unlock(&tc->stats_lock);
+}
+
+/* Frames still in flight on a channel being released will never be read. */
+static void tc_count_release(struct dahdi_transcoder_channel *chan)
+{
+	struct dahdi_transcoder *tc = chan->parent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->stamp_lock, flags);
+	per_cpu_ptr(tc->frames, smp_processor_id())->inflight -= chan->inflight;
+	if (TC_NO_PAIR != chan->pair)
+		tc_pair_frames_here(chan)->inflight -= chan->inflight;
+	chan->inflight = 0;
+	chan->pair = TC_NO_PAIR;
+	spin_unlock_irqrestore(&chan->stamp_lock, flags);
+}
+
+/* Returns the top of the bucket which the given share of the turnaround
+ * times, in parts per hundred, fall at or below. */
+static u32 tc_percentile(const struct dahdi_tc_counters *c, int percent)
+{
+	u64 total = 0;
+	u64 want, seen = 0;
+	int x;
+
+	for (x = 0; x < DAHDI_TC_TURNAROUND_BUCKETS; x++)
+		total += c->turnaround[x];
+	if (!total)
+		return 0;
+	want = total * percent + 99;
+	do_div(want, 100);
+	for (x = 0; x < DAHDI_TC_TURNAROUND_BUCKETS; x++) {
+		seen += c->turnaround[x];
+		if (seen >= want)
+			break;
+	}
+	return min(tc_bucket_top(x), c->turnaround_max);
+}
+
+/* Adds the frame counters of one CPU into sum. */
+static void tc_add_frames(struct dahdi_tc_counters *sum,
+			  const struct dahdi_tc_counters *c)
+{
+	int x;
+
+	sum->frames_in += c->frames_in;
+	sum->frames_out += c->frames_out;
+	sum->inflight += c->inflight;
+	sum->inflight_max = max(sum->inflight_max, c->inflight_max);
+	sum->turnaround_max = max(sum->turnaround_max, c->turnaround_max);
+	for (x = 0; x < DAHDI_TC_TURNAROUND_BUCKETS; x++)
+		sum->turnaround[x] += c->turnaround[x];
+}
+
+/* Called with the stats_lock of the transcoder held. */
+static void tc_sum_counters(struct dahdi_tc_counters *sum,
+			    const struct dahdi_transcoder *tc)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	sum->allocs = tc->counters.allocs;
+	sum->busy = tc->counters.busy;
+	for_each_possible_cpu(cpu)
+		tc_add_frames(sum, per_cpu_ptr(tc->frames, cpu));
+}
+
+/* Called with the pairs_lock held. */
+static void tc_sum_pair_counters(struct dahdi_tc_counters *sum, int pair)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	sum->allocs = tc_pairs[pair].counters.allocs;
+	sum->busy = tc_pairs[pair].counters.busy;
+	for_each_possible_cpu(cpu)
+		tc_add_frames(sum, &per_cpu(tc_pair_frames, cpu).pair[pair]);
+}
+
+static void tc_fill_counters(struct dahdi_transcoder_counters *out,
+			     const struct dahdi_tc_counters *c)
+{
+	memset(out, 0, sizeof(*out));
+	out->allocs = c->allocs;
+	out->busy = c->busy;
+	out->frames_in = c->frames_in;
+	out->frames_out = c->frames_out;
+	out->inflight = c->inflight;
+	out->inflight_max = c->inflight_max;
+	out->turnaround_p50 = tc_percentile(c, 50);
+	out->turnaround_p99 = tc_percentile(c, 99);
+	out->turnaround_max = c->turnaround_max;
+}
 
 struct dahdi_transcoder *dahdi_transcoder_alloc(int numchans)
 {
 	struct dahdi_transcoder *tc;
-	unsigned int x;
+	int x;
 	size_t size = sizeof(*tc) + (sizeof(tc->channels[0]) * numchans);
 
+	if ((numchans <= 0) || (numchans >= TC_FREE_NONE))
+		return NULL;
+
 	if (!(tc = kmalloc(size, GFP_KERNEL)))
 		return NULL;
 
@@ -71,8 +483,26 @@ struct dahdi_transcoder *dahdi_transcoder_alloc(int numchans)
 	for (x=0; x < tc->numchannels; x++) {
 		init_waitqueue_head(&tc->channels[x].ready);
 		tc->channels[x].parent = tc;
+		tc->channels[x].pair = TC_NO_PAIR;
+		spin_lock_init(&tc->channels[x].stamp_lock);
+	}
+	tc->frames = alloc_percpu(struct dahdi_tc_counters);
+	if (!tc->frames) {
+		kfree(tc);
+		return NULL;
 	}
 
+	atomic_set(&tc->inuse, 0);
+	atomic_set(&tc->unbuilt, TC_FREE_NONE);
+	for (x = 0; x < DAHDI_TC_FREELISTS; x++) {
+		atomic_set(&tc->built[x].fmts, 0);
+		atomic_set(&tc->built[x].head, TC_FREE_NONE);
+	}
+	/* Pushed from the top, so the lowest channels are handed out first */
+	for (x = tc->numchannels - 1; x >= 0; x--)
+		tc_push(tc, &tc->unbuilt, &tc->channels[x]);
+	spin_lock_init(&tc->stats_lock);
+
 	WARN_ON(!dahdi_transcode_fops);
 	/* Individual transcoders should supply their own file_operations for
 	 * write and read.  But they will by default use the file_operations
@@ -83,6 +513,8 @@ struct dahdi_transcoder *dahdi_transcoder_alloc(int numchans)
 
 void dahdi_transcoder_free(struct dahdi_transcoder *tc)
 {
+	if (tc)
+		free_percpu(tc->frames);
 	kfree(tc);
 }
 
@@ -97,13 +529,47 @@ static int is_on_list(struct list_head *entry, struct list_head *head)
 	return 0;
 }
 
+static ssize_t dahdi_tc_counted_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct dahdi_transcoder_channel *chan = file->private_data;
+	ssize_t res = chan->parent->driver_read(file, buf, count, ppos);
+
+	if (res > 0)
+		tc_frame_out(chan);
+	return res;
+}
+
+static ssize_t dahdi_tc_counted_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct dahdi_transcoder_channel *chan = file->private_data;
+	ssize_t res = chan->parent->driver_write(file, buf, count, ppos);
+
+	if (res > 0)
+		tc_frame_in(chan);
+	return res;
+}
+
 /* Register a transcoder */
 int dahdi_transcoder_register(struct dahdi_transcoder *tc)
 {
+	/* Frames read and written on the channels are counted on the way
+	 * through to the driver. */
+	if (tc->fops.read != dahdi_tc_counted_read) {
+		tc->driver_read = tc->fops.read;
+		tc->fops.read = dahdi_tc_counted_read;
+	}
+	if (tc->fops.write != dahdi_tc_counted_write) {
+		tc->driver_write = tc->fops.write;
+		tc->fops.write = dahdi_tc_counted_write;
+	}
+
 	spin_lock(&translock);
 	BUG_ON(is_on_list(&tc->registration_list_node, &registration_list));
 	list_add_tail(&tc->registration_list_node, &registration_list);
-	list_add_tail(&tc->active_list_node, &active_list);
+	list_add_tail_rcu(&tc->active_list_node, &active_list);
 	spin_unlock(&translock);
 
 	printk(KERN_INFO "%s: Registered codec translator '%s' " \
@@ -130,8 +596,11 @@ int dahdi_transcoder_unregister(struct dahdi_transcoder *tc)
 		return -EINVAL;
 	}
 	list_del_init(&tc->registration_list_node);
-	list_del_init(&tc->active_list_node);
+	list_del_rcu(&tc->active_list_node);
 	spin_unlock(&translock);
+	/* Wait for any allocation still looking at it */
+	synchronize_rcu();
+	INIT_LIST_HEAD(&tc->active_list_node);
 
 	printk(KERN_INFO "Unregistered codec translator '%s' with %d " \
 	       "transcoders (srcs=%08x, dsts=%08x)\n", 
@@ -166,10 +635,14 @@ static int dahdi_tc_open(struct inode *inode, struct file *file)
 static void dtc_release(struct dahdi_transcoder_channel *chan)
 {
 	BUG_ON(!chan);
-	if (chan->parent && chan->parent->release) {
+	BUG_ON(!chan->parent);
+	if (chan->parent->release) {
 		chan->parent->release(chan);
 	}
+	tc_count_release(chan);
 	dahdi_tc_clear_busy(chan);
+	atomic_dec(&chan->parent->inuse);
+	tc_put_free(chan->parent, chan);
 }
 
 static int dahdi_tc_release(struct inode *inode, struct file *file)
@@ -184,40 +657,87 @@ static int dahdi_tc_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/* Pop channels off the list until one can be used for fmts, which is one
+ * that is not built or is built for fmts.  Any others are chained on
+ * rejects to be put back later. */
+static struct dahdi_transcoder_channel *
+tc_pop_usable(struct dahdi_transcoder *tc, atomic_t *head, u32 fmts,
+	      int *rejects)
+{
+	struct dahdi_transcoder_channel *chan;
+
+	while ((chan = tc_pop(tc, head))) {
+		if (!dahdi_tc_is_built(chan) || (fmts == chan->built_fmts))
+			return chan;
+		chan->next_free = *rejects;
+		*rejects = chan - tc->channels;
+	}
+	return NULL;
+}
+
 /* Find a free channel on the transcoder and mark it busy. */
-static inline struct dahdi_transcoder_channel *
+static struct dahdi_transcoder_channel *
 get_free_channel(struct dahdi_transcoder *tc,
 	const struct dahdi_transcoder_formats *fmts)
 {
-	struct dahdi_transcoder_channel *chan;
-	int i;
-	/* Should be called with the translock held. */
-#ifdef CONFIG_SMP
-	WARN_ON(!spin_is_locked(&translock));
-#endif
-
-	for (i = 0; i < tc->numchannels; i++) {
-		chan = &tc->channels[i];
-		if (!dahdi_tc_is_busy(chan)) {
-			if (!dahdi_tc_is_built(chan)) {
-				dahdi_tc_set_busy(chan);
-				return chan;
-			} else {
-				/* If the channel is already built, we must
-				 * make sure that it can support the formats
-				 * that we're interested in. */
-				if ((fmts->srcfmt|fmts->dstfmt) == chan->built_fmts) {
-					dahdi_tc_set_busy(chan);
-					return chan;
-				}
-			}
+	u32 want = fmts->srcfmt | fmts->dstfmt;
+	struct dahdi_tc_freelist *fl = tc_built_list(tc, want, 0);
+	struct dahdi_transcoder_channel *chan = NULL;
+	struct dahdi_transcoder_channel *reject;
+	int rejects = TC_FREE_NONE;
+	int x;
+
+	/* Channels already built for these formats first, then those which
+	 * are not built at all.  Channels are built and torn down in pairs
+	 * by some hardware, so last look at those which were built for other
+	 * formats when they were freed, since they may have been torn down
+	 * since. */
+	if (fl)
+		chan = tc_pop_usable(tc, &fl->head, want, &rejects);
+	if (!chan)
+		chan = tc_pop_usable(tc, &tc->unbuilt, want, &rejects);
+	for (x = 0; !chan && (x < DAHDI_TC_FREELISTS); x++) {
+		if (&tc->built[x] != fl) {
+			chan = tc_pop_usable(tc, &tc->built[x].head, want,
+					     &rejects);
 		}
 	}
-	return NULL;
+
+	while (TC_FREE_NONE != rejects) {
+		reject = &tc->channels[rejects];
+		rejects = reject->next_free;
+		tc_put_free(tc, reject);
+	}
+
+	if (chan) {
+		dahdi_tc_set_busy(chan);
+		atomic_inc(&tc->inuse);
+	}
+	return chan;
+}
+
+static inline int tc_supports(const struct dahdi_transcoder *tc,
+			      const struct dahdi_transcoder_formats *fmts)
+{
+	return (tc->dstfmts & fmts->dstfmt) && (tc->srcfmts & fmts->srcfmt);
+}
+
+/* Returns true if a should be tried before b: it has a higher priority, or
+ * the same priority and a smaller share of its channels in use. */
+static inline int tc_better(struct dahdi_transcoder *a,
+			    struct dahdi_transcoder *b)
+{
+	if (a->priority != b->priority)
+		return a->priority > b->priority;
+	return (atomic_read(&a->inuse) * b->numchannels) <
+		(atomic_read(&b->inuse) * a->numchannels);
 }
 
 /* Search the list for a transcoder that supports the specified format, and
- * allocate and return an available channel on it.   
+ * allocate and return an available channel on it.  The least loaded of the
+ * transcoders with the highest priority which support the formats is tried
+ * first, in order to spread the load among the hardware in the system while
+ * keeping software transcoders for when it is full.
  *
  * Returns either a pointer to the allocated channel, -EBUSY if the format is
  * supported but all the channels are busy, or -ENODEV if there are not any
@@ -227,42 +747,113 @@ static struct dahdi_transcoder_channel *
 __find_free_channel(struct list_head *list, const struct dahdi_transcoder_formats *fmts)
 {
 	struct dahdi_transcoder *tc;
+	struct dahdi_transcoder *best = NULL;
 	struct dahdi_transcoder_channel *chan = NULL;
-	unsigned int match = 0;
-
-	list_for_each_entry(tc, list, active_list_node) {
-		if ((tc->dstfmts & fmts->dstfmt) && (tc->srcfmts & fmts->srcfmt)) {
-			/* We found a transcoder that can handle our formats.
-			 * Now look for an available channel. */
-			match = 1; 
-			if ((chan = get_free_channel(tc, fmts))) {
-				/* transcoder tc has a free channel.  In order
-				 * to spread the load among available
-				 * transcoders (when there are more than one
-				 * transcoder in the system) we'll move tc 
-				 * to the end of the list. */
-				list_move_tail(&tc->active_list_node, list);
-				return chan;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tc, list, active_list_node) {
+		if (tc_supports(tc, fmts)) {
+			if (!best || tc_better(tc, best))
+				best = tc;
+		}
+	}
+	if (best)
+		chan = get_free_channel(best, fmts);
+	if (best && !chan) {
+		/* It may have nothing free which suits these formats.  Try the
+		 * others of its priority, then each lower priority in turn. */
+		int level = best->priority;
+		int next, found;
+
+		for (;;) {
+			list_for_each_entry_rcu(tc, list, active_list_node) {
+				if ((tc != best) && (tc->priority == level) &&
+				    tc_supports(tc, fmts)) {
+					if ((chan = get_free_channel(tc, fmts)))
+						break;
+				}
 			}
+			if (chan)
+				break;
+			found = 0;
+			next = level;
+			list_for_each_entry_rcu(tc, list, active_list_node) {
+				if (tc_supports(tc, fmts) &&
+				    (tc->priority < level) &&
+				    (!found || (tc->priority > next))) {
+					next = tc->priority;
+					found = 1;
+				}
+			}
+			if (!found)
+				break;
+			level = next;
+		}
+	}
+	if (best && !chan) {
+		/* Every transcoder which could have done it was full. */
+		list_for_each_entry_rcu(tc, list, active_list_node) {
+			if (tc_supports(tc, fmts))
+				tc_count_busy(tc);
 		}
 	}
-	return (void*)((long)((match) ? -EBUSY : -ENODEV));
+	rcu_read_unlock();
+
+	if (chan)
+		return chan;
+	return (void*)((long)((best) ? -EBUSY : -ENODEV));
 }
 
+#ifdef ENABLE_ALLOC_STATS
+static void tc_alloc_stats(struct dahdi_transcoder *tc, ktime_t start,
+			   ktime_t found)
+{
+	s64 find_ns = ktime_to_ns(ktime_sub(found, start));
+	s64 alloc_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&tc->stats_lock);
+	tc->find_ns += find_ns;
+	if (find_ns > tc->find_max_ns)
+		tc->find_max_ns = find_ns;
+	tc->alloc_ns += alloc_ns;
+	if (alloc_ns > tc->alloc_max_ns)
+		tc->alloc_max_ns = alloc_ns;
+	spin_unlock(&tc->stats_lock);
+}
+#endif
+
 static long dahdi_tc_allocate(struct file *file, unsigned long data)
 {
 	struct dahdi_transcoder_channel *chan = NULL;
 	struct dahdi_transcoder_formats fmts;
+	long res;
+#ifdef ENABLE_ALLOC_STATS
+	ktime_t start, found;
+#endif
 	
 	if (copy_from_user(&fmts, (__user const void *) data, sizeof(fmts))) {
 		return -EFAULT;
 	}
 
-	spin_lock(&translock);
+#ifdef ENABLE_ALLOC_STATS
+	start = ktime_get();
+#endif
 	chan = __find_free_channel(&active_list, &fmts);
-	spin_unlock(&translock);
+#ifdef ENABLE_ALLOC_STATS
+	found = ktime_get();
+#endif
 
 	if (IS_ERR(chan)) {
+		if (-EBUSY == PTR_ERR(chan)) {
+			u8 pair = tc_pair_index(fmts.srcfmt, fmts.dstfmt);
+
+			atomic_inc(&busy_count);
+			if (TC_NO_PAIR != pair) {
+				spin_lock(&pairs_lock);
+				tc_pairs[pair].counters.busy++;
+				spin_unlock(&pairs_lock);
+			}
+		}
 		return PTR_ERR(chan);
 	}
 
@@ -298,10 +889,17 @@ static long dahdi_tc_allocate(struct file *file, unsigned long data)
 	}
 
 	/* Actually reset the transcoder channel */
-	if (chan->parent->allocate)
-		return chan->parent->allocate(chan);
+	if (!chan->parent->allocate)
+		return -EINVAL;
 
-	return -EINVAL;
+	res = chan->parent->allocate(chan);
+	if (!res)
+		tc_count_alloc(chan);
+#ifdef ENABLE_ALLOC_STATS
+	if (!res)
+		tc_alloc_stats(chan->parent, start, found);
+#endif
+	return res;
 }
 
 static long dahdi_tc_getinfo(unsigned long data)
@@ -336,6 +934,67 @@ static long dahdi_tc_getinfo(unsigned long data)
 	return copy_to_user((__user void *) data, &info, sizeof(info)) ? -EFAULT : 0;
 }
 
+static long dahdi_tc_getstats(unsigned long data)
+{
+	struct dahdi_transcoder_stats stats;
+	struct dahdi_tc_counters sum;
+	struct dahdi_transcoder *tc;
+	unsigned int count = 0;
+	long res = -ENOSYS;
+
+	if (copy_from_user(&stats, (__user const void *) data, sizeof(stats)))
+		return -EFAULT;
+
+	spin_lock(&translock);
+	list_for_each_entry(tc, &registration_list, registration_list_node) {
+		if (stats.tcnum != count++)
+			continue;
+		memset(&stats, 0, sizeof(stats));
+		stats.tcnum = count - 1;
+		stats.numchannels = tc->numchannels;
+		stats.inuse = atomic_read(&tc->inuse);
+		spin_lock(&tc->stats_lock);
+		tc_sum_counters(&sum, tc);
+		spin_unlock(&tc->stats_lock);
+		tc_fill_counters(&stats.counters, &sum);
+		if (tc->get_stats)
+			tc->get_stats(tc, &stats);
+		res = 0;
+		break;
+	}
+	spin_unlock(&translock);
+
+	if (res)
+		return res;
+	return copy_to_user((__user void *) data, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+static long dahdi_tc_getpairstats(unsigned long data)
+{
+	struct dahdi_transcoder_pair_stats stats;
+	struct dahdi_tc_counters sum;
+	unsigned int index;
+
+	if (copy_from_user(&stats, (__user const void *) data, sizeof(stats)))
+		return -EFAULT;
+
+	index = stats.index;
+	spin_lock(&pairs_lock);
+	if (index >= tc_npairs) {
+		spin_unlock(&pairs_lock);
+		return -ENOSYS;
+	}
+	memset(&stats, 0, sizeof(stats));
+	stats.index = index;
+	stats.srcfmt = tc_pairs[index].srcfmt;
+	stats.dstfmt = tc_pairs[index].dstfmt;
+	tc_sum_pair_counters(&sum, index);
+	spin_unlock(&pairs_lock);
+	tc_fill_counters(&stats.counters, &sum);
+
+	return copy_to_user((__user void *) data, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
 static ssize_t dahdi_tc_write(struct file *file, __user const char *usrbuf, size_t count, loff_t *ppos)
 {
 	if (file->private_data) {
@@ -366,6 +1025,180 @@ static ssize_t dahdi_tc_read(struct file *file, __user char *usrbuf, size_t coun
 	}
 }
 
+/* Returns the channel allocated on file, or NULL if file is not a
+ * transcoder with a channel. */
+static struct dahdi_transcoder_channel *tc_file_channel(struct file *file)
+{
+	if (!file->f_op || (file->f_op->open != dahdi_tc_open))
+		return NULL;
+	return file->private_data;
+}
+
+static void tc_submit(struct file **files,
+		      struct dahdi_transcoder_frame *frames, int count)
+{
+	struct dahdi_transcoder *tc;
+	struct file *f;
+	int x, y, z;
+
+	for (x = 0; x < count; x = y) {
+		y = x + 1;
+		if (!files[x])
+			continue;
+		tc = tc_file_channel(files[x])->parent;
+		if (tc->write_batch) {
+			/* Hand the driver the whole run of frames which it
+			 * can take together. */
+			while ((y < count) && files[y] &&
+			       (tc_file_channel(files[y])->parent->write_batch ==
+				tc->write_batch))
+				y++;
+			tc->write_batch(files + x, frames + x, y - x);
+			for (z = x; z < y; z++) {
+				if (frames[z].status > 0)
+					tc_frame_in(tc_file_channel(files[z]));
+			}
+			continue;
+		}
+		f = files[x];
+		frames[x].status = f->f_op->write(f,
+			(__user const char *)(unsigned long)frames[x].buf,
+			frames[x].len, &f->f_pos);
+	}
+}
+
+static void tc_collect(struct file **files,
+		       struct dahdi_transcoder_frame *frames, int count)
+{
+	struct file *f;
+	int x;
+
+	for (x = 0; x < count; x++) {
+		f = files[x];
+		if (!f)
+			continue;
+		if (!dahdi_tc_is_data_waiting(tc_file_channel(f))) {
+			frames[x].status = -EAGAIN;
+			continue;
+		}
+		frames[x].status = f->f_op->read(f,
+			(__user char *)(unsigned long)frames[x].buf,
+			frames[x].len, &f->f_pos);
+	}
+}
+
+/* DAHDI_TC_SUBMIT and DAHDI_TC_COLLECT */
+static long dahdi_tc_batch(unsigned long data, int submit)
+{
+	struct dahdi_transcoder_batch batch;
+	struct dahdi_transcoder_frame *frames;
+	struct dahdi_transcoder_frame __user *uframes;
+	struct file **files;
+	unsigned int offset, n, x;
+	long res = 0;
+
+	if (copy_from_user(&batch, (__user const void *) data, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count > DAHDI_TC_MAX_BATCH)
+		return -EINVAL;
+	uframes = (struct dahdi_transcoder_frame __user *)
+		(unsigned long)batch.frames;
+
+	frames = kmalloc(TC_BATCH_CHUNK * (sizeof(*frames) + sizeof(*files)),
+			 GFP_KERNEL);
+	if (!frames)
+		return -ENOMEM;
+	files = (struct file **)(frames + TC_BATCH_CHUNK);
+
+	batch.done = 0;
+	for (offset = 0; offset < batch.count; offset += n) {
+		n = min_t(unsigned int, batch.count - offset, TC_BATCH_CHUNK);
+		if (copy_from_user(frames, uframes + offset,
+				   n * sizeof(*frames))) {
+			res = -EFAULT;
+			break;
+		}
+
+		for (x = 0; x < n; x++) {
+			frames[x].status = 0;
+			files[x] = fget(frames[x].fd);
+			if (!files[x]) {
+				frames[x].status = -EBADF;
+			} else if (!tc_file_channel(files[x])) {
+				fput(files[x]);
+				files[x] = NULL;
+				frames[x].status = -EINVAL;
+			}
+		}
+
+		if (submit)
+			tc_submit(files, frames, n);
+		else
+			tc_collect(files, frames, n);
+
+		for (x = 0; x < n; x++) {
+			if (files[x])
+				fput(files[x]);
+			if (frames[x].status > 0)
+				batch.done++;
+		}
+
+		if (copy_to_user(uframes + offset, frames,
+				 n * sizeof(*frames))) {
+			res = -EFAULT;
+			break;
+		}
+	}
+	kfree(frames);
+
+	if (!res && copy_to_user((__user void *) data, &batch, sizeof(batch)))
+		res = -EFAULT;
+	return res;
+}
+
+static int dahdi_tc_ring_setup(struct file *file, unsigned long data)
+{
+	struct dahdi_transcoder_channel *chan = file->private_data;
+	struct dahdi_transcoder_ring ring;
+	int res;
+
+	if (!chan)
+		return -EINVAL;
+	if (!chan->parent->ring_setup)
+		return -ENOSYS;
+	if (copy_from_user(&ring, (__user const void *) data, sizeof(ring)))
+		return -EFAULT;
+	res = chan->parent->ring_setup(chan, &ring);
+	if (res)
+		return res;
+	return copy_to_user((__user void *) data, &ring, sizeof(ring)) ? -EFAULT : 0;
+}
+
+static int dahdi_tc_ring_slot(struct file *file, unsigned long data, int submit)
+{
+	struct dahdi_transcoder_channel *chan = file->private_data;
+	struct dahdi_transcoder_slot slot;
+	int res;
+
+	if (!chan)
+		return -EINVAL;
+	if (!chan->parent->ring_setup)
+		return -ENOSYS;
+	if (submit) {
+		if (copy_from_user(&slot, (__user const void *) data, sizeof(slot)))
+			return -EFAULT;
+		res = chan->parent->ring_submit(chan, &slot);
+		if (!res)
+			tc_frame_in(chan);
+		return res;
+	}
+	res = chan->parent->ring_collect(chan, &slot);
+	if (res)
+		return res;
+	tc_frame_out(chan);
+	return copy_to_user((__user void *) data, &slot, sizeof(slot)) ? -EFAULT : 0;
+}
+
 static long dahdi_tc_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
 	switch (cmd) {
@@ -373,6 +1206,20 @@ static long dahdi_tc_unlocked_ioctl(struct file *file, unsigned int cmd, unsigne
 		return dahdi_tc_allocate(file, data);
 	case DAHDI_TC_GETINFO:
 		return dahdi_tc_getinfo(data);
+	case DAHDI_TC_SUBMIT:
+		return dahdi_tc_batch(data, 1);
+	case DAHDI_TC_COLLECT:
+		return dahdi_tc_batch(data, 0);
+	case DAHDI_TC_RING_SETUP:
+		return dahdi_tc_ring_setup(file, data);
+	case DAHDI_TC_RING_SUBMIT:
+		return dahdi_tc_ring_slot(file, data, 1);
+	case DAHDI_TC_RING_COLLECT:
+		return dahdi_tc_ring_slot(file, data, 0);
+	case DAHDI_TC_GETSTATS:
+		return dahdi_tc_getstats(data);
+	case DAHDI_TC_GETPAIRSTATS:
+		return dahdi_tc_getpairstats(data);
 	case DAHDI_TRANSCODE_OP:
 		/* This is a deprecated call from the previous transcoder
 		 * interface, which was all routed through the dahdi_ioctl in
@@ -440,6 +1287,99 @@ static struct file_operations __dahdi_transcode_fops = {
 #endif
 };
 
+#ifdef CONFIG_PROC_FS
+static int dahdi_tc_proc_read(char *page, char **start, off_t off, int count,
+			      int *eof, void *data)
+{
+	struct dahdi_transcoder *tc;
+	struct dahdi_transcoder_stats stats;
+	struct dahdi_transcoder_counters *c = &stats.counters;
+	struct dahdi_tc_counters sum;
+	u64 find_avg, alloc_avg;
+	u32 allocs;
+	int len = 0;
+	int x;
+
+	if (off > 0) {
+		*eof = 1;
+		return 0;
+	}
+
+	len += snprintf(page + len, count - len, "busy %d\n",
+			atomic_read(&busy_count));
+	spin_lock(&translock);
+	list_for_each_entry(tc, &registration_list, registration_list_node) {
+		if (len >= count)
+			break;
+		memset(&stats, 0, sizeof(stats));
+		spin_lock(&tc->stats_lock);
+		tc_sum_counters(&sum, tc);
+		tc_fill_counters(c, &sum);
+		find_avg = tc->find_ns;
+		alloc_avg = tc->alloc_ns;
+		allocs = (u32)min_t(u64, tc->counters.allocs, 0xffffffff);
+		if (allocs) {
+			do_div(find_avg, allocs);
+			do_div(alloc_avg, allocs);
+		}
+		len += snprintf(page + len, count - len,
+				"%s: channels %d inuse %d allocs %llu "
+				"find avg %uns max %uns "
+				"alloc avg %uns max %uns\n",
+				tc->name, tc->numchannels,
+				atomic_read(&tc->inuse),
+				(unsigned long long)c->allocs,
+				(unsigned int)find_avg, tc->find_max_ns,
+				(unsigned int)alloc_avg, tc->alloc_max_ns);
+		spin_unlock(&tc->stats_lock);
+		len += snprintf(page + len, count - len,
+				"%s: busy %llu frames in %llu out %llu "
+				"inflight %u max %u "
+				"turnaround p50 %uus p99 %uus max %uus\n",
+				tc->name, (unsigned long long)c->busy,
+				(unsigned long long)c->frames_in,
+				(unsigned long long)c->frames_out,
+				c->inflight, c->inflight_max,
+				c->turnaround_p50, c->turnaround_p99,
+				c->turnaround_max);
+		if (tc->get_stats && (len < count)) {
+			tc->get_stats(tc, &stats);
+			len += snprintf(page + len, count - len,
+					"%s: hwqueue %u/%u retries %u "
+					"timeouts %u\n",
+					tc->name, stats.hwqueue,
+					stats.hwqueue_size, stats.retries,
+					stats.timeouts);
+		}
+	}
+	spin_unlock(&translock);
+
+	spin_lock(&pairs_lock);
+	for (x = 0; (x < tc_npairs) && (len < count); x++) {
+		tc_sum_pair_counters(&sum, x);
+		tc_fill_counters(c, &sum);
+		len += snprintf(page + len, count - len,
+				"pair %08x>%08x: allocs %llu busy %llu "
+				"frames in %llu out %llu inflight %u max %u "
+				"turnaround p50 %uus p99 %uus max %uus\n",
+				tc_pairs[x].srcfmt, tc_pairs[x].dstfmt,
+				(unsigned long long)c->allocs,
+				(unsigned long long)c->busy,
+				(unsigned long long)c->frames_in,
+				(unsigned long long)c->frames_out,
+				c->inflight, c->inflight_max,
+				c->turnaround_p50, c->turnaround_p99,
+				c->turnaround_max);
+	}
+	spin_unlock(&pairs_lock);
+
+	if (len > count)
+		len = count;
+	*eof = 1;
+	return len;
+}
+#endif
+
 static struct dahdi_chardev transcode_chardev = {
 	.name = "transcode",
 	.minor = 250,
@@ -459,12 +1399,20 @@ static int dahdi_transcode_init(void)
 	if ((res = dahdi_register_chardev(&transcode_chardev)))
 		return res;
 
+#ifdef CONFIG_PROC_FS
+	create_proc_read_entry("dahdi/transcode", 0444, NULL,
+			       dahdi_tc_proc_read, NULL);
+#endif
+
 	printk(KERN_INFO "%s: Loaded.\n", THIS_MODULE->name);
 	return 0;
 }
 
 static void dahdi_transcode_cleanup(void)
 {
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("dahdi/transcode", NULL);
+#endif
 	dahdi_unregister_chardev(&transcode_chardev);
 
 	dahdi_transcode_fops = NULL;
@@ -0,0 +1,1166 @@
+/*
+ * Software Transcoder for DAHDI
+ *
+ * Provides the transcoder interface (/dev/dahdi/transcode) without any
+ * hardware, converting between G.711 (ulaw and alaw), G.726-32, Dialogic
+ * (OKI) ADPCM and signed linear.  Frames are transcoded by a kernel thread
+ * bound to each CPU online at load (it moves elsewhere while its CPU is
+ * down); each thread services every channel which has frames waiting
+ * before it sleeps again, so a busy system converts many channels' frames
+ * per wakeup.
+ *
+ * The G.726 code is derived from the Sun Microsystems reference
+ * implementation, which was released for unrestricted use.
+ *
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/moduleparam.h>
+#include <linux/cpu.h>
+#include <linux/cache.h>
+#include <asm/uaccess.h>
+
+#include <dahdi/kernel.h>
+
+#define SWTC_FORMATS	(DAHDI_FORMAT_ULAW | DAHDI_FORMAT_ALAW | \
+			 DAHDI_FORMAT_G726 | DAHDI_FORMAT_ADPCM | \
+			 DAHDI_FORMAT_SLINEAR)
+
+/* Longest frame accepted, in samples (80ms) */
+#define SWTC_MAX_SAMPLES	640
+
+/* Frames a channel may have written and not yet read back */
+#define SWTC_MAX_FRAMES		16
+
+#define SWTC_MAX_CHANNELS	1024
+
+/* Workers follow their CPU going down and coming back up */
+#if defined(CONFIG_HOTPLUG_CPU) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29))
+#define SWTC_HOTPLUG
+#endif
+
+static int debug;
+static int channels = 128;
+
+/* State of the G.726 (ADPCM, 32kbit/s) coder */
+struct g726_state {
+	long yl;	/* Locked or steady state step size multiplier */
+	short yu;	/* Unlocked or non-steady state step size multiplier */
+	short dms;	/* Short term energy estimate */
+	short dml;	/* Long term energy estimate */
+	short ap;	/* Linear weighting coefficient of yl and yu */
+	short a[2];	/* Coefficients of the pole portion of the predictor */
+	short b[6];	/* Coefficients of the zero portion of the predictor */
+	short pk[2];	/* Signs of the previous two partial reconstructions */
+	short dq[6];	/* Previous quantized differences, floating point */
+	short sr[2];	/* Previous reconstructed samples, floating point */
+	char td;	/* Delayed tone detect */
+};
+
+/* State of the Dialogic ADPCM coder */
+struct adpcm_state {
+	int signal;
+	int ssindex;
+};
+
+struct swtc_codec {
+	struct g726_state g726;
+	struct adpcm_state adpcm;
+};
+
+struct swtc_frame {
+	struct list_head node;
+	u32 srcfmt;
+	u32 dstfmt;
+	int samples;
+	unsigned int len;	/* Bytes in data, input or output */
+	unsigned char data[0];
+};
+
+/* Room for the longest frame in any format, signed linear being the
+ * largest */
+#define SWTC_FRAME_SIZE	L1_CACHE_ALIGN(sizeof(struct swtc_frame) + \
+				       SWTC_MAX_SAMPLES * sizeof(short))
+
+/* A kernel thread, bound to one CPU, and the channels it services */
+struct swtc_worker {
+	struct task_struct *task;
+	int cpu;
+	spinlock_t lock;	/* Protects pending */
+	struct list_head pending;	/* Channels with frames to transcode */
+	wait_queue_head_t wq;
+	unsigned long passes;	/* Times it woke up to find work */
+	unsigned long frames;	/* Frames transcoded */
+	short linear[SWTC_MAX_SAMPLES];
+};
+
+struct swtc_pvt {
+	spinlock_t lock;	/* Protects everything below */
+	struct dahdi_transcoder_channel *dtc;
+	struct swtc_worker *worker;
+	struct list_head node;		/* On the worker's pending list */
+	struct list_head tx_queue;	/* Frames waiting to be transcoded */
+	struct list_head rx_queue;	/* Transcoded frames to be read */
+	struct list_head free_frames;	/* SWTC_MAX_FRAMES, set aside */
+	int outstanding;	/* Frames on either queue or in progress */
+	unsigned int gen;	/* Bumped on release to discard old frames */
+	int reset;		/* Codec state must be reset before next use */
+	struct swtc_codec dec;	/* Used only by the worker */
+	struct swtc_codec enc;	/* Used only by the worker */
+	void *frame_mem;	/* What the frames were carved from */
+};
+
+static struct dahdi_transcoder *swtc;
+static struct swtc_pvt *pvts;
+static struct swtc_worker *workers;
+static int numworkers;
+
+/*
+ * G.726-32
+ */
+
+static short power2[15] = {1, 2, 4, 8, 0x10, 0x20, 0x40, 0x80,
+	0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000};
+
+static short qtab_721[7] = {-124, 80, 178, 246, 300, 349, 400};
+/* Log of the reconstructed difference for each code */
+static short dqlntab[16] = {-2048, 4, 135, 213, 273, 323, 373, 425,
+	425, 373, 323, 273, 213, 135, 4, -2048};
+/* Scale factor multipliers */
+static short witab[16] = {-12, 18, 41, 64, 112, 198, 355, 1122,
+	1122, 355, 198, 112, 64, 41, 18, -12};
+/* Transition detect factors */
+static short fitab[16] = {0, 0, 0, 0x200, 0x200, 0x200, 0x600, 0xE00,
+	0xE00, 0x600, 0x200, 0x200, 0x200, 0, 0, 0};
+
+static int quan(int val, short *table, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		if (val < *table++)
+			break;
+	return i;
+}
+
+/* Multiply a predictor coefficient by a floating point sample */
+static int fmult(int an, int srn)
+{
+	short anmag, anexp, anmant;
+	short wanexp, wanmant;
+	short retval;
+
+	anmag = (an > 0) ? an : ((-an) & 0x1FFF);
+	anexp = quan(anmag, power2, 15) - 6;
+	anmant = (anmag == 0) ? 32 :
+		(anexp >= 0) ? anmag >> anexp : anmag << -anexp;
+	wanexp = anexp + ((srn >> 6) & 0xF) - 13;
+
+	wanmant = (anmant * (srn & 077) + 0x30) >> 4;
+	retval = (wanexp >= 0) ? ((wanmant << wanexp) & 0x7FFF) :
+		(wanmant >> -wanexp);
+
+	return ((an ^ srn) < 0) ? -retval : retval;
+}
+
+static void g726_init_state(struct g726_state *s)
+{
+	int x;
+
+	memset(s, 0, sizeof(*s));
+	s->yl = 34816;
+	s->yu = 544;
+	for (x = 0; x < 2; x++)
+		s->sr[x] = 32;
+	for (x = 0; x < 6; x++)
+		s->dq[x] = 32;
+}
+
+static int predictor_zero(struct g726_state *s)
+{
+	int i;
+	int sezi;
+
+	sezi = fmult(s->b[0] >> 2, s->dq[0]);
+	for (i = 1; i < 6; i++)
+		sezi += fmult(s->b[i] >> 2, s->dq[i]);
+	return sezi;
+}
+
+static int predictor_pole(struct g726_state *s)
+{
+	return fmult(s->a[1] >> 2, s->sr[1]) + fmult(s->a[0] >> 2, s->sr[0]);
+}
+
+static int step_size(struct g726_state *s)
+{
+	int y, dif, al;
+
+	if (s->ap >= 256)
+		return s->yu;
+
+	y = s->yl >> 6;
+	dif = s->yu - y;
+	al = s->ap >> 2;
+	if (dif > 0)
+		y += (dif * al) >> 6;
+	else if (dif < 0)
+		y += (dif * al + 0x3F) >> 6;
+	return y;
+}
+
+static int quantize(int d, int y, short *table, int size)
+{
+	short dqm;	/* Magnitude of d */
+	short exp;	/* Integer part of base 2 log of d */
+	short mant;	/* Fractional part of base 2 log */
+	short dl;	/* Log of magnitude of d */
+	short dln;	/* Step size scale factor normalized log */
+	int i;
+
+	dqm = abs(d);
+	exp = quan(dqm >> 1, power2, 15);
+	mant = ((dqm << 7) >> exp) & 0x7F;
+	dl = (exp << 7) + mant;
+	dln = dl - (y >> 2);
+
+	i = quan(dln, table, size);
+	if (d < 0)
+		return (size << 1) + 1 - i;
+	else if (i == 0)
+		return (size << 1) + 1;
+	return i;
+}
+
+static int reconstruct(int sign, int dqln, int y)
+{
+	short dql;	/* Log of dq magnitude */
+	short dex;	/* Integer part of log */
+	short dqt;
+	short dq;	/* Reconstructed difference signal sample */
+
+	dql = dqln + (y >> 2);
+	if (dql < 0)
+		return sign ? -0x8000 : 0;
+
+	dex = (dql >> 7) & 15;
+	dqt = 128 + (dql & 127);
+	dq = (dqt << 7) >> (14 - dex);
+	return sign ? (dq - 0x8000) : dq;
+}
+
+static void update(int y, int wi, int fi, int dq, int sr, int dqsez,
+		   struct g726_state *s)
+{
+	int cnt;
+	short mag, exp;
+	short a2p = 0;
+	short a1ul;
+	short pks1;
+	short fa1;
+	char tr;
+	short ylint, thr2, dqthr;
+	short ylfrac, thr1;
+	short pk0;
+
+	pk0 = (dqsez < 0) ? 1 : 0;
+
+	mag = dq & 0x7FFF;
+	ylint = s->yl >> 15;
+	ylfrac = (s->yl >> 10) & 0x1F;
+	thr1 = (32 + ylfrac) << ylint;
+	thr2 = (ylint > 9) ? 31 << 10 : thr1;
+	dqthr = (thr2 + (thr2 >> 1)) >> 1;
+	if (s->td == 0)
+		tr = 0;
+	else if (mag <= dqthr)
+		tr = 0;
+	else
+		tr = 1;	/* Modem signal */
+
+	/* Quantizer scale factor adaptation */
+	s->yu = y + ((wi - y) >> 5);
+	if (s->yu < 544)
+		s->yu = 544;
+	else if (s->yu > 5120)
+		s->yu = 5120;
+	s->yl += s->yu + ((-s->yl) >> 6);
+
+	/* Adaptive predictor coefficients */
+	if (tr == 1) {
+		memset(s->a, 0, sizeof(s->a));
+		memset(s->b, 0, sizeof(s->b));
+	} else {
+		pks1 = pk0 ^ s->pk[0];
+
+		a2p = s->a[1] - (s->a[1] >> 7);
+		if (dqsez != 0) {
+			fa1 = pks1 ? s->a[0] : -s->a[0];
+			if (fa1 < -8191)
+				a2p -= 0x100;
+			else if (fa1 > 8191)
+				a2p += 0xFF;
+			else
+				a2p += fa1 >> 5;
+
+			if (pk0 ^ s->pk[1]) {
+				if (a2p <= -12160)
+					a2p = -12288;
+				else if (a2p >= 12416)
+					a2p = 12288;
+				else
+					a2p -= 0x80;
+			} else if (a2p <= -12416) {
+				a2p = -12288;
+			} else if (a2p >= 12160) {
+				a2p = 12288;
+			} else {
+				a2p += 0x80;
+			}
+		}
+		s->a[1] = a2p;
+
+		s->a[0] -= s->a[0] >> 8;
+		if (dqsez != 0) {
+			if (pks1 == 0)
+				s->a[0] += 192;
+			else
+				s->a[0] -= 192;
+		}
+		a1ul = 15360 - a2p;
+		if (s->a[0] < -a1ul)
+			s->a[0] = -a1ul;
+		else if (s->a[0] > a1ul)
+			s->a[0] = a1ul;
+
+		for (cnt = 0; cnt < 6; cnt++) {
+			s->b[cnt] -= s->b[cnt] >> 8;
+			if (dq & 0x7FFF) {
+				if ((dq ^ s->dq[cnt]) >= 0)
+					s->b[cnt] += 128;
+				else
+					s->b[cnt] -= 128;
+			}
+		}
+	}
+
+	for (cnt = 5; cnt > 0; cnt--)
+		s->dq[cnt] = s->dq[cnt - 1];
+	if (mag == 0) {
+		s->dq[0] = (dq >= 0) ? 0x20 : 0xFC20;
+	} else {
+		exp = quan(mag, power2, 15);
+		s->dq[0] = (dq >= 0) ?
+			(exp << 6) + ((mag << 6) >> exp) :
+			(exp << 6) + ((mag << 6) >> exp) - 0x400;
+	}
+
+	s->sr[1] = s->sr[0];
+	if (sr == 0) {
+		s->sr[0] = 0x20;
+	} else if (sr > 0) {
+		exp = quan(sr, power2, 15);
+		s->sr[0] = (exp << 6) + ((sr << 6) >> exp);
+	} else if (sr > -32768) {
+		mag = -sr;
+		exp = quan(mag, power2, 15);
+		s->sr[0] = (exp << 6) + ((mag << 6) >> exp) - 0x400;
+	} else {
+		s->sr[0] = 0xFC20;
+	}
+
+	s->pk[1] = s->pk[0];
+	s->pk[0] = pk0;
+
+	/* Tone detect */
+	if (tr == 1)
+		s->td = 0;
+	else if (a2p < -11776)
+		s->td = 1;
+	else
+		s->td = 0;
+
+	/* Adaptation speed control */
+	s->dms += (fi - s->dms) >> 5;
+	s->dml += (((fi << 2) - s->dml) >> 7);
+
+	if (tr == 1)
+		s->ap = 256;
+	else if (y < 1536)
+		s->ap += (0x200 - s->ap) >> 4;
+	else if (s->td == 1)
+		s->ap += (0x200 - s->ap) >> 4;
+	else if (abs((s->dms << 2) - s->dml) >= (s->dml >> 3))
+		s->ap += (0x200 - s->ap) >> 4;
+	else
+		s->ap += (-s->ap) >> 4;
+}
+
+static int g726_encode(short sample, struct g726_state *s)
+{
+	short sezi, se, sez;
+	short d, sr, y, dqsez, dq, i;
+	short sl = sample >> 2;	/* 14 bit dynamic range */
+
+	sezi = predictor_zero(s);
+	sez = sezi >> 1;
+	se = (sezi + predictor_pole(s)) >> 1;
+
+	d = sl - se;
+	y = step_size(s);
+	i = quantize(d, y, qtab_721, 7);
+	dq = reconstruct(i & 8, dqlntab[i], y);
+	sr = (dq < 0) ? se - (dq & 0x3FFF) : se + dq;
+	dqsez = sr + sez - se;
+
+	update(y, witab[i] << 5, fitab[i], dq, sr, dqsez, s);
+	return i;
+}
+
+static short g726_decode(int i, struct g726_state *s)
+{
+	short sezi, sez, se;
+	short y, sr, dq, dqsez;
+
+	i &= 0x0f;
+	sezi = predictor_zero(s);
+	sez = sezi >> 1;
+	se = (sezi + predictor_pole(s)) >> 1;
+
+	y = step_size(s);
+	dq = reconstruct(i & 0x08, dqlntab[i], y);
+	sr = (dq < 0) ? (se - (dq & 0x3FFF)) : se + dq;
+	dqsez = sr - se + sez;
+
+	update(y, witab[i] << 5, fitab[i], dq, sr, dqsez, s);
+	return sr << 2;
+}
+
+/*
+ * Dialogic ADPCM
+ */
+
+static int adpcm_indsft[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+static int adpcm_stpsz[49] = {16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+	41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157,
+	173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544,
+	598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552};
+
+static short adpcm_decode(int code, struct adpcm_state *s)
+{
+	int step = adpcm_stpsz[s->ssindex];
+	int diff = step >> 3;
+
+	if (code & 4)
+		diff += step;
+	if (code & 2)
+		diff += step >> 1;
+	if (code & 1)
+		diff += step >> 2;
+	if (code & 8)
+		diff = -diff;
+
+	s->signal += diff;
+	if (s->signal > 2047)
+		s->signal = 2047;
+	else if (s->signal < -2047)
+		s->signal = -2047;
+
+	s->ssindex += adpcm_indsft[code & 7];
+	if (s->ssindex < 0)
+		s->ssindex = 0;
+	else if (s->ssindex > 48)
+		s->ssindex = 48;
+
+	return s->signal << 4;
+}
+
+static int adpcm_encode(short sample, struct adpcm_state *s)
+{
+	int step = adpcm_stpsz[s->ssindex];
+	int diff = (sample >> 4) - s->signal;
+	int code = 0;
+
+	if (diff < 0) {
+		code = 8;
+		diff = -diff;
+	}
+	if (diff >= step) {
+		code |= 4;
+		diff -= step;
+	}
+	step >>= 1;
+	if (diff >= step) {
+		code |= 2;
+		diff -= step;
+	}
+	step >>= 1;
+	if (diff >= step)
+		code |= 1;
+
+	/* Track the decoder at the far end */
+	adpcm_decode(code, s);
+	return code;
+}
+
+/*
+ * Framing
+ */
+
+/* Number of samples in len bytes of fmt, or -1 if it is not whole */
+static int swtc_samples(u32 fmt, size_t len)
+{
+	switch (fmt) {
+	case DAHDI_FORMAT_SLINEAR:
+		return (len & 1) ? -1 : len / 2;
+	case DAHDI_FORMAT_G726:
+	case DAHDI_FORMAT_ADPCM:
+		return len * 2;
+	default:
+		return len;
+	}
+}
+
+static unsigned int swtc_bytes(u32 fmt, int samples)
+{
+	switch (fmt) {
+	case DAHDI_FORMAT_SLINEAR:
+		return samples * 2;
+	case DAHDI_FORMAT_G726:
+	case DAHDI_FORMAT_ADPCM:
+		return samples / 2;
+	default:
+		return samples;
+	}
+}
+
+static void swtc_reset_codec(struct swtc_codec *codec)
+{
+	g726_init_state(&codec->g726);
+	memset(&codec->adpcm, 0, sizeof(codec->adpcm));
+}
+
+static void swtc_decode(struct swtc_codec *codec, struct swtc_frame *f,
+			short *linear)
+{
+	const unsigned char *in = f->data;
+	int x;
+
+	switch (f->srcfmt) {
+	case DAHDI_FORMAT_ULAW:
+		for (x = 0; x < f->samples; x++)
+			linear[x] = DAHDI_MULAW(in[x]);
+		break;
+	case DAHDI_FORMAT_ALAW:
+		for (x = 0; x < f->samples; x++)
+			linear[x] = DAHDI_ALAW(in[x]);
+		break;
+	case DAHDI_FORMAT_SLINEAR:
+		memcpy(linear, in, f->samples * sizeof(short));
+		break;
+	case DAHDI_FORMAT_G726:
+		/* AAL2 packing, as Asterisk's G726AAL2 that DAHDI_FORMAT_G726
+		 * stands for; the first sample is in the high nibble */
+		for (x = 0; x < f->samples / 2; x++) {
+			linear[x * 2] = g726_decode(in[x] >> 4, &codec->g726);
+			linear[x * 2 + 1] = g726_decode(in[x] & 0xf,
+							&codec->g726);
+		}
+		break;
+	case DAHDI_FORMAT_ADPCM:
+		for (x = 0; x < f->samples / 2; x++) {
+			linear[x * 2] = adpcm_decode(in[x] >> 4,
+						     &codec->adpcm);
+			linear[x * 2 + 1] = adpcm_decode(in[x] & 0xf,
+							 &codec->adpcm);
+		}
+		break;
+	}
+}
+
+static void swtc_encode(struct swtc_codec *codec, struct swtc_frame *f,
+			const short *linear)
+{
+	unsigned char *out = f->data;
+	int x;
+
+	switch (f->dstfmt) {
+	case DAHDI_FORMAT_ULAW:
+		for (x = 0; x < f->samples; x++)
+			out[x] = DAHDI_LIN2MU(linear[x]);
+		break;
+	case DAHDI_FORMAT_ALAW:
+		for (x = 0; x < f->samples; x++)
+			out[x] = DAHDI_LIN2A(linear[x]);
+		break;
+	case DAHDI_FORMAT_SLINEAR:
+		memcpy(out, linear, f->samples * sizeof(short));
+		break;
+	case DAHDI_FORMAT_G726:
+		for (x = 0; x < f->samples / 2; x++) {
+			out[x] = (g726_encode(linear[x * 2],
+					      &codec->g726) << 4) |
+				 g726_encode(linear[x * 2 + 1], &codec->g726);
+		}
+		break;
+	case DAHDI_FORMAT_ADPCM:
+		for (x = 0; x < f->samples / 2; x++) {
+			out[x] = (adpcm_encode(linear[x * 2],
+					       &codec->adpcm) << 4) |
+				 adpcm_encode(linear[x * 2 + 1],
+					      &codec->adpcm);
+		}
+		break;
+	}
+	f->len = swtc_bytes(f->dstfmt, f->samples);
+}
+
+/*
+ * Workers
+ */
+
+/* Transcode every frame the channel has waiting.  Returns the number of
+ * frames done. */
+static int swtc_service(struct swtc_worker *w, struct swtc_pvt *pvt)
+{
+	struct dahdi_transcoder_channel *dtc = pvt->dtc;
+	struct swtc_frame *f;
+	unsigned int gen;
+	int count = 0;
+
+	spin_lock(&pvt->lock);
+	while (!list_empty(&pvt->tx_queue)) {
+		f = list_entry(pvt->tx_queue.next, struct swtc_frame, node);
+		list_del_init(&f->node);
+		gen = pvt->gen;
+		if (pvt->reset) {
+			swtc_reset_codec(&pvt->dec);
+			swtc_reset_codec(&pvt->enc);
+			pvt->reset = 0;
+		}
+		spin_unlock(&pvt->lock);
+
+		swtc_decode(&pvt->dec, f, w->linear);
+		swtc_encode(&pvt->enc, f, w->linear);
+
+		spin_lock(&pvt->lock);
+		if (gen != pvt->gen) {
+			/* The channel was released while we worked */
+			list_add(&f->node, &pvt->free_frames);
+			continue;
+		}
+		list_add_tail(&f->node, &pvt->rx_queue);
+		dahdi_tc_set_data_waiting(dtc);
+		++count;
+	}
+	spin_unlock(&pvt->lock);
+
+	if (count)
+		dahdi_transcoder_alert(dtc);
+	return count;
+}
+
+static int swtc_thread(void *data)
+{
+	struct swtc_worker *w = data;
+	struct swtc_pvt *pvt;
+	int count;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(w->wq, !list_empty(&w->pending) ||
+					 kthread_should_stop());
+
+		/* Channels queued while we work are picked up on this same
+		 * pass, without another wakeup. */
+		count = 0;
+		spin_lock(&w->lock);
+		while (!list_empty(&w->pending)) {
+			pvt = list_entry(w->pending.next, struct swtc_pvt,
+					 node);
+			list_del_init(&pvt->node);
+			spin_unlock(&w->lock);
+			count += swtc_service(w, pvt);
+			cond_resched();
+			spin_lock(&w->lock);
+		}
+		spin_unlock(&w->lock);
+
+		if (count) {
+			w->passes++;
+			w->frames += count;
+		}
+	}
+	return 0;
+}
+
+/* Queue the channel on its worker, waking it if it was idle */
+static void swtc_kick(struct swtc_pvt *pvt)
+{
+	struct swtc_worker *w = pvt->worker;
+	int wake = 0;
+
+	spin_lock(&w->lock);
+	if (list_empty(&pvt->node)) {
+		wake = list_empty(&w->pending);
+		list_add_tail(&pvt->node, &w->pending);
+	}
+	spin_unlock(&w->lock);
+
+	if (wake)
+		wake_up_interruptible(&w->wq);
+}
+
+/*
+ * Transcoder interface
+ */
+
+static int swtc_format_ok(u32 fmt)
+{
+	return (fmt & SWTC_FORMATS) && !(fmt & ~SWTC_FORMATS) &&
+		!(fmt & (fmt - 1));
+}
+
+static int swtc_operation_allocate(struct dahdi_transcoder_channel *dtc)
+{
+	struct swtc_pvt *pvt = dtc->pvt;
+
+	if (!swtc_format_ok(dtc->srcfmt) || !swtc_format_ok(dtc->dstfmt) ||
+	    (dtc->srcfmt == dtc->dstfmt))
+		return -EINVAL;
+
+	spin_lock(&pvt->lock);
+	pvt->reset = 1;
+	dtc->built_fmts = dtc->srcfmt | dtc->dstfmt;
+	dahdi_tc_set_built(dtc);
+	spin_unlock(&pvt->lock);
+
+	if (debug) {
+		printk(KERN_DEBUG "%s: Allocated channel %d (%08x -> %08x)\n",
+		       THIS_MODULE->name, (int)(pvt - pvts), dtc->srcfmt,
+		       dtc->dstfmt);
+	}
+	return 0;
+}
+
+static void swtc_put_frame(struct swtc_pvt *pvt, struct swtc_frame *f)
+{
+	spin_lock(&pvt->lock);
+	list_add(&f->node, &pvt->free_frames);
+	spin_unlock(&pvt->lock);
+}
+
+static int swtc_operation_release(struct dahdi_transcoder_channel *dtc)
+{
+	struct swtc_pvt *pvt = dtc->pvt;
+
+	spin_lock(&pvt->worker->lock);
+	list_del_init(&pvt->node);
+	spin_unlock(&pvt->worker->lock);
+
+	spin_lock(&pvt->lock);
+	pvt->gen++;
+	list_splice_init(&pvt->tx_queue, &pvt->free_frames);
+	list_splice_init(&pvt->rx_queue, &pvt->free_frames);
+	pvt->outstanding = 0;
+	dahdi_tc_clear_data_waiting(dtc);
+	dahdi_tc_clear_built(dtc);
+	dtc->built_fmts = 0;
+	spin_unlock(&pvt->lock);
+	return 0;
+}
+
+static struct swtc_frame *swtc_get_ready(struct dahdi_transcoder_channel *dtc)
+{
+	struct swtc_pvt *pvt = dtc->pvt;
+	struct swtc_frame *f = NULL;
+
+	spin_lock(&pvt->lock);
+	if (!list_empty(&pvt->rx_queue)) {
+		f = list_entry(pvt->rx_queue.next, struct swtc_frame, node);
+		list_del_init(&f->node);
+		pvt->outstanding--;
+	}
+	if (list_empty(&pvt->rx_queue))
+		dahdi_tc_clear_data_waiting(dtc);
+	spin_unlock(&pvt->lock);
+	return f;
+}
+
+/* Called with a buffer in which to copy a transcoded frame. */
+static ssize_t swtc_read(struct file *file, char __user *frame,
+			 size_t count, loff_t *ppos)
+{
+	struct dahdi_transcoder_channel *dtc = file->private_data;
+	struct swtc_frame *f;
+	ssize_t res;
+
+	while (!(f = swtc_get_ready(dtc))) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dtc->ready,
+					     dahdi_tc_is_data_waiting(dtc)))
+			return -EINTR;
+	}
+
+	if (count < f->len) {
+		if (printk_ratelimit()) {
+			printk(KERN_ERR "%s: Cannot copy %u bytes into %zd "
+			       "byte user buffer.\n", THIS_MODULE->name,
+			       f->len, count);
+		}
+		res = -EFBIG;
+	} else if (copy_to_user(frame, f->data, f->len)) {
+		res = -EFAULT;
+	} else {
+		res = f->len;
+	}
+
+	swtc_put_frame(dtc->pvt, f);
+	return res;
+}
+
+/* Called with a frame in the srcfmt to be transcoded into the dstfmt. */
+static ssize_t swtc_write(struct file *file, const char __user *frame,
+			  size_t count, loff_t *ppos)
+{
+	struct dahdi_transcoder_channel *dtc = file->private_data;
+	struct swtc_pvt *pvt = dtc->pvt;
+	struct swtc_frame *f;
+	int samples;
+	unsigned int outlen;
+
+	if (!dahdi_tc_is_built(dtc))
+		return -EAGAIN;
+
+	samples = swtc_samples(dtc->srcfmt, count);
+	if ((samples <= 0) || (samples > SWTC_MAX_SAMPLES))
+		return -EINVAL;
+	/* Packed formats carry samples in pairs */
+	if (((dtc->dstfmt == DAHDI_FORMAT_G726) ||
+	     (dtc->dstfmt == DAHDI_FORMAT_ADPCM)) && (samples & 1))
+		return -EINVAL;
+
+	outlen = swtc_bytes(dtc->dstfmt, samples);
+	if (max_t(unsigned int, count, outlen) >
+	    SWTC_FRAME_SIZE - sizeof(*f))
+		return -EINVAL;
+
+	spin_lock(&pvt->lock);
+	if ((pvt->outstanding >= SWTC_MAX_FRAMES) ||
+	    list_empty(&pvt->free_frames)) {
+		/* Nobody is reading the results */
+		spin_unlock(&pvt->lock);
+		return -EBUSY;
+	}
+	f = list_entry(pvt->free_frames.next, struct swtc_frame, node);
+	list_del_init(&f->node);
+	spin_unlock(&pvt->lock);
+
+	f->srcfmt = dtc->srcfmt;
+	f->dstfmt = dtc->dstfmt;
+	f->samples = samples;
+	f->len = count;
+	if (copy_from_user(f->data, frame, count)) {
+		swtc_put_frame(pvt, f);
+		return -EFAULT;
+	}
+
+	spin_lock(&pvt->lock);
+	pvt->outstanding++;
+	list_add_tail(&f->node, &pvt->tx_queue);
+	spin_unlock(&pvt->lock);
+
+	swtc_kick(pvt);
+	return count;
+}
+
+#ifdef SWTC_HOTPLUG
+/* A worker is bound to its CPU, and would otherwise be left with nowhere to
+ * run when it goes down.  It runs on the CPUs left until its own is back,
+ * so its channels are still serviced. */
+static int swtc_cpu_callback(struct notifier_block *nb, unsigned long action,
+			     void *hcpu)
+{
+	int cpu = (long)hcpu;
+	int x;
+
+	for (x = 0; x < numworkers; x++) {
+		if ((workers[x].cpu != cpu) || !workers[x].task)
+			continue;
+		switch (action & ~CPU_TASKS_FROZEN) {
+		case CPU_DOWN_PREPARE:
+			set_cpus_allowed_ptr(workers[x].task, cpu_online_mask);
+			break;
+		case CPU_ONLINE:
+		case CPU_DOWN_FAILED:
+			set_cpus_allowed_ptr(workers[x].task, cpumask_of(cpu));
+			break;
+		}
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block swtc_cpu_notifier = {
+	.notifier_call = swtc_cpu_callback,
+};
+#endif
+
+static void swtc_stop_workers(void)
+{
+	int x;
+
+#ifdef SWTC_HOTPLUG
+	unregister_hotcpu_notifier(&swtc_cpu_notifier);
+#endif
+	for (x = 0; x < numworkers; x++) {
+		if (!workers[x].task)
+			continue;
+		kthread_stop(workers[x].task);
+		if (debug) {
+			printk(KERN_DEBUG "%s: Worker on CPU %d transcoded %lu "
+			       "frames in %lu passes\n", THIS_MODULE->name,
+			       workers[x].cpu, workers[x].frames,
+			       workers[x].passes);
+		}
+	}
+	kfree(workers);
+	workers = NULL;
+}
+
+static int swtc_start_workers(void)
+{
+	struct swtc_worker *w;
+	int cpu;
+
+	workers = kcalloc(num_online_cpus(), sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+
+	numworkers = 0;
+#ifdef SWTC_HOTPLUG
+	register_hotcpu_notifier(&swtc_cpu_notifier);
+#endif
+	/* No CPU goes down or comes up while the workers are being bound */
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		w = &workers[numworkers];
+		w->cpu = cpu;
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->pending);
+		init_waitqueue_head(&w->wq);
+		w->task = kthread_create(swtc_thread, w, "dahdi_swtc/%d", cpu);
+		if (IS_ERR(w->task)) {
+			w->task = NULL;
+			put_online_cpus();
+			swtc_stop_workers();
+			return -ENOMEM;
+		}
+		kthread_bind(w->task, cpu);
+		wake_up_process(w->task);
+		if (++numworkers == num_online_cpus())
+			break;
+	}
+	put_online_cpus();
+	return 0;
+}
+
+static void swtc_free_pvts(void)
+{
+	int x;
+
+	for (x = 0; x < channels; x++)
+		kfree(pvts[x].frame_mem);
+	kfree(pvts);
+	pvts = NULL;
+}
+
+/* Sets aside the frames of each channel, so that writing a frame does not
+ * have to go to the allocator. */
+static int swtc_alloc_pvts(void)
+{
+	struct swtc_pvt *pvt;
+	struct swtc_frame *f;
+	int x, y;
+
+	pvts = kcalloc(channels, sizeof(*pvts), GFP_KERNEL);
+	if (!pvts)
+		return -ENOMEM;
+	for (x = 0; x < channels; x++) {
+		pvt = &pvts[x];
+		INIT_LIST_HEAD(&pvt->free_frames);
+		pvt->frame_mem = kmalloc(SWTC_MAX_FRAMES * SWTC_FRAME_SIZE,
+					 GFP_KERNEL);
+		if (!pvt->frame_mem) {
+			swtc_free_pvts();
+			return -ENOMEM;
+		}
+		for (y = 0; y < SWTC_MAX_FRAMES; y++) {
+			f = pvt->frame_mem + y * SWTC_FRAME_SIZE;
+			list_add_tail(&f->node, &pvt->free_frames);
+		}
+	}
+	return 0;
+}
+
+/* G.726-32 of a 1kHz tone at 8000 peak, packed for AAL2 */
+static const short swtc_test_linear[16] = {
+	0, 5657, 8000, 5657, 0, -5657, -8000, -5657,
+	0, 5657, 8000, 5657, 0, -5657, -8000, -5657,
+};
+static const unsigned char swtc_test_g726[8] = {
+	0xf7, 0x77, 0xf8, 0x88, 0xf7, 0x74, 0xea, 0xab,
+};
+static const short swtc_test_decoded[16] = {
+	0, 88, 152, 92, 0, -216, -480, -208,
+	8, 1084, 2016, 868, -964, -4624, -4696, -3460,
+};
+
+/* Checks the G.726 coder against known vectors, so that a change to it or
+ * to the order of the samples in a byte cannot go unnoticed. */
+static int __init swtc_selftest(void)
+{
+	struct swtc_codec *codec;
+	struct swtc_frame *f;
+	short linear[ARRAY_SIZE(swtc_test_linear)];
+	int res = 0;
+
+	codec = kmalloc(sizeof(*codec), GFP_KERNEL);
+	f = kmalloc(sizeof(*f) + sizeof(swtc_test_linear), GFP_KERNEL);
+	if (!codec || !f) {
+		kfree(codec);
+		kfree(f);
+		return -ENOMEM;
+	}
+
+	f->srcfmt = DAHDI_FORMAT_SLINEAR;
+	f->dstfmt = DAHDI_FORMAT_G726;
+	f->samples = ARRAY_SIZE(swtc_test_linear);
+	swtc_reset_codec(codec);
+	swtc_encode(codec, f, swtc_test_linear);
+	if ((f->len != sizeof(swtc_test_g726)) ||
+	    memcmp(f->data, swtc_test_g726, sizeof(swtc_test_g726))) {
+		printk(KERN_ERR "%s: G.726 encoder self test failed\n",
+		       THIS_MODULE->name);
+		res = -EIO;
+	}
+
+	f->srcfmt = DAHDI_FORMAT_G726;
+	memcpy(f->data, swtc_test_g726, sizeof(swtc_test_g726));
+	swtc_reset_codec(codec);
+	swtc_decode(codec, f, linear);
+	if (memcmp(linear, swtc_test_decoded, sizeof(linear))) {
+		printk(KERN_ERR "%s: G.726 decoder self test failed\n",
+		       THIS_MODULE->name);
+		res = -EIO;
+	}
+
+	kfree(codec);
+	kfree(f);
+	return res;
+}
+
+static int __init swtc_init(void)
+{
+	struct swtc_pvt *pvt;
+	int res;
+	int x;
+
+	if ((channels < 1) || (channels > SWTC_MAX_CHANNELS)) {
+		printk(KERN_ERR "%s: channels must be between 1 and %d\n",
+		       THIS_MODULE->name, SWTC_MAX_CHANNELS);
+		return -EINVAL;
+	}
+
+	res = swtc_selftest();
+	if (res)
+		return res;
+
+	res = swtc_alloc_pvts();
+	if (res)
+		return res;
+
+	swtc = dahdi_transcoder_alloc(channels);
+	if (!swtc) {
+		swtc_free_pvts();
+		return -ENOMEM;
+	}
+
+	res = swtc_start_workers();
+	if (res) {
+		dahdi_transcoder_free(swtc);
+		swtc_free_pvts();
+		return res;
+	}
+
+	sprintf(swtc->name, "Software Transcoder");
+	swtc->srcfmts = SWTC_FORMATS;
+	swtc->dstfmts = SWTC_FORMATS;
+	/* Only used once the hardware transcoders are full */
+	swtc->priority = DAHDI_TC_PRIORITY_SOFTWARE;
+	swtc->allocate = swtc_operation_allocate;
+	swtc->release = swtc_operation_release;
+	swtc->fops.owner = THIS_MODULE;
+	swtc->fops.read = swtc_read;
+	swtc->fops.write = swtc_write;
+
+	for (x = 0; x < channels; x++) {
+		pvt = &pvts[x];
+		spin_lock_init(&pvt->lock);
+		pvt->dtc = &swtc->channels[x];
+		/* Free channels are handed out lowest first and the most
+		 * recently released are reused first, so the busy ones stay
+		 * spread evenly across the workers. */
+		pvt->worker = &workers[x % numworkers];
+		INIT_LIST_HEAD(&pvt->node);
+		INIT_LIST_HEAD(&pvt->tx_queue);
+		INIT_LIST_HEAD(&pvt->rx_queue);
+		swtc->channels[x].pvt = pvt;
+	}
+
+	dahdi_transcoder_register(swtc);
+	return 0;
+}
+
+static void __exit swtc_cleanup(void)
+{
+	dahdi_transcoder_unregister(swtc);
+	swtc_stop_workers();
+	/* Nothing can have a channel open, since that holds this module, so
+	 * every frame is back in the memory of its channel. */
+	dahdi_transcoder_free(swtc);
+	swtc_free_pvts();
+}
+
+module_param(debug, int, S_IRUGO | S_IWUSR);
+module_param(channels, int, S_IRUGO);
+MODULE_PARM_DESC(channels, "Number of transcoder channels (default 128)");
+MODULE_DESCRIPTION("DAHDI Software Transcoder");
+#ifdef MODULE_LICENSE
+MODULE_LICENSE("GPL");
+#endif
+
+module_init(swtc_init);
+module_exit(swtc_cleanup);
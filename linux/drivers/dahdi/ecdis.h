@@ -3,7 +3,10 @@
  *
  * ec_disable_detector.h - A detector which should eventually meet the
  *                         G.164/G.165 requirements for detecting the
- *                         2100Hz echo cancellor disable tone.
+ *                         2100Hz echo cancellor disable tone, extended to
+ *                         a bank watching for the other fax and modem
+ *                         tones which call for a change of echo canceller
+ *                         behaviour.
  *
  * Written by Steve Underwood <steveu@coppice.org>
  *
@@ -26,78 +29,200 @@
  * this program for more details.
  */
 
-#include "biquad.h"
-
 #define FALSE 0
 #define TRUE (!FALSE)
 
+/* Tones reported by echo_can_disable_detector_update() */
+#define ECDIS_CED	(1 << 0)	/* ANS or ANS/PR: 2100Hz, optionally with phase reversals */
+#define ECDIS_ANSAM	(1 << 1)	/* ANSam or ANSam/PR (V.8): as above, with 15Hz AM */
+#define ECDIS_V21	(1 << 2)	/* V.21 channel 2 HDLC flags (T.30 preamble) */
+#define ECDIS_CNG	(1 << 3)	/* 1100Hz fax calling tone */
+#define ECDIS_BELL	(1 << 4)	/* 2225Hz Bell 103 answer tone */
+
+/* All the tones are measured over the same 10ms blocks, by a bank of
+   Goertzel filters updated in a single pass over each chunk. The bins are
+   100Hz wide, which covers the frequency tolerances of all the tones, and
+   the filters are skipped altogether for the rest of a block as soon as a
+   chunk is too quiet to contain any of them. */
+#define ECDIS_BLOCK		80
+/* Mean magnitude of a chunk below which it is considered quiet */
+#define ECDIS_MIN_LEVEL		70
+
+#if (ECDIS_BLOCK % DAHDI_CHUNKSIZE)
+#error ECDIS_BLOCK must be a multiple of DAHDI_CHUNKSIZE
+#endif
+
+enum {
+	ECDIS_1100,
+	ECDIS_1650,
+	ECDIS_1850,
+	ECDIS_2100,
+	ECDIS_2225,
+};
+
+/* 2*cos(2*pi*f/8000), Q13 */
+static const int32_t ecdis_coeffs[DAHDI_ECDIS_TONES] = {
+	[ECDIS_1100] = 10641,
+	[ECDIS_1650] = 4447,
+	[ECDIS_1850] = 1926,
+	[ECDIS_2100] = -1285,
+	[ECDIS_2225] = -2880,
+};
+
 static inline void echo_can_disable_detector_init (echo_can_disable_detector_state_t *det)
 {
-    /* Elliptic notch */
-    /* This is actually centred at 2095Hz, but gets the balance we want, due
-       to the asymmetric walls of the notch */
-    biquad2_init (&det->notch,
-    	     	  (int32_t) (-0.7600000*32768.0),
-    	    	  (int32_t) (-0.1183852*32768.0),
-    	    	  (int32_t) (-0.5104039*32768.0),
-    	    	  (int32_t) ( 0.1567596*32768.0),
-    	    	  (int32_t) ( 1.0000000*32768.0));
-
-    det->channel_level = 0;
-    det->notch_level = 0;    
-    det->tone_present = FALSE;
-    det->tone_cycle_duration = 0;
-    det->good_cycles = 0;
-    det->hit = 0;
+	memset(det, 0, sizeof(*det));
+}
+/*- End of function --------------------------------------------------------*/
+
+/* Energy of the block in one Goertzel bin. For a pure tone at the bin
+   frequency this is ECDIS_BLOCK/2 times block_energy. */
+static inline uint64_t ecdis_tone_energy (echo_can_disable_detector_state_t *det, int k)
+{
+	int64_t v1 = det->v1[k];
+	int64_t v2 = det->v2[k];
+	int64_t e;
+
+	e = v1*v1 + v2*v2 - ((ecdis_coeffs[k]*v1*v2) >> 13);
+	return (e > 0)  ?  e  :  0;
+}
+/*- End of function --------------------------------------------------------*/
+
+/* Does the tone hold at least tenths/10 of the block's energy? */
+static inline int ecdis_tone_present (echo_can_disable_detector_state_t *det, uint64_t energy, int tenths)
+{
+	if (det->block_quiet)
+		return FALSE;
+	return energy*10 >= (uint64_t) det->block_energy*(ECDIS_BLOCK/2)*tenths;
+}
+/*- End of function --------------------------------------------------------*/
+
+static inline int ecdis_check_block (echo_can_disable_detector_state_t *det)
+{
+	uint64_t e[DAHDI_ECDIS_TONES];
+	int hits = 0;
+	int k;
+
+	if (det->block_quiet)
+		memset(e, 0, sizeof(e));
+	else {
+		for (k = 0;  k < DAHDI_ECDIS_TONES;  k++)
+			e[k] = ecdis_tone_energy(det, k);
+	}
+
+	/* 2100Hz: ANS is a steady tone, ANS/PR has a phase reversal every
+	   450+-25ms, which shows as a block or two without the tone. ANSam is
+	   amplitude modulated by +-20% at 15Hz, so a good share of its blocks
+	   fall well below the strongest ones. */
+	if (ecdis_tone_present(det, e[ECDIS_2100], 7)) {
+		if (det->ans_gap > 0  &&  det->ans_gap <= 2) {
+			/* Back after a phase reversal; do we get a kick every 450+-25ms? */
+			if (det->ans_cycle + det->ans_gap >= 42  &&  det->ans_cycle + det->ans_gap <= 48)
+				det->good_cycles++;
+			det->ans_cycle = 0;
+		}
+		det->ans_gap = 0;
+		det->ans_cycle++;
+		det->am_blocks++;
+		if (e[ECDIS_2100] > det->am_max)
+			det->am_max = e[ECDIS_2100];
+		else if (e[ECDIS_2100]*3 < det->am_max*2)
+			det->am_low++;
+		/* It's ANS/PR, so wait for at least three cycles before returning
+		   a hit; a steady 600ms of tone is ANS. */
+		if (det->good_cycles > 2  ||  det->ans_cycle >= 60) {
+			/* More than one block in eight well below the peak means AM */
+			hits |= (det->am_low*8 > det->am_blocks)  ?  ECDIS_ANSAM  :  ECDIS_CED;
+		}
+	} else if (++det->ans_gap > 2) {
+		det->ans_cycle = 0;
+		det->good_cycles = 0;
+		det->am_blocks = 0;
+		det->am_low = 0;
+		det->am_max = 0;
+	}
+
+	/* 1100Hz: CNG is 0.5s of tone every 3.5s */
+	if (ecdis_tone_present(det, e[ECDIS_1100], 5)) {
+		if (++det->cng_blocks >= 40)
+			hits |= ECDIS_CNG;
+	} else {
+		det->cng_blocks = 0;
+	}
+
+	/* 2225Hz: Bell 103 answer tone */
+	if (ecdis_tone_present(det, e[ECDIS_2225], 7)) {
+		if (++det->bell_blocks >= 50)
+			hits |= ECDIS_BELL;
+	} else {
+		det->bell_blocks = 0;
+	}
+
+	/* 1650/1850Hz: V.21 channel 2 FSK carrying HDLC flags, which must
+	   show both frequencies */
+	if (ecdis_tone_present(det, e[ECDIS_1650] + e[ECDIS_1850], 5)) {
+		if (ecdis_tone_present(det, e[ECDIS_1650], 1))
+			det->v21_seen |= 1;
+		if (ecdis_tone_present(det, e[ECDIS_1850], 1))
+			det->v21_seen |= 2;
+		if (++det->v21_blocks >= 25  &&  det->v21_seen == 3)
+			hits |= ECDIS_V21;
+	} else {
+		det->v21_blocks = 0;
+		det->v21_seen = 0;
+	}
+
+	memset(det->v1, 0, sizeof(det->v1));
+	memset(det->v2, 0, sizeof(det->v2));
+	det->block_energy = 0;
+	det->block_samples = 0;
+	det->block_quiet = FALSE;
+
+	/* Report each tone once */
+	hits &= ~det->hits;
+	det->hits |= hits;
+	return hits;
 }
 /*- End of function --------------------------------------------------------*/
 
+/* Feed a chunk of linear samples through the detector bank. Returns a mask
+   of the ECDIS_* tones detected for the first time. */
 static inline int echo_can_disable_detector_update (echo_can_disable_detector_state_t *det,
-						    int16_t amp)
+						    const short *amp, int len)
 {
-	int16_t notched;
-
-    	notched = biquad2 (&det->notch, amp);
-    	/* Estimate the overall energy in the channel, and the energy in
-	   the notch (i.e. overall channel energy - tone energy => noise).
-	   Use abs instead of multiply for speed (is it really faster?).
-	   Damp the overall energy a little more for a stable result.
-	   Damp the notch energy a little less, so we don't damp out the
-	   blip every time the phase reverses */
-        det->channel_level += ((abs(amp) - det->channel_level) >> 5);
-	det->notch_level += ((abs(notched) - det->notch_level) >> 4);
-	if (det->channel_level >= 70) {
-		/* There is adequate energy in the channel. Is it mostly at 2100Hz? */
-		if (det->notch_level*6 < det->channel_level) {
-			det->tone_cycle_duration++;
-			/* The notch says yes, so we have the tone. */
-			if (!det->tone_present) {
-				/* Do we get a kick every 450+-25ms? */
-				if ((det->tone_cycle_duration >= (425 * 8)) &&
-				    (det->tone_cycle_duration <= (475 * 8))) {
-					/* It's ANS/PR (CED with polarity reversals), so wait
-					   for at least three cycles before returning a hit. */
-					det->good_cycles++;
-					if (det->good_cycles > 2)
-						det->hit = TRUE;
-				}
-				det->tone_cycle_duration = 0;
-				det->tone_present = TRUE;
-			} else if (det->tone_cycle_duration >= 600 * 8) {
-				/* It's ANS (CED without polarity reversals)
-				   so return a hit. */
-				det->hit = TRUE;
+	uint32_t level = 0;
+	uint32_t energy;
+	int32_t x;
+	int32_t v0;
+	int i;
+	int k;
+
+	if (!det->block_quiet) {
+		for (i = 0;  i < len;  i++)
+			level += abs(amp[i]);
+		if (level < ECDIS_MIN_LEVEL*len)
+			det->block_quiet = TRUE;
+	}
+
+	if (!det->block_quiet) {
+		energy = det->block_energy;
+		for (i = 0;  i < len;  i++) {
+			/* Scaled so that the filters can't overflow in a block */
+			x = amp[i] >> 4;
+			energy += x*x;
+			for (k = 0;  k < DAHDI_ECDIS_TONES;  k++) {
+				v0 = ((ecdis_coeffs[k]*det->v1[k]) >> 13) - det->v2[k] + x;
+				det->v2[k] = det->v1[k];
+				det->v1[k] = v0;
 			}
-		} else {
-			det->tone_present = FALSE;
 		}
-	} else {
-		det->tone_present = FALSE;
-		det->tone_cycle_duration = 0;
-		det->good_cycles = 0;
+		det->block_energy = energy;
 	}
 
-	return  det->hit;
+	det->block_samples += len;
+	if (det->block_samples < ECDIS_BLOCK)
+		return 0;
+	return ecdis_check_block(det);
 }
 /*- End of function --------------------------------------------------------*/
 /*- End of file ------------------------------------------------------------*/
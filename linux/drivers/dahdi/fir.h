@@ -56,6 +56,20 @@ static inline void fir16_create (fir16_state_t *fir,
 }
 /*- End of function --------------------------------------------------------*/
     
+/* As fir16_create(), but the history buffer (taps entries, zeroed) is supplied
+   by the caller, for states which are allocated in one block. */
+static inline void fir16_init (fir16_state_t *fir,
+			       int16_t *coeffs,
+			       int16_t *history,
+			       int taps)
+{
+    fir->taps = taps;
+    fir->curr_pos = taps - 1;
+    fir->coeffs = coeffs;
+    fir->history = history;
+}
+/*- End of function --------------------------------------------------------*/
+
 static inline void fir16_free (fir16_state_t *fir)
 {
     kfree(fir->history);
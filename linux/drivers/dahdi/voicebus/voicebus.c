@@ -65,9 +65,23 @@
 #endif
 #endif
 
-/*! The number of descriptors in both the tx and rx descriptor ring. */
-#define DRING_SIZE	(1 << 7)  /* Must be a power of 2 */
-#define DRING_MASK	(DRING_SIZE-1)
+/* When polled is set as an interface starts, the interrupt handler only
+ * masks the tx complete interrupt and schedules a tasklet, which drains up
+ * to poll_budget completed tx and rx descriptors a pass and unmasks the
+ * interrupt again once there are none left.  Not used with the TIMER
+ * deferred processing, which never takes interrupts. */
+static int polled;
+static int poll_budget = 16;
+
+/* Latency added after missed interrupts is taken back a millisecond at a
+ * time once the interface has gone this many seconds without missing one,
+ * as long as at least VB_SHRINK_MARGIN buffers stayed queued throughout.
+ * Each time the latency has to grow again soon after shrinking, the wait
+ * doubles, up to VB_SHRINK_BACKOFF times this.  0 never shrinks it. */
+static int latency_shrink_secs = 60;
+#define VB_SHRINK_MARGIN	3
+#define VB_SHRINK_BACKOFF	16
+
 
 /* Interrupt status' reported in SR_CSR5 */
 #define TX_COMPLETE_INTERRUPT 		0x00000001
@@ -110,6 +124,8 @@
 #define 	CSR9_MDI		0x00080000
 
 #define OWN_BIT (1 << 31)
+/* Set in des1 of a tx descriptor to interrupt when it completes. */
+#define TX_INTERRUPT_ON_COMPLETION (1 << 31)
 
 /* In memory structure shared by the host and the adapter. */
 struct voicebus_descriptor {
@@ -126,8 +142,11 @@ struct voicebus_descriptor_list {
 	unsigned int 	head;
 	/* Write ready buffers to the tail. */
 	unsigned int 	tail;
+	/* Number of descriptors, a power of two, and one less. */
+	unsigned int	size;
+	unsigned int	mask;
 	/* Array to save the kernel virtual address of pending buffers. */
-	void  		*pending[DRING_SIZE];
+	void  		**pending;
 	/* PCI Bus address of the descriptor list. */
 	dma_addr_t	desc_dma;
 	/*! The number of buffers currently submitted to the hardware. */
@@ -136,6 +155,14 @@ struct voicebus_descriptor_list {
 	unsigned int	padding;
 };
 
+/*! The last few latency changes, which are shown in sysfs. */
+#define VB_LATENCY_HISTORY	16
+struct vb_latency_change {
+	unsigned long	when;	/* jiffies */
+	u16		from;
+	u16		to;
+};
+
 /**
  * struct voicebus -
  *
@@ -184,6 +211,17 @@ struct voicebus {
 #elif VOICEBUS_DEFERRED == TIMER
 	/*! Process buffers in a timer without generating interrupts. */
 	struct timer_list timer;
+#endif
+#if VOICEBUS_DEFERRED != TIMER
+	/*! Drains the descriptor rings while POLLED is set. */
+	struct tasklet_struct	poll_tasklet;
+	/*! Budget of each pass of poll_tasklet, taken from poll_budget. */
+	unsigned int	budget;
+	/*! Interrupts which scheduled a poll, poll passes, and passes which
+	 * ran out of budget. */
+	unsigned long	poll_interrupts;
+	unsigned long	poll_passes;
+	unsigned long	poll_exhausted;
 #endif
 	/*! Callback function to board specific module to process frames. */
 	void (*handle_receive)(void *vbb, void *context);
@@ -193,10 +231,26 @@ struct voicebus {
 	struct completion stopped_completion;
 	/*! Flags */
 	unsigned long flags;
+	/*! What was last written to IER_CSR7, so that the interrupt handler
+	 * ignores status for sources that are masked. */
+	u32		enabled_interrupts;
 	/*! Number of tx buffers to queue up before enabling interrupts. */
 	unsigned int 	min_tx_buffer_count;
 	unsigned int	max_latency;
-	void		*vbb_stash[DRING_SIZE];
+	/*! The floor set with voicebus_set_minlatency. */
+	unsigned int	min_latency;
+	/*! Milliseconds of stable running needed before the next shrink. */
+	unsigned int	shrink_after;
+	/*! Milliseconds since the latency last changed or an underrun. */
+	unsigned int	stable_ms;
+	/*! Fewest tx buffers left queued at a service in that time. */
+	unsigned int	margin;
+	unsigned long	last_shrink;
+	struct vb_latency_change history[VB_LATENCY_HISTORY];
+	unsigned int	history_count;
+	/*! Tx descriptors completed for each tx complete interrupt. */
+	unsigned int	frames_per_service;
+	void		**vbb_stash;
 	unsigned int	count;
 };
 
@@ -238,6 +292,7 @@ static inline void handle_transmit(struct voicebus *vb, void *vbb)
 #define STOP				4
 #define STOPPED				5
 #define LATENCY_LOCKED			6
+#define POLLED				7
 
 #if VOICEBUS_DEFERRED == WORKQUEUE
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 18)
@@ -301,13 +356,19 @@ vb_initialize_descriptors(struct voicebus *vb, struct voicebus_descriptor_list *
 		dl->padding = 0;
 	}
 
+	dl->pending = kcalloc(dl->size, sizeof(dl->pending[0]), GFP_KERNEL);
+	if (!dl->pending)
+		return -ENOMEM;
 	dl->desc = pci_alloc_consistent(vb->pdev,
-		(sizeof(*d) + dl->padding) * DRING_SIZE, &dl->desc_dma);
-	if (!dl->desc)
+		(sizeof(*d) + dl->padding) * dl->size, &dl->desc_dma);
+	if (!dl->desc) {
+		kfree(dl->pending);
+		dl->pending = NULL;
 		return -ENOMEM;
+	}
 
-	memset(dl->desc, 0, (sizeof(*d) + dl->padding) * DRING_SIZE);
-	for (i = 0; i < DRING_SIZE; ++i) {
+	memset(dl->desc, 0, (sizeof(*d) + dl->padding) * dl->size);
+	for (i = 0; i < dl->size; ++i) {
 		d = vb_descriptor(dl, i);
 		d->des1 = des1;
 	}
@@ -344,16 +405,26 @@ vb_initialize_tx_descriptors(struct voicebus *vb)
 		dl->padding = 0;
 	}
 
+	dl->pending = kcalloc(dl->size, sizeof(dl->pending[0]), GFP_KERNEL);
+	if (!dl->pending)
+		return -ENOMEM;
 	dl->desc = pci_alloc_consistent(vb->pdev,
 					(sizeof(*d) + dl->padding) *
-					DRING_SIZE, &dl->desc_dma);
-	if (!dl->desc)
+					dl->size, &dl->desc_dma);
+	if (!dl->desc) {
+		kfree(dl->pending);
+		dl->pending = NULL;
 		return -ENOMEM;
+	}
 
-	memset(dl->desc, 0, (sizeof(*d) + dl->padding) * DRING_SIZE);
-	for (i = 0; i < DRING_SIZE; ++i) {
+	memset(dl->desc, 0, (sizeof(*d) + dl->padding) * dl->size);
+	for (i = 0; i < dl->size; ++i) {
 		d = vb_descriptor(dl, i);
 		d->des1 = des1;
+		/* Only every frames_per_service'th descriptor interrupts, and
+		 * the deferred processing completes all of them. */
+		if ((i + 1) % vb->frames_per_service)
+			d->des1 &= ~TX_INTERRUPT_ON_COMPLETION;
 		d->buffer1 = vb->idle_vbb_dma_addr;
 		dl->pending[i] = vb->idle_vbb;
 		SET_OWNED(d);
@@ -370,6 +441,13 @@ vb_initialize_rx_descriptors(struct voicebus *vb)
 		vb, &vb->rxd, vb->framesize, DMA_FROM_DEVICE);
 }
 
+/* When the tx complete interrupt only comes every frames_per_service
+ * frames, the host needs that many more buffers queued to keep ahead. */
+static inline unsigned int vb_latency_floor(const struct voicebus *vb)
+{
+	return VOICEBUS_DEFAULT_LATENCY + vb->frames_per_service - 1;
+}
+
 /*! \brief  Use to set the minimum number of buffers queued to the hardware
  * before enabling interrupts.
  */
@@ -384,15 +462,16 @@ voicebus_set_minlatency(struct voicebus *vb, unsigned int ms)
 	 *
 	 */
 #define MESSAGE "%d ms is an invalid value for minumum latency.  Setting to %d ms.\n"
-	if (DRING_SIZE < ms) {
-		dev_warn(&vb->pdev->dev, MESSAGE, ms, DRING_SIZE);
+	if (vb->txd.size < ms) {
+		dev_warn(&vb->pdev->dev, MESSAGE, ms, vb->txd.size);
 		return -EINVAL;
-	} else if (VOICEBUS_DEFAULT_LATENCY > ms) {
-		dev_warn(&vb->pdev->dev, MESSAGE, ms, VOICEBUS_DEFAULT_LATENCY);
+	} else if (vb_latency_floor(vb) > ms) {
+		dev_warn(&vb->pdev->dev, MESSAGE, ms, vb_latency_floor(vb));
 		return -EINVAL;
 	}
 	VBLOCK(vb);
 	vb->min_tx_buffer_count = ms;
+	vb->min_latency = ms;
 	VBUNLOCK(vb);
 	return 0;
 }
@@ -525,7 +604,7 @@ vb_cleanup_tx_descriptors(struct voicebus *vb)
 
 	BUG_ON(!vb_is_stopped(vb));
 
-	for (i = 0; i < DRING_SIZE; ++i) {
+	for (i = 0; i < dl->size; ++i) {
 		d = vb_descriptor(dl, i);
 		if (d->buffer1 && (d->buffer1 != vb->idle_vbb_dma_addr)) {
 			WARN_ON(!dl->pending[i]);
@@ -552,7 +631,7 @@ vb_cleanup_rx_descriptors(struct voicebus *vb)
 
 	BUG_ON(!vb_is_stopped(vb));
 
-	for (i = 0; i < DRING_SIZE; ++i) {
+	for (i = 0; i < dl->size; ++i) {
 		d = vb_descriptor(dl, i);
 		if (d->buffer1) {
 			dma_unmap_single(&vb->pdev->dev, d->buffer1,
@@ -588,8 +667,10 @@ vb_free_descriptors(struct voicebus *vb, struct voicebus_descriptor_list *dl)
 	vb_cleanup_descriptors(vb, dl);
 	pci_free_consistent(
 		vb->pdev,
-		(sizeof(struct voicebus_descriptor)+dl->padding)*DRING_SIZE,
+		(sizeof(struct voicebus_descriptor)+dl->padding)*dl->size,
 		dl->desc, dl->desc_dma);
+	kfree(dl->pending);
+	dl->pending = NULL;
 }
 
 /*!
@@ -834,7 +915,7 @@ int voicebus_transmit(struct voicebus *vb, void *vbb)
 	}
 
 	dl->pending[dl->tail] = vbb;
-	dl->tail = (++(dl->tail)) & DRING_MASK;
+	dl->tail = (++(dl->tail)) & dl->mask;
 	d->buffer1 = dma_map_single(&vb->pdev->dev, vbb,
 				    vb->framesize, DMA_TO_DEVICE);
 	SET_OWNED(d); /* That's it until the hardware is done with it. */
@@ -864,7 +945,7 @@ vb_submit_rxb(struct voicebus *vb, void *vbb)
 	}
 
 	dl->pending[tail] = vbb;
-	dl->tail = (++tail) & DRING_MASK;
+	dl->tail = (++tail) & dl->mask;
 	d->buffer1 = dma_map_single(&vb->pdev->dev, vbb,
 				    vb->framesize, DMA_FROM_DEVICE);
 	SET_OWNED(d); /* That's it until the hardware is done with it. */
@@ -902,7 +983,7 @@ vb_get_completed_txb(struct voicebus *vb)
 			 vb->framesize, DMA_TO_DEVICE);
 
 	vbb = dl->pending[head];
-	dl->head = (++head) & DRING_MASK;
+	dl->head = (++head) & dl->mask;
 	d->buffer1 = vb->idle_vbb_dma_addr;
 	SET_OWNED(d);
 	atomic_dec(&dl->count);
@@ -925,7 +1006,7 @@ vb_get_completed_rxb(struct voicebus *vb)
 	dma_unmap_single(&vb->pdev->dev, d->buffer1,
 			 vb->framesize, DMA_FROM_DEVICE);
 	vbb = dl->pending[head];
-	dl->head = (++head) & DRING_MASK;
+	dl->head = (++head) & dl->mask;
 	d->buffer1 = 0;
 	atomic_dec(&dl->count);
 	return vbb;
@@ -982,16 +1063,23 @@ vb_rx_demand_poll(struct voicebus *vb)
 	VBUNLOCK(vb);
 }
 
+static inline void
+__vb_set_interrupts(struct voicebus *vb, u32 mask)
+{
+	vb->enabled_interrupts = mask;
+	__vb_setctl(vb, IER_CSR7, mask);
+}
+
 static void
 __vb_enable_interrupts(struct voicebus *vb)
 {
-	__vb_setctl(vb, IER_CSR7, DEFAULT_INTERRUPTS);
+	__vb_set_interrupts(vb, DEFAULT_INTERRUPTS);
 }
 
 static void
 __vb_disable_interrupts(struct voicebus *vb)
 {
-	__vb_setctl(vb, IER_CSR7, 0);
+	__vb_set_interrupts(vb, 0);
 }
 
 static void
@@ -1050,7 +1138,7 @@ voicebus_start(struct voicebus *vb)
 	 *  handle transmit as if it were.
 	 */
 	/* Ensure that all the rx slots are ready for a buffer. */
-	for (i = 0; i < DRING_SIZE; ++i) {
+	for (i = 0; i < vb->rxd.size; ++i) {
 		vbb = voicebus_alloc(vb);
 		if (unlikely(NULL == vbb)) {
 			BUG_ON(1);
@@ -1071,6 +1159,18 @@ voicebus_start(struct voicebus *vb)
 
 	}
 
+#if VOICEBUS_DEFERRED != TIMER
+	if (polled) {
+		/* The tx buffers of a pass are stashed, and more than
+		 * VOICEBUS_DEFAULT_MAXLATENCY at once means trouble. */
+		vb->budget = min_t(unsigned int, max(poll_budget, 1),
+				   VOICEBUS_DEFAULT_MAXLATENCY);
+		set_bit(POLLED, &vb->flags);
+	} else {
+		clear_bit(POLLED, &vb->flags);
+	}
+#endif
+
 	VBLOCK(vb);
 	clear_bit(STOP, &vb->flags);
 	clear_bit(STOPPED, &vb->flags);
@@ -1173,6 +1273,8 @@ voicebus_stop(struct voicebus *vb)
 
 #if VOICEBUS_DEFERRED == TIMER
 	del_timer_sync(&vb->timer);
+#else
+	tasklet_kill(&vb->poll_tasklet);
 #endif
 
 	return 0;
@@ -1195,6 +1297,52 @@ voicebus_current_latency_show(struct device *dev,
 
 DEVICE_ATTR(voicebus_current_latency, 0444,
 	    voicebus_current_latency_show, NULL);
+
+/* One line for each of the latest changes, oldest first:  how many seconds
+ * ago, and the latency before and after. */
+static ssize_t
+voicebus_latency_history_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	unsigned long flags;
+	struct voicebus *vb = dev_get_drvdata(dev);
+	struct vb_latency_change history[VB_LATENCY_HISTORY];
+	unsigned int count, i, first;
+	int len = 0;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	count = vb->history_count;
+	memcpy(history, vb->history, sizeof(history));
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	first = (count > VB_LATENCY_HISTORY) ? count - VB_LATENCY_HISTORY : 0;
+	for (i = first; i < count; ++i) {
+		const struct vb_latency_change *c =
+			&history[i % VB_LATENCY_HISTORY];
+		len += sprintf(buf + len, "%lu %u %u\n",
+			       (jiffies - c->when) / HZ, c->from, c->to);
+	}
+	return len;
+}
+
+DEVICE_ATTR(voicebus_latency_history, 0444,
+	    voicebus_latency_history_show, NULL);
+
+#if VOICEBUS_DEFERRED != TIMER
+static ssize_t
+voicebus_poll_stats_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	struct voicebus *vb = dev_get_drvdata(dev);
+	return sprintf(buf, "%s budget %u interrupts %lu passes %lu "
+		       "exhausted %lu\n",
+		       test_bit(POLLED, &vb->flags) ? "polled" : "interrupt",
+		       vb->budget, vb->poll_interrupts, vb->poll_passes,
+		       vb->poll_exhausted);
+}
+
+DEVICE_ATTR(voicebus_poll_stats, 0444, voicebus_poll_stats_show, NULL);
+#endif
 #endif
 
 /*!
@@ -1211,6 +1359,10 @@ voicebus_release(struct voicebus *vb)
 {
 #ifdef CONFIG_VOICEBUS_SYSFS
 	device_remove_file(&vb->pdev->dev, &dev_attr_voicebus_current_latency);
+	device_remove_file(&vb->pdev->dev, &dev_attr_voicebus_latency_history);
+#if VOICEBUS_DEFERRED != TIMER
+	device_remove_file(&vb->pdev->dev, &dev_attr_voicebus_poll_stats);
+#endif
 #endif
 
 	/* quiesce the hardware */
@@ -1219,6 +1371,9 @@ voicebus_release(struct voicebus *vb)
 	destroy_workqueue(vb->workqueue);
 #elif VOICEBUS_DEFERRED == TASKLET
 	tasklet_kill(&vb->tasklet);
+#endif
+#if VOICEBUS_DEFERRED != TIMER
+	tasklet_kill(&vb->poll_tasklet);
 #endif
 	vb_reset_interface(vb);
 #if VOICEBUS_DEFERRED != TIMER
@@ -1233,12 +1388,70 @@ voicebus_release(struct voicebus *vb)
 				  vb->idle_vbb, vb->idle_vbb_dma_addr);
 	}
 	kmem_cache_destroy(vb->buffer_cache);
+	kfree(vb->vbb_stash);
 	release_region(vb->iobase, 0xff);
 	pci_disable_device(vb->pdev);
 	kfree(vb);
 }
 EXPORT_SYMBOL(voicebus_release);
 
+/* Called with vb->lock held. */
+static void
+__vb_record_latency(struct voicebus *vb, unsigned int from, unsigned int to)
+{
+	struct vb_latency_change *c =
+		&vb->history[vb->history_count++ % VB_LATENCY_HISTORY];
+	c->when = jiffies;
+	c->from = from;
+	c->to = to;
+}
+
+/* Starts looking for a stable period over again. */
+static inline void vb_restart_stable_period(struct voicebus *vb)
+{
+	vb->stable_ms = 0;
+	vb->margin = vb->txd.size;
+}
+
+/**
+ * vb_should_decrease_latency() - Check whether to drop a tx buffer.
+ * @completed:	Non-idle tx buffers completed since the last check.
+ * @queued:	Tx buffers still queued to the hardware.
+ *
+ * Each completed buffer is a millisecond of running.
+ */
+static int
+vb_should_decrease_latency(struct voicebus *vb, unsigned int completed,
+			   unsigned int queued)
+{
+	if (!vb->shrink_after || test_bit(LATENCY_LOCKED, &vb->flags))
+		return 0;
+	if (queued < vb->margin)
+		vb->margin = queued;
+	vb->stable_ms += completed;
+	if (vb->stable_ms < vb->shrink_after)
+		return 0;
+	if ((vb->min_tx_buffer_count <= vb->min_latency) ||
+	    (vb->margin < VB_SHRINK_MARGIN)) {
+		vb_restart_stable_period(vb);
+		return 0;
+	}
+	return 1;
+}
+
+/* The caller drops one completed tx buffer instead of sending it again. */
+static void
+vb_decrease_latency(struct voicebus *vb)
+{
+	spin_lock(&vb->lock);
+	__vb_record_latency(vb, vb->min_tx_buffer_count,
+			    vb->min_tx_buffer_count - 1);
+	--vb->min_tx_buffer_count;
+	spin_unlock(&vb->lock);
+	vb->last_shrink = jiffies;
+	vb_restart_stable_period(vb);
+}
+
 static void
 vb_increase_latency(struct voicebus *vb, unsigned int increase)
 {
@@ -1254,8 +1467,13 @@ vb_increase_latency(struct voicebus *vb, unsigned int increase)
 	if (unlikely(increase > VOICEBUS_MAXLATENCY_BUMP))
 		increase = VOICEBUS_MAXLATENCY_BUMP;
 
-	if ((increase + vb->min_tx_buffer_count) > vb->max_latency)
+	if ((increase + vb->min_tx_buffer_count) > vb->max_latency) {
+		/* Already at the most we may add: nothing to record, and no
+		 * reason to back off shrinking again. */
+		if (vb->min_tx_buffer_count >= vb->max_latency)
+			return;
 		increase = vb->max_latency - vb->min_tx_buffer_count;
+	}
 
 	/* Because there are 2 buffers in the transmit FIFO on the hardware,
 	 * setting 3 ms of latency means that the host needs to be able to
@@ -1276,8 +1494,17 @@ vb_increase_latency(struct voicebus *vb, unsigned int increase)
 	/* Set the new latency (but we want to ensure that there aren't any
 	 * printks to the console, so we don't call the function) */
 	spin_lock(&vb->lock);
+	__vb_record_latency(vb, vb->min_tx_buffer_count,
+			    vb->min_tx_buffer_count + increase);
 	vb->min_tx_buffer_count += increase;
 	spin_unlock(&vb->lock);
+
+	/* Shrinking was premature, so wait longer before the next try. */
+	if (vb->last_shrink && time_before(jiffies, vb->last_shrink +
+					   msecs_to_jiffies(vb->shrink_after))) {
+		vb->shrink_after = min(vb->shrink_after * 2,
+			latency_shrink_secs * 1000U * VB_SHRINK_BACKOFF);
+	}
 }
 
 static void vb_set_all_owned(struct voicebus *vb,
@@ -1286,7 +1513,7 @@ static void vb_set_all_owned(struct voicebus *vb,
 	int i;
 	struct voicebus_descriptor *d;
 
-	for (i = 0; i < DRING_SIZE; ++i) {
+	for (i = 0; i < dl->size; ++i) {
 		d = vb_descriptor(dl, i);
 		SET_OWNED(d);
 	}
@@ -1317,7 +1544,7 @@ static unsigned int __vb_get_default_behind_count(const struct voicebus *vb)
 	if (current_descriptor->buffer1 == vb->idle_vbb_dma_addr)
 		return 2;
 
-	next_descriptor = vb_descriptor(dl, ((dl->head + 1) & DRING_MASK));
+	next_descriptor = vb_descriptor(dl, ((dl->head + 1) & dl->mask));
 	if (next_descriptor->buffer1 == vb->idle_vbb_dma_addr)
 		return 1;
 
@@ -1384,7 +1611,7 @@ static unsigned int vb_recover_tx_descriptor_list(struct voicebus *vb)
 		d->buffer1 = vb->idle_vbb_dma_addr;
 		dl->pending[dl->head] = vb->idle_vbb;
 		SET_OWNED(d);
-		dl->head = ++dl->head & DRING_MASK;
+		dl->head = ++dl->head & dl->mask;
 		d = vb_descriptor(dl, dl->head);
 		++behind;
 	}
@@ -1393,7 +1620,7 @@ static unsigned int vb_recover_tx_descriptor_list(struct voicebus *vb)
 	 * currently working on one of the idle buffers that we can't detect is
 	 * completed yet in the previous block. Set the head and tail pointers
 	 * to this new position so that everything can pick up normally. */
-	dl->tail = dl->head = (dl->head + 10) & DRING_MASK;
+	dl->tail = dl->head = (dl->head + 10) & dl->mask;
 
 	if (NULL != vbb)
 		handle_transmit(vb, vbb);
@@ -1402,15 +1629,21 @@ static unsigned int vb_recover_tx_descriptor_list(struct voicebus *vb)
 }
 
 /**
- * vb_deferred() - Manage the transmit and receive descriptor rings.
+ * __vb_deferred() - Manage the transmit and receive descriptor rings.
+ * @budget:	The most tx buffers, and the most rx buffers, to complete.
  *
+ * Returns nonzero if it stopped on the budget with buffers still completed.
  */
-static void vb_deferred(struct voicebus *vb)
+static int __vb_deferred(struct voicebus *vb, unsigned int budget)
 {
 	unsigned int buffer_count;
 	unsigned int i;
 	unsigned int idle_buffers;
+	unsigned int received = 0;
 	int softunderrun;
+	int decreased = 0;
+	int more = 0;
+	int tx_exhausted;
 
 	int underrun = test_bit(TX_UNDERRUN, &vb->flags);
 
@@ -1425,18 +1658,21 @@ static void vb_deferred(struct voicebus *vb)
 	 * On the other hand, idle buffers are "dummy" buffers that solely exist
 	 * to in order to prevent the transmit descriptor ring from ever
 	 * completely draining. */
-	while ((vb->vbb_stash[buffer_count] = vb_get_completed_txb(vb))) {
+	while ((buffer_count < budget) &&
+	       (vb->vbb_stash[buffer_count] = vb_get_completed_txb(vb))) {
 		++buffer_count;
 		if (unlikely(VOICEBUS_DEFAULT_MAXLATENCY < buffer_count)) {
 			dev_warn(&vb->pdev->dev, "Critical problem detected "
 				 "in transmit ring descriptor\n");
-			if (buffer_count >= DRING_SIZE)
-				buffer_count = DRING_SIZE - 1;
+			if (buffer_count >= vb->txd.size)
+				buffer_count = vb->txd.size - 1;
 			break;
 		}
 	}
 
 	vb->count += buffer_count;
+	/* Taken before shrinking the latency can drop one of the buffers. */
+	tx_exhausted = (buffer_count == budget);
 
 	/* Next, check to see if we're in a softunderrun condition.
 	 *
@@ -1468,9 +1704,17 @@ static void vb_deferred(struct voicebus *vb)
 		 * transmitted before our interrupt handler was called. */
 		idle_buffers = vb_recover_tx_descriptor_list(vb);
 		vb_increase_latency(vb, idle_buffers);
+		vb_restart_stable_period(vb);
 	} else {
 		softunderrun = 0;
 		idle_buffers = 0;
+		if (buffer_count && !underrun &&
+		    vb_should_decrease_latency(vb, buffer_count,
+					       atomic_read(&vb->txd.count))) {
+			voicebus_free(vb, vb->vbb_stash[--buffer_count]);
+			vb_decrease_latency(vb);
+			decreased = 1;
+		}
 	}
 
 	/* Now we can process the completed non-idle buffers since we know at
@@ -1482,18 +1726,19 @@ static void vb_deferred(struct voicebus *vb)
 	 * completely ran out of transmit descriptors.  This is what we are
 	 * trying to avoid with all this racy softunderun business, but alas,
 	 * it's still possible to happen if interrupts are locked longer than
-	 * DRING_SIZE milliseconds for some reason. We should have already fixed
+	 * the ring size in milliseconds for some reason. We should have already fixed
 	 * up the descriptor ring in this case, so let's just tell the hardware
 	 * to reread what it believes the next descriptor is. */
 	if (unlikely(underrun)) {
 		if (printk_ratelimit()) {
 			dev_info(&vb->pdev->dev, "Host failed to service "
 				 "card interrupt within %d ms which is a "
-				 "hardunderun.\n", DRING_SIZE);
+				 "hardunderun.\n", vb->txd.size);
 		}
 		vb_rx_demand_poll(vb);
 		vb_tx_demand_poll(vb);
 		clear_bit(TX_UNDERRUN, &vb->flags);
+		vb_restart_stable_period(vb);
 	}
 
 	/* Print any messages about soft latency bumps after we fix the transmit
@@ -1512,19 +1757,85 @@ static void vb_deferred(struct voicebus *vb)
 				 "increase latency.\n", vb->max_latency);
 		}
 	}
+	if (unlikely(decreased && printk_ratelimit())) {
+		dev_info(&vb->pdev->dev, "No missed interrupts for %d s. "
+			 "Decreasing latency to %d ms.\n",
+			 vb->shrink_after / 1000, vb->min_tx_buffer_count);
+	}
 
 	/* And finally, pass up any receive buffers.  We also use vb->count to
 	 * make a half-hearted attempt to not pass any recieved idle buffers to
 	 * the caller, but this needs more work.... */
-	while ((vb->vbb_stash[0] = vb_get_completed_rxb(vb))) {
+	while ((received < budget) &&
+	       (vb->vbb_stash[0] = vb_get_completed_rxb(vb))) {
 		if (vb->count) {
 			vb->handle_receive(vb->vbb_stash[0], vb->context);
 			--vb->count;
 		}
 		vb_submit_rxb(vb, vb->vbb_stash[0]);
+		++received;
+	}
+
+	if (tx_exhausted) {
+		const struct voicebus_descriptor *d =
+			vb_descriptor(&vb->txd, vb->txd.head);
+		more = !OWNED(d) && (d->buffer1 != vb->idle_vbb_dma_addr);
 	}
+	if (received == budget) {
+		const struct voicebus_descriptor *d =
+			vb_descriptor(&vb->rxd, vb->rxd.head);
+		more |= d->buffer1 && !OWNED(d);
+	}
+	return more;
+}
+
+static inline void vb_deferred(struct voicebus *vb)
+{
+	__vb_deferred(vb, vb->txd.size);
+}
+
+#if VOICEBUS_DEFERRED != TIMER
+/*!
+ * \brief Drains the descriptor rings with the tx complete interrupt masked.
+ *
+ * The interrupt status is acked before the rings are looked at, so that a
+ * buffer completed after the last look raises the interrupt again as soon
+ * as it is unmasked.
+ */
+static void
+vb_poll_tasklet(unsigned long data)
+{
+	struct voicebus *vb = (struct voicebus *)data;
+	LOCKS_VOICEBUS;
+
+	++vb->poll_passes;
+	vb_setctl(vb, SR_CSR5, TX_COMPLETE_INTERRUPT);
+	if (__vb_deferred(vb, vb->budget)) {
+		/* Let everything else at the CPU before the next pass. */
+		++vb->poll_exhausted;
+		tasklet_schedule(&vb->poll_tasklet);
+		return;
+	}
+	VBLOCK(vb);
+	if (!test_bit(STOP, &vb->flags))
+		__vb_enable_interrupts(vb);
+	VBUNLOCK(vb);
 }
 
+/*!
+ * \brief Masks the tx complete interrupt and hands the rings to the poller.
+ *
+ * Called from the interrupt handler.
+ */
+static inline void
+vb_schedule_poll(struct voicebus *vb)
+{
+	__vb_set_interrupts(vb, DEFAULT_INTERRUPTS & ~CSR7_TCIE);
+	++vb->poll_interrupts;
+	tasklet_schedule(&vb->poll_tasklet);
+}
+#endif
+
 /*!
  * \brief Interrupt handler for VoiceBus interface.
  *
@@ -1548,10 +1859,32 @@ vb_isr(int irq, void *dev_id)
 	/* Mask out the reserved bits. */
 	int_status &= ~(0xfc004010);
 	int_status &= 0x7fff;
+#if VOICEBUS_DEFERRED != TIMER
+	/* Status bits line up with their enables in IER_CSR7.  A masked
+	 * source, such as tx complete while polling, stays set in SR_CSR5 and
+	 * must not claim a shared interrupt raised by another device.  The
+	 * timer runs with everything masked, so it looks at all of them. */
+	int_status &= vb->enabled_interrupts;
+#endif
 
 	if (!int_status)
 		return IRQ_NONE;
 
+#if VOICEBUS_DEFERRED != TIMER
+	if (test_bit(POLLED, &vb->flags) &&
+	    (int_status & (TX_COMPLETE_INTERRUPT | TX_UNAVAILABLE_INTERRUPT))) {
+		/* The poller acks the tx complete status itself. */
+		if (int_status & TX_UNAVAILABLE_INTERRUPT)
+			set_bit(TX_UNDERRUN, &vb->flags);
+		vb_schedule_poll(vb);
+		int_status &= ~(TX_COMPLETE_INTERRUPT |
+				TX_UNAVAILABLE_INTERRUPT);
+		__vb_setctl(vb, SR_CSR5, TX_UNAVAILABLE_INTERRUPT);
+		if (!int_status)
+			return IRQ_HANDLED;
+	}
+#endif
+
 	if (likely(int_status & TX_COMPLETE_INTERRUPT)) {
 		/* ******************************************************** */
 		/* NORMAL INTERRUPT CASE				    */
@@ -1573,7 +1906,7 @@ vb_isr(int irq, void *dev_id)
 			 * interrupt within the required time interval (1ms
 			 * for each buffer on the queue).  Increasing the
 			 * depth of the tx queue (up to a maximum of
-			 * DRING_SIZE) can make the driver / system more
+			 * the ring size) can make the driver / system more
 			 * tolerant of interrupt latency under periods of
 			 * heavy system load, but also increases the general
 			 * latency that the driver adds to the voice
@@ -1658,11 +1991,18 @@ vb_tasklet(unsigned long data)
 /*!
  * \brief Initalize the voicebus interface.
  *
+ * ring_size is the number of tx and of rx descriptors, a power of two from
+ * VOICEBUS_MIN_RING_SIZE to VOICEBUS_MAX_RING_SIZE, and frames_per_service
+ * is how many tx descriptors complete for each interrupt, a power of two
+ * up to VOICEBUS_MAX_FRAMES_PER_SERVICE.  Zero picks the defaults.
+ *
  * This function must be called in process context since it may sleep.
  * \todo Complete this description.
  */
 int
-voicebus_init(struct pci_dev *pdev, u32 framesize, const char *board_name,
+voicebus_init(struct pci_dev *pdev, u32 framesize,
+		  unsigned int ring_size, unsigned int frames_per_service,
+		  const char *board_name,
 		  void (*handle_receive)(void *vbb, void *context),
 		  void (*handle_transmit)(void *vbb, void *context),
 		  void *context,
@@ -1679,10 +2019,28 @@ voicebus_init(struct pci_dev *pdev, u32 framesize, const char *board_name,
 	BUG_ON(NULL == handle_receive);
 	BUG_ON(NULL == handle_transmit);
 
+	*vbp = NULL;
+	if (!ring_size)
+		ring_size = VOICEBUS_DEFAULT_RING_SIZE;
+	if (!frames_per_service)
+		frames_per_service = 1;
+	if ((ring_size & (ring_size - 1)) ||
+	    (ring_size < VOICEBUS_MIN_RING_SIZE) ||
+	    (ring_size > VOICEBUS_MAX_RING_SIZE)) {
+		dev_err(&pdev->dev, "%u is not a valid descriptor ring size.\n",
+			ring_size);
+		return -EINVAL;
+	}
+	if ((frames_per_service & (frames_per_service - 1)) ||
+	    (frames_per_service > VOICEBUS_MAX_FRAMES_PER_SERVICE)) {
+		dev_err(&pdev->dev, "%u is not a valid number of frames per "
+			"service.\n", frames_per_service);
+		return -EINVAL;
+	}
+
 	/* ----------------------------------------------------------------
 	   Initialize the pure software constructs.
 	   ---------------------------------------------------------------- */
-	*vbp = NULL;
 	vb = kmalloc(sizeof(*vb), GFP_KERNEL);
 	if (NULL == vb) {
 		dev_dbg(&vb->pdev->dev, "Failed to allocate memory for "
@@ -1701,7 +2059,13 @@ voicebus_init(struct pci_dev *pdev, u32 framesize, const char *board_name,
 	set_bit(STOP, &vb->flags);
 	clear_bit(IN_DEFERRED_PROCESSING, &vb->flags);
 	vb->framesize = framesize;
-	vb->min_tx_buffer_count = VOICEBUS_DEFAULT_LATENCY;
+	vb->txd.size = vb->rxd.size = ring_size;
+	vb->txd.mask = vb->rxd.mask = ring_size - 1;
+	vb->frames_per_service = frames_per_service;
+	vb->min_tx_buffer_count = vb_latency_floor(vb);
+	vb->min_latency = vb_latency_floor(vb);
+	vb->shrink_after = max(latency_shrink_secs, 0) * 1000U;
+	vb_restart_stable_period(vb);
 
 #if VOICEBUS_DEFERRED == WORKQUEUE
 	/* NOTE: This workqueue must be single threaded because locking is not
@@ -1724,6 +2088,9 @@ voicebus_init(struct pci_dev *pdev, u32 framesize, const char *board_name,
 	vb->timer.function = vb_timer;
 	vb->timer.data = (unsigned long)vb;
 #endif
+#if VOICEBUS_DEFERRED != TIMER
+	tasklet_init(&vb->poll_tasklet, vb_poll_tasklet, (unsigned long)vb);
+#endif
 
 	vb->handle_receive = handle_receive;
 	vb->handle_transmit = handle_transmit;
@@ -1753,10 +2120,25 @@ voicebus_init(struct pci_dev *pdev, u32 framesize, const char *board_name,
 		goto cleanup;
 	}
 
+	vb->vbb_stash = kcalloc(ring_size, sizeof(vb->vbb_stash[0]),
+				GFP_KERNEL);
+	if (!vb->vbb_stash) {
+		retval = -ENOMEM;
+		goto cleanup;
+	}
+
 #ifdef CONFIG_VOICEBUS_SYSFS
 	dev_dbg(&vb->pdev->dev, "Creating sysfs attributes.\n");
 	retval = device_create_file(&vb->pdev->dev,
 				    &dev_attr_voicebus_current_latency);
+	if (!retval)
+		retval = device_create_file(&vb->pdev->dev,
+					    &dev_attr_voicebus_latency_history);
+#if VOICEBUS_DEFERRED != TIMER
+	if (!retval)
+		retval = device_create_file(&vb->pdev->dev,
+					    &dev_attr_voicebus_poll_stats);
+#endif
 	if (retval) {
 		dev_dbg(&vb->pdev->dev,
 			"Failed to create device attributes.\n");
@@ -1858,6 +2240,8 @@ cleanup:
 	if (vb->buffer_cache)
 		kmem_cache_destroy(vb->buffer_cache);
 
+	kfree(vb->vbb_stash);
+
 	if (vb->iobase)
 		release_region(vb->iobase, 0xff);
 
@@ -1982,6 +2366,19 @@ void __exit voicebus_module_cleanup(void)
 	WARN_ON(!list_empty(&binary_loader_list));
 }
 
+module_param(latency_shrink_secs, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(latency_shrink_secs, "Seconds without a missed interrupt "
+	"before latency added for one is taken back a millisecond at a time, "
+	"for interfaces set up after this is set.  0 never takes it back.  "
+	"Default 60.");
+module_param(polled, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(polled, "Service the descriptor rings from a budgeted "
+	"poller, with the interrupt masked while there is work, on "
+	"interfaces started after this is set.  Default 0.");
+module_param(poll_budget, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_budget, "Most frames each way that one pass of the "
+	"poller services.  Default 16.");
+
 MODULE_DESCRIPTION("Voicebus Interface w/VPMADT032 support");
 MODULE_AUTHOR("Digium Incorporated <support@digium.com>");
 MODULE_LICENSE("GPL");
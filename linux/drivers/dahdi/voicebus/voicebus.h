@@ -35,11 +35,18 @@ struct voicebus;
 #define VOICEBUS_DEFAULT_MAXLATENCY 25
 #define VOICEBUS_MAXLATENCY_BUMP 6
 
+/* Limits on the arguments to voicebus_init. */
+#define VOICEBUS_DEFAULT_RING_SIZE 128
+#define VOICEBUS_MIN_RING_SIZE 32
+#define VOICEBUS_MAX_RING_SIZE 1024
+#define VOICEBUS_MAX_FRAMES_PER_SERVICE 8
+
 void voicebus_setdebuglevel(struct voicebus *vb, u32 level);
 int voicebus_getdebuglevel(struct voicebus *vb);
 struct pci_dev *voicebus_get_pci_dev(struct voicebus *vb);
 void *voicebus_pci_dev_to_context(struct pci_dev *pdev);
 int voicebus_init(struct pci_dev* pdev, u32 framesize, 
+		  unsigned int ring_size, unsigned int frames_per_service,
                   const char *board_name,
 		  void (*handle_receive)(void *buffer, void *context),
 		  void (*handle_transmit)(void *buffer, void *context),
@@ -38,6 +38,7 @@
 #include <linux/udp.h>
 #include <linux/etherdevice.h>
 #include <linux/timer.h>
+#include <linux/percpu.h>
 
 #include "dahdi/kernel.h"
 
@@ -129,9 +130,15 @@ typedef	unsigned gfp_t;		/* Added in 2.6.14 */
 
 static int debug;
 static char *mode;
+static int pipeline;
+static int loopback;
+static int warm_pairs;
+static int warm_alaw;
 
 static spinlock_t wctc4xxp_list_lock;
 static struct list_head wctc4xxp_list;
+/* Builds warm pairs, which waits on the DTE, off the shared workqueue. */
+static struct workqueue_struct *wctc4xxp_warm_wq;
 
 #define ETH_P_CSM_ENCAPS 0x889B
 
@@ -208,8 +215,6 @@ struct csm_encaps_hdr {
 #define DRING_MASK (DRING_SIZE-1)
 #define MIN_PACKET_LEN  64
 
-#undef USE_CUSTOM_MEMCACHE
-
 /* Transcoder buffer (tcb) */
 struct tcb {
 	void *data;
@@ -224,6 +229,7 @@ struct tcb {
 #define __WAIT_FOR_ACK          (1 << 3)
 #define __WAIT_FOR_RESPONSE     (1 << 4)
 #define DTE_CMD_TIMEOUT         (1 << 5)
+#define RING_SLOT               (1 << 6) /* sends a slot of a frame ring */
 #define WAIT_FOR_ACK (__WAIT_FOR_ACK | DO_NOT_AUTO_FREE)
 #define WAIT_FOR_RESPONSE (__WAIT_FOR_RESPONSE | DO_NOT_AUTO_FREE)
 	unsigned long flags;
@@ -232,10 +238,12 @@ struct tcb {
 	struct timer_list timer;
 	/* The number of bytes available in data. */
 	int data_len;
+	/* The payload of a frame sent from a frame ring, which the DMA engine
+	 * reads straight from the slot after the headers in data. */
+	void *data2;
+	int data2_len;
 	spinlock_t lock;
-#ifdef USE_CUSTOM_MEMCACHE
-	u32 sentinel;
-#endif
+	int pooled;	/* data is the SFRAME_SIZE buffer of a tcb_pool tcb */
 };
 
 static inline const struct csm_encaps_hdr *
@@ -252,85 +260,405 @@ initialize_cmd(struct tcb *cmd, unsigned long cmd_flags)
 	init_completion(&cmd->complete);
 	cmd->flags = cmd_flags;
 	spin_lock_init(&cmd->lock);
-#ifdef USE_CUSTOM_MEMCACHE
-	cmd->sentinel = 0xdeadbeef;
-#endif
 }
 
-#ifdef USE_CUSTOM_MEMCACHE
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+/*! Used to allocate commands to submit to the dte. */
+kmem_cache_t *cmd_cache;
+#else
+/*! Used to allocate commands to submit to the dte. */
+static struct kmem_cache *cmd_cache;
+#endif
+
+/*
+ * Commands are normally handed out from a pool of tcbs which already have a
+ * SFRAME_SIZE buffer, so that sending and receiving packets does not go to
+ * the allocator.  Each CPU keeps two magazines of tcbs which it uses with
+ * only interrupts disabled, and trades a whole magazine with the depot when
+ * both are empty or both are full.  The pool is grown for each card as it
+ * is probed; once it runs dry, commands come from cmd_cache instead.
+ */
+#define TCB_MAGAZINE_SIZE	16
+
+struct tcb_magazine {
+	struct list_head node;		/* On the depot when not loaded */
+	unsigned int rounds;
+	struct tcb *cmds[TCB_MAGAZINE_SIZE];
+};
 
-struct my_cache {
-	atomic_t outstanding_count;
-	spinlock_t lock;
-	struct list_head free;
+struct tcb_cpu_cache {
+	struct tcb_magazine *loaded;
+	struct tcb_magazine *previous;
 };
 
-static struct tcb *my_cache_alloc(struct my_cache *c, gfp_t alloc_flags)
+static DEFINE_PER_CPU(struct tcb_cpu_cache, tcb_cpu_cache);
+
+static struct {
+	spinlock_t lock;
+	struct list_head full;		/* Magazines with every round */
+	struct list_head empty;
+	struct list_head spill;		/* Pooled tcbs without a magazine */
+	unsigned int size;		/* Pooled tcbs, wherever they are */
+	unsigned int target;		/* Pooled tcbs the cards asked for */
+} tcb_depot;
+
+/* Allocations the pool could not serve, and magazines traded with the
+ * depot.  Both are reported as read only module parameters. */
+static unsigned int pool_exhausted;
+static unsigned int pool_trades;
+static int pool_per_channel = 4;
+
+static struct tcb *
+tcb_pool_get(void)
 {
+	struct tcb_cpu_cache *cc;
+	struct tcb_magazine *mag;
+	struct tcb *cmd = NULL;
 	unsigned long flags;
-	struct tcb *cmd;
-	spin_lock_irqsave(&c->lock, flags);
-	if (!list_empty(&c->free)) {
-		cmd = list_entry(c->free.next, struct tcb, node);
-		list_del_init(&cmd->node);
-		spin_unlock_irqrestore(&c->lock, flags);
-	} else {
-		spin_unlock_irqrestore(&c->lock, flags);
-		cmd = kmalloc(sizeof(*cmd), alloc_flags);
+
+	local_irq_save(flags);
+	cc = &per_cpu(tcb_cpu_cache, smp_processor_id());
+	if (unlikely(!cc->loaded || !cc->loaded->rounds)) {
+		if (cc->previous && cc->previous->rounds) {
+			mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+		} else {
+			/* Both are empty, so give one back for a full one. */
+			spin_lock(&tcb_depot.lock);
+			if (!list_empty(&tcb_depot.full)) {
+				mag = list_entry(tcb_depot.full.next,
+					struct tcb_magazine, node);
+				list_del(&mag->node);
+				if (cc->previous)
+					list_add(&cc->previous->node,
+						&tcb_depot.empty);
+				cc->previous = cc->loaded;
+				cc->loaded = mag;
+				++pool_trades;
+			} else if (!list_empty(&tcb_depot.spill)) {
+				cmd = list_entry(tcb_depot.spill.next,
+					struct tcb, node);
+				list_del(&cmd->node);
+			} else {
+				++pool_exhausted;
+			}
+			spin_unlock(&tcb_depot.lock);
+		}
 	}
-	atomic_inc(&c->outstanding_count);
+	if (!cmd && cc->loaded && cc->loaded->rounds)
+		cmd = cc->loaded->cmds[--cc->loaded->rounds];
+	local_irq_restore(flags);
 	return cmd;
 }
 
-static void my_cache_free(struct my_cache *c, struct tcb *cmd)
+static void
+tcb_pool_put(struct tcb *cmd)
 {
+	struct tcb_cpu_cache *cc;
+	struct tcb_magazine *mag;
 	unsigned long flags;
-	spin_lock_irqsave(&c->lock, flags);
-	list_add_tail(&cmd->node, &c->free);
-	spin_unlock_irqrestore(&c->lock, flags);
-	atomic_dec(&c->outstanding_count);
+
+	local_irq_save(flags);
+	cc = &per_cpu(tcb_cpu_cache, smp_processor_id());
+	if (unlikely(!cc->loaded ||
+		     (TCB_MAGAZINE_SIZE == cc->loaded->rounds))) {
+		if (cc->previous &&
+		    (cc->previous->rounds < TCB_MAGAZINE_SIZE)) {
+			mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+		} else {
+			/* Both are full, so give one back for an empty one. */
+			spin_lock(&tcb_depot.lock);
+			if (!list_empty(&tcb_depot.empty)) {
+				mag = list_entry(tcb_depot.empty.next,
+					struct tcb_magazine, node);
+				list_del(&mag->node);
+				if (cc->previous)
+					list_add(&cc->previous->node,
+						&tcb_depot.full);
+				cc->previous = cc->loaded;
+				cc->loaded = mag;
+				++pool_trades;
+			} else {
+				list_add(&cmd->node, &tcb_depot.spill);
+				cmd = NULL;
+			}
+			spin_unlock(&tcb_depot.lock);
+		}
+	}
+	if (cmd)
+		cc->loaded->cmds[cc->loaded->rounds++] = cmd;
+	local_irq_restore(flags);
 }
 
-static struct my_cache *my_cache_create(void)
+static void
+tcb_pool_free_tcb(struct tcb *cmd)
 {
-	struct my_cache *c;
-	c = kzalloc(sizeof(*c), GFP_KERNEL);
-	if (!c)
-		return NULL;
-	spin_lock_init(&c->lock);
-	INIT_LIST_HEAD(&c->free);
-	return c;
+	kfree(cmd->data);
+	kmem_cache_free(cmd_cache, cmd);
 }
 
-static int my_cache_destroy(struct my_cache *c)
+/* Frees pooled tcbs sitting in the depot until the pool is no bigger than
+ * the cards want.  Those loaded on a CPU or in use stay until unload. */
+static void
+tcb_pool_trim(void)
 {
+	struct tcb_magazine *mag;
 	struct tcb *cmd;
-	if (atomic_read(&c->outstanding_count)) {
-		DTE_DEBUG(DTE_DEBUG_GENERAL,"Leaked %d commands.\n",
-			atomic_read(&c->outstanding_count));
+	LIST_HEAD(to_free);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tcb_depot.lock, flags);
+	while ((tcb_depot.size > tcb_depot.target) &&
+	       !list_empty(&tcb_depot.spill)) {
+		list_move(tcb_depot.spill.next, &to_free);
+		--tcb_depot.size;
 	}
-	while (!list_empty(&c->free)) {
-		cmd = list_entry(c->free.next, struct tcb, node);
-		list_del_init(&cmd->node);
-		kfree(cmd);
+	while ((tcb_depot.size >= tcb_depot.target + TCB_MAGAZINE_SIZE) &&
+	       !list_empty(&tcb_depot.full)) {
+		mag = list_entry(tcb_depot.full.next, struct tcb_magazine,
+			node);
+		while (mag->rounds) {
+			cmd = mag->cmds[--mag->rounds];
+			list_add(&cmd->node, &to_free);
+		}
+		list_move(&mag->node, &tcb_depot.empty);
+		tcb_depot.size -= TCB_MAGAZINE_SIZE;
+	}
+	spin_unlock_irqrestore(&tcb_depot.lock, flags);
+
+	while (!list_empty(&to_free)) {
+		cmd = list_entry(to_free.next, struct tcb, node);
+		list_del(&cmd->node);
+		tcb_pool_free_tcb(cmd);
 	}
-	kfree(c);
-	return 0;
 }
 
-static struct my_cache *cmd_cache;
+/* Adds count tcbs to the pool, rounded down to whole magazines, with an
+ * empty magazine for each full one.  Short of memory, the pool just stays
+ * smaller. */
+static void
+tcb_pool_grow(unsigned int count)
+{
+	struct tcb_magazine *mag;
+	struct tcb *cmd;
+	LIST_HEAD(full);
+	LIST_HEAD(empty);
+	unsigned int added = 0;
+	unsigned long flags;
 
-#else
+	while (added + TCB_MAGAZINE_SIZE <= count) {
+		mag = kzalloc(sizeof(*mag), GFP_KERNEL);
+		if (!mag)
+			break;
+		list_add(&mag->node, &full);
+		while (mag->rounds < TCB_MAGAZINE_SIZE) {
+			cmd = kmem_cache_alloc(cmd_cache, GFP_KERNEL);
+			if (!cmd)
+				break;
+			memset(cmd, 0, sizeof(*cmd));
+			cmd->data = kmalloc(SFRAME_SIZE, GFP_KERNEL);
+			if (!cmd->data) {
+				kmem_cache_free(cmd_cache, cmd);
+				break;
+			}
+			cmd->pooled = 1;
+			mag->cmds[mag->rounds++] = cmd;
+		}
+		if (mag->rounds < TCB_MAGAZINE_SIZE) {
+			while (mag->rounds)
+				tcb_pool_free_tcb(mag->cmds[--mag->rounds]);
+			list_move(&mag->node, &empty);
+			break;
+		}
+		added += TCB_MAGAZINE_SIZE;
+		mag = kzalloc(sizeof(*mag), GFP_KERNEL);
+		if (!mag)
+			break;
+		list_add(&mag->node, &empty);
+	}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
-/*! Used to allocate commands to submit to the dte. */
-kmem_cache_t *cmd_cache;
-#else
-/*! Used to allocate commands to submit to the dte. */
-static struct kmem_cache *cmd_cache;
-#endif
+	spin_lock_irqsave(&tcb_depot.lock, flags);
+	list_splice(&full, &tcb_depot.full);
+	list_splice(&empty, &tcb_depot.empty);
+	tcb_depot.size += added;
+	tcb_depot.target += count;
+	spin_unlock_irqrestore(&tcb_depot.lock, flags);
+}
+
+static void
+tcb_pool_shrink(unsigned int count)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tcb_depot.lock, flags);
+	tcb_depot.target -= min(count, tcb_depot.target);
+	spin_unlock_irqrestore(&tcb_depot.lock, flags);
+	tcb_pool_trim();
+}
+
+static void
+tcb_pool_init(void)
+{
+	spin_lock_init(&tcb_depot.lock);
+	INIT_LIST_HEAD(&tcb_depot.full);
+	INIT_LIST_HEAD(&tcb_depot.empty);
+	INIT_LIST_HEAD(&tcb_depot.spill);
+}
+
+/* Called once every card is gone, so every pooled tcb is back. */
+static void
+tcb_pool_destroy(void)
+{
+	struct tcb_cpu_cache *cc;
+	struct tcb_magazine *mag;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cc = &per_cpu(tcb_cpu_cache, cpu);
+		if (cc->loaded)
+			list_add(&cc->loaded->node, &tcb_depot.full);
+		if (cc->previous)
+			list_add(&cc->previous->node, &tcb_depot.full);
+		cc->loaded = cc->previous = NULL;
+	}
+	list_splice_init(&tcb_depot.empty, &tcb_depot.full);
+	while (!list_empty(&tcb_depot.full)) {
+		mag = list_entry(tcb_depot.full.next, struct tcb_magazine,
+			node);
+		list_del(&mag->node);
+		while (mag->rounds) {
+			tcb_pool_free_tcb(mag->cmds[--mag->rounds]);
+			--tcb_depot.size;
+		}
+		kfree(mag);
+	}
+	tcb_depot.target = 0;
+	tcb_pool_trim();
+	if (tcb_depot.size) {
+		printk(KERN_DEBUG "%s: Leaked %d commands.\n",
+			THIS_MODULE->name, tcb_depot.size);
+	}
+}
+
+/* The frame ring of a channel, set up with DAHDI_TC_RING_SETUP.  The slots
+ * live in whole pages so they can be mapped to user space, and hold only
+ * payloads.  Each transmit slot has headers of its own that user space cannot
+ * see, so that a process cannot send anything but RTP to its own channel.
+ * They are filled in from the channel when the ring is set up, and only the
+ * length, checksum, sequence number and timestamp change with each frame.
+ * The DMA engine reads the headers from the first buffer of a descriptor and
+ * the payload from the slot itself with the second, so transmitted payloads
+ * are never copied.  Received payloads are copied once into the ring, since
+ * the receive descriptors are shared by every channel. */
+#define RING_SLOT_SIZE		2048	/* Room for an SFRAME_SIZE mapping */
+#define RING_SLOTS_PER_PAGE	(PAGE_SIZE / RING_SLOT_SIZE)
+#define RING_DEFAULT_SLOTS	16
+#define RING_MAX_SLOTS		256
+
+struct wctc4xxp_ring;
+
+struct wctc4xxp_ring_slot {
+	struct tcb cmd;		/* Sends the slot while it is in flight */
+	struct wctc4xxp_ring *ring;
+	struct rtp_packet *frame; /* Headers only; SFRAME_SIZE to map */
+};
+
+struct wctc4xxp_ring {
+	/* One for the channel, and one for each frame in flight, since the
+	 * pages cannot go away while the DMA engine may still read them. */
+	atomic_t refcount;
+	unsigned int txslots;
+	unsigned int rxslots;
+	unsigned int npages;
+	unsigned long *pages;
+	DECLARE_BITMAP(inflight, RING_MAX_SLOTS);
+	/* The receive slots are filled at rx_head and collected at rx_tail,
+	 * under the lock of the channel. */
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	unsigned int overruns;
+	u16 rx_len[RING_MAX_SLOTS];
+	struct wctc4xxp_ring_slot tx[0];
+};
+
+static inline void *
+wctc4xxp_ring_slot(const struct wctc4xxp_ring *ring, unsigned int slot)
+{
+	return (void *)(ring->pages[slot / RING_SLOTS_PER_PAGE] +
+		(slot % RING_SLOTS_PER_PAGE) * RING_SLOT_SIZE);
+}
+
+static void
+wctc4xxp_ring_put(struct wctc4xxp_ring *ring)
+{
+	unsigned int i;
 
-#endif /* USE_CUSTOM_MEMCACHE */
+	if (!atomic_dec_and_test(&ring->refcount))
+		return;
+	for (i = 0; i < ring->txslots; ++i)
+		kfree(ring->tx[i].frame);
+	for (i = 0; i < ring->npages; ++i) {
+		if (ring->pages[i])
+			free_page(ring->pages[i]);
+	}
+	kfree(ring->pages);
+	kfree(ring);
+}
+
+static struct wctc4xxp_ring *
+wctc4xxp_ring_alloc(unsigned int txslots, unsigned int rxslots)
+{
+	struct wctc4xxp_ring *ring;
+	unsigned int i;
+
+	ring = kzalloc(sizeof(*ring) + txslots * sizeof(ring->tx[0]),
+		GFP_KERNEL);
+	if (!ring)
+		return NULL;
+	atomic_set(&ring->refcount, 1);
+	ring->txslots = txslots;
+	ring->rxslots = rxslots;
+	ring->npages = (txslots + rxslots + RING_SLOTS_PER_PAGE - 1) /
+		RING_SLOTS_PER_PAGE;
+	ring->pages = kcalloc(ring->npages, sizeof(ring->pages[0]),
+		GFP_KERNEL);
+	if (!ring->pages) {
+		kfree(ring);
+		return NULL;
+	}
+	for (i = 0; i < ring->npages; ++i) {
+		ring->pages[i] = get_zeroed_page(GFP_KERNEL);
+		if (!ring->pages[i]) {
+			wctc4xxp_ring_put(ring);
+			return NULL;
+		}
+	}
+	for (i = 0; i < txslots; ++i) {
+		ring->tx[i].ring = ring;
+		ring->tx[i].frame = kmalloc(SFRAME_SIZE, GFP_KERNEL);
+		if (!ring->tx[i].frame) {
+			wctc4xxp_ring_put(ring);
+			return NULL;
+		}
+	}
+	return ring;
+}
+
+/* Called instead of freeing the command of a transmit slot once the DMA
+ * engine is done with it. */
+static void
+wctc4xxp_ring_slot_done(struct tcb *cmd)
+{
+	struct wctc4xxp_ring_slot *slot =
+		container_of(cmd, struct wctc4xxp_ring_slot, cmd);
+	struct wctc4xxp_ring *ring = slot->ring;
+
+	clear_bit(slot - ring->tx, ring->inflight);
+	wctc4xxp_ring_put(ring);
+}
 
 static inline struct tcb *
 __alloc_cmd(size_t size, gfp_t alloc_flags, unsigned long cmd_flags)
@@ -341,21 +669,26 @@ __alloc_cmd(size_t size, gfp_t alloc_flags, unsigned long cmd_flags)
 		return NULL;
 	if (size < MIN_PACKET_LEN)
 		size = MIN_PACKET_LEN;
-#ifdef USE_CUSTOM_MEMCACHE
-	cmd = my_cache_alloc(cmd_cache, alloc_flags);
-#else
-	cmd = kmem_cache_alloc(cmd_cache, alloc_flags);
-#endif
+	cmd = tcb_pool_get();
 	if (likely(cmd)) {
+		void *data = cmd->data;
+		memset(cmd, 0, sizeof(*cmd));
+		memset(data, 0, size);
+		cmd->data = data;
+		cmd->pooled = 1;
+	} else {
+		cmd = kmem_cache_alloc(cmd_cache, alloc_flags);
+		if (unlikely(!cmd))
+			return NULL;
 		memset(cmd, 0, sizeof(*cmd));
 		cmd->data = kzalloc(size, alloc_flags);
 		if (unlikely(!cmd->data)) {
 			kmem_cache_free(cmd_cache, cmd);
 			return NULL;
 		}
-		cmd->data_len = size;
-		initialize_cmd(cmd, cmd_flags);
 	}
+	cmd->data_len = size;
+	initialize_cmd(cmd, cmd_flags);
 	return cmd;
 }
 
@@ -368,13 +701,18 @@ alloc_cmd(size_t size)
 static void
 __free_cmd(struct tcb *cmd)
 {
-	if (cmd)
-		kfree(cmd->data);
-#ifdef USE_CUSTOM_MEMCACHE
-	my_cache_free(cmd_cache, cmd);
-#else
+	if (cmd && (cmd->flags & RING_SLOT)) {
+		wctc4xxp_ring_slot_done(cmd);
+		return;
+	}
+	if (!cmd)
+		return;
+	if (likely(cmd->pooled)) {
+		tcb_pool_put(cmd);
+		return;
+	}
+	kfree(cmd->data);
 	kmem_cache_free(cmd_cache, cmd);
-#endif
 	return;
 }
 
@@ -407,6 +745,7 @@ struct channel_pvt {
 	};
 	struct channel_stats stats;
 	struct list_head rx_queue; /* Transcoded packets for this channel. */
+	struct wctc4xxp_ring *ring; /* Frame ring, if one was set up. */
 };
 
 struct wcdte {
@@ -420,6 +759,7 @@ struct wcdte {
 #define DTE_READY	1
 #define DTE_SHUTDOWN	2
 #define DTE_POLLING	3
+#define DTE_LOOPBACK	4
 	unsigned long flags;
 
 	/* This is a device-global list of commands that are waiting to be
@@ -453,6 +793,8 @@ struct wcdte {
 #if DEFERRED_PROCESSING == WORKQUEUE
 	struct work_struct deferred_work;
 #endif
+	/* Builds the idle channel pairs kept ready by the warm_pairs option. */
+	struct work_struct warm_work;
 
 	/*
 	 * This section contains the members necessary for exporting the
@@ -468,6 +810,9 @@ struct wcdte {
 #endif
 	struct timer_list watchdog;
 	atomic_t open_channels;
+	atomic_t cmd_retries;	/* Commands resent by the watchdog */
+	atomic_t cmd_timeouts;	/* Commands given up on by the watchdog */
+	unsigned int pool_tcbs;	/* Added to the tcb pool for this card */
 	struct timer_list polling;
 #if HZ > 100
 	unsigned long jiffies_at_last_poll;
@@ -538,11 +883,15 @@ static struct sk_buff *
 tcb_to_skb(struct net_device *netdev, const struct tcb *cmd)
 {
 	struct sk_buff *skb;
-	skb = alloc_skb(cmd->data_len, in_atomic() ? GFP_ATOMIC : GFP_KERNEL);
+	skb = alloc_skb(cmd->data_len + cmd->data2_len,
+			in_atomic() ? GFP_ATOMIC : GFP_KERNEL);
 	if (skb) {
 		skb->dev = netdev;
-		skb_put(skb, cmd->data_len);
-		memcpy(skb->data, cmd->data, cmd->data_len);
+		memcpy(skb_put(skb, cmd->data_len), cmd->data, cmd->data_len);
+		if (cmd->data2_len) {
+			memcpy(skb_put(skb, cmd->data2_len), cmd->data2,
+			       cmd->data2_len);
+		}
 		skb->protocol = eth_type_trans(skb, netdev);
 	}
 	return skb;
@@ -892,7 +1241,7 @@ struct wctc4xxp_descriptor {
 	__le32 des0;
 	__le32 des1;
 	__le32 buffer1;
-	__le32 container; /* Unused */
+	__le32 buffer2; /* Second buffer of the frame, if split (des1 21:11) */
 } __attribute__((packed));
 
 struct wctc4xxp_descriptor_ring {
@@ -987,21 +1336,53 @@ wctc4xxp_initialize_descriptor_ring(struct pci_dev *pdev,
 #define SET_OWNED(_d_) do { wmb(); (_d_)->des0 |= OWN_BIT; wmb(); } while (0)
 
 static const unsigned int BUFFER1_SIZE_MASK = 0x7ff;
+#define BUFFER2_SIZE_SHIFT 11
 
-static int
-wctc4xxp_submit(struct wctc4xxp_descriptor_ring *dr, struct tcb *c)
+/* Points the descriptor at the tail of the ring to the command.  The caller
+ * holds the ring lock and hands the descriptor to the hardware. */
+static inline volatile struct wctc4xxp_descriptor *
+__wctc4xxp_fill_tail(struct wctc4xxp_descriptor_ring *dr, struct tcb *c)
 {
 	volatile struct wctc4xxp_descriptor *d;
 	unsigned int len;
-	unsigned long flags;
 
-	WARN_ON(!c);
-	len = (c->data_len < MIN_PACKET_LEN) ? MIN_PACKET_LEN : c->data_len;
-	if (c->data_len > MAX_FRAME_SIZE) {
+	if (c->data2_len)
+		len = c->data_len;
+	else if (c->data_len < MIN_PACKET_LEN)
+		len = MIN_PACKET_LEN;
+	else
+		len = c->data_len;
+	if ((c->data_len + c->data2_len) > MAX_FRAME_SIZE) {
 		WARN_ON_ONCE(!"Invalid command length passed\n");
 		c->data_len = MAX_FRAME_SIZE;
+		c->data2_len = 0;
+	}
+
+	d = wctc4xxp_descriptor(dr, dr->tail);
+	d->des1 &= cpu_to_le32(~(BUFFER1_SIZE_MASK |
+			(BUFFER1_SIZE_MASK << BUFFER2_SIZE_SHIFT)));
+	d->des1 |= cpu_to_le32(len & BUFFER1_SIZE_MASK);
+	d->buffer1 = pci_map_single(dr->pdev, c->data,
+			SFRAME_SIZE, dr->direction);
+	if (c->data2_len) {
+		d->des1 |= cpu_to_le32((c->data2_len & BUFFER1_SIZE_MASK) <<
+				BUFFER2_SIZE_SHIFT);
+		d->buffer2 = pci_map_single(dr->pdev, c->data2,
+				c->data2_len, dr->direction);
 	}
+	dr->pending[dr->tail] = c;
+	dr->tail = (dr->tail + 1) & DRING_MASK;
+	++dr->count;
+	return d;
+}
+
+static int
+wctc4xxp_submit(struct wctc4xxp_descriptor_ring *dr, struct tcb *c)
+{
+	volatile struct wctc4xxp_descriptor *d;
+	unsigned long flags;
 
+	WARN_ON(!c);
 	spin_lock_irqsave(&dr->lock, flags);
 	d = wctc4xxp_descriptor(dr, dr->tail);
 	WARN_ON(!d);
@@ -1010,19 +1391,51 @@ wctc4xxp_submit(struct wctc4xxp_descriptor_ring *dr, struct tcb *c)
 		/* Do not overwrite a buffer that is still in progress. */
 		return -EBUSY;
 	}
-	d->des1 &= cpu_to_le32(~(BUFFER1_SIZE_MASK));
-	d->des1 |= cpu_to_le32(len & BUFFER1_SIZE_MASK);
-	d->buffer1 = pci_map_single(dr->pdev, c->data,
-			SFRAME_SIZE, dr->direction);
-
+	d = __wctc4xxp_fill_tail(dr, c);
 	SET_OWNED(d); /* That's it until the hardware is done with it. */
-	dr->pending[dr->tail] = c;
-	dr->tail = ++dr->tail & DRING_MASK;
-	++dr->count;
 	spin_unlock_irqrestore(&dr->lock, flags);
 	return 0;
 }
 
+/**
+ * wctc4xxp_submit_batch - Submit a list of commands on consecutive descriptors.
+ * @dr: The descriptor ring we're using.
+ * @cmds: The commands.  Those submitted are taken off the list.
+ *
+ * The first descriptor is only handed to the hardware after the rest, so
+ * that it finds the whole batch waiting once it starts on it.  Returns the
+ * number of commands submitted, which is fewer than were on the list if the
+ * ring filled up.
+ */
+static int
+wctc4xxp_submit_batch(struct wctc4xxp_descriptor_ring *dr,
+	struct list_head *cmds)
+{
+	volatile struct wctc4xxp_descriptor *d;
+	volatile struct wctc4xxp_descriptor *first = NULL;
+	struct tcb *c;
+	unsigned long flags;
+	int count = 0;
+
+	spin_lock_irqsave(&dr->lock, flags);
+	while (!list_empty(cmds)) {
+		if (wctc4xxp_descriptor(dr, dr->tail)->buffer1)
+			break;
+		c = list_entry(cmds->next, struct tcb, node);
+		list_del_init(&c->node);
+		d = __wctc4xxp_fill_tail(dr, c);
+		if (first)
+			SET_OWNED(d);
+		else
+			first = d;
+		++count;
+	}
+	if (first)
+		SET_OWNED(first);
+	spin_unlock_irqrestore(&dr->lock, flags);
+	return count;
+}
+
 static inline struct tcb*
 wctc4xxp_retrieve(struct wctc4xxp_descriptor_ring *dr)
 {
@@ -1037,6 +1450,11 @@ wctc4xxp_retrieve(struct wctc4xxp_descriptor_ring *dr)
 			SFRAME_SIZE, dr->direction);
 		c = dr->pending[head];
 		WARN_ON(!c);
+		if (d->buffer2) {
+			pci_unmap_single(dr->pdev, d->buffer2,
+				c->data2_len, dr->direction);
+			d->buffer2 = 0;
+		}
 		dr->head = (++head) & DRING_MASK;
 		d->buffer1 = 0;
 		--dr->count;
@@ -1202,16 +1620,27 @@ create_channel_cmd(struct channel_pvt *pvt, struct tcb *cmd, u8 type, u8 class,
 	cmd->data_len = SIZE_WITH_N_PARAMETERS(num_parameters);
 }
 
+/*
+ * The prep_*_cmd functions fill in a command, which the matching send_*_cmd
+ * functions then send and wait for, or which can be pipelined with others.
+ */
+
+static void
+prep_create_channel_cmd(struct wcdte *wc, struct tcb *cmd, u16 timeslot)
+{
+	const u16 parameters[] = {0x0002, timeslot};
+	create_supervisor_cmd(wc, cmd, CONFIG_CHANGE_TYPE,
+		CONFIG_DEVICE_CLASS, SUPVSR_CREATE_CHANNEL,
+		parameters, ARRAY_SIZE(parameters));
+}
+
 static int
 send_create_channel_cmd(struct wcdte *wc, struct tcb *cmd, u16 timeslot,
 	u16 *channel_number)
 {
 	int res;
-	const u16 parameters[] = {0x0002, timeslot};
 
-	create_supervisor_cmd(wc, cmd, CONFIG_CHANGE_TYPE,
-		CONFIG_DEVICE_CLASS, SUPVSR_CREATE_CHANNEL,
-		parameters, ARRAY_SIZE(parameters));
+	prep_create_channel_cmd(wc, cmd, timeslot);
 
 	res = wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 	if (res)
@@ -1357,15 +1786,21 @@ send_tdm_opt_cmd(struct wcdte *wc, struct tcb *cmd)
 	return wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 }
 
-static int
-send_destroy_channel_cmd(struct wcdte *wc, struct tcb *cmd, u16 channel)
+static void
+prep_destroy_channel_cmd(struct wcdte *wc, struct tcb *cmd, u16 channel)
 {
-	int res;
-	u16 result;
 	const u16 parameters[] = {channel};
 	create_supervisor_cmd(wc, cmd, CONFIG_CHANGE_TYPE,
 		CONFIG_DEVICE_CLASS, 0x0011, parameters,
 		ARRAY_SIZE(parameters));
+}
+
+static int
+send_destroy_channel_cmd(struct wcdte *wc, struct tcb *cmd, u16 channel)
+{
+	int res;
+	u16 result;
+	prep_destroy_channel_cmd(wc, cmd, channel);
 	res = wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 	if (res)
 		return res;
@@ -1379,12 +1814,9 @@ send_destroy_channel_cmd(struct wcdte *wc, struct tcb *cmd, u16 channel)
 	return 0;
 }
 
-static int
-send_set_ip_hdr_channel_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+static void
+prep_set_ip_hdr_channel_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 {
-	int res;
-	u16 result;
-	struct wcdte *wc = pvt->wc;
 	const u16 parameters[] = {0, 0x0045, 0, 0, 0x0040, 0x1180, 0,
 		0xa8c0, 0x0309, 0xa8c0, 0x0309,
 		cpu_to_be16(pvt->timeslot_out_num + 0x5000),
@@ -1392,6 +1824,15 @@ send_set_ip_hdr_channel_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 		0, 0};
 	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
 		0x9000, parameters, ARRAY_SIZE(parameters));
+}
+
+static int
+send_set_ip_hdr_channel_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+{
+	int res;
+	u16 result;
+	struct wcdte *wc = pvt->wc;
+	prep_set_ip_hdr_channel_cmd(pvt, cmd);
 	res = wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 	if (res)
 		return res;
@@ -1405,15 +1846,21 @@ send_set_ip_hdr_channel_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 	return 0;
 }
 
+static void
+prep_voip_vceopt_cmd(struct channel_pvt *pvt, struct tcb *cmd, u16 length)
+{
+	const u16 parameters[] = {((length << 8)|0x21), 0x1c00, 0x0004, 0, 0};
+	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
+		0x8001, parameters, ARRAY_SIZE(parameters));
+}
+
 static int
 send_voip_vceopt_cmd(struct channel_pvt *pvt, struct tcb *cmd, u16 length)
 {
 	int res;
 	u16 result;
-	const u16 parameters[] = {((length << 8)|0x21), 0x1c00, 0x0004, 0, 0};
 	struct wcdte *wc = pvt->wc;
-	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
-		0x8001, parameters, ARRAY_SIZE(parameters));
+	prep_voip_vceopt_cmd(pvt, cmd, length);
 	res = wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 	if (res)
 		return res;
@@ -1427,15 +1874,21 @@ send_voip_vceopt_cmd(struct channel_pvt *pvt, struct tcb *cmd, u16 length)
 	return 0;
 }
 
+static void
+prep_voip_tonectl_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+{
+	const u16 parameters[] = {0};
+	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
+		0x805b, parameters, ARRAY_SIZE(parameters));
+}
+
 static int
 send_voip_tonectl_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 {
 	int res;
 	u16 result;
-	const u16 parameters[] = {0};
 	struct wcdte *wc = pvt->wc;
-	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
-		0x805b, parameters, ARRAY_SIZE(parameters));
+	prep_voip_tonectl_cmd(pvt, cmd);
 	res = wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 	if (res)
 		return res;
@@ -1449,41 +1902,65 @@ send_voip_tonectl_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 	return 0;
 }
 
-static int
-send_voip_dtmfopt_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+static void
+prep_voip_dtmfopt_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 {
 	const u16 parameters[] = {0x0008};
 	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
 		0x8002, parameters, ARRAY_SIZE(parameters));
-	return wctc4xxp_transmit_cmd_and_wait(pvt->wc, cmd);
 }
 
 static int
-send_voip_indctrl_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+send_voip_dtmfopt_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+{
+	prep_voip_dtmfopt_cmd(pvt, cmd);
+	return wctc4xxp_transmit_cmd_and_wait(pvt->wc, cmd);
+}
+
+static void
+prep_voip_indctrl_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 {
 	const u16 parameters[] = {0x0007};
 	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
 		0x8084, parameters, ARRAY_SIZE(parameters));
-	return wctc4xxp_transmit_cmd_and_wait(pvt->wc, cmd);
 }
 
 static int
-send_voip_vopena_cmd(struct channel_pvt *pvt, struct tcb *cmd, u8 format)
+send_voip_indctrl_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 {
-	const u16 parameters[] = {1, ((format<<8)|0x80), 0, 0, 0,
-		0x3412, 0x7856};
+	prep_voip_indctrl_cmd(pvt, cmd);
+	return wctc4xxp_transmit_cmd_and_wait(pvt->wc, cmd);
+}
+
+static void
+prep_voip_vopena_cmd(struct channel_pvt *pvt, struct tcb *cmd, u8 format)
+{
+	const u16 parameters[] = {1, ((format<<8)|0x80), 0, 0, 0,
+		0x3412, 0x7856};
 	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
 		0x8000, parameters, ARRAY_SIZE(parameters));
-	return wctc4xxp_transmit_cmd_and_wait(pvt->wc, cmd);
 }
 
 static int
-send_voip_vopena_close_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+send_voip_vopena_cmd(struct channel_pvt *pvt, struct tcb *cmd, u8 format)
+{
+	prep_voip_vopena_cmd(pvt, cmd, format);
+	return wctc4xxp_transmit_cmd_and_wait(pvt->wc, cmd);
+}
+
+static void
+prep_voip_vopena_close_cmd(struct channel_pvt *pvt, struct tcb *cmd)
 {
-	int res;
 	const u16 parameters[] = {0};
 	create_channel_cmd(pvt, cmd, CONFIG_CHANGE_TYPE, CONFIG_CHANNEL_CLASS,
 		0x8000, parameters, ARRAY_SIZE(parameters));
+}
+
+static int
+send_voip_vopena_close_cmd(struct channel_pvt *pvt, struct tcb *cmd)
+{
+	int res;
+	prep_voip_vopena_close_cmd(pvt, cmd);
 	res = wctc4xxp_transmit_cmd_and_wait(pvt->wc, cmd);
 	if (res)
 		return res;
@@ -1505,26 +1982,32 @@ send_ip_options_cmd(struct wcdte *wc, struct tcb *cmd)
 	return wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 }
 
-static int
-_send_trans_connect_cmd(struct wcdte *wc, struct tcb *cmd, u16 enable, u16
+static void
+prep_trans_connect_cmd(struct wcdte *wc, struct tcb *cmd, u16 enable, u16
 	encoder_channel, u16 decoder_channel, u16 encoder_format,
 	u16 decoder_format)
 {
-	int res;
 	const u16 parameters[] = {enable, encoder_channel, encoder_format,
 		decoder_channel, decoder_format};
 	create_supervisor_cmd(wc, cmd, CONFIG_CHANGE_TYPE,
 		CONFIG_DEVICE_CLASS, 0x9322, parameters,
 		ARRAY_SIZE(parameters));
+}
+
+static int
+_send_trans_connect_cmd(struct wcdte *wc, struct tcb *cmd, u16 enable, u16
+	encoder_channel, u16 decoder_channel, u16 encoder_format,
+	u16 decoder_format)
+{
+	int res;
+	prep_trans_connect_cmd(wc, cmd, enable, encoder_channel,
+		decoder_channel, encoder_format, decoder_format);
 	res = wctc4xxp_transmit_cmd_and_wait(wc, cmd);
 	if (res)
 		return res;
 
 	/* Let's check the response for any error codes.... */
 	if (0x0000 != response_header(cmd)->params[0]) {
-#ifdef USE_CUSTOM_MEMCACHE
-		WARN_ON(0xdeadbeef != cmd->response->sentinel);
-#endif
 		WARN_ON(1);
 		return -EIO;
 	}
@@ -1549,21 +2032,13 @@ send_trans_disconnect_cmd(struct wcdte *wc, struct tcb *cmd, const u16
 		decoder_channel, encoder_format, decoder_format);
 }
 
-static struct tcb *
-wctc4xxp_create_rtp_cmd(struct wcdte *wc, struct dahdi_transcoder_channel *dtc,
-	size_t inbytes)
+/* Fills in the parts of the headers that are the same for every frame sent
+ * on the channel. */
+static void
+wctc4xxp_fill_rtp_template(struct rtp_packet *packet,
+	const struct dahdi_transcoder_channel *dtc)
 {
 	const struct channel_pvt *cpvt = dtc->pvt;
-	struct rtp_packet *packet;
-	struct tcb *cmd;
-
-	cmd = alloc_cmd(sizeof(*packet) + inbytes);
-	if (!cmd)
-		return NULL;
-
-	packet = cmd->data;
-
-	BUG_ON(cmd->data_len < sizeof(*packet));
 
 	/* setup the ethernet header */
 	memcpy(packet->ethhdr.h_dest, dst_mac, sizeof(dst_mac));
@@ -1574,23 +2049,16 @@ wctc4xxp_create_rtp_cmd(struct wcdte *wc, struct dahdi_transcoder_channel *dtc,
 	packet->iphdr.ihl =		5;
 	packet->iphdr.version =		4;
 	packet->iphdr.tos =		0;
-	packet->iphdr.tot_len =		cpu_to_be16(inbytes+40);
 	packet->iphdr.id =		0;
 	packet->iphdr.frag_off =	cpu_to_be16(0x4000);
 	packet->iphdr.ttl =		64;
 	packet->iphdr.protocol =	0x11; /* UDP */
-	packet->iphdr.check =		0;
 	packet->iphdr.saddr =		cpu_to_be32(0xc0a80903);
 	packet->iphdr.daddr =		cpu_to_be32(0xc0a80903);
 
-	packet->iphdr.check =	ip_fast_csum((void *)&packet->iphdr,
-					packet->iphdr.ihl);
-
 	/* setup the UDP header */
 	packet->udphdr.source =	cpu_to_be16(cpvt->timeslot_out_num + 0x5000);
 	packet->udphdr.dest =	cpu_to_be16(cpvt->timeslot_in_num + 0x5000);
-	packet->udphdr.len  =	cpu_to_be16(inbytes + sizeof(struct rtphdr) +
-					sizeof(struct udphdr));
 	packet->udphdr.check =	0;
 
 	/* Setup the RTP header */
@@ -1600,9 +2068,41 @@ wctc4xxp_create_rtp_cmd(struct wcdte *wc, struct dahdi_transcoder_channel *dtc,
 	packet->rtphdr.csrc_count = 0;
 	packet->rtphdr.marker =	    0;
 	packet->rtphdr.type =	    wctc4xxp_dahdifmt_to_dtefmt(dtc->srcfmt);
+	packet->rtphdr.ssrc =	    cpu_to_be32(cpvt->ssrc);
+}
+
+/* Fills in the parts of the headers that change with each frame. */
+static void
+wctc4xxp_fill_rtp_frame(struct rtp_packet *packet,
+	const struct channel_pvt *cpvt, size_t inbytes)
+{
+	packet->iphdr.tot_len =	cpu_to_be16(inbytes+40);
+	packet->iphdr.check =	0;
+	packet->iphdr.check =	ip_fast_csum((void *)&packet->iphdr,
+					packet->iphdr.ihl);
+	packet->udphdr.len  =	cpu_to_be16(inbytes + sizeof(struct rtphdr) +
+					sizeof(struct udphdr));
 	packet->rtphdr.seqno =	    cpu_to_be16(cpvt->seqno);
 	packet->rtphdr.timestamp =  cpu_to_be32(cpvt->timestamp);
-	packet->rtphdr.ssrc =	    cpu_to_be32(cpvt->ssrc);
+}
+
+static struct tcb *
+wctc4xxp_create_rtp_cmd(struct wcdte *wc, struct dahdi_transcoder_channel *dtc,
+	size_t inbytes)
+{
+	struct rtp_packet *packet;
+	struct tcb *cmd;
+
+	cmd = alloc_cmd(sizeof(*packet) + inbytes);
+	if (!cmd)
+		return NULL;
+
+	packet = cmd->data;
+
+	BUG_ON(cmd->data_len < sizeof(*packet));
+
+	wctc4xxp_fill_rtp_template(packet, dtc);
+	wctc4xxp_fill_rtp_frame(packet, dtc->pvt, inbytes);
 
 	WARN_ON(cmd->data_len > SFRAME_SIZE);
 	return cmd;
@@ -1622,6 +2122,12 @@ wctc4xxp_cleanup_descriptor_ring(struct wctc4xxp_descriptor_ring *dr)
 			pci_unmap_single(dr->pdev, d->buffer1,
 				SFRAME_SIZE, dr->direction);
 			d->buffer1 = 0;
+			if (d->buffer2) {
+				pci_unmap_single(dr->pdev, d->buffer2,
+					dr->pending[i]->data2_len,
+					dr->direction);
+				d->buffer2 = 0;
+			}
 			/* Commands will also be sitting on the waiting for
 			 * response list, so we want to make sure to delete
 			 * them from that list as well. */
@@ -1687,18 +2193,36 @@ wctc4xxp_remove_from_response_list(struct wcdte *wc, struct tcb *cmd)
 	spin_unlock_irqrestore(&wc->cmd_list_lock, flags);
 }
 
-static void
-wctc4xxp_transmit_cmd(struct wcdte *wc, struct tcb *cmd)
-{
-	int res;
+static void wctc4xxp_loopback_transmit(struct wcdte *wc, struct tcb *cmd);
 
-	if (cmd->data_len < MIN_PACKET_LEN) {
+/* Pads a command out to the shortest frame the DTE takes.  A frame from a
+ * frame ring is padded with whatever follows the payload in its slot, since
+ * the headers say how long the payload is. */
+static inline void
+wctc4xxp_pad_cmd(struct tcb *cmd)
+{
+	if (cmd->data2_len) {
+		if ((cmd->data_len + cmd->data2_len) < MIN_PACKET_LEN)
+			cmd->data2_len = MIN_PACKET_LEN - cmd->data_len;
+	} else if (cmd->data_len < MIN_PACKET_LEN) {
 		memset((u8 *)(cmd->data) + cmd->data_len, 0,
 		       MIN_PACKET_LEN-cmd->data_len);
 		cmd->data_len = MIN_PACKET_LEN;
 	}
+}
+
+static void
+wctc4xxp_transmit_cmd(struct wcdte *wc, struct tcb *cmd)
+{
+	int res;
+
+	wctc4xxp_pad_cmd(cmd);
 	WARN_ON(cmd->response);
 	WARN_ON(cmd->flags & TX_COMPLETE);
+	if (unlikely(test_bit(DTE_LOOPBACK, &wc->flags))) {
+		wctc4xxp_loopback_transmit(wc, cmd);
+		return;
+	}
 	cmd->timeout = jiffies + HZ/4;
 	if (cmd->flags & (__WAIT_FOR_ACK | __WAIT_FOR_RESPONSE)) {
 		if (cmd->flags & __WAIT_FOR_RESPONSE) {
@@ -1732,6 +2256,40 @@ wctc4xxp_transmit_cmd(struct wcdte *wc, struct tcb *cmd)
 	}
 }
 
+/* Transmits a list of commands which do not wait for an ack or a response,
+ * with one transmit demand poll for all of them. */
+static void
+wctc4xxp_transmit_batch(struct wcdte *wc, struct list_head *cmds)
+{
+	struct tcb *cmd, *temp;
+
+	if (unlikely(test_bit(DTE_LOOPBACK, &wc->flags))) {
+		list_for_each_entry_safe(cmd, temp, cmds, node) {
+			list_del_init(&cmd->node);
+			wctc4xxp_transmit_cmd(wc, cmd);
+		}
+		return;
+	}
+
+	list_for_each_entry(cmd, cmds, node) {
+		wctc4xxp_pad_cmd(cmd);
+		WARN_ON(cmd->flags & (__WAIT_FOR_ACK | __WAIT_FOR_RESPONSE));
+		cmd->timeout = jiffies + HZ/4;
+		if (!(cmd->flags & DO_NOT_CAPTURE))
+			wctc4xxp_net_capture_cmd(wc, cmd);
+	}
+
+	if (wctc4xxp_submit_batch(wc->txd, cmds))
+		wctc4xxp_transmit_demand_poll(wc);
+
+	/* Whatever did not fit in the descriptor ring waits on the command
+	 * list, as in wctc4xxp_transmit_cmd. */
+	list_for_each_entry_safe(cmd, temp, cmds, node) {
+		list_del_init(&cmd->node);
+		wctc4xxp_add_to_command_list(wc, cmd);
+	}
+}
+
 static int
 wctc4xxp_transmit_cmd_and_wait(struct wcdte *wc, struct tcb *cmd)
 {
@@ -1745,6 +2303,116 @@ wctc4xxp_transmit_cmd_and_wait(struct wcdte *wc, struct tcb *cmd)
 	return 0;
 }
 
+#define MAX_PIPELINE 16
+
+/* A group of commands that are all sent before waiting on any of them.  The
+ * responses are matched to the commands as they come in, so a channel can be
+ * set up in a few round trips to the DTE instead of one per command.
+ *
+ * Responses are matched on function and channel only, so two commands that
+ * share both are never in flight together; the later one waits for the next
+ * round trip, whatever order the DTE answers in. */
+struct wctc4xxp_pipeline {
+	struct wcdte *wc;
+	int count;
+	unsigned long check;	/* Commands whose result code is checked. */
+	struct tcb *cmds[MAX_PIPELINE];
+};
+
+static void
+wctc4xxp_pipeline_init(struct wctc4xxp_pipeline *pl, struct wcdte *wc)
+{
+	pl->wc = wc;
+	pl->count = 0;
+	pl->check = 0;
+}
+
+static struct tcb *
+wctc4xxp_pipeline_cmd(struct wctc4xxp_pipeline *pl, int check)
+{
+	struct tcb *cmd;
+
+	if (pl->count >= MAX_PIPELINE) {
+		WARN_ON(1);
+		return NULL;
+	}
+	cmd = alloc_cmd(SFRAME_SIZE);
+	if (!cmd)
+		return NULL;
+	if (check)
+		__set_bit(pl->count, &pl->check);
+	pl->cmds[pl->count++] = cmd;
+	return cmd;
+}
+
+/* Whether a response to cmds[i] could be taken for one to an earlier
+ * command of the same round trip. */
+static int
+wctc4xxp_pipeline_conflicts(const struct wctc4xxp_pipeline *pl, int first,
+	int i)
+{
+	const struct csm_encaps_hdr *hdr = pl->cmds[i]->data;
+	const struct csm_encaps_hdr *other;
+	int j;
+
+	for (j = first; j < i; ++j) {
+		other = pl->cmds[j]->data;
+		if ((other->function == hdr->function) &&
+		    (other->channel == hdr->channel))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+wctc4xxp_pipeline_run(struct wctc4xxp_pipeline *pl)
+{
+	struct tcb *cmd;
+	int first, last, i;
+	int res = 0;
+
+	for (first = 0; !res && (first < pl->count); first = last) {
+		last = first + 1;
+		while ((last < pl->count) &&
+		       !wctc4xxp_pipeline_conflicts(pl, first, last))
+			++last;
+
+		for (i = first; i < last; ++i) {
+			pl->cmds[i]->flags |= DO_NOT_AUTO_FREE;
+			wctc4xxp_transmit_cmd(pl->wc, pl->cmds[i]);
+		}
+
+		/* Wait for all of them, even after a failure, since none can
+		 * be freed while it is still on the response list. */
+		for (i = first; i < last; ++i) {
+			cmd = pl->cmds[i];
+			wait_for_completion(&cmd->complete);
+			if (cmd->flags & DTE_CMD_TIMEOUT) {
+				DTE_DEBUG(DTE_DEBUG_GENERAL,
+				  "Timeout waiting for pipelined command %d.\n",
+				  i);
+				res = -EIO;
+			} else if (test_bit(i, &pl->check) &&
+				 (0x0000 != response_header(cmd)->params[0])) {
+				WARN_ON(1);
+				res = -EIO;
+			}
+		}
+	}
+	return res;
+}
+
+static void
+wctc4xxp_pipeline_free(struct wctc4xxp_pipeline *pl)
+{
+	int i;
+
+	for (i = 0; i < pl->count; ++i)
+		free_cmd(pl->cmds[i]);
+	pl->count = 0;
+	pl->check = 0;
+}
+
 static int wctc4xxp_create_channel_pair(struct wcdte *wc,
 		struct channel_pvt *cpvt, u8 simple, u8 complicated);
 static int wctc4xxp_destroy_channel_pair(struct wcdte *wc,
@@ -1822,7 +2490,7 @@ wctc4xxp_mark_channel_complement_built(struct wcdte *wc,
 
 	/* It shouldn't already have been built... */
 	WARN_ON(dahdi_tc_is_built(compl_dtc));
-	compl_dtc->built_fmts = dtc->dstfmt | dtc->srcfmt;
+	compl_dtc->built_fmts = dtc->built_fmts;
 	compl_cpvt = compl_dtc->pvt;
 	DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP,
 		"dtc: %p is the complement to %p\n", compl_dtc, dtc);
@@ -1834,6 +2502,135 @@ wctc4xxp_mark_channel_complement_built(struct wcdte *wc,
 	return 0;
 }
 
+/* Destroys the pair dtc belongs to and marks both halves as not built.  Must
+ * be called with the chansem held. */
+static int
+wctc4xxp_unbuild_channel_pair(struct wcdte *wc,
+	struct dahdi_transcoder_channel *dtc)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct dahdi_transcoder_channel *compl_dtc;
+	struct channel_pvt *compl_cpvt;
+	int index;
+	int res;
+
+	index = cpvt->timeslot_in_num/2;
+	BUG_ON(index >= wc->numchannels);
+	if (cpvt->encoder)
+		compl_dtc = &(wc->udecode->channels[index]);
+	else
+		compl_dtc = &(wc->uencode->channels[index]);
+
+	res = wctc4xxp_destroy_channel_pair(wc, cpvt);
+	if (res)
+		return res;
+
+	DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP, "Releasing channel: %p\n", dtc);
+	/* Mark this channel as not built */
+	dahdi_tc_clear_built(dtc);
+	dtc->built_fmts = 0;
+	cpvt->chan_in_num = INVALID;
+	cpvt->chan_out_num = INVALID;
+	/* Mark the channel complement as not built */
+	dahdi_tc_clear_built(compl_dtc);
+	compl_dtc->built_fmts = 0;
+	compl_cpvt = compl_dtc->pvt;
+	compl_cpvt->chan_in_num = INVALID;
+	compl_cpvt->chan_out_num = INVALID;
+	return 0;
+}
+
+/* The formats of the warm pairs: ulaw (or alaw) and the first complex format
+ * the DTE was loaded with. */
+static u32
+wctc4xxp_warm_fmts(const struct wcdte *wc)
+{
+	u32 complex = (wc->uencode->dstfmts & DAHDI_FORMAT_G729A) ?
+		DAHDI_FORMAT_G729A : DAHDI_FORMAT_G723_1;
+	return complex | ((warm_alaw) ? DAHDI_FORMAT_ALAW : DAHDI_FORMAT_ULAW);
+}
+
+/* Counts the pairs built for the warm formats that nobody is using.  Only
+ * stable with the chansem held. */
+static int
+wctc4xxp_idle_warm_pairs(const struct wcdte *wc)
+{
+	const u32 fmts = wctc4xxp_warm_fmts(wc);
+	struct dahdi_transcoder_channel *encoder, *decoder;
+	int i;
+	int count = 0;
+
+	for (i = 0; i < wc->numchannels; ++i) {
+		encoder = &(wc->uencode->channels[i]);
+		decoder = &(wc->udecode->channels[i]);
+		if (dahdi_tc_is_built(encoder) &&
+		    (encoder->built_fmts == fmts) &&
+		    !dahdi_tc_is_busy(encoder) && !dahdi_tc_is_busy(decoder))
+			++count;
+	}
+	return count;
+}
+
+static void
+wctc4xxp_kick_warm_pairs(struct wcdte *wc)
+{
+	if (warm_pairs > 0 && !test_bit(DTE_SHUTDOWN, &wc->flags))
+		queue_work(wctc4xxp_warm_wq, &wc->warm_work);
+}
+
+static void
+wctc4xxp_cancel_warm_work(struct wcdte *wc)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 22)
+	cancel_work_sync(&wc->warm_work);
+#else
+	flush_workqueue(wctc4xxp_warm_wq);
+#endif
+}
+
+/* Builds pairs for the warm formats on free channels until there are
+ * warm_pairs of them idle, so that calls for the common formats do not wait
+ * on the DTE to set up a channel. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+static void wctc4xxp_warm_work(void *param)
+{
+	struct wcdte *wc = param;
+#else
+static void wctc4xxp_warm_work(struct work_struct *work)
+{
+	struct wcdte *wc = container_of(work, struct wcdte, warm_work);
+#endif
+	const u32 fmts = wctc4xxp_warm_fmts(wc);
+	const u8 complicated = wctc4xxp_dahdifmt_to_dtefmt(fmts &
+		(DAHDI_FORMAT_G729A | DAHDI_FORMAT_G723_1));
+	const u8 simple = wctc4xxp_dahdifmt_to_dtefmt(fmts &
+		(DAHDI_FORMAT_ULAW | DAHDI_FORMAT_ALAW));
+	struct dahdi_transcoder_channel *encoder, *decoder;
+	int i;
+
+	down(&wc->chansem);
+	for (i = 0; i < wc->numchannels; ++i) {
+		if (test_bit(DTE_SHUTDOWN, &wc->flags) ||
+		    (wctc4xxp_idle_warm_pairs(wc) >= warm_pairs))
+			break;
+		encoder = &(wc->uencode->channels[i]);
+		decoder = &(wc->udecode->channels[i]);
+		if (dahdi_tc_is_built(encoder) || dahdi_tc_is_busy(encoder) ||
+		    dahdi_tc_is_busy(decoder))
+			continue;
+		if (wctc4xxp_create_channel_pair(wc, encoder->pvt, simple,
+			complicated)) {
+			DTE_PRINTK(WARNING, "Failed to build warm channel "
+				"pair %d.\n", i);
+			break;
+		}
+		dahdi_tc_set_built(encoder);
+		encoder->built_fmts = fmts;
+		wctc4xxp_mark_channel_complement_built(wc, encoder);
+	}
+	up(&wc->chansem);
+}
+
 static int
 do_channel_allocate(struct dahdi_transcoder_channel *dtc)
 {
@@ -1854,10 +2651,21 @@ do_channel_allocate(struct dahdi_transcoder_channel *dtc)
 	 * channel semaphore, in case the previous holder of the semaphore
 	 * built this channel as a complement to itself. */
 	if (dahdi_tc_is_built(dtc)) {
-		up(&wc->chansem);
-		DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP,
-		  "Allocating channel %p which is already built.\n", dtc);
-		return 0;
+		if (dtc->built_fmts == (dtc->dstfmt | dtc->srcfmt)) {
+			up(&wc->chansem);
+			DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP,
+			  "Allocating channel %p which is already built.\n",
+			  dtc);
+			wctc4xxp_kick_warm_pairs(wc);
+			return 0;
+		}
+		/* The warm pair builder took this channel before it was
+		 * allocated for some other formats. */
+		res = wctc4xxp_unbuild_channel_pair(wc, dtc);
+		if (res) {
+			up(&wc->chansem);
+			return res;
+		}
 	}
 
 	DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP,
@@ -1913,6 +2721,9 @@ wctc4xxp_disable_interrupts(struct wcdte *wc)
 static void
 wctc4xxp_enable_polling(struct wcdte *wc)
 {
+	/* There is no card to poll behind the loopback DTE. */
+	if (test_bit(DTE_LOOPBACK, &wc->flags))
+		return;
 	set_bit(DTE_POLLING, &wc->flags);
 	mod_timer(&wc->polling, jiffies + 1);
 	wctc4xxp_disable_interrupts(wc);
@@ -1935,9 +2746,11 @@ wctc4xxp_operation_allocate(struct dahdi_transcoder_channel *dtc)
 			wctc4xxp_enable_polling(wc);
 	}
 
-	if (dahdi_tc_is_built(dtc)) {
+	if (dahdi_tc_is_built(dtc) &&
+	    (dtc->built_fmts == (dtc->dstfmt | dtc->srcfmt))) {
 		DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP,
 		  "Allocating channel %p which is already built.\n", dtc);
+		wctc4xxp_kick_warm_pairs(wc);
 		return 0;
 	}
 	return do_channel_allocate(dtc);
@@ -1958,14 +2771,24 @@ wctc4xxp_operation_release(struct dahdi_transcoder_channel *dtc)
 	/* This is the 'complimentary channel' to dtc.  I.e., if dtc is an
 	 * encoder, compl_dtc is the decoder and vice-versa */
 	struct dahdi_transcoder_channel *compl_dtc;
-	struct channel_pvt *compl_cpvt;
 	struct channel_pvt *cpvt = dtc->pvt;
 	struct wcdte *wc = cpvt->wc;
 	int packets_received, packets_sent;
+	struct wctc4xxp_ring *ring;
+	unsigned long flags;
 
 	BUG_ON(!cpvt);
 	BUG_ON(!wc);
 
+	/* The frame ring goes with the channel, once any frames still being
+	 * sent from it are done. */
+	spin_lock_irqsave(&cpvt->lock, flags);
+	ring = cpvt->ring;
+	cpvt->ring = NULL;
+	spin_unlock_irqrestore(&cpvt->lock, flags);
+	if (ring)
+		wctc4xxp_ring_put(ring);
+
 	if (unlikely(test_bit(DTE_SHUTDOWN, &wc->flags))) {
 		/* The shudown flags can also be set if there is a
 		 * catastrophic failure. */
@@ -2016,22 +2839,15 @@ wctc4xxp_operation_release(struct dahdi_transcoder_channel *dtc)
 		res = 0;
 		goto error_exit;
 	}
-	res = wctc4xxp_destroy_channel_pair(wc, cpvt);
-	if (res)
+	/* Keep the pair built if it can serve as one of the warm pairs. */
+	if ((dtc->built_fmts == wctc4xxp_warm_fmts(wc)) &&
+	    (wctc4xxp_idle_warm_pairs(wc) < warm_pairs)) {
+		DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP,
+			"Keeping channel %p built as a warm pair.\n", dtc);
+		res = 0;
 		goto error_exit;
-
-	DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP, "Releasing channel: %p\n", dtc);
-	/* Mark this channel as not built */
-	dahdi_tc_clear_built(dtc);
-	dtc->built_fmts = 0;
-	cpvt->chan_in_num = INVALID;
-	cpvt->chan_out_num = INVALID;
-	/* Mark the channel complement as not built */
-	dahdi_tc_clear_built(compl_dtc);
-	compl_dtc->built_fmts = 0;
-	compl_cpvt = compl_dtc->pvt;
-	compl_cpvt->chan_in_num = INVALID;
-	compl_cpvt->chan_out_num = INVALID;
+	}
+	res = wctc4xxp_unbuild_channel_pair(wc, dtc);
 error_exit:
 	up(&wc->chansem);
 	return res;
@@ -2134,6 +2950,10 @@ wctc4xxp_read(struct file *file, char __user *frame, size_t count, loff_t *ppos)
 		return -EIO;
 	}
 
+	/* Frames go to the frame ring instead, once there is one. */
+	if (cpvt->ring)
+		return -EINVAL;
+
 	cmd = get_ready_cmd(dtc);
 	if (!cmd) {
 		if (file->f_flags & O_NONBLOCK) {
@@ -2180,15 +3000,13 @@ wctc4xxp_read(struct file *file, char __user *frame, size_t count, loff_t *ppos)
 	return payload_bytes;
 }
 
-/* Called with a frame in the srcfmt to be transcoded into the dstfmt. */
-static ssize_t
-wctc4xxp_write(struct file *file, const char __user *frame,
-	size_t count, loff_t *ppos)
+/* Checks that a frame of count bytes can be sent on the channel, and
+ * advances the RTP timestamp for it. */
+static int
+wctc4xxp_check_frame(struct dahdi_transcoder_channel *dtc, size_t count)
 {
-	struct dahdi_transcoder_channel *dtc = file->private_data;
 	struct channel_pvt *cpvt = dtc->pvt;
 	struct wcdte *wc = cpvt->wc;
-	struct tcb *cmd;
 
 	BUG_ON(!cpvt);
 	BUG_ON(!wc);
@@ -2230,38 +3048,329 @@ wctc4xxp_write(struct file *file, const char __user *frame,
 		/* Same for ulaw and alaw */
 		cpvt->timestamp += G729_SAMPLES;
 	}
+	return 0;
+}
+
+/* Builds the RTP packet to transcode a frame from user space on the
+ * channel, or returns an error as wctc4xxp_write would. */
+static struct tcb *
+wctc4xxp_prepare_frame(struct dahdi_transcoder_channel *dtc,
+	const char __user *frame, size_t count)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wcdte *wc = cpvt->wc;
+	struct tcb *cmd;
+	int res;
+
+	res = wctc4xxp_check_frame(dtc, count);
+	if (res)
+		return ERR_PTR(res);
 
 	cmd = wctc4xxp_create_rtp_cmd(wc, dtc, count);
 	if (!cmd)
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 	/* Copy the data directly from user space into the command buffer. */
 	if (copy_from_user(&((struct rtp_packet *)(cmd->data))->payload[0],
 		frame, count)) {
 		DTE_PRINTK(ERR, "Failed to copy packet from userspace.\n");
 		free_cmd(cmd);
-		return -EFAULT;
+		return ERR_PTR(-EFAULT);
+	}
+	cpvt->seqno += 1;
+
+	DTE_DEBUG(DTE_DEBUG_RTP_TX,
+	    "Sending packet of %Zu byte on channel (%p).\n", count, dtc);
+
+	atomic_inc(&cpvt->stats.packets_sent);
+	return cmd;
+}
+
+/* Checks the receive ring after sending frames when the card is polled
+ * rather than interrupting. */
+static void
+wctc4xxp_poll_after_write(struct wcdte *wc)
+{
+	if (test_bit(DTE_POLLING, &wc->flags)) {
+#if HZ == 100
+		__wctc4xxp_polling(wc);
+#else
+		if (jiffies != wc->jiffies_at_last_poll) {
+			wc->jiffies_at_last_poll = jiffies;
+			__wctc4xxp_polling(wc);
+		}
+#endif
+	}
+}
+
+/* Called with a frame in the srcfmt to be transcoded into the dstfmt. */
+static ssize_t
+wctc4xxp_write(struct file *file, const char __user *frame,
+	size_t count, loff_t *ppos)
+{
+	struct dahdi_transcoder_channel *dtc = file->private_data;
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct tcb *cmd;
+
+	cmd = wctc4xxp_prepare_frame(dtc, frame, count);
+	if (IS_ERR(cmd))
+		return PTR_ERR(cmd);
+
+	wctc4xxp_transmit_cmd(cpvt->wc, cmd);
+	wctc4xxp_poll_after_write(cpvt->wc);
+	return count;
+}
+
+/* Frames of a DAHDI_TC_SUBMIT for the channels of this driver.  Each run of
+ * frames for the same card goes on consecutive transmit descriptors. */
+static void
+wctc4xxp_write_batch(struct file **files,
+	struct dahdi_transcoder_frame *frames, int count)
+{
+	struct dahdi_transcoder_channel *dtc;
+	struct wcdte *wc = NULL;
+	struct tcb *cmd;
+	LIST_HEAD(cmds);
+	int x;
+
+	for (x = 0; x < count; ++x) {
+		dtc = files[x]->private_data;
+		if (wc && (wc != ((struct channel_pvt *)dtc->pvt)->wc)) {
+			wctc4xxp_transmit_batch(wc, &cmds);
+			wctc4xxp_poll_after_write(wc);
+		}
+		wc = ((struct channel_pvt *)dtc->pvt)->wc;
+
+		cmd = wctc4xxp_prepare_frame(dtc,
+			(const char __user *)(unsigned long)frames[x].buf,
+			frames[x].len);
+		if (IS_ERR(cmd)) {
+			frames[x].status = PTR_ERR(cmd);
+			continue;
+		}
+		list_add_tail(&cmd->node, &cmds);
+		frames[x].status = frames[x].len;
+	}
+	if (wc) {
+		wctc4xxp_transmit_batch(wc, &cmds);
+		wctc4xxp_poll_after_write(wc);
+	}
+}
+
+static int
+wctc4xxp_ring_setup(struct dahdi_transcoder_channel *dtc,
+	struct dahdi_transcoder_ring *r)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wcdte *wc = cpvt->wc;
+	struct wctc4xxp_ring *ring;
+	unsigned int txslots, rxslots;
+	unsigned int i;
+	unsigned long flags;
+
+	if (unlikely(test_bit(DTE_SHUTDOWN, &wc->flags)))
+		return -EIO;
+	if (cpvt->ring)
+		return -EBUSY;
+
+	txslots = (r->txslots) ? min_t(u32, r->txslots, RING_MAX_SLOTS) :
+		RING_DEFAULT_SLOTS;
+	/* The slot last collected is held back from the driver, so receiving
+	 * needs at least two. */
+	rxslots = (r->rxslots) ? max_t(u32, 2,
+		min_t(u32, r->rxslots, RING_MAX_SLOTS)) : RING_DEFAULT_SLOTS;
+	ring = wctc4xxp_ring_alloc(txslots, rxslots);
+	if (!ring)
+		return -ENOMEM;
+	for (i = 0; i < txslots; ++i)
+		wctc4xxp_fill_rtp_template(ring->tx[i].frame, dtc);
+
+	spin_lock_irqsave(&cpvt->lock, flags);
+	if (cpvt->ring) {
+		spin_unlock_irqrestore(&cpvt->lock, flags);
+		wctc4xxp_ring_put(ring);
+		return -EBUSY;
+	}
+	cpvt->ring = ring;
+	spin_unlock_irqrestore(&cpvt->lock, flags);
+
+	r->txslots = txslots;
+	r->rxslots = rxslots;
+	r->slot_size = RING_SLOT_SIZE;
+	r->payload_offset = 0;
+	r->max_payload = SFRAME_SIZE - sizeof(struct rtp_packet);
+	r->size = ring->npages << PAGE_SHIFT;
+	return 0;
+}
+
+/* Takes a reference on the frame ring of the channel, so that it cannot be
+ * freed by a release or a new allocation of the channel while in use. */
+static struct wctc4xxp_ring *
+wctc4xxp_ring_get(struct channel_pvt *cpvt)
+{
+	struct wctc4xxp_ring *ring;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cpvt->lock, flags);
+	ring = cpvt->ring;
+	if (ring)
+		atomic_inc(&ring->refcount);
+	spin_unlock_irqrestore(&cpvt->lock, flags);
+	return ring;
+}
+
+/* Sends the payload in a transmit slot, straight from the slot.  Only the
+ * headers of the slot that change with each frame are written.  User space
+ * can still change the payload while it is sent, but nothing else. */
+static int
+wctc4xxp_ring_submit(struct dahdi_transcoder_channel *dtc,
+	const struct dahdi_transcoder_slot *s)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wcdte *wc = cpvt->wc;
+	struct wctc4xxp_ring *ring;
+	struct wctc4xxp_ring_slot *slot;
+	struct tcb *cmd;
+	int res;
+
+	ring = wctc4xxp_ring_get(cpvt);
+	if (!ring)
+		return -EINVAL;
+	if (s->slot >= ring->txslots) {
+		res = -EINVAL;
+		goto error_exit;
+	}
+	if (test_and_set_bit(s->slot, ring->inflight)) {
+		res = -EBUSY;
+		goto error_exit;
+	}
+	res = wctc4xxp_check_frame(dtc, s->len);
+	if (res) {
+		clear_bit(s->slot, ring->inflight);
+		goto error_exit;
 	}
+
+	slot = &ring->tx[s->slot];
+	wctc4xxp_fill_rtp_frame(slot->frame, cpvt, s->len);
 	cpvt->seqno += 1;
 
+	cmd = &slot->cmd;
+	memset(cmd, 0, sizeof(*cmd));
+	initialize_cmd(cmd, RING_SLOT);
+	cmd->data = slot->frame;
+	cmd->data_len = sizeof(struct rtp_packet);
+	cmd->data2 = wctc4xxp_ring_slot(ring, s->slot);
+	cmd->data2_len = s->len;
+
 	DTE_DEBUG(DTE_DEBUG_RTP_TX,
-	    "Sending packet of %Zu byte on channel (%p).\n", count, dtc);
+	    "Sending slot %u of %u bytes on channel (%p).\n", s->slot, s->len,
+	    dtc);
 
+	/* The reference taken above is now held by the frame in flight. */
 	atomic_inc(&cpvt->stats.packets_sent);
 	wctc4xxp_transmit_cmd(wc, cmd);
+	wctc4xxp_poll_after_write(wc);
+	return 0;
 
-	if (test_bit(DTE_POLLING, &wc->flags)) {
-#if HZ == 100
-		__wctc4xxp_polling(wc);
-#else
-		if (jiffies != wc->jiffies_at_last_poll) {
-			wc->jiffies_at_last_poll = jiffies;
-			__wctc4xxp_polling(wc);
+error_exit:
+	wctc4xxp_ring_put(ring);
+	return res;
+}
+
+static int
+wctc4xxp_ring_collect(struct dahdi_transcoder_channel *dtc,
+	struct dahdi_transcoder_slot *s)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wctc4xxp_ring *ring;
+	unsigned long flags;
+	int res = -EAGAIN;
+
+	spin_lock_irqsave(&cpvt->lock, flags);
+	ring = cpvt->ring;
+	if (!ring) {
+		res = -EINVAL;
+	} else if (ring->rx_tail != ring->rx_head) {
+		s->slot = ring->rx_tail % ring->rxslots;
+		s->len = ring->rx_len[s->slot];
+		++ring->rx_tail;
+		res = 0;
+	}
+	if (!ring || (ring->rx_tail == ring->rx_head))
+		dahdi_tc_clear_data_waiting(dtc);
+	spin_unlock_irqrestore(&cpvt->lock, flags);
+
+	if (!res)
+		atomic_inc(&cpvt->stats.packets_received);
+	return res;
+}
+
+/* Puts a transcoded frame in the next receive slot.  Called with the lock
+ * of the channel held.  Returns -EIO if the frame was dropped. */
+static int
+wctc4xxp_ring_receive(struct wcdte *wc, struct wctc4xxp_ring *ring,
+	const struct rtp_packet *packet)
+{
+	unsigned int slot;
+	size_t payload_bytes;
+
+	payload_bytes = be16_to_cpu(packet->udphdr.len) -
+		sizeof(struct rtphdr) - sizeof(struct udphdr);
+	if (payload_bytes > SFRAME_SIZE - sizeof(struct rtp_packet))
+		return -EIO;
+	if ((ring->rx_head - ring->rx_tail) >= (ring->rxslots - 1)) {
+		++ring->overruns;
+		if (printk_ratelimit()) {
+			DTE_PRINTK(WARNING,
+			  "Frame ring full; dropped %u frames.\n",
+			  ring->overruns);
 		}
-#endif
+		return -EIO;
 	}
+	slot = ring->rx_head % ring->rxslots;
+	/* The one copy on the receive side, since the receive descriptors are
+	 * shared by all the channels and filled before the channel is known. */
+	memcpy(wctc4xxp_ring_slot(ring, ring->txslots + slot),
+		&packet->payload[0], payload_bytes);
+	ring->rx_len[slot] = payload_bytes;
+	++ring->rx_head;
+	return 0;
+}
+
+static int
+wctc4xxp_mmap(struct file *file, struct vm_area_struct *vma)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
+	struct dahdi_transcoder_channel *dtc = file->private_data;
+	struct channel_pvt *cpvt;
+	struct wctc4xxp_ring *ring;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned int i;
+	int res;
 
+	if (!dtc)
+		return -EINVAL;
+	cpvt = dtc->pvt;
+	ring = wctc4xxp_ring_get(cpvt);
+	if (!ring)
+		return -EINVAL;
+	if (vma->vm_pgoff || (size > (ring->npages << PAGE_SHIFT))) {
+		wctc4xxp_ring_put(ring);
+		return -EINVAL;
+	}
 
-	return count;
+	/* The pages inserted hold references of their own. */
+	res = 0;
+	for (i = 0; i < (size >> PAGE_SHIFT); ++i) {
+		res = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT),
+			virt_to_page(ring->pages[i]));
+		if (res)
+			break;
+	}
+	wctc4xxp_ring_put(ring);
+	return res;
+#else
+	return -ENOSYS;
+#endif
 }
 
 static void
@@ -2473,6 +3582,7 @@ queue_rtp_packet(struct wcdte *wc, struct tcb *cmd)
 	struct channel_pvt *cpvt;
 	struct rtp_packet *packet = cmd->data;
 	unsigned long flags;
+	int dropped;
 
 	if (unlikely(ip_fast_csum((void *)(&packet->iphdr),
 		packet->iphdr.ihl))) {
@@ -2510,13 +3620,74 @@ queue_rtp_packet(struct wcdte *wc, struct tcb *cmd)
 
 	cpvt = dtc->pvt;
 	spin_lock_irqsave(&cpvt->lock, flags);
-	list_add_tail(&cmd->node, &cpvt->rx_queue);
-	dahdi_tc_set_data_waiting(dtc);
-	spin_unlock_irqrestore(&cpvt->lock, flags);
+	if (cpvt->ring) {
+		dropped = wctc4xxp_ring_receive(wc, cpvt->ring, packet);
+		if (cpvt->ring->rx_head != cpvt->ring->rx_tail)
+			dahdi_tc_set_data_waiting(dtc);
+		spin_unlock_irqrestore(&cpvt->lock, flags);
+		free_cmd(cmd);
+		if (dropped)
+			dahdi_transcoder_dropped(dtc);
+	} else {
+		list_add_tail(&cmd->node, &cpvt->rx_queue);
+		dahdi_tc_set_data_waiting(dtc);
+		spin_unlock_irqrestore(&cpvt->lock, flags);
+	}
 	dahdi_transcoder_alert(dtc);
 	return;
 }
 
+/* Stands in for the DTE of the loopback device.  Each RTP packet comes back
+ * at once to the channel that sent it, as the DTE would send the transcoded
+ * frame, but with the payload as it was sent.  Nothing else is sent to the
+ * loopback DTE, since it has no channels to set up; commands that would
+ * wait on it time out instead. */
+static void
+wctc4xxp_loopback_transmit(struct wcdte *wc, struct tcb *cmd)
+{
+	const struct ethhdr *ethhdr = cmd->data;
+	struct dahdi_transcoder_channel *dtc;
+	struct rtp_packet *packet;
+	struct tcb *rx;
+	unsigned int index;
+	__be16 port;
+
+	if (cpu_to_be16(ETH_P_IP) == ethhdr->h_proto) {
+		rx = __alloc_cmd(SFRAME_SIZE, GFP_ATOMIC, 0);
+		if (rx) {
+			/* This copy is the one the card makes by DMA. */
+			memcpy(rx->data, cmd->data, cmd->data_len);
+			memcpy((u8 *)rx->data + cmd->data_len, cmd->data2,
+			       cmd->data2_len);
+			packet = rx->data;
+			index = (be16_to_cpu(packet->udphdr.dest) - 0x5000) / 2;
+			if (index < wc->numchannels) {
+				if ((0x00 == packet->rtphdr.type) ||
+				    (0x08 == packet->rtphdr.type))
+					dtc = &(wc->uencode->channels[index]);
+				else
+					dtc = &(wc->udecode->channels[index]);
+				packet->rtphdr.type =
+				    wctc4xxp_dahdifmt_to_dtefmt(dtc->dstfmt);
+			}
+			port = packet->udphdr.source;
+			packet->udphdr.source = packet->udphdr.dest;
+			packet->udphdr.dest = port;
+			queue_rtp_packet(wc, rx);
+		} else {
+			DTE_PRINTK(ERR, "Out of memory in %s.\n", __func__);
+		}
+	} else if (cmd->flags & (__WAIT_FOR_ACK | __WAIT_FOR_RESPONSE)) {
+		cmd->flags |= DTE_CMD_TIMEOUT;
+	}
+
+	cmd->flags |= TX_COMPLETE;
+	if (cmd->flags & DO_NOT_AUTO_FREE)
+		complete(&cmd->complete);
+	else
+		free_cmd(cmd);
+}
+
 static inline void
 wctc4xxp_receiveprep(struct wcdte *wc, struct tcb *cmd)
 {
@@ -3011,6 +4182,94 @@ setup_half_channel(struct channel_pvt *pvt, struct tcb *cmd, u16 length)
 	return 0;
 }
 
+static int
+pipeline_half_channel(struct wctc4xxp_pipeline *pl, struct channel_pvt *pvt,
+	u16 length)
+{
+	struct tcb *cmd;
+
+	cmd = wctc4xxp_pipeline_cmd(pl, 1);
+	if (!cmd)
+		return -ENOMEM;
+	prep_set_ip_hdr_channel_cmd(pvt, cmd);
+	cmd = wctc4xxp_pipeline_cmd(pl, 1);
+	if (!cmd)
+		return -ENOMEM;
+	prep_voip_vceopt_cmd(pvt, cmd, length);
+	cmd = wctc4xxp_pipeline_cmd(pl, 1);
+	if (!cmd)
+		return -ENOMEM;
+	prep_voip_tonectl_cmd(pvt, cmd);
+	cmd = wctc4xxp_pipeline_cmd(pl, 0);
+	if (!cmd)
+		return -ENOMEM;
+	prep_voip_dtmfopt_cmd(pvt, cmd);
+	cmd = wctc4xxp_pipeline_cmd(pl, 0);
+	if (!cmd)
+		return -ENOMEM;
+	prep_voip_indctrl_cmd(pvt, cmd);
+	return 0;
+}
+
+/* Builds the pair in three round trips: one to create each channel, since
+ * the two create commands cannot be told apart, and one for everything that
+ * needs their DTE channel numbers. */
+static int
+wctc4xxp_pipeline_channel_pair(struct wcdte *wc,
+	struct channel_pvt *encoder_pvt, struct channel_pvt *decoder_pvt,
+	u16 encoder_timeslot, u16 decoder_timeslot, u8 simple, u8 complicated,
+	u16 length)
+{
+	struct wctc4xxp_pipeline pl;
+	struct tcb *encoder_cmd, *decoder_cmd, *cmd;
+	u16 encoder_channel, decoder_channel;
+	int res = -ENOMEM;
+
+	wctc4xxp_pipeline_init(&pl, wc);
+	encoder_cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	decoder_cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	if (!encoder_cmd || !decoder_cmd)
+		goto error_exit;
+	prep_create_channel_cmd(wc, encoder_cmd, encoder_timeslot);
+	prep_create_channel_cmd(wc, decoder_cmd, decoder_timeslot);
+	res = wctc4xxp_pipeline_run(&pl);
+	if (res)
+		goto error_exit;
+	encoder_channel = le16_to_cpu(response_header(encoder_cmd)->params[1]);
+	decoder_channel = le16_to_cpu(response_header(decoder_cmd)->params[1]);
+	wctc4xxp_pipeline_free(&pl);
+
+	WARN_ON(encoder_channel == decoder_channel);
+	encoder_pvt->chan_in_num = encoder_channel;
+	encoder_pvt->chan_out_num = decoder_channel;
+	decoder_pvt->chan_in_num = decoder_channel;
+	decoder_pvt->chan_out_num = encoder_channel;
+
+	res = -ENOMEM;
+	if (pipeline_half_channel(&pl, encoder_pvt, length))
+		goto error_exit;
+	if (pipeline_half_channel(&pl, decoder_pvt, length))
+		goto error_exit;
+	cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	if (!cmd)
+		goto error_exit;
+	prep_trans_connect_cmd(wc, cmd, 1, encoder_channel, decoder_channel,
+		complicated, simple);
+	cmd = wctc4xxp_pipeline_cmd(&pl, 0);
+	if (!cmd)
+		goto error_exit;
+	prep_voip_vopena_cmd(encoder_pvt, cmd, complicated);
+	cmd = wctc4xxp_pipeline_cmd(&pl, 0);
+	if (!cmd)
+		goto error_exit;
+	prep_voip_vopena_cmd(decoder_pvt, cmd, simple);
+	res = wctc4xxp_pipeline_run(&pl);
+
+error_exit:
+	wctc4xxp_pipeline_free(&pl);
+	return res;
+}
+
 static int
 wctc4xxp_create_channel_pair(struct wcdte *wc, struct channel_pvt *cpvt,
 	u8 simple, u8 complicated)
@@ -3021,10 +4280,6 @@ wctc4xxp_create_channel_pair(struct wcdte *wc, struct channel_pvt *cpvt,
 	u16 length;
 	struct tcb *cmd;
 
-	cmd = alloc_cmd(SFRAME_SIZE);
-	if (!cmd)
-		return -ENOMEM;
-
 	BUG_ON(!wc || !cpvt);
 	if (cpvt->encoder) {
 		encoder_timeslot = cpvt->timeslot_in_num;
@@ -3050,6 +4305,34 @@ wctc4xxp_create_channel_pair(struct wcdte *wc, struct channel_pvt *cpvt,
 	BUG_ON(!decoder_pvt);
 
 	WARN_ON(encoder_timeslot == decoder_timeslot);
+	length = (DTE_FORMAT_G729A == complicated) ? G729_LENGTH :
+		(DTE_FORMAT_G723_1 == complicated) ? G723_LENGTH : 0;
+
+	if (test_bit(DTE_LOOPBACK, &wc->flags)) {
+		/* Nothing to set up; name the DTE channels after the
+		 * timeslots. */
+		encoder_pvt->chan_in_num = encoder_timeslot;
+		encoder_pvt->chan_out_num = decoder_timeslot;
+		decoder_pvt->chan_in_num = decoder_timeslot;
+		decoder_pvt->chan_out_num = encoder_timeslot;
+		return 0;
+	}
+
+	if (pipeline) {
+		if (wctc4xxp_pipeline_channel_pair(wc, encoder_pvt,
+			decoder_pvt, encoder_timeslot, decoder_timeslot,
+			simple, complicated, length))
+			return -EIO;
+		DTE_DEBUG(DTE_DEBUG_CHANNEL_SETUP,
+		  "DTE has completed pipelined setup of channels %d and %d.\n",
+		  encoder_pvt->chan_in_num, decoder_pvt->chan_in_num);
+		return 0;
+	}
+
+	cmd = alloc_cmd(SFRAME_SIZE);
+	if (!cmd)
+		return -ENOMEM;
+
 	/* First, let's create two channels, one for the simple -> complex
 	 * encoder and another for the complex->simple decoder. */
 	if (send_create_channel_cmd(wc, cmd, encoder_timeslot,
@@ -3060,9 +4343,6 @@ wctc4xxp_create_channel_pair(struct wcdte *wc, struct channel_pvt *cpvt,
 		&decoder_channel))
 		goto error_exit;
 
-	length = (DTE_FORMAT_G729A == complicated) ? G729_LENGTH :
-		(DTE_FORMAT_G723_1 == complicated) ? G723_LENGTH : 0;
-
 	WARN_ON(encoder_channel == decoder_channel);
 	/* Now set all the default parameters for the encoder. */
 	encoder_pvt->chan_in_num = encoder_channel;
@@ -3095,6 +4375,45 @@ error_exit:
 	return -EIO;
 }
 
+/* Tears the pair down in one round trip.  This still waits for the DTE to
+ * finish, so that the timeslots are not reused while it is tearing down. */
+static int
+wctc4xxp_pipeline_destroy_pair(struct wcdte *wc,
+	struct channel_pvt *encoder_pvt, struct channel_pvt *decoder_pvt,
+	int chan1, int chan2)
+{
+	struct wctc4xxp_pipeline pl;
+	struct tcb *cmd;
+	int res = -ENOMEM;
+
+	wctc4xxp_pipeline_init(&pl, wc);
+	cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	if (!cmd)
+		goto error_exit;
+	prep_voip_vopena_close_cmd(encoder_pvt, cmd);
+	cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	if (!cmd)
+		goto error_exit;
+	prep_voip_vopena_close_cmd(decoder_pvt, cmd);
+	cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	if (!cmd)
+		goto error_exit;
+	prep_trans_connect_cmd(wc, cmd, 0, chan1, chan2, 0, 0);
+	cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	if (!cmd)
+		goto error_exit;
+	prep_destroy_channel_cmd(wc, cmd, chan1);
+	cmd = wctc4xxp_pipeline_cmd(&pl, 1);
+	if (!cmd)
+		goto error_exit;
+	prep_destroy_channel_cmd(wc, cmd, chan2);
+	res = wctc4xxp_pipeline_run(&pl);
+
+error_exit:
+	wctc4xxp_pipeline_free(&pl);
+	return res;
+}
+
 static int
 wctc4xxp_destroy_channel_pair(struct wcdte *wc, struct channel_pvt *cpvt)
 {
@@ -3103,10 +4422,6 @@ wctc4xxp_destroy_channel_pair(struct wcdte *wc, struct channel_pvt *cpvt)
 	int chan1, chan2, timeslot1, timeslot2;
 	struct tcb *cmd;
 
-	cmd = alloc_cmd(SFRAME_SIZE);
-	if (!cmd)
-		return -ENOMEM;
-
 	if (cpvt->encoder) {
 		chan1 = cpvt->chan_in_num;
 		timeslot1 = cpvt->timeslot_in_num;
@@ -3131,6 +4446,17 @@ wctc4xxp_destroy_channel_pair(struct wcdte *wc, struct channel_pvt *cpvt)
 	encoder_pvt = dtc1->pvt;
 	decoder_pvt = dtc2->pvt;
 
+	if (test_bit(DTE_LOOPBACK, &wc->flags))
+		return 0;
+
+	if (pipeline)
+		return wctc4xxp_pipeline_destroy_pair(wc, encoder_pvt,
+			decoder_pvt, chan1, chan2);
+
+	cmd = alloc_cmd(SFRAME_SIZE);
+	if (!cmd)
+		return -ENOMEM;
+
 	if (send_voip_vopena_close_cmd(encoder_pvt, cmd))
 		goto error_exit;
 	if (send_voip_vopena_close_cmd(decoder_pvt, cmd))
@@ -3229,6 +4555,7 @@ static void wctc4xxp_setup_file_operations(struct file_operations *fops)
 	fops->owner = THIS_MODULE;
 	fops->read =  wctc4xxp_read;
 	fops->write = wctc4xxp_write;
+	fops->mmap =  wctc4xxp_mmap;
 }
 
 static int
@@ -3245,6 +4572,25 @@ initialize_channel_pvt(struct wcdte *wc, int encoder,
 	return 0;
 }
 
+/* Both transcoders share the descriptor ring and the command counters. */
+static void
+wctc4xxp_get_stats(struct dahdi_transcoder *tc,
+	struct dahdi_transcoder_stats *stats)
+{
+	struct channel_pvt *cpvt = tc->channels[0].pvt;
+	struct wcdte *wc = cpvt->wc;
+	unsigned long flags;
+
+	if (wc->txd) {
+		spin_lock_irqsave(&wc->txd->lock, flags);
+		stats->hwqueue = wc->txd->count;
+		spin_unlock_irqrestore(&wc->txd->lock, flags);
+		stats->hwqueue_size = DRING_SIZE;
+	}
+	stats->retries = atomic_read(&wc->cmd_retries);
+	stats->timeouts = atomic_read(&wc->cmd_timeouts);
+}
+
 static int
 initialize_transcoder(struct wcdte *wc, unsigned int srcfmts,
 	unsigned int dstfmts, struct channel_pvt *pvts,
@@ -3258,6 +4604,11 @@ initialize_transcoder(struct wcdte *wc, unsigned int srcfmts,
 	(*zt)->dstfmts = dstfmts;
 	(*zt)->allocate = wctc4xxp_operation_allocate;
 	(*zt)->release = wctc4xxp_operation_release;
+	(*zt)->write_batch = wctc4xxp_write_batch;
+	(*zt)->ring_setup = wctc4xxp_ring_setup;
+	(*zt)->ring_submit = wctc4xxp_ring_submit;
+	(*zt)->ring_collect = wctc4xxp_ring_collect;
+	(*zt)->get_stats = wctc4xxp_get_stats;
 	wctc4xxp_setup_file_operations(&((*zt)->fops));
 	for (chan = 0; chan < wc->numchannels; ++chan)
 		(*zt)->channels[chan].pvt = &pvts[chan];
@@ -3339,6 +4690,7 @@ wctc4xxp_watchdog(unsigned long data)
 				 * haven't received the ACK or the response.
 				 */
 				cmd->flags |= DTE_CMD_TIMEOUT;
+				atomic_inc(&wc->cmd_timeouts);
 				list_del_init(&cmd->node);
 				complete(&cmd->complete);
 			} else if (cmd->flags & TX_COMPLETE) {
@@ -3347,6 +4699,7 @@ wctc4xxp_watchdog(unsigned long data)
 				 */
 				list_move_tail(&cmd->node, &cmds_to_retry);
 				cmd->flags &= ~(TX_COMPLETE);
+				atomic_inc(&wc->cmd_retries);
 			} else {
 				/* The command is still sitting on the tx
 				 * descriptor ring.  We don't want to move it
@@ -3357,6 +4710,7 @@ wctc4xxp_watchdog(unsigned long data)
 				  "Retrying command that was " \
 				  "still on descriptor list.\n");
 				cmd->timeout = jiffies + HZ/4;
+				atomic_inc(&wc->cmd_retries);
 				wctc4xxp_transmit_demand_poll(wc);
 				reschedule_timer = 1;
 			}
@@ -3457,8 +4811,10 @@ wctc4xxp_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 	INIT_LIST_HEAD(&wc->rx_list);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
 	INIT_WORK(&wc->deferred_work, deferred_work_func, wc);
+	INIT_WORK(&wc->warm_work, wctc4xxp_warm_work, wc);
 #else
 	INIT_WORK(&wc->deferred_work, deferred_work_func);
+	INIT_WORK(&wc->warm_work, wctc4xxp_warm_work);
 #endif
 	DTE_PRINTK(INFO, "Attached to device at %s.\n", pci_name(wc->pdev));
 
@@ -3538,6 +4894,12 @@ wctc4xxp_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 		wc->numchannels = min_numchannels;
 	}
 
+	/* Enough tcbs for both descriptor rings and a few frames in flight
+	 * on every channel. */
+	wc->pool_tcbs = 2 * DRING_SIZE +
+		wc->numchannels * max(pool_per_channel, 0);
+	tcb_pool_grow(wc->pool_tcbs);
+
 	res = initialize_encoders(wc, complexfmts);
 	if (res)
 		goto error_exit_swinit;
@@ -3618,6 +4980,7 @@ wctc4xxp_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 	DTE_DEBUG(DTE_DEBUG_GENERAL, "Operating in DEBUG mode.\n");
 	dahdi_transcoder_register(wc->uencode);
 	dahdi_transcoder_register(wc->udecode);
+	wctc4xxp_kick_warm_pairs(wc);
 
 	return 0;
 
@@ -3640,6 +5003,7 @@ error_exit_swinit:
 	spin_lock(&wctc4xxp_list_lock);
 	list_del(&wc->node);
 	spin_unlock(&wctc4xxp_list_lock);
+	tcb_pool_shrink(wc->pool_tcbs);
 	kfree(wc);
 	return res;
 }
@@ -3670,6 +5034,9 @@ static void __devexit wctc4xxp_remove_one(struct pci_dev *pdev)
 	spin_unlock(&wctc4xxp_list_lock);
 
 	set_bit(DTE_SHUTDOWN, &wc->flags);
+	/* The warm pair builder checks DTE_SHUTDOWN, so it will not start
+	 * building again once it has finished here. */
+	wctc4xxp_cancel_warm_work(wc);
 	if (del_timer_sync(&wc->watchdog))
 		del_timer_sync(&wc->watchdog);
 
@@ -3710,6 +5077,7 @@ static void __devexit wctc4xxp_remove_one(struct pci_dev *pdev)
 	dahdi_transcoder_free(wc->udecode);
 	kfree(wc->encoders);
 	kfree(wc->decoders);
+	tcb_pool_shrink(wc->pool_tcbs);
 	kfree(wc);
 }
 
@@ -3730,6 +5098,97 @@ static struct pci_driver wctc4xxp_driver = {
 	.id_table = wctc4xxp_pci_tbl,
 };
 
+static struct wcdte *loopback_wc;
+
+/* Creates a transcoder with loopback channels and no card behind it, so the
+ * read/write and frame ring paths can be exercised without the hardware. */
+static int
+wctc4xxp_loopback_create(void)
+{
+	struct wcdte *wc;
+	int res;
+
+	wc = kzalloc(sizeof(*wc), GFP_KERNEL);
+	if (!wc)
+		return -ENOMEM;
+
+	snprintf(wc->board_name, sizeof(wc->board_name)-1, "tcloop%d",
+		wctc4xxp_add_to_device_list(wc));
+	wc->variety = "Loopback DTE";
+	wc->numchannels = min(loopback, 255);
+	wc->last_rx_seq_num = -1;
+	set_bit(DTE_LOOPBACK, &wc->flags);
+	strcpy(wc->complexname, "loopback");
+	wc->pool_tcbs = wc->numchannels * max(pool_per_channel, 0);
+	tcb_pool_grow(wc->pool_tcbs);
+
+	init_MUTEX(&wc->chansem);
+	spin_lock_init(&wc->reglock);
+	spin_lock_init(&wc->cmd_list_lock);
+	spin_lock_init(&wc->rx_list_lock);
+	spin_lock_init(&wc->rx_lock);
+	INIT_LIST_HEAD(&wc->cmd_list);
+	INIT_LIST_HEAD(&wc->waiting_for_response_list);
+	INIT_LIST_HEAD(&wc->rx_list);
+	init_waitqueue_head(&wc->waitq);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+	INIT_WORK(&wc->warm_work, wctc4xxp_warm_work, wc);
+#else
+	INIT_WORK(&wc->warm_work, wctc4xxp_warm_work);
+#endif
+
+	res = initialize_encoders(wc, DAHDI_FORMAT_G729A | DAHDI_FORMAT_G723_1);
+	if (!res)
+		res = initialize_decoders(wc,
+			DAHDI_FORMAT_G729A | DAHDI_FORMAT_G723_1);
+	if (res) {
+		kfree(wc->encoders);
+		kfree(wc->decoders);
+		dahdi_transcoder_free(wc->uencode);
+		dahdi_transcoder_free(wc->udecode);
+		spin_lock(&wctc4xxp_list_lock);
+		list_del(&wc->node);
+		spin_unlock(&wctc4xxp_list_lock);
+		tcb_pool_shrink(wc->pool_tcbs);
+		kfree(wc);
+		return res;
+	}
+	sprintf(wc->uencode->name, "Loopback Encoder");
+	sprintf(wc->udecode->name, "Loopback Decoder");
+
+	dahdi_transcoder_register(wc->uencode);
+	dahdi_transcoder_register(wc->udecode);
+	DTE_PRINTK(INFO, "Installed a loopback DTE with %d channels.\n",
+		wc->numchannels);
+	loopback_wc = wc;
+	wctc4xxp_kick_warm_pairs(wc);
+	return 0;
+}
+
+static void
+wctc4xxp_loopback_destroy(void)
+{
+	struct wcdte *wc = loopback_wc;
+
+	if (!wc)
+		return;
+	spin_lock(&wctc4xxp_list_lock);
+	list_del(&wc->node);
+	spin_unlock(&wctc4xxp_list_lock);
+	set_bit(DTE_SHUTDOWN, &wc->flags);
+	wctc4xxp_cancel_warm_work(wc);
+	dahdi_transcoder_unregister(wc->udecode);
+	dahdi_transcoder_unregister(wc->uencode);
+	wctc4xxp_cleanup_channels(wc);
+	dahdi_transcoder_free(wc->uencode);
+	dahdi_transcoder_free(wc->udecode);
+	kfree(wc->encoders);
+	kfree(wc->decoders);
+	tcb_pool_shrink(wc->pool_tcbs);
+	kfree(wc);
+	loopback_wc = NULL;
+}
+
 static int __init wctc4xxp_init(void)
 {
 	int res;
@@ -3741,47 +5200,78 @@ static int __init wctc4xxp_init(void)
 	cache_flags = SLAB_HWCACHE_ALIGN;
 #endif
 
-#ifdef USE_CUSTOM_MEMCACHE
-	cmd_cache = my_cache_create();
-#else
-#	if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23)
 	cmd_cache = kmem_cache_create(THIS_MODULE->name, sizeof(struct tcb),
 			0, cache_flags, NULL, NULL);
-#	else
+#else
 	cmd_cache = kmem_cache_create(THIS_MODULE->name, sizeof(struct tcb),
 			0, cache_flags, NULL);
-#	endif
 #endif
 
 	if (!cmd_cache)
 		return -ENOMEM;
+	wctc4xxp_warm_wq = create_singlethread_workqueue("wctc4xxp_warm");
+	if (!wctc4xxp_warm_wq) {
+		kmem_cache_destroy(cmd_cache);
+		return -ENOMEM;
+	}
+	tcb_pool_init();
 	spin_lock_init(&wctc4xxp_list_lock);
 	INIT_LIST_HEAD(&wctc4xxp_list);
 	res = dahdi_pci_module(&wctc4xxp_driver);
 	if (res) {
-#ifdef USE_CUSTOM_MEMCACHE
-		my_cache_destroy(cmd_cache);
-#else
+		tcb_pool_destroy();
+		destroy_workqueue(wctc4xxp_warm_wq);
 		kmem_cache_destroy(cmd_cache);
-#endif
 		return -ENODEV;
 	}
+	if (loopback > 0) {
+		res = wctc4xxp_loopback_create();
+		if (res) {
+			pci_unregister_driver(&wctc4xxp_driver);
+			tcb_pool_destroy();
+			destroy_workqueue(wctc4xxp_warm_wq);
+			kmem_cache_destroy(cmd_cache);
+			return res;
+		}
+	}
 	return 0;
 }
 
 static void __exit wctc4xxp_cleanup(void)
 {
+	wctc4xxp_loopback_destroy();
 	pci_unregister_driver(&wctc4xxp_driver);
-#ifdef USE_CUSTOM_MEMCACHE
-	my_cache_destroy(cmd_cache);
-#else
+	tcb_pool_destroy();
+	destroy_workqueue(wctc4xxp_warm_wq);
 	kmem_cache_destroy(cmd_cache);
-#endif
 }
 
 module_param(debug, int, S_IRUGO | S_IWUSR);
 module_param(mode, charp, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(mode, "'g729', 'g723.1', or 'any'.  Default 'any'.");
+module_param(pipeline, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pipeline, "Send the commands that build and tear down a "
+	"channel pair without waiting on each response.  Default 0.");
+module_param(pool_per_channel, int, S_IRUGO);
+MODULE_PARM_DESC(pool_per_channel, "Preallocated commands for each channel "
+	"of a card, on top of those for its descriptor rings.  Default 4.");
+module_param(pool_exhausted, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_exhausted, "Commands allocated because the "
+	"preallocated pool was empty.");
+module_param(pool_trades, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_trades, "Magazines of commands traded between the "
+	"CPUs and the shared pool.");
+module_param(warm_pairs, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(warm_pairs, "Number of idle channel pairs to keep built "
+	"for the most common format pair.  Default 0.");
+module_param(warm_alaw, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(warm_alaw, "Build the warm channel pairs for alaw instead "
+	"of ulaw.  Default 0.");
+module_param(loopback, int, S_IRUGO);
+MODULE_PARM_DESC(loopback, "Number of channels of a loopback transcoder, "
+	"with no card behind it, which sends each frame back untranscoded.  "
+	"Default 0 (none).");
 MODULE_DESCRIPTION("Wildcard TC400P+TC400M Driver");
 MODULE_AUTHOR("Digium Incorporated <support@digium.com>");
 MODULE_LICENSE("GPL");
@@ -203,6 +203,8 @@ static int nativebridge = 0;
 static int ringdebounce = DEFAULT_RING_DEBOUNCE;
 static int fwringdetect = 0;
 static int latency = VOICEBUS_DEFAULT_LATENCY;
+static int ring_size = VOICEBUS_DEFAULT_RING_SIZE;
+static int frames_per_service = 1;
 
 #define MS_PER_HOOKCHECK	(1)
 #define NEONMWI_ON_DEBOUNCE	(100/MS_PER_HOOKCHECK)
@@ -3739,7 +3741,8 @@ static int __devinit wctdm_init_one(struct pci_dev *pdev, const struct pci_devic
 
 	snprintf(wc->board_name, sizeof(wc->board_name)-1, "%s%d",
 		 wctdm_driver.name, i);
-	ret = voicebus_init(pdev, SFRAME_SIZE, wc->board_name,
+	ret = voicebus_init(pdev, SFRAME_SIZE, ring_size, frames_per_service,
+		wc->board_name,
 		handle_receive, handle_transmit, wc, debug, &wc->vb);
 	if (ret) {
 		kfree(wc);
@@ -3952,6 +3955,8 @@ module_param(fxsrxgain, int, 0600);
 module_param(ringdebounce, int, 0600);
 module_param(fwringdetect, int, 0600);
 module_param(latency, int, 0600);
+module_param(ring_size, int, 0600);
+module_param(frames_per_service, int, 0600);
 module_param(neonmwi_monitor, int, 0600);
 module_param(neonmwi_level, int, 0600);
 module_param(neonmwi_envelope, int, 0600);
@@ -61,6 +61,8 @@ static int loopback = 0;
 static int t1e1override = -1;
 static int unchannelized = 0;
 static int latency = VOICEBUS_DEFAULT_LATENCY;
+static int ring_size = VOICEBUS_DEFAULT_RING_SIZE;
+static int frames_per_service = 1;
 int vpmsupport = 1;
 static int vpmtsisupport = 0;
 
@@ -1804,7 +1806,8 @@ static int __devinit te12xp_init_one(struct pci_dev *pdev, const struct pci_devi
 #	endif
 
 	snprintf(wc->name, sizeof(wc->name)-1, "wcte12xp%d", index);
-	if ((res = voicebus_init(pdev, SFRAME_SIZE, wc->name,
+	if ((res = voicebus_init(pdev, SFRAME_SIZE, ring_size,
+				 frames_per_service, wc->name,
 				 t1_handle_receive, t1_handle_transmit, wc,
 				 debug, &wc->vb))) {
 		WARN_ON(1);
@@ -1940,6 +1943,8 @@ module_param(aisalarmdebounce, int, S_IRUGO | S_IWUSR);
 module_param(yelalarmdebounce, int, S_IRUGO | S_IWUSR);
 #endif
 module_param(latency, int, S_IRUGO | S_IWUSR);
+module_param(ring_size, int, S_IRUGO | S_IWUSR);
+module_param(frames_per_service, int, S_IRUGO | S_IWUSR);
 #ifdef VPM_SUPPORT
 module_param(vpmsupport, int, S_IRUGO | S_IWUSR);
 module_param(vpmtsisupport, int, S_IRUGO | S_IWUSR);
@@ -114,15 +114,32 @@ typedef struct
     int32_t z2;
 } biquad2_state_t;
 
+/*! Number of tones watched by the DAHDI core's fax/modem tone detector */
+#define DAHDI_ECDIS_TONES	5
+
 typedef struct
 {
-    biquad2_state_t notch;
-    int notch_level;
-    int channel_level;
-    int tone_present;
-    int tone_cycle_duration;
+    /* Goertzel filter state, one entry per tone */
+    int32_t v1[DAHDI_ECDIS_TONES];
+    int32_t v2[DAHDI_ECDIS_TONES];
+    /* Analysis block in progress */
+    uint32_t block_energy;
+    int block_samples;
+    int block_quiet;
+    /* 2100Hz (ANS, ANS/PR, ANSam, ANSam/PR) */
+    int ans_gap;
+    int ans_cycle;
     int good_cycles;
-    int hit;
+    int am_blocks;
+    int am_low;
+    uint64_t am_max;
+    /* 1100Hz (CNG), 2225Hz (Bell answer tone), 1650/1850Hz (V.21 HDLC flags) */
+    int cng_blocks;
+    int bell_blocks;
+    int v21_blocks;
+    int v21_seen;
+    /* Tones already reported */
+    int hits;
 } echo_can_disable_detector_state_t;
 
 struct sf_detect_state {
@@ -194,6 +211,22 @@ struct dahdi_echocan_features {
 	 * with the tone detection feature flags).
 	 */
 	u32 NLP_automatic:1;
+
+	/*! If the echocan keeps the stats field of the dahdi_echocan_state structure
+	 * up to date as it processes samples, this feature flag should be set so that
+	 * the DAHDI core will report those statistics to userspace.
+	 */
+	u32 stats:1;
+
+	/*! If the echocan keeps no state that depends on seeing every chunk while
+	 * nothing is being transmitted, this feature flag should be set. The DAHDI
+	 * core will then skip the echocan_process operation (leaving the received
+	 * signal untouched) once the transmit direction has been silent for longer
+	 * than the echo tail, and resume calling it as soon as the transmit signal
+	 * returns. Since only silent transmit samples are skipped, the echocan's
+	 * transmit history will still be correct when it resumes.
+	 */
+	u32 idle_bypass:1;
 };
 
 /*! Operations (methods) that can be performed on a DAHDI echo canceler instance (state
@@ -279,6 +312,25 @@ struct dahdi_echocan_factory {
 	 */
 	int (*echocan_create)(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			      struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
+
+	/*! \brief Opt: Report the size of an instance's state for a given tail length.
+	 * \param[in] tap_length The number of taps the instance will be created with.
+	 *
+	 * If provided, the DAHDI core keeps a pool of cacheline-aligned state blocks
+	 * of this size for each supported tail length, reserved as spans are registered,
+	 * and the echocan_create and echocan_free functions should get their state
+	 * memory from dahdi_echocan_state_alloc() and dahdi_echocan_state_free().
+	 *
+	 * \return The number of bytes needed for one instance.
+	 */
+	size_t (*echocan_state_size)(u32 tap_length);
+
+	/*! Optional: the number of instances the echocan can provide at once
+	 * (for example because of licensing), or zero for no limit. Once it is
+	 * reached the DAHDI core will try the next echocan in the channel's list
+	 * of preferences instead.
+	 */
+	unsigned int max_instances;
 };
 
 /*! \brief Register an echo canceler factory with the DAHDI core.
@@ -296,6 +348,32 @@ int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec);
  */
 void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec);
 
+/*! \brief Get zeroed state memory for an echo canceler instance from its factory's pool.
+ * \param[in] ec Pointer to the (registered) factory creating the instance.
+ * \param[in] tap_length The tail length of the instance.
+ *
+ * The block is at least echocan_state_size(tap_length) bytes. Blocks for the
+ * pooled tail lengths (powers of two from 32 to 1024) start on a cacheline
+ * boundary; any other length is allocated with kmalloc(). Must be called from
+ * process context.
+ *
+ * \retval Pointer to the state memory on success.
+ * \retval NULL on failure.
+ */
+void *dahdi_echocan_state_alloc(const struct dahdi_echocan_factory *ec, u32 tap_length);
+
+/*! \brief Return state memory obtained from dahdi_echocan_state_alloc().
+ * \param[in] ec Pointer to the factory the memory was obtained from.
+ * \param[in] tap_length The tail length that was passed when it was obtained.
+ * \param[in] state The state memory.
+ *
+ * May be called with interrupts disabled, but not from interrupt context,
+ * since it takes the echo canceler list lock.
+ *
+ * \return Nothing.
+ */
+void dahdi_echocan_state_free(const struct dahdi_echocan_factory *ec, u32 tap_length, void *state);
+
 enum dahdi_echocan_mode {
 	__ECHO_MODE_MUTE = 1 << 8,
 	ECHO_MODE_IDLE = 0,
@@ -315,13 +393,13 @@ struct dahdi_echocan_state {
 	 */
 	const struct dahdi_echocan_ops *ops;
 
-	/*! State data used by the DAHDI core's CED detector for the transmit
-	 * direction, if needed.
+	/*! State data used by the DAHDI core's fax/modem tone detector for
+	 * the transmit direction, if needed.
 	 */
 	echo_can_disable_detector_state_t txecdis;
 
-	/*! State data used by the DAHDI core's CED detector for the receive
-	 * direction, if needed.
+	/*! State data used by the DAHDI core's fax/modem tone detector for
+	 * the receive direction, if needed.
 	 */
 	echo_can_disable_detector_state_t rxecdis;
 
@@ -337,8 +415,50 @@ struct dahdi_echocan_state {
 
 		/*! How many samples to wait before beginning the training operation. */
 		u32 pretrain_timer;
+
+		/*! The echo tail, in samples. */
+		u32 tail;
+
+		/*! How many consecutive silent samples have been transmitted. */
+		u32 tx_idle;
+
+		/*! How many samples the DAHDI core passed through without calling
+		 * the echocan_process operation, as the transmit direction was idle.
+		 */
+		u32 bypassed;
 	} status;
 
+	/*! Running statistics, maintained by echocans which set the stats feature
+	 * flag. The levels are short-term averages of the signal magnitude, and
+	 * may be in whatever scale the echocan finds convenient as long as all
+	 * three use the same one; the DAHDI core only compares them with each
+	 * other. The counters are never reset while the instance exists.
+	 */
+	struct dahdi_echocan_stats {
+		/*! Level of the transmit (far end) signal. */
+		u32 tx_level;
+
+		/*! Level of the receive signal before cancellation. */
+		u32 rx_level;
+
+		/*! Level of the receive signal after cancellation. */
+		u32 clean_level;
+
+		/*! Number of samples processed. */
+		u32 samples;
+
+		/*! Number of samples during which the NLP was suppressing the output. */
+		u32 nlp_samples;
+
+		/*! Number of times double talk was detected and adaptation was halted. */
+		u32 doubletalk;
+
+		/*! Number of times the echocan found its filter diverging and
+		 * reset or restored it.
+		 */
+		u32 resets;
+	} stats;
+
 	/*! This structure contains event flags, allowing the echocan to report
 	 * events that occurred as it processed the transmit and receive streams
 	 * of samples. Each call to the echocan_process operation for this
@@ -529,6 +649,9 @@ struct dahdi_chan {
 	/*! The echo canceler module that should be used to create an
 	   instance when this channel needs one */
 	const struct dahdi_echocan_factory *ec_factory;
+	/*! Echo canceler modules to try, in order, if ec_factory cannot
+	   provide an instance */
+	const struct dahdi_echocan_factory *ec_fallback[DAHDI_MAX_ECHOCAN_PREFS - 1];
 	/*! The echo canceler module that owns the instance currently
 	   on this channel, if one is present */
 	const struct dahdi_echocan_factory *ec_current;
@@ -851,6 +974,9 @@ struct dahdi_span {
 #endif	
 };
 
+/*! Frames in flight on a channel whose write times are kept */
+#define DAHDI_TC_STAMPS		8
+
 struct dahdi_transcoder_channel {
 	void *pvt;
 	struct dahdi_transcoder *parent;
@@ -863,6 +989,15 @@ struct dahdi_transcoder_channel {
 	unsigned long flags;
 	u32 dstfmt;
 	u32 srcfmt;
+	/* Used by dahdi_transcode only */
+	u16 next_free;
+	u8 pair;		/*!< Format pair the channel is counted in */
+	u8 stamp_head;
+	u8 stamp_tail;
+	u16 inflight;		/*!< Frames written and not read yet */
+	u16 unstamped;		/*!< Of those, the ones read before the stamps */
+	spinlock_t stamp_lock;
+	u32 stamps[DAHDI_TC_STAMPS];	/*!< When they were written, in us */
 };
 
 static inline int 
@@ -914,6 +1049,37 @@ dahdi_tc_clear_data_waiting(struct dahdi_transcoder_channel *dtc) {
 	clear_bit(DAHDI_TC_FLAG_DATA_WAITING, &dtc->flags);
 }
 
+/*! Free channels of a transcoder which are built for one pair of formats.
+ *  The head holds the index of the first channel in its low 16 bits and a
+ *  count of updates above that, so the list can be changed with
+ *  atomic_cmpxchg() alone. */
+struct dahdi_tc_freelist {
+	atomic_t fmts;		/*!< built_fmts of the channels, 0 if unused */
+	atomic_t head;
+};
+
+#define DAHDI_TC_FREELISTS	8
+
+#define DAHDI_TC_TURNAROUND_BUCKETS	100
+
+/*! Counters dahdi_transcode keeps for each transcoder and each pair of
+ *  formats, which DAHDI_TC_GETSTATS and DAHDI_TC_GETPAIRSTATS report.
+ *  Turnaround times are kept in a histogram with four buckets for each
+ *  power of two microseconds.  The frame counters are kept for each CPU,
+ *  so that frames are counted without a shared lock, and only added up
+ *  when they are reported; inflight then wraps on each CPU, since frames
+ *  can be written on one and read on another. */
+struct dahdi_tc_counters {
+	u64 allocs;
+	u64 busy;
+	u64 frames_in;
+	u64 frames_out;
+	u32 inflight;
+	u32 inflight_max;	/*!< Most in flight on any one channel */
+	u32 turnaround_max;
+	u32 turnaround[DAHDI_TC_TURNAROUND_BUCKETS];
+};
+
 struct dahdi_transcoder {
 	struct list_head active_list_node;
 	struct list_head registration_list_node;
@@ -924,10 +1090,59 @@ struct dahdi_transcoder {
 	struct file_operations fops;
 	int (*allocate)(struct dahdi_transcoder_channel *channel);
 	int (*release)(struct dahdi_transcoder_channel *channel);
+	/*! Optional. Writes count frames of a DAHDI_TC_SUBMIT at once,
+	 *  frames[x] to the channel opened as files[x], setting the status of
+	 *  each to what write() would have returned.  Lets the driver hand
+	 *  the hardware the whole batch together. */
+	void (*write_batch)(struct file **files,
+			    struct dahdi_transcoder_frame *frames, int count);
+	/*! Optional.  Sets up the frame ring of an allocated channel for
+	 *  DAHDI_TC_RING_SETUP, to be mapped by the mmap of fops. */
+	int (*ring_setup)(struct dahdi_transcoder_channel *channel,
+			  struct dahdi_transcoder_ring *ring);
+	/*! Required with ring_setup.  Sends the frame in a transmit slot. */
+	int (*ring_submit)(struct dahdi_transcoder_channel *channel,
+			   const struct dahdi_transcoder_slot *slot);
+	/*! Required with ring_setup.  Finds the next filled receive slot. */
+	int (*ring_collect)(struct dahdi_transcoder_channel *channel,
+			    struct dahdi_transcoder_slot *slot);
+	/*! Optional.  Fills in the hardware fields of DAHDI_TC_GETSTATS.
+	 *  Called with a spinlock held. */
+	void (*get_stats)(struct dahdi_transcoder *tc,
+			  struct dahdi_transcoder_stats *stats);
+	/*! Set before registering.  New channels go to the transcoders of the
+	 *  highest priority with one free, and the load is only spread among
+	 *  those of the same priority.  Hardware leaves it at
+	 *  DAHDI_TC_PRIORITY_HARDWARE; a software transcoder uses
+	 *  DAHDI_TC_PRIORITY_SOFTWARE, so that it only takes the channels the
+	 *  hardware has no room for. */
+	int priority;
+
+	/* Used by dahdi_transcode only */
+	atomic_t inuse;			/*!< Channels allocated */
+	atomic_t unbuilt;		/*!< Free channels which are not built */
+	struct dahdi_tc_freelist built[DAHDI_TC_FREELISTS];
+	spinlock_t stats_lock;
+	struct dahdi_tc_counters counters;	/*!< allocs and busy */
+	struct dahdi_tc_counters *frames;	/*!< The rest, for each CPU */
+	/* The read and write of fops, which go through dahdi_transcode to be
+	 * counted. */
+	ssize_t (*driver_read)(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos);
+	ssize_t (*driver_write)(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos);
+	u64 find_ns;			/*!< Time spent picking the channels */
+	u64 alloc_ns;			/*!< Time spent in DAHDI_TC_ALLOCATE */
+	u32 find_max_ns;
+	u32 alloc_max_ns;
+
 	/* Transcoder channels */
 	struct dahdi_transcoder_channel channels[0];
 };
 
+#define DAHDI_TC_PRIORITY_HARDWARE	0
+#define DAHDI_TC_PRIORITY_SOFTWARE	-10
+
 #define DAHDI_WATCHDOG_NOINTS		(1 << 0)
 
 #define DAHDI_WATCHDOG_INIT			1000
@@ -957,6 +1172,13 @@ struct dahdi_dynamic_driver {
 	/*! Flush any pending messages */
 	int (*flush)(void);
 
+	/*! Optional: return a buffer of msglen bytes in which the next message
+	    is built in place, or NULL to fall back to transmit() */
+	unsigned char *(*getbuf)(void *tpipe, int msglen);
+
+	/*! Send the message built in the buffer returned by getbuf() */
+	int (*sendbuf)(void *tpipe, int msglen);
+
 	struct dahdi_dynamic_driver *next;
 };
 
@@ -976,6 +1198,14 @@ int dahdi_receive(struct dahdi_span *span);
 /*! Prepare writechunk buffers on all channels for this span */
 int dahdi_transmit(struct dahdi_span *span);
 
+/*! Tell DAHDI that \a chunks chunks' worth of audio, timed by the far end's
+   clock, have arrived on a span, so that a timing driver can follow that clock */
+void dahdi_span_clockref(struct dahdi_span *span, int chunks);
+
+/*! Returns nonzero when no channel or timer is open and nothing else
+   needs the master span's ticks, so a timing driver may slow down */
+int dahdi_timing_idle(void);
+
 /*! Abort the buffer currently being receive with event "event" */
 void dahdi_hdlc_abort(struct dahdi_chan *ss, int event);
 
@@ -1008,6 +1238,10 @@ int dahdi_transcoder_unregister(struct dahdi_transcoder *tc);
 /*! \brief Alert a transcoder */
 int dahdi_transcoder_alert(struct dahdi_transcoder_channel *ztc);
 
+/*! \brief Tell dahdi_transcode that a frame written to the channel was
+ *  dropped, and that nothing will be read for it. */
+void dahdi_transcoder_dropped(struct dahdi_transcoder_channel *ztc);
+
 /*! \brief Unregister a span */
 int dahdi_unregister(struct dahdi_span *span);
 
@@ -1067,6 +1301,9 @@ void dahdi_set_dynamic_ioctl(int (*func)(unsigned int cmd, unsigned long data));
 /*! \brief Used by DAHDI HPEC module -- don't use directly */
 void dahdi_set_hpec_ioctl(int (*func)(unsigned int cmd, unsigned long data));
 
+/*! \brief Used by a timing driver following a span's far end clock -- don't use directly */
+void dahdi_set_clockref_hook(void (*func)(struct dahdi_span *span, int chunks));
+
 /*! \brief Used privately by DAHDI.  Avoid touching directly */
 struct dahdi_tone {
 	int fac1;
@@ -429,6 +429,24 @@ enum {
 /* The echo canceler's NLP (only) was enabled */
 #define DAHDI_EVENT_EC_NLP_ENABLED	28
 
+/* A V.21 preamble (T.30 HDLC flags) was detected on the channel in the transmit direction */
+#define DAHDI_EVENT_TX_V21_DETECTED	29
+
+/* A V.21 preamble (T.30 HDLC flags) was detected on the channel in the receive direction */
+#define DAHDI_EVENT_RX_V21_DETECTED	30
+
+/* A Bell 103 answer tone (2225 Hz) was detected on the channel in the transmit direction */
+#define DAHDI_EVENT_TX_BELL_ANS_DETECTED	31
+
+/* A Bell 103 answer tone (2225 Hz) was detected on the channel in the receive direction */
+#define DAHDI_EVENT_RX_BELL_ANS_DETECTED	32
+
+/* A V.8 ANSam tone was detected on the channel in the transmit direction */
+#define DAHDI_EVENT_TX_ANSAM_DETECTED	33
+
+/* A V.8 ANSam tone was detected on the channel in the receive direction */
+#define DAHDI_EVENT_RX_ANSAM_DETECTED	34
+
 #define DAHDI_EVENT_PULSEDIGIT		(1 << 16)	/* This is OR'd with the digit received */
 #define DAHDI_EVENT_DTMFDOWN		(1 << 17)	/* Ditto for DTMF key down event */
 #define DAHDI_EVENT_DTMFUP		(1 << 18)	/* Ditto for DTMF key up event */
@@ -447,6 +465,86 @@ struct dahdi_transcoder_info {
 	__u32 srcfmts;
 };
 
+/* One frame for DAHDI_TC_SUBMIT or DAHDI_TC_COLLECT.  Pointers are passed
+ * as __u64 so that the layout is the same for 32 and 64 bit programs. */
+struct dahdi_transcoder_frame {
+	__s32 fd;	/* Descriptor the channel was allocated on */
+	__s32 status;	/* Set to the bytes written or read, or -errno */
+	__u32 len;	/* Bytes to write from buf, or room in buf to read */
+	__u32 reserved;	/* Set to 0 */
+	__u64 buf;	/* (unsigned long) of the buffer */
+};
+
+/* A batch of frames, possibly for many channels.  Frames for channels on
+ * the same transcoder are best kept next to each other, since the driver
+ * can then hand them to the hardware together. */
+struct dahdi_transcoder_batch {
+	__u32 count;	/* Frames in the array */
+	__u32 done;	/* Set to the number written or read */
+	__u64 frames;	/* (unsigned long) of the array of frames */
+};
+
+#define DAHDI_TC_MAX_BATCH	1024
+
+/* Layout of the frame ring of a channel, which mmap() of the channel's
+ * descriptor maps once DAHDI_TC_RING_SETUP has set it up.  The ring is
+ * txslots transmit slots followed by rxslots receive slots, each slot_size
+ * bytes long, with the frame payload payload_offset bytes into the slot. */
+struct dahdi_transcoder_ring {
+	__u32 txslots;		/* Asked for (0 for the default), and granted */
+	__u32 rxslots;		/* Asked for (0 for the default), and granted */
+	__u32 slot_size;
+	__u32 payload_offset;
+	__u32 max_payload;	/* Largest frame a slot holds */
+	__u32 size;		/* Bytes to mmap() */
+};
+
+/* Counters kept for a transcoder, or for a pair of formats across all of
+ * them.  Turnaround is the time from a frame being written to the
+ * transcoded frame being read, in microseconds; the percentiles are rounded
+ * up to the histogram bucket they fall in, which is within 25%. */
+struct dahdi_transcoder_counters {
+	__u64 allocs;		/* Channels allocated */
+	__u64 busy;		/* Allocations refused because all were busy */
+	__u64 frames_in;	/* Frames written */
+	__u64 frames_out;	/* Transcoded frames read */
+	__u32 inflight;		/* Frames written and not read yet */
+	__u32 inflight_max;	/* Most in flight on any one channel */
+	__u32 turnaround_p50;
+	__u32 turnaround_p99;
+	__u32 turnaround_max;
+	__u32 reserved;
+};
+
+/* DAHDI_TC_GETSTATS */
+struct dahdi_transcoder_stats {
+	__u32 tcnum;		/* Transcoder, numbered as for DAHDI_TC_GETINFO */
+	__u32 numchannels;
+	__u32 inuse;		/* Channels allocated now */
+	__u32 reserved;
+	struct dahdi_transcoder_counters counters;
+	/* From the driver, for hardware which has them, and 0 otherwise */
+	__u32 hwqueue;		/* Frames and commands on the hardware queue */
+	__u32 hwqueue_size;
+	__u32 retries;		/* Commands resent to the hardware */
+	__u32 timeouts;		/* Commands the hardware never answered */
+};
+
+/* DAHDI_TC_GETPAIRSTATS */
+struct dahdi_transcoder_pair_stats {
+	__u32 index;		/* Pairs are numbered from 0 as first used */
+	__u32 srcfmt;
+	__u32 dstfmt;
+	__u32 reserved;
+	struct dahdi_transcoder_counters counters;
+};
+
+/* A slot of the frame ring for DAHDI_TC_RING_SUBMIT or DAHDI_TC_RING_COLLECT */
+struct dahdi_transcoder_slot {
+	__u32 slot;		/* Index among the transmit or receive slots */
+	__u32 len;		/* Bytes of payload in the slot */
+};
+
 #define DAHDI_MAX_ECHOCANPARAMS 8
 
 /* ioctl definitions */
@@ -941,6 +1039,23 @@ struct dahdi_attach_echocan {
 
 #define DAHDI_ATTACH_ECHOCAN 		_IOW(DAHDI_CODE, 59, struct dahdi_attach_echocan)
 
+/*
+  As DAHDI_ATTACH_ECHOCAN, but with a list of echo canceler modules to try in
+  turn when the channel needs an echo canceler. The span's own (hardware) echo
+  canceler, if it has one, is always tried first; the modules in the list are
+  tried after that, skipping any that are at their capacity.
+ */
+#define DAHDI_MAX_ECHOCAN_PREFS		4
+
+struct dahdi_attach_echocans {
+	int	chan;		/* Channel we're applying this to */
+	char	echocan[DAHDI_MAX_ECHOCAN_PREFS][16];	/* Names of echo cancelers,
+				   in order of preference; the list ends at
+				   the first empty name */
+};
+
+#define DAHDI_ATTACH_ECHOCANS		_IOW(DAHDI_CODE, 104, struct dahdi_attach_echocans)
+
 
 /*
  *  60-80 are reserved for private drivers
@@ -996,6 +1111,29 @@ struct dahdi_hwgain {
 #define DAHDI_TC_CODE			'T'
 #define DAHDI_TC_ALLOCATE		_IOW(DAHDI_TC_CODE, 1, struct dahdi_transcoder_formats)
 #define DAHDI_TC_GETINFO		_IOWR(DAHDI_TC_CODE, 2, struct dahdi_transcoder_info)
+/* Write each frame of the batch to its channel, as write() on the channel's
+ * descriptor would. */
+#define DAHDI_TC_SUBMIT			_IOWR(DAHDI_TC_CODE, 3, struct dahdi_transcoder_batch)
+/* Read a transcoded frame from the channel of each frame of the batch, if
+ * it has one waiting; status is -EAGAIN for those which do not.  This never
+ * blocks; poll() the channels to wait for frames. */
+#define DAHDI_TC_COLLECT		_IOWR(DAHDI_TC_CODE, 4, struct dahdi_transcoder_batch)
+/* Set up the frame ring of an allocated channel, for transcoders which
+ * support it.  Frames then go through the ring instead of read() and
+ * write().  The transcoder reads transmitted payloads straight from their
+ * slots; received payloads are still copied once, into their slots. */
+#define DAHDI_TC_RING_SETUP		_IOWR(DAHDI_TC_CODE, 5, struct dahdi_transcoder_ring)
+/* Send the frame in a transmit slot.  The slot belongs to the driver until
+ * the frame has gone to the transcoder; -EBUSY means it is still in use. */
+#define DAHDI_TC_RING_SUBMIT		_IOW(DAHDI_TC_CODE, 6, struct dahdi_transcoder_slot)
+/* Get the next receive slot holding a transcoded frame, or -EAGAIN.  The
+ * slot stays untouched until the following DAHDI_TC_RING_COLLECT. */
+#define DAHDI_TC_RING_COLLECT		_IOR(DAHDI_TC_CODE, 7, struct dahdi_transcoder_slot)
+/* Get the counters of a transcoder; -ENOSYS past the last one, as for
+ * DAHDI_TC_GETINFO.  These need no channel to be allocated. */
+#define DAHDI_TC_GETSTATS		_IOWR(DAHDI_TC_CODE, 8, struct dahdi_transcoder_stats)
+/* Get the counters of a pair of formats; -ENOSYS past the last one. */
+#define DAHDI_TC_GETPAIRSTATS		_IOWR(DAHDI_TC_CODE, 9, struct dahdi_transcoder_pair_stats)
 
 /*
  * VMWI Specification 
@@ -1027,6 +1165,28 @@ struct dahdi_vmwi_info {
 
 #define DAHDI_ECHOCANCEL_FAX_MODE	_IOW(DAHDI_CODE, 102, int)
 
+/*
+ * Get the running statistics of a channel's echo canceller. ERL is the
+ * loss from the transmitted signal to the echo in the received signal,
+ * ERLE the further loss achieved by the canceller, both in tenths of a dB.
+ */
+struct dahdi_ecstats {
+	char echocan[16];	/* Name of the echo canceller in use */
+	__s32 erl;		/* Echo return loss, in 0.1 dB */
+	__s32 erle;		/* Echo return loss enhancement, in 0.1 dB */
+	__u32 converged;	/* Non-zero if ERLE shows useful cancellation */
+	__u32 samples;		/* Samples processed so far */
+	__u32 nlp_samples;	/* Samples during which the NLP was suppressing */
+	__u32 doubletalk;	/* Times double talk halted adaptation */
+	__u32 resets;		/* Times the filter diverged and was reset */
+	__u32 bypassed;		/* Samples skipped while the transmit side was idle */
+	__u32 tx_level;		/* Raw signal levels, in a canceller specific scale */
+	__u32 rx_level;
+	__u32 clean_level;
+};
+
+#define DAHDI_GET_ECSTATS		_IOR(DAHDI_CODE, 103, struct dahdi_ecstats)
+
 /* Get current status IOCTL */
 /* Defines for Radio Status (dahdi_radio_stat.radstat) bits */
 
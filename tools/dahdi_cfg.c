@@ -85,7 +85,7 @@ static struct dahdi_lineconfig lc[DAHDI_MAX_SPANS];
 
 static struct dahdi_chanconfig cc[DAHDI_MAX_CHANNELS];
 
-static struct dahdi_attach_echocan ae[DAHDI_MAX_CHANNELS];
+static struct dahdi_attach_echocans ae[DAHDI_MAX_CHANNELS];
 
 static struct dahdi_dynamic_span zds[NUM_DYNAMIC];
 
@@ -710,7 +710,8 @@ static int setechocan(char *keyword, char *args)
 	int res;
 	int chans[DAHDI_MAX_CHANNELS] = { 0, };
 	char *echocan, *chanlist;
-	unsigned int x;
+	char *names[DAHDI_MAX_ECHOCAN_PREFS] = { NULL, };
+	unsigned int x, y;
 
 	echocan = strtok(args, ",");
 
@@ -721,9 +722,22 @@ static int setechocan(char *keyword, char *args)
 		}
 	}
 
+	/* A list of echo cancellers to fall back on, in order of preference,
+	   is separated by slashes */
+	for (y = 0; echocan && (y < DAHDI_MAX_ECHOCAN_PREFS); y++) {
+		names[y] = echocan;
+		if ((echocan = strchr(echocan, '/')))
+			*echocan++ = '\0';
+	}
+	if (echocan) {
+		error("Too many echo cancellers listed (at most %d)\n", DAHDI_MAX_ECHOCAN_PREFS);
+		return -1;
+	}
+
 	for (x = 0; x < DAHDI_MAX_CHANNELS; x++) {
 		if (chans[x]) {
-			dahdi_copy_string(ae[x].echocan, echocan, sizeof(ae[x].echocan));
+			for (y = 0; y < DAHDI_MAX_ECHOCAN_PREFS; y++)
+				dahdi_copy_string(ae[x].echocan[y], names[y] ? names[y] : "", sizeof(ae[x].echocan[y]));
 		}
 	}
 
@@ -1303,7 +1317,10 @@ static void printconfig(int fd)
 					printf("Channel %02d %s to %02d", x, sig[x], cc[x].idlebits);
 				else {
 					printf("Channel %02d: %s (%s)", x, sig[x], laws[cc[x].deflaw]);
-					printf(" (Echo Canceler: %s)", ae[x].echocan[0] ? ae[x].echocan : "none");
+					printf(" (Echo Canceler: %s", ae[x].echocan[0][0] ? ae[x].echocan[0] : "none");
+					for (y = 1; (y < DAHDI_MAX_ECHOCAN_PREFS) && ae[x].echocan[y][0]; y++)
+						printf("/%s", ae[x].echocan[y]);
+					printf(")");
 					for (y=1;y<DAHDI_MAX_CHANNELS;y++) {
 						if (cc[y].master == x)  {
 							printf("%s%02d", ps++ ? " " : " (Slaves: ", y);
@@ -1619,13 +1636,26 @@ finish:
 
 		ae[x].chan = x;
 		if (verbose) {
-			printf("Setting echocan for channel %d to %s\n", ae[x].chan, ae[x].echocan[0] ? ae[x].echocan : "none");
+			printf("Setting echocan for channel %d to %s\n", ae[x].chan, ae[x].echocan[0][0] ? ae[x].echocan[0] : "none");
 		}
 
-		if (ioctl(fd, DAHDI_ATTACH_ECHOCAN, &ae[x])) {
-			fprintf(stderr, "DAHDI_ATTACH_ECHOCAN failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
-			close(fd);
-			exit(1);
+		if (ae[x].echocan[1][0]) {
+			if (ioctl(fd, DAHDI_ATTACH_ECHOCANS, &ae[x])) {
+				fprintf(stderr, "DAHDI_ATTACH_ECHOCANS failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
+				close(fd);
+				exit(1);
+			}
+		} else {
+			struct dahdi_attach_echocan single;
+
+			/* Only one; use the original ioctl, which older kernels know */
+			single.chan = x;
+			dahdi_copy_string(single.echocan, ae[x].echocan[0], sizeof(single.echocan));
+			if (ioctl(fd, DAHDI_ATTACH_ECHOCAN, &single)) {
+				fprintf(stderr, "DAHDI_ATTACH_ECHOCAN failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
+				close(fd);
+				exit(1);
+			}
 		}
 	}
 	if (0 == numzones) {
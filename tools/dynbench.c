@@ -0,0 +1,267 @@
+/*
+ * Dynamic span message throughput benchmark
+ *
+ * Creates a pair of local (dahdi_dynamic_loc) spans looped to each
+ * other, keeps some of the channels busy with random audio while the
+ * rest idle, and reports the message rate and size the spans send,
+ * with and without compact messages.
+ *
+ * Needs dahdi_dynamic and dahdi_dynamic_loc loaded, and a timing source
+ * (a DAHDI card or dahdi_dummy), since the local spans provide none.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <errno.h>
+
+#include <dahdi/user.h>
+#include "dahdi_tools_version.h"
+
+#define BLOCK_SIZE	160
+
+#define COMPACT_PARAM	"/sys/module/dahdi_dynamic/parameters/compact"
+#define DYNAMIC_PROC	"/proc/dahdi/dynamic"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n channels] [-a active] [-t seconds] [-k key]\n", prog);
+	fprintf(stderr, "   -n: channels in each span (default 31)\n");
+	fprintf(stderr, "   -a: channels carrying audio, the rest idle (default 4)\n");
+	fprintf(stderr, "   -t: seconds to measure each mode for (default 5)\n");
+	fprintf(stderr, "   -k: dahdi_dynamic_loc key to use for the pair (default 9)\n");
+	exit(1);
+}
+
+static int set_compact(int on)
+{
+	FILE *f;
+
+	f = fopen(COMPACT_PARAM, "w");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s: %s\n", COMPACT_PARAM, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "%d\n", on);
+	fclose(f);
+	return 0;
+}
+
+/* Find the transmit counters of the named span in /proc/dahdi/dynamic */
+static int read_counters(const char *span, unsigned long *msgs, unsigned long *bytes)
+{
+	FILE *f;
+	char line[512];
+	char *c;
+	int res = -1;
+
+	f = fopen(DYNAMIC_PROC, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s: %s\n", DYNAMIC_PROC, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, span, strlen(span)) || (line[strlen(span)] != ':'))
+			continue;
+		c = strstr(line, " tx ");
+		if (c && (sscanf(c, " tx %lu/%lu", msgs, bytes) == 2))
+			res = 0;
+		break;
+	}
+	fclose(f);
+	return res;
+}
+
+static int find_basechan(int ctl, int spanno)
+{
+	struct dahdi_params p;
+	int x;
+
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		memset(&p, 0, sizeof(p));
+		p.channo = x;
+		if (ioctl(ctl, DAHDI_GET_PARAMS, &p))
+			continue;
+		if ((p.spanno == spanno) && (p.chanpos == 1))
+			return x;
+	}
+	return -1;
+}
+
+static int open_chan(int ctl, int channo)
+{
+	struct dahdi_chanconfig cc;
+	int fd;
+	int bs = BLOCK_SIZE;
+
+	memset(&cc, 0, sizeof(cc));
+	cc.chan = channo;
+	cc.sigtype = DAHDI_SIG_CLEAR;
+	cc.deflaw = DAHDI_LAW_MULAW;
+	if (ioctl(ctl, DAHDI_CHANCONFIG, &cc)) {
+		fprintf(stderr, "Unable to configure channel %d: %s\n", channo, strerror(errno));
+		return -1;
+	}
+	fd = open("/dev/dahdi/channel", O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open channel: %s\n", strerror(errno));
+		return -1;
+	}
+	if (ioctl(fd, DAHDI_SPECIFY, &channo) || ioctl(fd, DAHDI_SET_BLOCKSIZE, &bs)) {
+		fprintf(stderr, "Unable to set up channel %d: %s\n", channo, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Keep the active channels' transmit buffers full for ms milliseconds */
+static void feed(int *fds, int active, int ms)
+{
+	unsigned char buf[BLOCK_SIZE];
+	struct timeval start, now, tv;
+	fd_set wfds;
+	int x, y, max;
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		gettimeofday(&now, NULL);
+		if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000 >= ms)
+			break;
+		FD_ZERO(&wfds);
+		max = -1;
+		for (x = 0; x < active; x++) {
+			FD_SET(fds[x], &wfds);
+			if (fds[x] > max)
+				max = fds[x];
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		if (select(max + 1, NULL, &wfds, NULL, &tv) <= 0)
+			continue;
+		for (x = 0; x < active; x++) {
+			if (!FD_ISSET(fds[x], &wfds))
+				continue;
+			for (y = 0; y < BLOCK_SIZE; y++)
+				buf[y] = rand();
+			if (write(fds[x], buf, sizeof(buf)) < 0 && errno != EAGAIN)
+				fprintf(stderr, "Write failed: %s\n", strerror(errno));
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct dahdi_dynamic_span a, b;
+	int chans = 31, active = 4, seconds = 5, key = 9;
+	int ctl, base, c, x, mode;
+	int res = 1;
+	int *fds;
+	unsigned long m0, b0, m1, b1;
+	double rate;
+	char name[64];
+
+	while ((c = getopt(argc, argv, "n:a:t:k:h")) != -1) {
+		switch (c) {
+		case 'n':
+			chans = atoi(optarg);
+			break;
+		case 'a':
+			active = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'k':
+			key = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((chans < 1) || (active < 0) || (active > chans) || (seconds < 1) ||
+	    (key < 0) || (key > 15))
+		usage(argv[0]);
+
+	ctl = open("/dev/dahdi/ctl", O_RDWR);
+	if (ctl < 0) {
+		fprintf(stderr, "Unable to open /dev/dahdi/ctl: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	memset(&a, 0, sizeof(a));
+	strcpy(a.driver, "loc");
+	snprintf(a.addr, sizeof(a.addr), "%x:0", key);
+	a.numchans = chans;
+	b = a;
+	snprintf(b.addr, sizeof(b.addr), "%x:1", key);
+	if (ioctl(ctl, DAHDI_DYNAMIC_CREATE, &a) || ioctl(ctl, DAHDI_DYNAMIC_CREATE, &b)) {
+		fprintf(stderr, "Unable to create local spans: %s\n", strerror(errno));
+		ioctl(ctl, DAHDI_DYNAMIC_DESTROY, &a);
+		exit(1);
+	}
+
+	fds = calloc(active ? active : 1, sizeof(*fds));
+	base = find_basechan(ctl, a.spanno);
+	if (!fds || (base < 0)) {
+		fprintf(stderr, "Unable to find the channels of span %d\n", a.spanno);
+		active = 0;
+		goto out;
+	}
+	for (x = 0; x < active; x++) {
+		fds[x] = open_chan(ctl, base + x);
+		if (fds[x] < 0) {
+			active = x;
+			goto out;
+		}
+	}
+
+	snprintf(name, sizeof(name), "DYN/loc/%s", a.addr);
+	printf("%d channels, %d active, %d seconds per mode\n", chans, active, seconds);
+	printf("%-10s %12s %12s %12s\n", "Mode", "Msgs/s", "Bytes/msg", "KBytes/s");
+	for (mode = 0; mode < 2; mode++) {
+		if (set_compact(mode))
+			goto out;
+		/* Let the spans agree on the format */
+		feed(fds, active, 1000);
+		if (read_counters(name, &m0, &b0))
+			goto out;
+		feed(fds, active, seconds * 1000);
+		if (read_counters(name, &m1, &b1))
+			goto out;
+		rate = (double)(m1 - m0) / seconds;
+		printf("%-10s %12.1f %12.1f %12.1f\n", mode ? "compact" : "full", rate,
+			(m1 != m0) ? (double)(b1 - b0) / (m1 - m0) : 0.0,
+			(double)(b1 - b0) / seconds / 1024);
+		if (!rate)
+			fprintf(stderr, "No messages sent; is there a timing source?\n");
+	}
+	set_compact(0);
+	res = 0;
+
+out:
+	for (x = 0; x < active; x++)
+		close(fds[x]);
+	ioctl(ctl, DAHDI_DYNAMIC_DESTROY, &b);
+	ioctl(ctl, DAHDI_DYNAMIC_DESTROY, &a);
+	close(ctl);
+	exit(res);
+}
@@ -0,0 +1,224 @@
+/*
+ * VoiceBus interrupt rate and latency benchmark
+ *
+ * Reloads a VoiceBus board driver (wctdm24xxp or wcte12xp) with each
+ * combination of descriptor ring size and frames per service asked for,
+ * and reports the interrupt rate the boards take and the latency they
+ * settle at with each.
+ *
+ * The driver is unloaded and loaded again, so nothing may be using its
+ * channels.  The latency is read from the voicebus_current_latency
+ * attribute, which is only there when voicebus was built with
+ * CONFIG_VOICEBUS_SYSFS; otherwise only the interrupt rate is shown.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <glob.h>
+#include <errno.h>
+
+#include "dahdi_tools_version.h"
+
+#define MAX_SETTINGS	16
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-d driver] [-r sizes] [-f frames] [-t seconds] [-s seconds]\n", prog);
+	fprintf(stderr, "   -d: board driver to reload (default wctdm24xxp)\n");
+	fprintf(stderr, "   -r: comma separated descriptor ring sizes (default 128)\n");
+	fprintf(stderr, "   -f: comma separated frames per service (default 1,2,4)\n");
+	fprintf(stderr, "   -t: seconds to measure each setting for (default 10)\n");
+	fprintf(stderr, "   -s: seconds to let the boards settle after loading (default 5)\n");
+	exit(1);
+}
+
+static int parse_list(const char *arg, int *vals)
+{
+	char *copy, *c, *next;
+	int count = 0;
+
+	copy = strdup(arg);
+	if (!copy)
+		return -1;
+	for (c = copy; c && *c && (count < MAX_SETTINGS); c = next) {
+		next = strchr(c, ',');
+		if (next)
+			*next++ = '\0';
+		vals[count] = atoi(c);
+		if (vals[count] < 1) {
+			free(copy);
+			return -1;
+		}
+		count++;
+	}
+	free(copy);
+	return count;
+}
+
+static int load_driver(const char *driver, int ring_size, int frames)
+{
+	char cmd[256];
+
+	snprintf(cmd, sizeof(cmd), "modprobe -r %s", driver);
+	if (system(cmd)) {
+		fprintf(stderr, "Unable to unload %s; are its channels in use?\n", driver);
+		return -1;
+	}
+	if (ring_size) {
+		snprintf(cmd, sizeof(cmd), "modprobe %s ring_size=%d frames_per_service=%d",
+			driver, ring_size, frames);
+	} else {
+		snprintf(cmd, sizeof(cmd), "modprobe %s", driver);
+	}
+	if (system(cmd)) {
+		fprintf(stderr, "Unable to load %s\n", driver);
+		return -1;
+	}
+	return 0;
+}
+
+/* Add up the interrupts taken on every CPU by the boards of the driver,
+ * which name their interrupts after the driver. */
+static int read_interrupts(const char *driver, unsigned long long *total)
+{
+	FILE *f;
+	char line[1024];
+	char *c, *end;
+	int found = 0;
+
+	f = fopen("/proc/interrupts", "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open /proc/interrupts: %s\n", strerror(errno));
+		return -1;
+	}
+	*total = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strstr(line, driver))
+			continue;
+		c = strchr(line, ':');
+		if (!c)
+			continue;
+		for (c++; ; c = end) {
+			while (isspace(*c))
+				c++;
+			if (!isdigit(*c))
+				break;
+			*total += strtoull(c, &end, 10);
+		}
+		found++;
+	}
+	fclose(f);
+	return found ? 0 : -1;
+}
+
+/* The highest latency any of the boards is running at, or -1 if the
+ * attribute is not there. */
+static int read_latency(const char *driver)
+{
+	char pattern[256];
+	glob_t g;
+	FILE *f;
+	size_t x;
+	int latency, max = -1;
+
+	snprintf(pattern, sizeof(pattern),
+		"/sys/bus/pci/drivers/%s/*/voicebus_current_latency", driver);
+	if (glob(pattern, 0, NULL, &g))
+		return -1;
+	for (x = 0; x < g.gl_pathc; x++) {
+		f = fopen(g.gl_pathv[x], "r");
+		if (!f)
+			continue;
+		if ((fscanf(f, "%d", &latency) == 1) && (latency > max))
+			max = latency;
+		fclose(f);
+	}
+	globfree(&g);
+	return max;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *driver = "wctdm24xxp";
+	int sizes[MAX_SETTINGS] = { 128 };
+	int frames[MAX_SETTINGS] = { 1, 2, 4 };
+	int nsizes = 1, nframes = 3;
+	int seconds = 10, settle = 5;
+	int c, x, y, latency;
+	int res = 1;
+	unsigned long long i0, i1;
+
+	while ((c = getopt(argc, argv, "d:r:f:t:s:h")) != -1) {
+		switch (c) {
+		case 'd':
+			driver = optarg;
+			break;
+		case 'r':
+			nsizes = parse_list(optarg, sizes);
+			break;
+		case 'f':
+			nframes = parse_list(optarg, frames);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			settle = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((nsizes < 1) || (nframes < 1) || (seconds < 1) || (settle < 0))
+		usage(argv[0]);
+
+	printf("%s, %d seconds per setting\n", driver, seconds);
+	printf("%-8s %-8s %12s %12s\n", "Ring", "Frames", "Irqs/s", "Latency ms");
+	for (x = 0; x < nsizes; x++) {
+		for (y = 0; y < nframes; y++) {
+			if (load_driver(driver, sizes[x], frames[y]))
+				goto out;
+			sleep(settle);
+			if (read_interrupts(driver, &i0)) {
+				fprintf(stderr, "No interrupts named after %s; "
+					"did the boards load?\n", driver);
+				goto out;
+			}
+			sleep(seconds);
+			if (read_interrupts(driver, &i1))
+				goto out;
+			/* Read it last, after any latency the boards needed
+			 * was added. */
+			latency = read_latency(driver);
+			printf("%-8d %-8d %12.1f ", sizes[x], frames[y],
+				(double)(i1 - i0) / seconds);
+			if (latency < 0)
+				printf("%12s\n", "-");
+			else
+				printf("%12d\n", latency);
+		}
+	}
+	res = 0;
+
+out:
+	/* Leave the driver loaded with its defaults. */
+	if (load_driver(driver, 0, 0))
+		res = 1;
+	exit(res);
+}